@@ -0,0 +1,460 @@
+#include "atmosphere.h"
+#include "shader_library.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// Must match local_size_x and local_size_y in shaders/atmosphere.comp.
+constexpr uint32_t kGroupSize = 8;
+// The world is in metres, the atmosphere in kilometres.
+constexpr double kKilometresPerUnit = 0.001;
+
+// By Atmosphere::Lut. The aerial perspective volume's depth is its slice
+// count, the shader marches through the slices in one invocation.
+constexpr std::array<VkExtent3D, 4> kLutExtents = {{
+    {256, 64, 1},
+    {32, 32, 1},
+    {192, 108, 1},
+    {32, 32, 32},
+}};
+constexpr VkFormat kLutFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+
+} // namespace
+
+bool Atmosphere::Init(const CreateInfo &create_info) {
+  device_ = create_info.device;
+  allocator_ = create_info.allocator;
+  pipeline_cache_ = create_info.pipeline_cache;
+  reversed_z_ = create_info.reversed_z;
+  if (create_info.mesh_shaders) {
+    render_stages_ |= VK_PIPELINE_STAGE_MESH_SHADER_BIT_EXT;
+  }
+  defer_destroy_ = create_info.defer_destroy;
+
+  VkSamplerCreateInfo sampler_info{};
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  if (vkCreateSampler(device_, &sampler_info, nullptr, &sampler_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create atmosphere sampler.");
+    return false;
+  }
+
+  for (uint32_t lut = 0; lut < kLutCount; ++lut) {
+    if (!CreateImage(static_cast<Lut>(lut))) {
+      return false;
+    }
+  }
+
+  // Binding 0: the frame's AtmosphereGpuData, bindings 1 and 2: the
+  // transmittance and multiple scattering read by the later LUTs, bindings 3
+  // to 6: every LUT written, by Lut.
+  std::array<VkDescriptorSetLayoutBinding, 7> compute_bindings{};
+  for (uint32_t i = 0; i < compute_bindings.size(); ++i) {
+    compute_bindings[i].binding = i;
+    compute_bindings[i].descriptorType =
+        i < 3 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+              : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    compute_bindings[i].descriptorCount = 1;
+    compute_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+  compute_bindings[0].descriptorType =
+      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  // See RenderSetLayout().
+  std::array<VkDescriptorSetLayoutBinding, 4> render_bindings{};
+  for (uint32_t i = 0; i < render_bindings.size(); ++i) {
+    render_bindings[i].binding = i;
+    render_bindings[i].descriptorType =
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    render_bindings[i].descriptorCount = 1;
+    render_bindings[i].stageFlags =
+        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    if (create_info.mesh_shaders) {
+      render_bindings[i].stageFlags |= VK_SHADER_STAGE_MESH_BIT_EXT;
+    }
+  }
+  render_bindings[0].descriptorType =
+      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = static_cast<uint32_t>(compute_bindings.size());
+  layout_info.pBindings = compute_bindings.data();
+  VkDescriptorSetLayoutCreateInfo render_layout_info = layout_info;
+  render_layout_info.bindingCount =
+      static_cast<uint32_t>(render_bindings.size());
+  render_layout_info.pBindings = render_bindings.data();
+  if (vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
+                                  &compute_set_layout_) != VK_SUCCESS ||
+      vkCreateDescriptorSetLayout(device_, &render_layout_info, nullptr,
+                                  &render_set_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create atmosphere descriptor set layouts.");
+    return false;
+  }
+  if (!CreateDescriptorSets(create_info.uniform_buffer)) {
+    return false;
+  }
+
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &compute_set_layout_;
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &pipeline_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create atmosphere pipeline layout.");
+    return false;
+  }
+  return CreatePipelines(create_info.shader_code, pipelines_);
+}
+
+void Atmosphere::Destroy() {
+  if (device_ == VK_NULL_HANDLE) {
+    return;
+  }
+  for (VkPipeline pipeline : pipelines_) {
+    vkDestroyPipeline(device_, pipeline, nullptr);
+  }
+  pipelines_ = {};
+  vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr);
+  vkDestroyDescriptorPool(device_, pool_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, render_set_layout_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, compute_set_layout_, nullptr);
+  for (Image &image : images_) {
+    vkDestroyImageView(device_, image.view, nullptr);
+    vkDestroyImage(device_, image.image, nullptr);
+    if (image.allocation.memory != VK_NULL_HANDLE) {
+      allocator_->Free(image.allocation);
+    }
+  }
+  images_ = {};
+  vkDestroySampler(device_, sampler_, nullptr);
+  pipeline_layout_ = VK_NULL_HANDLE;
+  pool_ = VK_NULL_HANDLE;
+  render_set_layout_ = VK_NULL_HANDLE;
+  compute_set_layout_ = VK_NULL_HANDLE;
+  sampler_ = VK_NULL_HANDLE;
+}
+
+AtmosphereGpuData Atmosphere::Update(const View &view) {
+  const AtmosphereParameters &p = parameters_;
+  AtmosphereGpuData data{};
+  data.rayleigh_scattering =
+      glm::vec4(p.rayleigh_scattering, p.rayleigh_scale_height);
+  data.mie_scattering = glm::vec4(p.mie_scattering, p.mie_scale_height);
+  data.mie_absorption = glm::vec4(p.mie_absorption, p.mie_anisotropy);
+  data.ozone_absorption =
+      glm::vec4(p.ozone_absorption, p.ozone_center_altitude);
+  data.ground_albedo = glm::vec4(p.ground_albedo, p.ozone_half_width);
+  data.sun_direction = glm::vec4(glm::normalize(sun_.direction),
+                                 std::cos(sun_.angular_radius));
+  data.sun_illuminance = glm::vec4(sun_.illuminance, sun_.exposure);
+  data.camera = glm::vec4(glm::vec3(view.camera_position * kKilometresPerUnit),
+                          static_cast<float>(kKilometresPerUnit));
+
+  // Far enough for every ray that misses the ground: to the horizon and from
+  // there out of the atmosphere.
+  double bottom = p.bottom_radius;
+  double top = p.top_radius;
+  double radius = glm::length(view.camera_position) * kKilometresPerUnit;
+  double distance =
+      std::sqrt(std::max(radius * radius - bottom * bottom, 0.0)) +
+      std::sqrt(top * top - bottom * bottom);
+  data.planet = glm::vec4(p.bottom_radius, p.top_radius,
+                          static_cast<float>(distance), 0.0f);
+  data.screen = glm::vec4(1.0f / view.render_extent.width,
+                          1.0f / view.render_extent.height,
+                          reversed_z_ ? 1.0f : 0.0f, 0.0f);
+  data.inverse_view_projection = glm::inverse(view.view_projection);
+
+  // Around the camera the sky only depends on its altitude, the sun's
+  // elevation and its colour, see shaders/atmosphere.comp.
+  auto sky_view_inputs = [](const AtmosphereGpuData &data) {
+    glm::vec3 camera(data.camera);
+    float radius = std::max(glm::length(camera), 1e-6f);
+    float sun_zenith =
+        glm::dot(camera, glm::vec3(data.sun_direction)) / radius;
+    return std::array<float, 5>{radius, sun_zenith, data.sun_illuminance.x,
+                                data.sun_illuminance.y,
+                                data.sun_illuminance.z};
+  };
+  luts_stale_ |= parameters_ != built_parameters_;
+  sky_view_stale_ |=
+      luts_stale_ || sky_view_inputs(data) != sky_view_inputs(built_data_);
+  aerial_perspective_stale_ |=
+      luts_stale_ ||
+      std::memcmp(&data, &built_data_, sizeof(AtmosphereGpuData)) != 0;
+  built_parameters_ = parameters_;
+  built_data_ = data;
+  return data;
+}
+
+void Atmosphere::Record(VkCommandBuffer command_buffer,
+                        uint32_t uniform_offset) {
+  if (!luts_stale_ && !sky_view_stale_ && !aerial_perspective_stale_) {
+    return;
+  }
+
+  // Waits for the previous frames' draws, whose vertex and fragment shaders
+  // read the LUTs, before anything is rewritten. The first time every LUT is
+  // laid out for good, they stay in GENERAL.
+  if (!laid_out_) {
+    std::array<VkImageMemoryBarrier, kLutCount> barriers{};
+    for (uint32_t lut = 0; lut < kLutCount; ++lut) {
+      VkImageMemoryBarrier &barrier = barriers[lut];
+      barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+      barrier.srcAccessMask = 0;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+      barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.image = images_[lut].image;
+      barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    }
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr,
+                         0, nullptr, static_cast<uint32_t>(barriers.size()),
+                         barriers.data());
+    laid_out_ = true;
+  } else {
+    vkCmdPipelineBarrier(command_buffer, render_stages_,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr,
+                         0, nullptr, 0, nullptr);
+  }
+
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          pipeline_layout_, 0, 1, &compute_set_, 1,
+                          &uniform_offset);
+  auto dispatch = [&](Lut lut) {
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      pipelines_[lut]);
+    const VkExtent3D &extent = kLutExtents[lut];
+    vkCmdDispatch(command_buffer,
+                  (extent.width + kGroupSize - 1) / kGroupSize,
+                  (extent.height + kGroupSize - 1) / kGroupSize, 1);
+  };
+  // Every LUT reads the ones before it.
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  if (luts_stale_) {
+    dispatch(kTransmittance);
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier,
+                         0, nullptr, 0, nullptr);
+    dispatch(kMultipleScattering);
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier,
+                         0, nullptr, 0, nullptr);
+    ++stats_.lut_builds;
+  }
+  if (sky_view_stale_) {
+    dispatch(kSkyView);
+    ++stats_.sky_view_builds;
+  }
+  if (aerial_perspective_stale_) {
+    dispatch(kAerialPerspective);
+    ++stats_.aerial_perspective_builds;
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       render_stages_, 0, 1, &barrier, 0, nullptr, 0,
+                       nullptr);
+  luts_stale_ = false;
+  sky_view_stale_ = false;
+  aerial_perspective_stale_ = false;
+}
+
+bool Atmosphere::ReloadShader(const std::vector<char> &shader_code) {
+  std::array<VkPipeline, kLutCount> pipelines{};
+  if (!CreatePipelines(shader_code, pipelines)) {
+    return false;
+  }
+  defer_destroy_([device = device_, old_pipelines = pipelines_]() {
+    for (VkPipeline pipeline : old_pipelines) {
+      vkDestroyPipeline(device, pipeline, nullptr);
+    }
+  });
+  pipelines_ = pipelines;
+  // The new shader may compute something else.
+  luts_stale_ = true;
+  sky_view_stale_ = true;
+  aerial_perspective_stale_ = true;
+  return true;
+}
+
+bool Atmosphere::CreateImage(Lut lut) {
+  const VkExtent3D &extent = kLutExtents[lut];
+  bool volume = lut == kAerialPerspective;
+  Image &image = images_[lut];
+
+  VkImageCreateInfo image_info{};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = volume ? VK_IMAGE_TYPE_3D : VK_IMAGE_TYPE_2D;
+  image_info.format = kLutFormat;
+  image_info.extent = extent;
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  if (vkCreateImage(device_, &image_info, nullptr, &image.image) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create atmosphere LUT image.");
+    return false;
+  }
+  std::optional<GpuAllocation> allocation = allocator_->AllocateForImage(
+      image.image, VK_IMAGE_TILING_OPTIMAL,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+  if (!allocation) {
+    spdlog::error("Failed to allocate atmosphere LUT memory.");
+    return false;
+  }
+  image.allocation = *allocation;
+
+  VkImageViewCreateInfo view_info{};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = image.image;
+  view_info.viewType = volume ? VK_IMAGE_VIEW_TYPE_3D : VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = kLutFormat;
+  view_info.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  if (vkCreateImageView(device_, &view_info, nullptr, &image.view) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create atmosphere LUT image view.");
+    return false;
+  }
+  return true;
+}
+
+bool Atmosphere::CreateDescriptorSets(VkBuffer uniform_buffer) {
+  std::array<VkDescriptorPoolSize, 3> pool_sizes{};
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  pool_sizes[0].descriptorCount = 2;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pool_sizes[1].descriptorCount = 5;
+  pool_sizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  pool_sizes[2].descriptorCount = kLutCount;
+  VkDescriptorPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+  pool_info.pPoolSizes = pool_sizes.data();
+  pool_info.maxSets = 2;
+  if (vkCreateDescriptorPool(device_, &pool_info, nullptr, &pool_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create atmosphere descriptor pool.");
+    return false;
+  }
+  std::array<VkDescriptorSetLayout, 2> layouts = {compute_set_layout_,
+                                                  render_set_layout_};
+  std::array<VkDescriptorSet, 2> sets{};
+  VkDescriptorSetAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.descriptorPool = pool_;
+  allocate_info.descriptorSetCount = static_cast<uint32_t>(layouts.size());
+  allocate_info.pSetLayouts = layouts.data();
+  if (vkAllocateDescriptorSets(device_, &allocate_info, sets.data()) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to allocate atmosphere descriptor sets.");
+    return false;
+  }
+  compute_set_ = sets[0];
+  render_set_ = sets[1];
+
+  // One frame's worth, the dynamic offset picks the frame.
+  VkDescriptorBufferInfo buffer_info{};
+  buffer_info.buffer = uniform_buffer;
+  buffer_info.offset = 0;
+  buffer_info.range = sizeof(AtmosphereGpuData);
+
+  // The image infos are sized up front, the writes point into them.
+  std::vector<VkDescriptorImageInfo> image_infos;
+  image_infos.reserve(9);
+  std::vector<VkWriteDescriptorSet> writes;
+  auto add_write = [&](VkDescriptorSet set, uint32_t binding,
+                       VkDescriptorType type, Lut lut) {
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.descriptorCount = 1;
+    write.descriptorType = type;
+    if (type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC) {
+      write.pBufferInfo = &buffer_info;
+    } else {
+      image_infos.push_back(
+          {sampler_, images_[lut].view, VK_IMAGE_LAYOUT_GENERAL});
+      write.pImageInfo = &image_infos.back();
+    }
+    writes.push_back(write);
+  };
+  const VkDescriptorType uniform = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  const VkDescriptorType sampled = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  const VkDescriptorType storage = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  add_write(compute_set_, 0, uniform, kTransmittance);
+  add_write(compute_set_, 1, sampled, kTransmittance);
+  add_write(compute_set_, 2, sampled, kMultipleScattering);
+  for (uint32_t lut = 0; lut < kLutCount; ++lut) {
+    add_write(compute_set_, 3 + lut, storage, static_cast<Lut>(lut));
+  }
+  add_write(render_set_, 0, uniform, kTransmittance);
+  add_write(render_set_, 1, sampled, kTransmittance);
+  add_write(render_set_, 2, sampled, kSkyView);
+  add_write(render_set_, 3, sampled, kAerialPerspective);
+  vkUpdateDescriptorSets(device_, static_cast<uint32_t>(writes.size()),
+                         writes.data(), 0, nullptr);
+  return true;
+}
+
+bool Atmosphere::CreatePipelines(
+    const std::vector<char> &shader_code,
+    std::array<VkPipeline, kLutCount> &pipelines) {
+  VkShaderModuleCreateInfo module_info{};
+  module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  module_info.codeSize = shader_code.size();
+  module_info.pCode = reinterpret_cast<const uint32_t *>(shader_code.data());
+  VkShaderModule shader_module;
+  if (shader_code.empty() ||
+      vkCreateShaderModule(device_, &module_info, nullptr, &shader_module) !=
+          VK_SUCCESS) {
+    spdlog::error("Failed to create atmosphere shader module.");
+    return false;
+  }
+
+  bool success = true;
+  for (uint32_t lut = 0; lut < kLutCount; ++lut) {
+    SpecializationConstants specialization{lut};
+
+    VkComputePipelineCreateInfo pipeline_info{};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = shader_module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.stage.pSpecializationInfo = specialization.Info();
+    pipeline_info.layout = pipeline_layout_;
+    if (vkCreateComputePipelines(device_, pipeline_cache_, 1, &pipeline_info,
+                                 nullptr, &pipelines[lut]) != VK_SUCCESS) {
+      spdlog::error("Failed to create atmosphere pipeline.");
+      success = false;
+      break;
+    }
+  }
+  vkDestroyShaderModule(device_, shader_module, nullptr);
+  if (!success) {
+    for (VkPipeline &pipeline : pipelines) {
+      vkDestroyPipeline(device_, pipeline, nullptr);
+      pipeline = VK_NULL_HANDLE;
+    }
+  }
+  return success;
+}
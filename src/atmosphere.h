@@ -0,0 +1,214 @@
+#pragma once
+
+#include "gpu_allocator.h"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <glm/glm.hpp>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Earth-like by default. Distances in kilometres, coefficients per kilometre,
+// the atmosphere's own units, see shaders/atmosphere.comp.
+struct AtmosphereParameters {
+  float bottom_radius = 6371.0f;
+  float top_radius = 6471.0f;
+  glm::vec3 rayleigh_scattering{5.802e-3f, 13.558e-3f, 33.1e-3f};
+  float rayleigh_scale_height = 8.0f;
+  glm::vec3 mie_scattering{3.996e-3f};
+  glm::vec3 mie_absorption{0.444e-3f};
+  float mie_scale_height = 1.2f;
+  // Cornette-Shanks g.
+  float mie_anisotropy = 0.8f;
+  // In a layer that falls off linearly on both sides of its centre.
+  glm::vec3 ozone_absorption{0.650e-3f, 1.881e-3f, 0.085e-3f};
+  float ozone_center_altitude = 25.0f;
+  float ozone_half_width = 15.0f;
+  glm::vec3 ground_albedo{0.3f};
+
+  bool operator==(const AtmosphereParameters &) const = default;
+};
+
+struct AtmosphereSun {
+  // World space, towards the sun.
+  glm::vec3 direction = glm::normalize(glm::vec3(1.0f, 0.5f, 0.3f));
+  glm::vec3 illuminance{1.0f};
+  float angular_radius = 0.004675f;
+  // Applied before the tone mapping, see shaders/sky.frag.
+  float exposure = 10.0f;
+
+  bool operator==(const AtmosphereSun &) const = default;
+};
+
+// Layout of the AtmosphereUniforms block of the atmosphere shaders, std140.
+// Pushed into the uniform arena every frame.
+struct AtmosphereGpuData {
+  // w: scale height.
+  glm::vec4 rayleigh_scattering;
+  // w: scale height.
+  glm::vec4 mie_scattering;
+  // w: anisotropy.
+  glm::vec4 mie_absorption;
+  // w: centre altitude of the layer.
+  glm::vec4 ozone_absorption;
+  // w: half width of the ozone layer.
+  glm::vec4 ground_albedo;
+  // w: cosine of the angular radius.
+  glm::vec4 sun_direction;
+  // w: exposure.
+  glm::vec4 sun_illuminance;
+  // xyz: camera relative to the planet's centre in kilometres, w: kilometres
+  // per world unit.
+  glm::vec4 camera;
+  // x: bottom radius, y: top radius, z: distance the aerial perspective
+  // volume reaches.
+  glm::vec4 planet;
+  // xy: 1 / render extent, z: NDC depth of the near plane.
+  glm::vec4 screen;
+  // Camera relative, like the terrain's view projection.
+  glm::mat4 inverse_view_projection;
+};
+static_assert(sizeof(AtmosphereGpuData) == 224,
+              "AtmosphereGpuData has to match the shaders' std140 layout");
+
+// Sky and aerial perspective after Hillaire, "A Scalable and Production Ready
+// Sky and Atmosphere Rendering Technique" (2020), from four LUTs rendered by
+// shaders/atmosphere.comp:
+//
+// - Transmittance to the top of the atmosphere by altitude and zenith angle,
+//   256 x 64.
+// - Multiple scattering as an isotropic source by altitude and sun zenith
+//   angle, 32 x 32.
+// - Sky luminance around the camera by view zenith angle and azimuth to the
+//   sun, 192 x 108, for shaders/sky.frag, which draws it over whatever the
+//   terrain left empty.
+// - Aerial perspective, in-scattered luminance and transmittance in a screen
+//   aligned froxel volume of 32 x 32 x 32 with quadratically spaced slices,
+//   for the terrain's fragment shader.
+//
+// Update() tells which LUTs are stale and Record() only renders those: the
+// first two when the parameters change, the sky view when the camera's
+// altitude or the sun does, the froxel volume when anything about the view
+// does. The sizes are fixed, so even a frame that renders all of them costs
+// the same at every resolution. Frames that keep still render none. The
+// profiler's "Atmosphere" scope measures it.
+//
+// The LUTs are shared by all frames in flight, which use them in the order
+// they are submitted to the graphics queue: Record() waits for the draws of
+// the previous frames before it rewrites one.
+//
+// Render thread only.
+class Atmosphere {
+public:
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    GpuAllocator *allocator = nullptr;
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    // SPIR-V of shaders/atmosphere.comp.
+    std::vector<char> shader_code;
+    // UniformArena::Buffer(), the frame's AtmosphereGpuData is bound at a
+    // dynamic offset into it.
+    VkBuffer uniform_buffer = VK_NULL_HANDLE;
+    bool reversed_z = true;
+    // The terrain's mesh shaders light with the transmittance too. Needs
+    // VK_EXT_mesh_shader enabled.
+    bool mesh_shaders = false;
+    // Destroys a GPU resource once the frames using it have retired.
+    std::function<void(std::function<void()> &&)> defer_destroy;
+  };
+
+  struct View {
+    // In world units from the planet's centre, metres.
+    glm::dvec3 camera_position{0.0};
+    // Camera relative.
+    glm::mat4 view_projection{1.0f};
+    VkExtent2D render_extent{1, 1};
+  };
+
+  struct Stats {
+    uint32_t lut_builds = 0;
+    uint32_t sky_view_builds = 0;
+    uint32_t aerial_perspective_builds = 0;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  // The device has to be idle.
+  void Destroy();
+
+  // The frame's uniform data. Marks the LUTs that depend on what changed
+  // since the last frame as stale.
+  AtmosphereGpuData Update(const View &view);
+  // Renders the stale LUTs with the frame's AtmosphereGpuData at
+  // `uniform_offset`, outside a render pass, and leaves them readable by
+  // vertex, fragment and, with CreateInfo::mesh_shaders, mesh shaders.
+  void Record(VkCommandBuffer command_buffer, uint32_t uniform_offset);
+  bool ReloadShader(const std::vector<char> &shader_code);
+
+  // Take effect with the next Update().
+  void SetParameters(const AtmosphereParameters &parameters) {
+    parameters_ = parameters;
+  }
+  void SetSun(const AtmosphereSun &sun) { sun_ = sun; }
+  const AtmosphereParameters &Parameters() const { return parameters_; }
+  const AtmosphereSun &Sun() const { return sun_; }
+  const Stats &GetStats() const { return stats_; }
+
+  // Set for drawing with the LUTs, for the vertex, mesh and fragment stages:
+  // binding 0 the AtmosphereGpuData at a dynamic offset, binding 1 the
+  // transmittance, binding 2 the sky view and binding 3 the aerial
+  // perspective, all combined image samplers.
+  VkDescriptorSetLayout RenderSetLayout() const { return render_set_layout_; }
+  VkDescriptorSet RenderSet() const { return render_set_; }
+
+private:
+  enum Lut : uint32_t {
+    kTransmittance = 0,
+    kMultipleScattering = 1,
+    kSkyView = 2,
+    kAerialPerspective = 3,
+    kLutCount = 4
+  };
+
+  struct Image {
+    VkImage image = VK_NULL_HANDLE;
+    GpuAllocation allocation;
+    VkImageView view = VK_NULL_HANDLE;
+  };
+
+  bool CreateImage(Lut lut);
+  bool CreateDescriptorSets(VkBuffer uniform_buffer);
+  // One pipeline per LUT, all from the same shader.
+  bool CreatePipelines(const std::vector<char> &shader_code,
+                       std::array<VkPipeline, kLutCount> &pipelines);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  GpuAllocator *allocator_ = nullptr;
+  VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
+  bool reversed_z_ = true;
+  // Of the shaders reading RenderSet().
+  VkPipelineStageFlags render_stages_ = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                                        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  std::function<void(std::function<void()> &&)> defer_destroy_;
+
+  AtmosphereParameters parameters_;
+  AtmosphereSun sun_;
+
+  VkSampler sampler_ = VK_NULL_HANDLE;
+  std::array<Image, kLutCount> images_;
+  VkDescriptorSetLayout compute_set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout render_set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorPool pool_ = VK_NULL_HANDLE;
+  VkDescriptorSet compute_set_ = VK_NULL_HANDLE;
+  VkDescriptorSet render_set_ = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
+  std::array<VkPipeline, kLutCount> pipelines_{};
+
+  // What the LUTs were last rendered for, and which are stale.
+  bool laid_out_ = false;
+  AtmosphereParameters built_parameters_;
+  AtmosphereGpuData built_data_{};
+  bool luts_stale_ = true;
+  bool sky_view_stale_ = true;
+  bool aerial_perspective_stale_ = true;
+  Stats stats_;
+};
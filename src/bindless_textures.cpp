@@ -0,0 +1,161 @@
+#include "bindless_textures.h"
+#include <algorithm>
+#include <array>
+#include <spdlog/spdlog.h>
+
+bool BindlessTextures::Init(const CreateInfo &create_info,
+                            VkPhysicalDevice physical_device) {
+  device_ = create_info.device;
+
+  VkPhysicalDeviceVulkan12Properties properties12{};
+  properties12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+  VkPhysicalDeviceProperties2 properties{};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  properties.pNext = &properties12;
+  vkGetPhysicalDeviceProperties2(physical_device, &properties);
+  capacity_ = std::min(
+      {create_info.max_textures,
+       properties12.maxDescriptorSetUpdateAfterBindSampledImages,
+       properties12.maxPerStageDescriptorUpdateAfterBindSampledImages});
+
+  for (uint32_t i = 0; i < kCount; ++i) {
+    VkSamplerCreateInfo sampler_info{};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    VkSamplerAddressMode address_mode =
+        i == kLinearRepeat ? VK_SAMPLER_ADDRESS_MODE_REPEAT
+                           : VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeU = address_mode;
+    sampler_info.addressModeV = address_mode;
+    sampler_info.addressModeW = address_mode;
+    sampler_info.anisotropyEnable =
+        i == kLinearRepeat && create_info.max_anisotropy > 1.0f;
+    sampler_info.maxAnisotropy = create_info.max_anisotropy;
+    sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+    if (vkCreateSampler(device_, &sampler_info, nullptr, &samplers_[i]) !=
+        VK_SUCCESS) {
+      spdlog::error("Failed to create bindless sampler.");
+      return false;
+    }
+  }
+
+  // Binding 0: the images, binding 1: the samplers. Fragment shaders only for
+  // now, every stage that samples has to be listed.
+  std::array<VkDescriptorSetLayoutBinding, 2> bindings{};
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+  bindings[0].descriptorCount = capacity_;
+  bindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+  bindings[1].descriptorCount = kCount;
+  bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  bindings[1].pImmutableSamplers = samplers_;
+  std::array<VkDescriptorBindingFlags, 2> binding_flags = {
+      VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+          VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+          VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT,
+      0};
+  VkDescriptorSetLayoutBindingFlagsCreateInfo flags_info{};
+  flags_info.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+  flags_info.bindingCount = static_cast<uint32_t>(binding_flags.size());
+  flags_info.pBindingFlags = binding_flags.data();
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.pNext = &flags_info;
+  layout_info.flags =
+      VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+  layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+  layout_info.pBindings = bindings.data();
+  if (vkCreateDescriptorSetLayout(device_, &layout_info, nullptr, &layout_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create bindless descriptor set layout.");
+    return false;
+  }
+
+  std::array<VkDescriptorPoolSize, 2> pool_sizes{};
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+  pool_sizes[0].descriptorCount = capacity_;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_SAMPLER;
+  pool_sizes[1].descriptorCount = kCount;
+  VkDescriptorPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+  pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+  pool_info.pPoolSizes = pool_sizes.data();
+  pool_info.maxSets = 1;
+  VkDescriptorSetAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &layout_;
+  if (vkCreateDescriptorPool(device_, &pool_info, nullptr, &pool_) !=
+          VK_SUCCESS ||
+      (allocate_info.descriptorPool = pool_,
+       vkAllocateDescriptorSets(device_, &allocate_info, &set_)) !=
+          VK_SUCCESS) {
+    spdlog::error("Failed to allocate bindless descriptor set.");
+    return false;
+  }
+
+  free_slots_.clear();
+  next_slot_ = 0;
+  free_count_ = capacity_;
+  spdlog::info("Bindless texture slots: {}", capacity_);
+  return true;
+}
+
+void BindlessTextures::Destroy() {
+  if (device_ == VK_NULL_HANDLE) {
+    return;
+  }
+  vkDestroyDescriptorPool(device_, pool_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, layout_, nullptr);
+  for (VkSampler &sampler : samplers_) {
+    vkDestroySampler(device_, sampler, nullptr);
+    sampler = VK_NULL_HANDLE;
+  }
+  pool_ = VK_NULL_HANDLE;
+  layout_ = VK_NULL_HANDLE;
+  set_ = VK_NULL_HANDLE;
+  free_slots_.clear();
+  next_slot_ = 0;
+  free_count_ = 0;
+}
+
+std::optional<uint32_t> BindlessTextures::Add(VkImageView view) {
+  uint32_t index;
+  if (!free_slots_.empty()) {
+    index = free_slots_.back();
+    free_slots_.pop_back();
+  } else if (next_slot_ < capacity_) {
+    index = next_slot_++;
+  } else {
+    spdlog::error("Out of bindless texture slots.");
+    return std::nullopt;
+  }
+  --free_count_;
+
+  VkDescriptorImageInfo image_info{};
+  image_info.imageView = view;
+  image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  VkWriteDescriptorSet write{};
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.dstSet = set_;
+  write.dstBinding = 0;
+  write.dstArrayElement = index;
+  write.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+  write.descriptorCount = 1;
+  write.pImageInfo = &image_info;
+  vkUpdateDescriptorSets(device_, 1, &write, 0, nullptr);
+  return index;
+}
+
+void BindlessTextures::Remove(uint32_t index) {
+  // The descriptor is left as it is, partially bound arrays only require the
+  // slots that are read to be valid.
+  free_slots_.push_back(index);
+  ++free_count_;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// One descriptor set with a large array of sampled images and a few immutable
+// samplers, bound once per draw alongside the frame's set. Shaders pick
+// textures by index, the indices travel with the data that needs them (see
+// ChunkGpuData), so GPU driven draws never need a descriptor set switch.
+//
+// The image array is partially bound and update-after-bind with updates of
+// unused descriptors while pending: a slot can be written while frames in
+// flight use other slots. A removed slot is handed out again right away, so
+// Remove() may only be called once no frame in flight can still read it,
+// from the deletion queue.
+//
+// Render thread only.
+class BindlessTextures {
+public:
+  // Indices into `samplers` in the shaders.
+  enum Sampler : uint32_t { kLinearRepeat = 0, kLinearClamp = 1, kCount = 2 };
+
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    // Clamped to the device's update-after-bind limits.
+    uint32_t max_textures = 4096;
+    // Of kLinearRepeat, 1 without samplerAnisotropy.
+    float max_anisotropy = 1.0f;
+  };
+
+  bool Init(const CreateInfo &create_info, VkPhysicalDevice physical_device);
+  void Destroy();
+
+  // Writes `view`, in SHADER_READ_ONLY_OPTIMAL, into a free slot. Returns its
+  // index, or std::nullopt if the array is full.
+  std::optional<uint32_t> Add(VkImageView view);
+  void Remove(uint32_t index);
+
+  VkDescriptorSetLayout Layout() const { return layout_; }
+  VkDescriptorSet Set() const { return set_; }
+  uint32_t Capacity() const { return capacity_; }
+  uint32_t Count() const { return capacity_ - free_count_; }
+
+private:
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout layout_ = VK_NULL_HANDLE;
+  VkDescriptorPool pool_ = VK_NULL_HANDLE;
+  VkDescriptorSet set_ = VK_NULL_HANDLE;
+  VkSampler samplers_[kCount] = {};
+  uint32_t capacity_ = 0;
+  // Removed slots first, then the ones never used from next_slot_ on.
+  std::vector<uint32_t> free_slots_;
+  uint32_t next_slot_ = 0;
+  uint32_t free_count_ = 0;
+};
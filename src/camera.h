@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// Positions are in double precision world space. Rendering is camera relative,
+// so the view matrix only holds the rotation and everything drawn is offset by
+// -position on the CPU first.
+struct Camera {
+  glm::dvec3 position{0.0};
+  glm::dvec3 forward{0.0, 0.0, -1.0};
+  glm::dvec3 up{0.0, 1.0, 0.0};
+  float fov_y = glm::radians(45.0f);
+
+  glm::mat4 ViewMatrix() const {
+    return glm::lookAt(glm::vec3(0.0f), glm::vec3(forward), glm::vec3(up));
+  }
+
+  // Standard OpenGL style projection, remapped to Vulkan's clip space by
+  // GLM_FORCE_DEPTH_ZERO_TO_ONE and with Y pointing down.
+  glm::mat4 ProjectionMatrix(float aspect, float near_plane,
+                             float far_plane) const {
+    glm::mat4 projection =
+        glm::perspective(fov_y, aspect, near_plane, far_plane);
+    projection[1][1] *= -1.0f;
+    return projection;
+  }
+
+  // Reversed-Z projection with the far plane at infinity: depth is
+  // near_plane / distance, 1 at the near plane and 0 at infinity.
+  glm::mat4 InfiniteReversedProjectionMatrix(float aspect,
+                                             float near_plane) const {
+    float f = 1.0f / glm::tan(fov_y * 0.5f);
+    glm::mat4 projection(0.0f);
+    projection[0][0] = f / aspect;
+    projection[1][1] = -f;
+    projection[2][3] = -1.0f;
+    projection[3][2] = near_plane;
+    return projection;
+  }
+
+  // Pixels covered by an object of size 1 at distance 1, used to turn world
+  // space errors into screen space errors.
+  float ProjectionScale(float viewport_height) const {
+    return viewport_height / (2.0f * glm::tan(fov_y * 0.5f));
+  }
+};
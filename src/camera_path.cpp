@@ -0,0 +1,125 @@
+#include "camera_path.h"
+#include <algorithm>
+#include <fstream>
+#include <glm/gtc/constants.hpp>
+#include <sstream>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+constexpr double kScriptedKeyInterval = 0.1;
+
+} // namespace
+
+CameraPath CameraPath::Scripted(double planet_radius, double duration) {
+  // Fractions of the duration spent in orbit and on the descent, the rest is
+  // the ground skim.
+  const double orbit_end = 0.25;
+  const double descent_end = 0.7;
+  const double orbit_altitude = 2.0e7;
+  const double skim_start_altitude = 500.0;
+  const double skim_end_altitude = 100.0;
+  const double skim_speed = 300.0;
+
+  CameraPath path;
+  const size_t key_count =
+      std::max<size_t>(2, static_cast<size_t>(duration / kScriptedKeyInterval));
+  const double skim_duration = duration * (1.0 - descent_end);
+  for (size_t i = 0; i < key_count; ++i) {
+    double s = static_cast<double>(i) / static_cast<double>(key_count - 1);
+
+    double altitude;
+    double angle;
+    // 0 looks straight down, 1 at the horizon.
+    double horizon_blend;
+    if (s < orbit_end) {
+      double t = s / orbit_end;
+      altitude = orbit_altitude;
+      angle = t;
+      horizon_blend = 0.0;
+    } else if (s < descent_end) {
+      double t = (s - orbit_end) / (descent_end - orbit_end);
+      altitude = glm::exp(glm::mix(glm::log(orbit_altitude),
+                                   glm::log(skim_start_altitude), t));
+      angle = 1.0 + 0.3 * glm::sin(t * glm::half_pi<double>());
+      horizon_blend = t * t;
+    } else {
+      double t = (s - descent_end) / (1.0 - descent_end);
+      altitude = glm::mix(skim_start_altitude, skim_end_altitude, t);
+      angle = 1.3 + skim_speed * skim_duration * t / planet_radius;
+      horizon_blend = 1.0;
+    }
+
+    glm::dvec3 up =
+        glm::normalize(glm::dvec3(glm::cos(angle), 0.2, glm::sin(angle)));
+    glm::dvec3 tangent =
+        glm::normalize(glm::cross(up, glm::dvec3(0.0, 1.0, 0.0)));
+    Key key;
+    key.time = s * duration;
+    key.position = up * (planet_radius + altitude);
+    key.up = up;
+    key.forward = glm::normalize(glm::mix(-up, tangent, 0.95 * horizon_blend));
+    path.keys_.push_back(key);
+  }
+  return path;
+}
+
+std::optional<CameraPath> CameraPath::Load(const std::string &path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    spdlog::error("Failed to open camera path {}.", path);
+    return std::nullopt;
+  }
+
+  CameraPath camera_path;
+  std::string line;
+  size_t line_number = 0;
+  while (std::getline(file, line)) {
+    ++line_number;
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream stream(line);
+    Key key;
+    if (!(stream >> key.time >> key.position.x >> key.position.y >>
+          key.position.z >> key.forward.x >> key.forward.y >> key.forward.z >>
+          key.up.x >> key.up.y >> key.up.z)) {
+      spdlog::error("{}:{}: expected 10 numbers.", path, line_number);
+      return std::nullopt;
+    }
+    if (!camera_path.keys_.empty() &&
+        key.time < camera_path.keys_.back().time) {
+      spdlog::error("{}:{}: keys are not sorted by time.", path, line_number);
+      return std::nullopt;
+    }
+    camera_path.keys_.push_back(key);
+  }
+  if (camera_path.keys_.empty()) {
+    spdlog::error("Camera path {} has no keys.", path);
+    return std::nullopt;
+  }
+  return camera_path;
+}
+
+void CameraPath::Apply(double time, Camera &camera) const {
+  if (keys_.empty()) {
+    return;
+  }
+  auto next = std::upper_bound(
+      keys_.begin(), keys_.end(), time,
+      [](double t, const Key &key) { return t < key.time; });
+  if (next == keys_.begin() || next == keys_.end()) {
+    const Key &key = next == keys_.begin() ? keys_.front() : keys_.back();
+    camera.position = key.position;
+    camera.forward = glm::normalize(key.forward);
+    camera.up = glm::normalize(key.up);
+    return;
+  }
+
+  const Key &a = *(next - 1);
+  const Key &b = *next;
+  double t = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0.0;
+  camera.position = glm::mix(a.position, b.position, t);
+  camera.forward = glm::normalize(glm::mix(a.forward, b.forward, t));
+  camera.up = glm::normalize(glm::mix(a.up, b.up, t));
+}
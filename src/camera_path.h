@@ -0,0 +1,36 @@
+#pragma once
+
+#include "camera.h"
+#include <optional>
+#include <string>
+#include <vector>
+
+// Camera flight made of timed keyframes. Used for the demo flight and for
+// reproducible benchmark runs.
+class CameraPath {
+public:
+  struct Key {
+    double time = 0.0;
+    glm::dvec3 position{0.0};
+    glm::dvec3 forward{0.0, 0.0, -1.0};
+    glm::dvec3 up{0.0, 1.0, 0.0};
+  };
+
+  // Orbit at 20000 km, descent to the ground and a low skim over the surface
+  // of a planet with the given radius, `duration` seconds in total.
+  static CameraPath Scripted(double planet_radius, double duration);
+
+  // Reads a recorded path, one key per line:
+  // time px py pz fx fy fz ux uy uz
+  // Empty lines and lines starting with '#' are skipped. Keys have to be
+  // sorted by time.
+  static std::optional<CameraPath> Load(const std::string &path);
+
+  double Duration() const { return keys_.empty() ? 0.0 : keys_.back().time; }
+
+  // Interpolates the keys around `time`, clamped to the path.
+  void Apply(double time, Camera &camera) const;
+
+private:
+  std::vector<Key> keys_;
+};
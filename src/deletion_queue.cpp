@@ -0,0 +1,20 @@
+#include "deletion_queue.h"
+#include <utility>
+
+void DeletionQueue::Push(uint64_t frame, std::function<void()> &&deleter) {
+  entries_.push_back({frame, std::move(deleter)});
+}
+
+void DeletionQueue::Flush(uint64_t completed_frame) {
+  while (!entries_.empty() && entries_.front().frame <= completed_frame) {
+    entries_.front().deleter();
+    entries_.pop_front();
+  }
+}
+
+void DeletionQueue::FlushAll() {
+  while (!entries_.empty()) {
+    entries_.front().deleter();
+    entries_.pop_front();
+  }
+}
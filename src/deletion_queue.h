@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+// Defers destruction of GPU resources until every frame that could still
+// reference them has retired on the GPU. Entries are tagged with the frame
+// number that last used the resource and flushed once that frame's fence has
+// been waited on, so nothing needs vkDeviceWaitIdle to be destroyed safely.
+class DeletionQueue {
+public:
+  // Frame numbers must be pushed in non-decreasing order.
+  void Push(uint64_t frame, std::function<void()> &&deleter);
+
+  // Runs deleters of all entries tagged with a frame <= completed_frame.
+  void Flush(uint64_t completed_frame);
+
+  // Runs every pending deleter. Only call this once the device is idle.
+  void FlushAll();
+
+  bool Empty() const { return entries_.empty(); }
+
+private:
+  struct Entry {
+    uint64_t frame;
+    std::function<void()> deleter;
+  };
+
+  std::deque<Entry> entries_;
+};
@@ -0,0 +1,111 @@
+#include "detail_texture.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Cells of the first octave along each axis.
+constexpr uint32_t kBaseCells = 4;
+
+uint32_t Hash(uint32_t x, uint32_t y, uint32_t seed) {
+  uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ seed * 0xcb1ab31fu;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// In [-1, 1].
+float Lattice(uint32_t x, uint32_t y, uint32_t seed) {
+  return static_cast<float>(Hash(x, y, seed)) / 2147483647.5f - 1.0f;
+}
+
+// Value noise with `cells` cells across the texture, wrapping at its edges.
+float ValueNoise(float u, float v, uint32_t cells, uint32_t seed) {
+  float x = u * cells;
+  float y = v * cells;
+  uint32_t x0 = static_cast<uint32_t>(x);
+  uint32_t y0 = static_cast<uint32_t>(y);
+  float tx = x - x0;
+  float ty = y - y0;
+  tx = tx * tx * (3.0f - 2.0f * tx);
+  ty = ty * ty * (3.0f - 2.0f * ty);
+  uint32_t x1 = (x0 + 1) % cells;
+  uint32_t y1 = (y0 + 1) % cells;
+  x0 %= cells;
+  y0 %= cells;
+  float top = Lattice(x0, y0, seed) +
+              (Lattice(x1, y0, seed) - Lattice(x0, y0, seed)) * tx;
+  float bottom = Lattice(x0, y1, seed) +
+                 (Lattice(x1, y1, seed) - Lattice(x0, y1, seed)) * tx;
+  return top + (bottom - top) * ty;
+}
+
+} // namespace
+
+DetailTexture DetailTexture::Generate(uint32_t size, uint32_t seed,
+                                      uint32_t octaves, float persistence,
+                                      float contrast) {
+  DetailTexture texture;
+  texture.size = size;
+  // Octaves finer than a texel only alias.
+  octaves = std::max(octaves, 1u);
+  while (octaves > 1 && (kBaseCells << (octaves - 1)) > size) {
+    --octaves;
+  }
+  float amplitude_sum = 0.0f;
+  for (uint32_t octave = 0; octave < octaves; ++octave) {
+    amplitude_sum += std::pow(persistence, static_cast<float>(octave));
+  }
+
+  std::vector<float> values(size * size);
+  for (uint32_t y = 0; y < size; ++y) {
+    for (uint32_t x = 0; x < size; ++x) {
+      float u = (x + 0.5f) / size;
+      float v = (y + 0.5f) / size;
+      float value = 0.0f;
+      float amplitude = 1.0f;
+      for (uint32_t octave = 0; octave < octaves; ++octave) {
+        value += ValueNoise(u, v, kBaseCells << octave, seed + octave) *
+                 amplitude;
+        amplitude *= persistence;
+      }
+      values[y * size + x] = value / amplitude_sum * contrast;
+    }
+  }
+
+  // Centred on 0, so the average texel is 128, and averaging the float
+  // values keeps every level there.
+  double mean = 0.0;
+  for (float value : values) {
+    mean += value;
+  }
+  mean /= values.size();
+  for (float &value : values) {
+    value -= static_cast<float>(mean);
+  }
+
+  for (uint32_t level_size = size; level_size > 0; level_size /= 2) {
+    if (level_size != size) {
+      uint32_t parent_size = level_size * 2;
+      std::vector<float> level(level_size * level_size);
+      for (uint32_t y = 0; y < level_size; ++y) {
+        for (uint32_t x = 0; x < level_size; ++x) {
+          const float *row = &values[2 * y * parent_size + 2 * x];
+          level[y * level_size + x] =
+              (row[0] + row[1] + row[parent_size] + row[parent_size + 1]) *
+              0.25f;
+        }
+      }
+      values = std::move(level);
+    }
+    texture.level_offsets.push_back(texture.texels.size());
+    for (float value : values) {
+      texture.texels.push_back(static_cast<uint8_t>(
+          std::clamp(128.0f + value * 127.0f, 0.0f, 255.0f) + 0.5f));
+    }
+  }
+  return texture;
+}
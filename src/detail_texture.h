@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Tileable grayscale texture that modulates the terrain colour up close, R8
+// with its whole mip chain. 128 leaves the colour as it is, the shader scales
+// by twice the sample, and every mip level keeps that average so distant
+// terrain is not darkened or brightened by it.
+struct DetailTexture {
+  uint32_t size = 0;
+  // Every level, level 0 first, and the offset each one starts at.
+  std::vector<uint8_t> texels;
+  std::vector<size_t> level_offsets;
+
+  uint32_t LevelCount() const {
+    return static_cast<uint32_t>(level_offsets.size());
+  }
+
+  // Periodic value noise, `size` a power of two. Each of the `octaves` has
+  // twice the frequency of the last and `persistence` times its amplitude,
+  // `contrast` scales the sum.
+  static DetailTexture Generate(uint32_t size, uint32_t seed, uint32_t octaves,
+                                float persistence, float contrast);
+};
@@ -0,0 +1,352 @@
+#include "gpu_allocator.h"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+constexpr VkDeviceSize kMiB = 1024ull * 1024ull;
+constexpr VkDeviceSize kLargeHeapBlockSize = 256 * kMiB;
+constexpr VkDeviceSize kSmallHeapThreshold = 1024 * kMiB;
+
+} // namespace
+
+struct GpuMemoryBlock {
+  GpuMemoryBlock(VkDeviceMemory memory, VkDeviceSize size, void *mapped,
+                 uint32_t memory_type, uint32_t pool_index)
+      : memory(memory), mapped(mapped), memory_type(memory_type),
+        pool_index(pool_index), tlsf(size) {}
+
+  VkDeviceMemory memory;
+  void *mapped;
+  uint32_t memory_type;
+  uint32_t pool_index;
+  TlsfAllocator tlsf;
+};
+
+void GpuAllocator::Init(VkPhysicalDevice physical_device, VkDevice device) {
+  device_ = device;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties_);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  buffer_image_granularity_ = properties.limits.bufferImageGranularity;
+  max_allocation_count_ = properties.limits.maxMemoryAllocationCount;
+
+  pools_.resize(memory_properties_.memoryTypeCount * 2);
+}
+
+void GpuAllocator::Destroy() {
+  std::lock_guard lock(mutex_);
+  for (Pool &pool : pools_) {
+    for (auto &block : pool.blocks) {
+      if (!block->tlsf.Empty()) {
+        spdlog::warn("GPU memory block destroyed with {} live allocations.",
+                     block->tlsf.AllocationCount());
+      }
+      vkFreeMemory(device_, block->memory, nullptr);
+    }
+    pool.blocks.clear();
+  }
+  if (dedicated_count_ > 0) {
+    spdlog::warn("{} dedicated GPU allocations were not freed.",
+                 dedicated_count_);
+  }
+}
+
+std::optional<uint32_t>
+GpuAllocator::FindMemoryType(uint32_t type_filter,
+                             VkMemoryPropertyFlags properties) const {
+  for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; ++i) {
+    if ((type_filter & (1 << i)) &&
+        (memory_properties_.memoryTypes[i].propertyFlags & properties) ==
+            properties) {
+      return i;
+    }
+  }
+
+  spdlog::error("Failed to find suitable memory type.");
+  return std::nullopt;
+}
+
+std::optional<GpuAllocation>
+GpuAllocator::AllocateForBuffer(VkBuffer buffer,
+                                VkMemoryPropertyFlags properties) {
+  VkBufferMemoryRequirementsInfo2 requirements_info{};
+  requirements_info.sType =
+      VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+  requirements_info.buffer = buffer;
+
+  VkMemoryDedicatedRequirements dedicated_requirements{};
+  dedicated_requirements.sType =
+      VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+  VkMemoryRequirements2 requirements{};
+  requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+  requirements.pNext = &dedicated_requirements;
+  vkGetBufferMemoryRequirements2(device_, &requirements_info, &requirements);
+
+  bool dedicated = dedicated_requirements.prefersDedicatedAllocation ||
+                   dedicated_requirements.requiresDedicatedAllocation;
+  std::optional<GpuAllocation> allocation =
+      Allocate(requirements.memoryRequirements, properties,
+               ResourceKind::kLinear, dedicated, buffer, VK_NULL_HANDLE);
+  if (!allocation) {
+    return std::nullopt;
+  }
+
+  vkBindBufferMemory(device_, buffer, allocation->memory, allocation->offset);
+  return allocation;
+}
+
+std::optional<GpuAllocation>
+GpuAllocator::AllocateForImage(VkImage image, VkImageTiling tiling,
+                               VkMemoryPropertyFlags properties,
+                               bool prefer_dedicated) {
+  VkImageMemoryRequirementsInfo2 requirements_info{};
+  requirements_info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+  requirements_info.image = image;
+
+  VkMemoryDedicatedRequirements dedicated_requirements{};
+  dedicated_requirements.sType =
+      VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+  VkMemoryRequirements2 requirements{};
+  requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+  requirements.pNext = &dedicated_requirements;
+  vkGetImageMemoryRequirements2(device_, &requirements_info, &requirements);
+
+  bool dedicated = prefer_dedicated ||
+                   dedicated_requirements.prefersDedicatedAllocation ||
+                   dedicated_requirements.requiresDedicatedAllocation;
+  ResourceKind kind = tiling == VK_IMAGE_TILING_OPTIMAL ? ResourceKind::kOptimal
+                                                        : ResourceKind::kLinear;
+  std::optional<GpuAllocation> allocation =
+      Allocate(requirements.memoryRequirements, properties, kind, dedicated,
+               VK_NULL_HANDLE, image);
+  if (!allocation) {
+    return std::nullopt;
+  }
+
+  vkBindImageMemory(device_, image, allocation->memory, allocation->offset);
+  return allocation;
+}
+
+std::optional<GpuAllocation>
+GpuAllocator::AllocateForSparseImage(const VkMemoryRequirements &requirements,
+                                     VkMemoryPropertyFlags properties) {
+  return Allocate(requirements, properties, ResourceKind::kOptimal, false,
+                  VK_NULL_HANDLE, VK_NULL_HANDLE);
+}
+
+void GpuAllocator::Free(const GpuAllocation &allocation) {
+  if (allocation.memory == VK_NULL_HANDLE) {
+    return;
+  }
+
+  std::lock_guard lock(mutex_);
+  if (allocation.block == nullptr) {
+    vkFreeMemory(device_, allocation.memory, nullptr);
+    --dedicated_count_;
+    dedicated_bytes_ -= allocation.size;
+    return;
+  }
+
+  GpuMemoryBlock *block = allocation.block;
+  block->tlsf.Free(allocation.offset);
+  if (!block->tlsf.Empty()) {
+    return;
+  }
+
+  // Keep one empty block per pool around so that a resource freed and
+  // recreated every frame doesn't hit vkAllocateMemory each time.
+  Pool &pool = pools_[block->pool_index];
+  size_t empty_blocks =
+      std::count_if(pool.blocks.begin(), pool.blocks.end(),
+                    [](const auto &b) { return b->tlsf.Empty(); });
+  if (empty_blocks > 1) {
+    vkFreeMemory(device_, block->memory, nullptr);
+    std::erase_if(pool.blocks,
+                  [block](const auto &b) { return b.get() == block; });
+  }
+}
+
+GpuAllocatorStats GpuAllocator::GetStats() const {
+  std::lock_guard lock(mutex_);
+  GpuAllocatorStats stats;
+  VkDeviceSize free_bytes = 0;
+  VkDeviceSize contiguous_free_bytes = 0;
+  for (const Pool &pool : pools_) {
+    for (const auto &block : pool.blocks) {
+      VkDeviceSize largest = block->tlsf.LargestFreeRange();
+      ++stats.block_count;
+      stats.allocation_count += block->tlsf.AllocationCount();
+      stats.block_bytes += block->tlsf.Size();
+      stats.used_bytes += block->tlsf.UsedBytes();
+      stats.largest_free_range = std::max(stats.largest_free_range, largest);
+      free_bytes += block->tlsf.FreeBytes();
+      contiguous_free_bytes += largest;
+    }
+  }
+  stats.dedicated_count = dedicated_count_;
+  stats.dedicated_bytes = dedicated_bytes_;
+  stats.allocation_count += dedicated_count_;
+  if (free_bytes > 0) {
+    stats.fragmentation =
+        1.0f - static_cast<float>(contiguous_free_bytes) / free_bytes;
+  }
+  return stats;
+}
+
+void GpuAllocator::LogStats() const {
+  GpuAllocatorStats stats = GetStats();
+  spdlog::info("GPU memory: {} blocks ({:.1f} MiB, {:.1f} MiB used), {} "
+               "dedicated ({:.1f} MiB), {} allocations, fragmentation {:.2f}",
+               stats.block_count,
+               static_cast<double>(stats.block_bytes) / kMiB,
+               static_cast<double>(stats.used_bytes) / kMiB,
+               stats.dedicated_count,
+               static_cast<double>(stats.dedicated_bytes) / kMiB,
+               stats.allocation_count, stats.fragmentation);
+}
+
+std::optional<GpuAllocation>
+GpuAllocator::Allocate(const VkMemoryRequirements &requirements,
+                       VkMemoryPropertyFlags properties, ResourceKind kind,
+                       bool dedicated, VkBuffer dedicated_buffer,
+                       VkImage dedicated_image) {
+  std::optional<uint32_t> memory_type =
+      FindMemoryType(requirements.memoryTypeBits, properties);
+  if (!memory_type) {
+    return std::nullopt;
+  }
+
+  if (dedicated || requirements.size >= PreferredBlockSize(*memory_type) / 2) {
+    return AllocateDedicated(requirements.size, *memory_type, dedicated_buffer,
+                             dedicated_image);
+  }
+
+  std::lock_guard lock(mutex_);
+  Pool &pool = GetPool(*memory_type, kind);
+  GpuMemoryBlock *block = nullptr;
+  uint64_t offset = TlsfAllocator::kInvalidOffset;
+  for (auto &candidate : pool.blocks) {
+    offset = candidate->tlsf.Allocate(requirements.size, requirements.alignment);
+    if (offset != TlsfAllocator::kInvalidOffset) {
+      block = candidate.get();
+      break;
+    }
+  }
+  if (!block) {
+    block = CreateBlock(pool, *memory_type,
+                        requirements.size + requirements.alignment);
+    if (!block) {
+      return std::nullopt;
+    }
+    offset = block->tlsf.Allocate(requirements.size, requirements.alignment);
+  }
+
+  GpuAllocation allocation;
+  allocation.memory = block->memory;
+  allocation.offset = offset;
+  allocation.size = requirements.size;
+  allocation.memory_type = *memory_type;
+  allocation.block = block;
+  if (block->mapped) {
+    allocation.mapped = static_cast<char *>(block->mapped) + offset;
+  }
+  return allocation;
+}
+
+std::optional<GpuAllocation>
+GpuAllocator::AllocateDedicated(VkDeviceSize size, uint32_t memory_type,
+                                VkBuffer dedicated_buffer,
+                                VkImage dedicated_image) {
+  VkMemoryDedicatedAllocateInfo dedicated_info{};
+  dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+  dedicated_info.buffer = dedicated_buffer;
+  dedicated_info.image = dedicated_image;
+
+  VkMemoryAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.pNext = &dedicated_info;
+  allocate_info.allocationSize = size;
+  allocate_info.memoryTypeIndex = memory_type;
+
+  GpuAllocation allocation;
+  if (vkAllocateMemory(device_, &allocate_info, nullptr, &allocation.memory) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to allocate dedicated memory ({} bytes).", size);
+    return std::nullopt;
+  }
+  allocation.size = size;
+  allocation.memory_type = memory_type;
+  if (IsHostVisible(memory_type)) {
+    vkMapMemory(device_, allocation.memory, 0, VK_WHOLE_SIZE, 0,
+                &allocation.mapped);
+  }
+
+  std::lock_guard lock(mutex_);
+  ++dedicated_count_;
+  dedicated_bytes_ += size;
+  return allocation;
+}
+
+GpuMemoryBlock *GpuAllocator::CreateBlock(Pool &pool, uint32_t memory_type,
+                                          VkDeviceSize min_size) {
+  VkMemoryAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize =
+      std::max(PreferredBlockSize(memory_type), min_size);
+  allocate_info.memoryTypeIndex = memory_type;
+
+  // Under memory pressure fall back to smaller blocks before giving up.
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  while (vkAllocateMemory(device_, &allocate_info, nullptr, &memory) !=
+         VK_SUCCESS) {
+    if (allocate_info.allocationSize / 2 < min_size) {
+      spdlog::error("Failed to allocate GPU memory block ({} bytes).",
+                    allocate_info.allocationSize);
+      return nullptr;
+    }
+    allocate_info.allocationSize /= 2;
+  }
+
+  void *mapped = nullptr;
+  if (IsHostVisible(memory_type)) {
+    vkMapMemory(device_, memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+  }
+
+  size_t block_count = 0;
+  for (const Pool &p : pools_) {
+    block_count += p.blocks.size();
+  }
+  if (block_count + dedicated_count_ + 1 > max_allocation_count_) {
+    spdlog::warn("GPU allocation count exceeds maxMemoryAllocationCount ({}).",
+                 max_allocation_count_);
+  }
+  spdlog::info("Allocated GPU memory block: type {}, {:.1f} MiB", memory_type,
+               static_cast<double>(allocate_info.allocationSize) / kMiB);
+
+  uint32_t pool_index = static_cast<uint32_t>(&pool - pools_.data());
+  pool.blocks.push_back(std::make_unique<GpuMemoryBlock>(
+      memory, allocate_info.allocationSize, mapped, memory_type, pool_index));
+  return pool.blocks.back().get();
+}
+
+VkDeviceSize GpuAllocator::PreferredBlockSize(uint32_t memory_type) const {
+  uint32_t heap_index = memory_properties_.memoryTypes[memory_type].heapIndex;
+  VkDeviceSize heap_size = memory_properties_.memoryHeaps[heap_index].size;
+  return heap_size <= kSmallHeapThreshold ? heap_size / 8
+                                          : kLargeHeapBlockSize;
+}
+
+bool GpuAllocator::IsHostVisible(uint32_t memory_type) const {
+  return memory_properties_.memoryTypes[memory_type].propertyFlags &
+         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+GpuAllocator::Pool &GpuAllocator::GetPool(uint32_t memory_type,
+                                          ResourceKind kind) {
+  if (buffer_image_granularity_ <= 1) {
+    kind = ResourceKind::kLinear;
+  }
+  return pools_[memory_type * 2 + static_cast<uint32_t>(kind)];
+}
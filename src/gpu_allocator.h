@@ -0,0 +1,104 @@
+#pragma once
+
+#include "tlsf_allocator.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+struct GpuMemoryBlock;
+
+// A range of device memory handed out by GpuAllocator. Resources are bound at
+// (memory, offset). Host-visible memory is persistently mapped and `mapped`
+// points at the start of the range.
+struct GpuAllocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  void *mapped = nullptr;
+  uint32_t memory_type = 0;
+  // Owning block, nullptr for dedicated allocations.
+  GpuMemoryBlock *block = nullptr;
+};
+
+struct GpuAllocatorStats {
+  uint32_t block_count = 0;
+  uint32_t dedicated_count = 0;
+  uint32_t allocation_count = 0;
+  VkDeviceSize block_bytes = 0;
+  VkDeviceSize used_bytes = 0;
+  VkDeviceSize dedicated_bytes = 0;
+  VkDeviceSize largest_free_range = 0;
+  // 0 when all free block memory is one contiguous range, approaching 1 as it
+  // gets split into many small ranges.
+  float fragmentation = 0.0f;
+};
+
+// Engine-owned device memory allocator. Memory is taken from the driver in
+// large blocks per memory type and sub-allocated with TLSF, so the number of
+// vkAllocateMemory calls stays far below maxMemoryAllocationCount no matter
+// how many buffers exist. Large resources and resources the driver prefers to
+// own their memory get a dedicated allocation instead.
+//
+// Allocations may be made from any thread.
+class GpuAllocator {
+public:
+  void Init(VkPhysicalDevice physical_device, VkDevice device);
+  void Destroy();
+
+  std::optional<uint32_t> FindMemoryType(uint32_t type_filter,
+                                         VkMemoryPropertyFlags properties) const;
+
+  // Allocate memory for the resource and bind it.
+  std::optional<GpuAllocation>
+  AllocateForBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties);
+  std::optional<GpuAllocation> AllocateForImage(VkImage image,
+                                                VkImageTiling tiling,
+                                                VkMemoryPropertyFlags properties,
+                                                bool prefer_dedicated = false);
+  // Memory for one block of a sparse optimal image, which the caller binds
+  // with vkQueueBindSparse.
+  std::optional<GpuAllocation>
+  AllocateForSparseImage(const VkMemoryRequirements &requirements,
+                         VkMemoryPropertyFlags properties);
+  void Free(const GpuAllocation &allocation);
+
+  GpuAllocatorStats GetStats() const;
+  void LogStats() const;
+
+private:
+  // Buffers and linear images are kept apart from optimal images when the
+  // device reports a bufferImageGranularity, so neighbouring ranges never
+  // alias on the same granularity page.
+  enum class ResourceKind { kLinear = 0, kOptimal = 1 };
+
+  struct Pool {
+    std::vector<std::unique_ptr<GpuMemoryBlock>> blocks;
+  };
+
+  std::optional<GpuAllocation>
+  Allocate(const VkMemoryRequirements &requirements,
+           VkMemoryPropertyFlags properties, ResourceKind kind,
+           bool dedicated, VkBuffer dedicated_buffer, VkImage dedicated_image);
+  std::optional<GpuAllocation>
+  AllocateDedicated(VkDeviceSize size, uint32_t memory_type,
+                    VkBuffer dedicated_buffer, VkImage dedicated_image);
+  GpuMemoryBlock *CreateBlock(Pool &pool, uint32_t memory_type,
+                              VkDeviceSize min_size);
+  VkDeviceSize PreferredBlockSize(uint32_t memory_type) const;
+  bool IsHostVisible(uint32_t memory_type) const;
+  Pool &GetPool(uint32_t memory_type, ResourceKind kind);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties memory_properties_{};
+  VkDeviceSize buffer_image_granularity_ = 1;
+  uint32_t max_allocation_count_ = 0;
+
+  mutable std::mutex mutex_;
+  // Indexed by memory_type * 2 + ResourceKind.
+  std::vector<Pool> pools_;
+  uint32_t dedicated_count_ = 0;
+  VkDeviceSize dedicated_bytes_ = 0;
+};
@@ -0,0 +1,360 @@
+#include "hiz_pyramid.h"
+#include "shader_library.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// Must match local_size_x and local_size_y in shaders/hiz.comp.
+constexpr uint32_t kGroupSize = 8;
+
+// Of level 0. A power of two, so every level has exactly half the size of
+// the one above, the level sizes Vulkan derives round down.
+VkExtent2D BaseExtent(VkExtent2D depth_extent) {
+  return {std::bit_ceil(std::max((depth_extent.width + 1) / 2, 1u)),
+          std::bit_ceil(std::max((depth_extent.height + 1) / 2, 1u))};
+}
+
+} // namespace
+
+bool HiZPyramid::Init(const CreateInfo &create_info) {
+  device_ = create_info.device;
+  allocator_ = create_info.allocator;
+  pipeline_cache_ = create_info.pipeline_cache;
+  reversed_z_ = create_info.reversed_z;
+  if (create_info.task_shaders) {
+    cull_stages_ |= VK_PIPELINE_STAGE_TASK_SHADER_BIT_EXT;
+  }
+  defer_destroy_ = create_info.defer_destroy;
+
+  // Only read with texelFetch(), which ignores the filter.
+  VkSamplerCreateInfo sampler_info{};
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = VK_FILTER_NEAREST;
+  sampler_info.minFilter = VK_FILTER_NEAREST;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+  if (vkCreateSampler(device_, &sampler_info, nullptr, &sampler_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create Hi-Z sampler.");
+    return false;
+  }
+
+  // Binding 0: the level above or the depth buffer, binding 1: the level
+  // written.
+  std::array<VkDescriptorSetLayoutBinding, 2> bindings{};
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[1] = bindings[0];
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+  layout_info.pBindings = bindings.data();
+  VkDescriptorSetLayoutBinding cull_binding = bindings[0];
+  if (create_info.task_shaders) {
+    cull_binding.stageFlags |= VK_SHADER_STAGE_TASK_BIT_EXT;
+  }
+  VkDescriptorSetLayoutCreateInfo cull_layout_info = layout_info;
+  cull_layout_info.bindingCount = 1;
+  cull_layout_info.pBindings = &cull_binding;
+  if (vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
+                                  &build_set_layout_) != VK_SUCCESS ||
+      vkCreateDescriptorSetLayout(device_, &cull_layout_info, nullptr,
+                                  &cull_set_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create Hi-Z descriptor set layouts.");
+    return false;
+  }
+
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &build_set_layout_;
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &pipeline_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create Hi-Z pipeline layout.");
+    return false;
+  }
+  return CreatePipeline(create_info.shader_code, pipeline_);
+}
+
+void HiZPyramid::Destroy() {
+  if (device_ == VK_NULL_HANDLE) {
+    return;
+  }
+  DestroyTargets(targets_);
+  targets_ = {};
+  vkDestroyPipeline(device_, pipeline_, nullptr);
+  vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, cull_set_layout_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, build_set_layout_, nullptr);
+  vkDestroySampler(device_, sampler_, nullptr);
+  pipeline_ = VK_NULL_HANDLE;
+  pipeline_layout_ = VK_NULL_HANDLE;
+  cull_set_layout_ = VK_NULL_HANDLE;
+  build_set_layout_ = VK_NULL_HANDLE;
+  sampler_ = VK_NULL_HANDLE;
+}
+
+bool HiZPyramid::Resize(VkExtent2D extent, VkImageView depth_view) {
+  if (targets_.image != VK_NULL_HANDLE) {
+    defer_destroy_(
+        [this, targets = targets_]() { DestroyTargets(targets); });
+    targets_ = {};
+  }
+  Targets targets;
+  if (!CreateTargets(extent, depth_view, targets)) {
+    DestroyTargets(targets);
+    return false;
+  }
+  targets_ = std::move(targets);
+  return true;
+}
+
+void HiZPyramid::Record(VkCommandBuffer command_buffer) const {
+  if (targets_.image == VK_NULL_HANDLE) {
+    return;
+  }
+
+  // The previous frame's culling read the old contents.
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = targets_.image;
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, LevelCount(), 0,
+                              1};
+  vkCmdPipelineBarrier(command_buffer, cull_stages_,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+  if (targets_.placeholder) {
+    return;
+  }
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    pipeline_);
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.subresourceRange.levelCount = 1;
+  VkExtent2D base = BaseExtent(targets_.depth_extent);
+  for (uint32_t level = 0; level < LevelCount(); ++level) {
+    uint32_t width = std::max(base.width >> level, 1u);
+    uint32_t height = std::max(base.height >> level, 1u);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            pipeline_layout_, 0, 1,
+                            &targets_.build_sets[level], 0, nullptr);
+    vkCmdDispatch(command_buffer, (width + kGroupSize - 1) / kGroupSize,
+                  (height + kGroupSize - 1) / kGroupSize, 1);
+
+    // For the next level and, after the last one, the culling.
+    barrier.subresourceRange.baseMipLevel = level;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         cull_stages_, 0, 0, nullptr, 0, nullptr, 1,
+                         &barrier);
+  }
+}
+
+bool HiZPyramid::ReloadShader(const std::vector<char> &shader_code) {
+  VkPipeline pipeline;
+  if (!CreatePipeline(shader_code, pipeline)) {
+    return false;
+  }
+  defer_destroy_([device = device_, old_pipeline = pipeline_]() {
+    vkDestroyPipeline(device, old_pipeline, nullptr);
+  });
+  pipeline_ = pipeline;
+  return true;
+}
+
+bool HiZPyramid::CreatePipeline(const std::vector<char> &shader_code,
+                                VkPipeline &pipeline) {
+  VkShaderModuleCreateInfo module_info{};
+  module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  module_info.codeSize = shader_code.size();
+  module_info.pCode = reinterpret_cast<const uint32_t *>(shader_code.data());
+  VkShaderModule shader_module;
+  if (shader_code.empty() ||
+      vkCreateShaderModule(device_, &module_info, nullptr, &shader_module) !=
+          VK_SUCCESS) {
+    spdlog::error("Failed to create Hi-Z shader module.");
+    return false;
+  }
+
+  SpecializationConstants specialization{reversed_z_ ? 1u : 0u};
+
+  VkComputePipelineCreateInfo pipeline_info{};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = shader_module;
+  pipeline_info.stage.pName = "main";
+  pipeline_info.stage.pSpecializationInfo = specialization.Info();
+  pipeline_info.layout = pipeline_layout_;
+  VkResult result = vkCreateComputePipelines(
+      device_, pipeline_cache_, 1, &pipeline_info, nullptr, &pipeline);
+  vkDestroyShaderModule(device_, shader_module, nullptr);
+  if (result != VK_SUCCESS) {
+    spdlog::error("Failed to create Hi-Z pipeline.");
+    return false;
+  }
+  return true;
+}
+
+bool HiZPyramid::CreateTargets(VkExtent2D extent, VkImageView depth_view,
+                               Targets &targets) {
+  targets.placeholder = depth_view == VK_NULL_HANDLE;
+  if (targets.placeholder) {
+    extent = {1, 1};
+  }
+  targets.depth_extent = extent;
+  VkExtent2D base = BaseExtent(extent);
+  uint32_t level_count = static_cast<uint32_t>(
+      std::bit_width(std::max(base.width, base.height)));
+
+  VkImageCreateInfo image_info{};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = VK_FORMAT_R32_SFLOAT;
+  image_info.extent = {base.width, base.height, 1};
+  image_info.mipLevels = level_count;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  if (vkCreateImage(device_, &image_info, nullptr, &targets.image) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create Hi-Z image.");
+    return false;
+  }
+  // Recreated with the render targets, so it gets its own allocation like
+  // them.
+  std::optional<GpuAllocation> allocation = allocator_->AllocateForImage(
+      targets.image, VK_IMAGE_TILING_OPTIMAL,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+  if (!allocation) {
+    spdlog::error("Failed to allocate Hi-Z image memory.");
+    return false;
+  }
+  targets.allocation = *allocation;
+
+  VkImageViewCreateInfo view_info{};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = targets.image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = VK_FORMAT_R32_SFLOAT;
+  view_info.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, level_count, 0,
+                                1};
+  if (vkCreateImageView(device_, &view_info, nullptr, &targets.view) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create Hi-Z image view.");
+    return false;
+  }
+  for (uint32_t level = 0; level < level_count; ++level) {
+    view_info.subresourceRange.baseMipLevel = level;
+    view_info.subresourceRange.levelCount = 1;
+    VkImageView view;
+    if (vkCreateImageView(device_, &view_info, nullptr, &view) !=
+        VK_SUCCESS) {
+      spdlog::error("Failed to create Hi-Z level view.");
+      return false;
+    }
+    targets.level_views.push_back(view);
+  }
+
+  std::array<VkDescriptorPoolSize, 2> pool_sizes{};
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pool_sizes[0].descriptorCount = level_count + 1;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  pool_sizes[1].descriptorCount = level_count;
+  VkDescriptorPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+  pool_info.pPoolSizes = pool_sizes.data();
+  pool_info.maxSets = level_count + 1;
+  if (vkCreateDescriptorPool(device_, &pool_info, nullptr, &targets.pool) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create Hi-Z descriptor pool.");
+    return false;
+  }
+  std::vector<VkDescriptorSetLayout> layouts(level_count, build_set_layout_);
+  layouts.push_back(cull_set_layout_);
+  std::vector<VkDescriptorSet> sets(layouts.size());
+  VkDescriptorSetAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.descriptorPool = targets.pool;
+  allocate_info.descriptorSetCount = static_cast<uint32_t>(layouts.size());
+  allocate_info.pSetLayouts = layouts.data();
+  if (vkAllocateDescriptorSets(device_, &allocate_info, sets.data()) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to allocate Hi-Z descriptor sets.");
+    return false;
+  }
+  targets.cull_set = sets.back();
+  sets.pop_back();
+  targets.build_sets = std::move(sets);
+
+  // Two writes per level and one for the culling set. The image infos are
+  // sized up front, the writes point into them.
+  std::vector<VkDescriptorImageInfo> image_infos;
+  image_infos.reserve(2 * level_count + 1);
+  std::vector<VkWriteDescriptorSet> writes;
+  auto add_write = [&](VkDescriptorSet set, uint32_t binding,
+                       VkDescriptorType type, VkImageView view,
+                       VkImageLayout layout) {
+    image_infos.push_back({sampler_, view, layout});
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.descriptorCount = 1;
+    write.descriptorType = type;
+    write.pImageInfo = &image_infos.back();
+    writes.push_back(write);
+  };
+  for (uint32_t level = 0; level < level_count; ++level) {
+    VkDescriptorSet set = targets.build_sets[level];
+    // The placeholder's build set is never bound.
+    if (level > 0) {
+      add_write(set, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                targets.level_views[level - 1], VK_IMAGE_LAYOUT_GENERAL);
+    } else if (!targets.placeholder) {
+      add_write(set, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, depth_view,
+                VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+    }
+    add_write(set, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+              targets.level_views[level], VK_IMAGE_LAYOUT_GENERAL);
+  }
+  add_write(targets.cull_set, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            targets.view, VK_IMAGE_LAYOUT_GENERAL);
+  vkUpdateDescriptorSets(device_, static_cast<uint32_t>(writes.size()),
+                         writes.data(), 0, nullptr);
+  return true;
+}
+
+void HiZPyramid::DestroyTargets(const Targets &targets) const {
+  vkDestroyDescriptorPool(device_, targets.pool, nullptr);
+  for (VkImageView view : targets.level_views) {
+    vkDestroyImageView(device_, view, nullptr);
+  }
+  vkDestroyImageView(device_, targets.view, nullptr);
+  vkDestroyImage(device_, targets.image, nullptr);
+  if (targets.allocation.memory != VK_NULL_HANDLE) {
+    allocator_->Free(targets.allocation);
+  }
+}
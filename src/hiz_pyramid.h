@@ -0,0 +1,99 @@
+#pragma once
+
+#include "gpu_allocator.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Hierarchical depth of the main pass for occlusion culling, built with
+// shaders/hiz.comp. Level 0 has half the resolution of the depth buffer,
+// rounded up to a power of two, and every texel of every level stores the
+// farthest depth of the 2x2 texels it covers, so a texel of level k covers
+// 2^(k + 1) pixels along each axis. Texels past the depth buffer's edge
+// repeat its last row and column. A sphere whose nearest depth is behind the
+// texels under its screen bounds is hidden.
+//
+// The pyramid is shared by all frames in flight, which all use it in the order
+// they are submitted to the graphics queue.
+//
+// Render thread only.
+class HiZPyramid {
+public:
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    GpuAllocator *allocator = nullptr;
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    // SPIR-V of shaders/hiz.comp.
+    std::vector<char> shader_code;
+    // Whether depth 0 or 1 is the farthest.
+    bool reversed_z = true;
+    // The terrain's task shaders test meshlets against the pyramid too, see
+    // shaders/terrain.task. Needs VK_EXT_mesh_shader enabled.
+    bool task_shaders = false;
+    // Destroys a GPU resource once the frames using it have retired.
+    std::function<void(std::function<void()> &&)> defer_destroy;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  // The device has to be idle.
+  void Destroy();
+
+  // Recreates the pyramid for a single sampled depth buffer of `extent`,
+  // read through `depth_view` in DEPTH_STENCIL_READ_ONLY_OPTIMAL. The old one
+  // goes to the deletion queue. Without a depth view the pyramid is a 1x1
+  // placeholder that only gives CullSet() something to point to.
+  bool Resize(VkExtent2D extent, VkImageView depth_view);
+  // Builds every level from the depth buffer, which has to be readable by
+  // compute shaders. Leaves the pyramid readable by them, and by task shaders
+  // with CreateInfo::task_shaders, in GENERAL, which is all it does for the
+  // placeholder.
+  void Record(VkCommandBuffer command_buffer) const;
+  bool ReloadShader(const std::vector<char> &shader_code);
+
+  // Set with the whole pyramid as a combined image sampler at binding 0, for
+  // the culling shaders. Replaced by Resize().
+  VkDescriptorSetLayout CullSetLayout() const { return cull_set_layout_; }
+  VkDescriptorSet CullSet() const { return targets_.cull_set; }
+  // Of the depth buffer the pyramid is built from.
+  VkExtent2D DepthExtent() const { return targets_.depth_extent; }
+  uint32_t LevelCount() const {
+    return static_cast<uint32_t>(targets_.level_views.size());
+  }
+
+private:
+  // Everything that depends on the depth buffer.
+  struct Targets {
+    VkExtent2D depth_extent{};
+    bool placeholder = false;
+    VkImage image = VK_NULL_HANDLE;
+    GpuAllocation allocation;
+    VkImageView view = VK_NULL_HANDLE;
+    std::vector<VkImageView> level_views;
+    VkDescriptorPool pool = VK_NULL_HANDLE;
+    // Set i reads level i - 1, or the depth buffer, and writes level i.
+    std::vector<VkDescriptorSet> build_sets;
+    VkDescriptorSet cull_set = VK_NULL_HANDLE;
+  };
+
+  bool CreatePipeline(const std::vector<char> &shader_code,
+                      VkPipeline &pipeline);
+  bool CreateTargets(VkExtent2D extent, VkImageView depth_view,
+                     Targets &targets);
+  void DestroyTargets(const Targets &targets) const;
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  GpuAllocator *allocator_ = nullptr;
+  VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
+  bool reversed_z_ = true;
+  // Of the shaders reading CullSet().
+  VkPipelineStageFlags cull_stages_ = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  std::function<void(std::function<void()> &&)> defer_destroy_;
+
+  VkSampler sampler_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout build_set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout cull_set_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline pipeline_ = VK_NULL_HANDLE;
+  Targets targets_;
+};
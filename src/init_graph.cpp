@@ -0,0 +1,133 @@
+#include "init_graph.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <spdlog/spdlog.h>
+
+void InitGraph::Add(const char *name, std::vector<const char *> dependencies,
+                    Affinity affinity, std::function<void()> step) {
+  Step entry;
+  entry.name = name;
+  entry.affinity = affinity;
+  entry.run = std::move(step);
+  for (const char *dependency : dependencies) {
+    uint32_t index = 0;
+    while (index < steps_.size() &&
+           std::strcmp(steps_[index].name, dependency) != 0) {
+      ++index;
+    }
+    if (index == steps_.size()) {
+      spdlog::error("Init step {} depends on unknown step {}.", name,
+                    dependency);
+      valid_ = false;
+      continue;
+    }
+    entry.dependencies.push_back(index);
+  }
+  steps_.push_back(std::move(entry));
+}
+
+bool InitGraph::Run(JobSystem &job_system) {
+  if (!valid_) {
+    return false;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  auto run_step = [start](Step &step) {
+    auto step_start = std::chrono::steady_clock::now();
+    step.run();
+    auto step_end = std::chrono::steady_clock::now();
+    step.start_ms =
+        std::chrono::duration<double, std::milli>(step_start - start).count();
+    step.duration_ms =
+        std::chrono::duration<double, std::milli>(step_end - step_start)
+            .count();
+  };
+
+  // Dependencies of each step that have not finished yet, whoever finishes
+  // the last one starts it.
+  std::vector<std::vector<uint32_t>> dependents(steps_.size());
+  std::vector<std::atomic<uint32_t>> pending(steps_.size());
+  for (uint32_t index = 0; index < steps_.size(); ++index) {
+    pending[index].store(
+        static_cast<uint32_t>(steps_[index].dependencies.size()),
+        std::memory_order_relaxed);
+    for (uint32_t dependency : steps_[index].dependencies) {
+      dependents[dependency].push_back(index);
+    }
+  }
+
+  // Guards the main thread queue and the finished count. Notified with the
+  // mutex held, Run() may return as soon as it sees the last step finish.
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<uint32_t> main_thread;
+  size_t finished = 0;
+
+  std::function<void(uint32_t)> start_step;
+  auto finish_step = [&](uint32_t index) {
+    for (uint32_t dependent : dependents[index]) {
+      if (pending[dependent].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        start_step(dependent);
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    ++finished;
+    wake.notify_all();
+  };
+  start_step = [&](uint32_t index) {
+    if (steps_[index].affinity == Affinity::kMainThread) {
+      std::lock_guard<std::mutex> lock(mutex);
+      main_thread.push_back(index);
+      wake.notify_all();
+      return;
+    }
+    // Without workers this runs the step right here.
+    job_system.Launch(1, [&, index](uint32_t, uint32_t) {
+      run_step(steps_[index]);
+      finish_step(index);
+    });
+  };
+
+  for (uint32_t index = 0; index < steps_.size(); ++index) {
+    if (steps_[index].dependencies.empty()) {
+      start_step(index);
+    }
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  while (finished < steps_.size()) {
+    wake.wait(lock, [&] {
+      return !main_thread.empty() || finished == steps_.size();
+    });
+    if (main_thread.empty()) {
+      continue;
+    }
+    uint32_t index = main_thread.front();
+    main_thread.pop_front();
+    lock.unlock();
+    run_step(steps_[index]);
+    finish_step(index);
+    lock.lock();
+  }
+  lock.unlock();
+
+  std::vector<uint32_t> order(steps_.size());
+  std::iota(order.begin(), order.end(), 0u);
+  std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+    return steps_[a].start_ms < steps_[b].start_ms;
+  });
+  for (uint32_t index : order) {
+    spdlog::info("Init step {} in {:.1f} ms, started at {:.1f} ms.",
+                 steps_[index].name, steps_[index].duration_ms,
+                 steps_[index].start_ms);
+  }
+  spdlog::info("Ran {} init steps in {:.1f} ms.", steps_.size(),
+               std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count());
+  return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "job_system.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Startup steps and the steps each one needs to have finished. Run() starts
+// every step as soon as its own dependencies are done, anywhere on the job
+// system's workers or, for kMainThread steps, on the calling thread, which
+// runs them from a queue in the order they became ready. Each step's start and
+// duration are logged, so startup regressions show up in the log.
+//
+// Steps that do not depend on each other must only share thread safe state,
+// like the GpuAllocator, the ShaderLibrary or vkCreate*Pipelines() with an
+// internally synchronized pipeline cache. Steps that submit to a queue,
+// record from a shared command pool or use the window are kMainThread, which
+// also keeps them from running at the same time as each other.
+class InitGraph {
+public:
+  enum class Affinity { kAnyThread, kMainThread };
+
+  // `dependencies` are names of steps added before, which keeps the graph
+  // acyclic. The name has to outlive the graph.
+  void Add(const char *name, std::vector<const char *> dependencies,
+           Affinity affinity, std::function<void()> step);
+  // Runs every step once. Returns false without running any if a dependency
+  // is unknown, which is a bug in the graph.
+  [[nodiscard]] bool Run(JobSystem &job_system);
+
+private:
+  struct Step {
+    const char *name = nullptr;
+    std::vector<uint32_t> dependencies;
+    Affinity affinity = Affinity::kAnyThread;
+    std::function<void()> run;
+    // Relative to the start of Run(), written by the thread running it.
+    double start_ms = 0.0;
+    double duration_ms = 0.0;
+  };
+
+  std::vector<Step> steps_;
+  bool valid_ = true;
+};
@@ -0,0 +1,179 @@
+#include "job_system.h"
+
+void JobSystem::Init(uint32_t worker_count) {
+  stop_ = false;
+  // All queues exist before the first worker looks at them.
+  queues_.clear();
+  for (uint32_t i = 0; i < worker_count + 1; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  for (uint32_t i = 0; i < worker_count; ++i) {
+    workers_.emplace_back([this, i] { WorkerLoop(i + 1); });
+  }
+}
+
+void JobSystem::Destroy() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+  queues_.clear();
+  // Their handles never complete, callers wait for them before Destroy().
+  background_tasks_.clear();
+  queued_.store(0, std::memory_order_relaxed);
+}
+
+void JobSystem::ParallelFor(uint32_t count, const Job &job) {
+  if (count == 0) {
+    return;
+  }
+  if (ThreadCount() <= 1) {
+    for (uint32_t i = 0; i < count; ++i) {
+      job(i, 0);
+    }
+    return;
+  }
+
+  Batch batch;
+  batch.job = &job;
+  batch.remaining.store(count, std::memory_order_relaxed);
+  // Counted before the push so a concurrent pop never takes it below zero.
+  queued_.fetch_add(count, std::memory_order_relaxed);
+  uint32_t thread_count = ThreadCount();
+  for (uint32_t i = 0; i < count; ++i) {
+    Queue &queue = *queues_[i % thread_count];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back({&batch, i});
+  }
+  {
+    // Pairs with the predicate check in WorkerLoop() so no wake-up is lost.
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+  }
+  wake_.notify_all();
+
+  // The calling thread helps instead of blocking. The batch lives on this
+  // stack frame, so wait until the last job has finished, not only started.
+  Task task;
+  while (batch.remaining.load(std::memory_order_acquire) > 0) {
+    if (TryPop(0, task)) {
+      RunTask(task, 0);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+JobSystem::Handle JobSystem::Launch(uint32_t count, Job job) {
+  Handle handle;
+  if (count == 0) {
+    return handle;
+  }
+  if (ThreadCount() <= 1) {
+    for (uint32_t i = 0; i < count; ++i) {
+      job(i, 0);
+    }
+    return handle;
+  }
+
+  handle.batch_ = std::make_shared<Batch>();
+  handle.batch_->owned_job = std::move(job);
+  handle.batch_->job = &handle.batch_->owned_job;
+  handle.batch_->remaining.store(count, std::memory_order_relaxed);
+  queued_.fetch_add(count, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    for (uint32_t i = 0; i < count; ++i) {
+      background_tasks_.push_back({handle.batch_, i});
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+  }
+  wake_.notify_all();
+  return handle;
+}
+
+void JobSystem::Wait(const Handle &handle) {
+  BackgroundTask task;
+  while (!handle.Done()) {
+    if (TryPopBackground(task)) {
+      RunTask({task.batch.get(), task.index}, 0);
+      task.batch.reset();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+bool JobSystem::Handle::Done() const {
+  return !batch_ || batch_->remaining.load(std::memory_order_acquire) == 0;
+}
+
+void JobSystem::WorkerLoop(uint32_t thread) {
+  Task task;
+  BackgroundTask background_task;
+  for (;;) {
+    if (TryPop(thread, task)) {
+      RunTask(task, thread);
+      continue;
+    }
+    if (TryPopBackground(background_task)) {
+      RunTask({background_task.batch.get(), background_task.index}, thread);
+      background_task.batch.reset();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    wake_.wait(lock, [this] {
+      return stop_ || queued_.load(std::memory_order_relaxed) > 0;
+    });
+    if (stop_) {
+      return;
+    }
+  }
+}
+
+bool JobSystem::TryPop(uint32_t thread, Task &task) {
+  {
+    Queue &own = *queues_[thread];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = own.tasks.back();
+      own.tasks.pop_back();
+      queued_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  uint32_t thread_count = ThreadCount();
+  for (uint32_t i = 1; i < thread_count; ++i) {
+    Queue &victim = *queues_[(thread + i) % thread_count];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.front();
+      victim.tasks.pop_front();
+      queued_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool JobSystem::TryPopBackground(BackgroundTask &task) {
+  std::lock_guard<std::mutex> lock(background_mutex_);
+  if (background_tasks_.empty()) {
+    return false;
+  }
+  task = std::move(background_tasks_.front());
+  background_tasks_.pop_front();
+  queued_.fetch_sub(1, std::memory_order_relaxed);
+  return true;
+}
+
+void JobSystem::RunTask(const Task &task, uint32_t thread) {
+  (*task.batch->job)(task.index, thread);
+  task.batch->remaining.fetch_sub(1, std::memory_order_release);
+}
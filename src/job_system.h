@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool for fork-join parallelism within a frame. Every
+// thread, including the one calling ParallelFor(), owns a queue. Jobs are
+// dealt round-robin to the queues, a thread pops from the back of its own
+// queue and steals from the front of the others' once it runs dry.
+//
+// Launch() starts background jobs that may outlive the frame. A worker only
+// starts one while no ParallelFor() job is queued, and Wait() runs them on
+// the calling thread too. A background job that is already running is not
+// interrupted, so a ParallelFor() that begins meanwhile runs with one thread
+// less until it finishes. Background jobs should be short, like building a
+// single chunk.
+//
+// Which thread runs a job is not deterministic, so jobs must only write
+// results indexed by the job index. Per-thread resources (command pools) are
+// indexed by the thread index passed to the job.
+class JobSystem {
+public:
+  // Job index and index of the thread running it, in [0, ThreadCount()). The
+  // calling thread is thread 0.
+  using Job = std::function<void(uint32_t index, uint32_t thread)>;
+
+private:
+  struct Batch;
+
+public:
+  // Jobs started by one Launch(). Empty handles are done.
+  class Handle {
+  public:
+    bool Done() const;
+
+  private:
+    friend class JobSystem;
+    std::shared_ptr<Batch> batch_;
+  };
+
+  // Starts `worker_count` threads besides the calling one, 0 runs every job on
+  // the calling thread.
+  void Init(uint32_t worker_count);
+  void Destroy();
+
+  uint32_t ThreadCount() const {
+    return static_cast<uint32_t>(queues_.size());
+  }
+
+  // Runs job(i, thread) for every i in [0, count) and returns once all of
+  // them finished. Not reentrant, jobs must not call ParallelFor() themselves.
+  void ParallelFor(uint32_t count, const Job &job);
+  // Queues job(i, thread) for every i in [0, count) in the background and
+  // returns right away, `job` is kept until they finished. Without workers
+  // the jobs run on the calling thread before Launch() returns.
+  Handle Launch(uint32_t count, Job job);
+  // Returns once the jobs of `handle` finished, running queued background
+  // jobs on the calling thread meanwhile. Not from within a job.
+  void Wait(const Handle &handle);
+
+private:
+  struct Batch {
+    const Job *job = nullptr;
+    std::atomic<uint32_t> remaining{0};
+    // The job of a Launch()ed batch, `job` points here.
+    Job owned_job;
+  };
+
+  struct Task {
+    Batch *batch = nullptr;
+    uint32_t index = 0;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // Keeps its batch alive until the job has run, the handle may be gone.
+  struct BackgroundTask {
+    std::shared_ptr<Batch> batch;
+    uint32_t index = 0;
+  };
+
+  void WorkerLoop(uint32_t thread);
+  bool TryPop(uint32_t thread, Task &task);
+  bool TryPopBackground(BackgroundTask &task);
+  void RunTask(const Task &task, uint32_t thread);
+
+  std::vector<std::thread> workers_;
+  // One per thread, indexed like the thread index.
+  std::vector<std::unique_ptr<Queue>> queues_;
+  // Shared by all workers, first in first out.
+  std::mutex background_mutex_;
+  std::deque<BackgroundTask> background_tasks_;
+
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  // Tasks sitting in any queue, including the background one, lets idle
+  // workers sleep.
+  std::atomic<uint32_t> queued_{0};
+  bool stop_ = false;
+};
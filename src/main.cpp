@@ -1,11 +1,169 @@
 #include "vulkan_engine.h"
+#include <algorithm>
+#include <cstdlib>
+#include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
+#include <string>
+#include <string_view>
 
-int main() {
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--benchmark" || arg == "--heightfield-benchmark" ||
+        arg == "--query-benchmark") {
+      // stdout is reserved for the benchmark results.
+      spdlog::set_default_logger(spdlog::stderr_color_mt("stderr"));
+    }
+  }
   spdlog::info("Starting Planet Renderer");
+
+  EngineConfig config;
+  uint32_t benchmark_frames = 0;
+  uint32_t heightfield_benchmark_chunks = 0;
+  uint32_t query_benchmark_count = 0;
+  std::string benchmark_output;
+  std::string bake_path;
+  uint32_t bake_levels = 0;
+  bool bake_imagery = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--frames-in-flight" && i + 1 < argc) {
+      config.frames_in_flight =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--worker-threads" && i + 1 < argc) {
+      config.worker_threads =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--terrain-build-budget-ms" && i + 1 < argc) {
+      config.terrain_build_budget_ms = std::strtof(argv[++i], nullptr);
+    } else if (arg == "--no-reversed-z") {
+      config.reversed_z = false;
+    } else if (arg == "--render-pass") {
+      config.dynamic_rendering = false;
+    } else if (arg == "--present-mode" && i + 1 < argc) {
+      std::string_view mode = argv[++i];
+      if (mode == "fifo") {
+        config.present_mode = VK_PRESENT_MODE_FIFO_KHR;
+      } else if (mode == "fifo-relaxed") {
+        config.present_mode = VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+      } else if (mode == "mailbox") {
+        config.present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+      } else if (mode == "immediate") {
+        config.present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+      } else {
+        spdlog::warn("Unknown present mode: {}", mode);
+      }
+    } else if (arg == "--swap-chain-images" && i + 1 < argc) {
+      config.swap_chain_image_count =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--no-present-wait") {
+      config.present_wait = false;
+    } else if (arg == "--max-queued-presents" && i + 1 < argc) {
+      config.max_queued_presents =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--max-msaa" && i + 1 < argc) {
+      config.max_msaa_samples =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--no-adaptive-quality") {
+      config.adaptive_quality = false;
+    } else if (arg == "--target-gpu-ms" && i + 1 < argc) {
+      config.target_gpu_time_ms = std::strtof(argv[++i], nullptr);
+    } else if (arg == "--min-render-scale" && i + 1 < argc) {
+      config.min_render_scale = std::strtof(argv[++i], nullptr);
+    } else if (arg == "--no-shader-reload") {
+      config.shader_hot_reload = false;
+    } else if (arg == "--pipeline-statistics") {
+      config.pipeline_statistics = true;
+    } else if (arg == "--benchmark" && i + 1 < argc) {
+      benchmark_frames =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--heightfield-benchmark" && i + 1 < argc) {
+      heightfield_benchmark_chunks =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--query-benchmark" && i + 1 < argc) {
+      query_benchmark_count =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--simulation-rate" && i + 1 < argc) {
+      config.simulation_rate = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--query-level" && i + 1 < argc) {
+      config.terrain_query_level =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--no-occlusion-culling") {
+      config.occlusion_culling = false;
+    } else if (arg == "--no-mesh-shaders") {
+      config.mesh_shaders = false;
+    } else if (arg == "--cpu-terrain") {
+      config.gpu_terrain_generation = false;
+    } else if (arg == "--height-tiles" && i + 1 < argc) {
+      config.height_tile_file = argv[++i];
+    } else if (arg == "--imagery-tiles" && i + 1 < argc) {
+      config.imagery_tile_file = argv[++i];
+    } else if (arg == "--no-sparse-imagery") {
+      config.sparse_imagery = false;
+    } else if (arg == "--shadow-cascades" && i + 1 < argc) {
+      config.shadow_cascades =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--shadow-resolution" && i + 1 < argc) {
+      config.shadow_resolution =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--shadow-dynamic-cascades" && i + 1 < argc) {
+      config.shadow_dynamic_cascades =
+          static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--shadow-distance" && i + 1 < argc) {
+      config.shadow_distance = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--tile-cache-mb" && i + 1 < argc) {
+      config.tile_cache_budget =
+          std::strtoull(argv[++i], nullptr, 10) * 1024ull * 1024ull;
+    } else if (arg == "--bake-height-tiles" && i + 2 < argc) {
+      bake_path = argv[++i];
+      bake_levels = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--bake-imagery-tiles" && i + 2 < argc) {
+      bake_imagery = true;
+      bake_path = argv[++i];
+      bake_levels = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--benchmark-output" && i + 1 < argc) {
+      benchmark_output = argv[++i];
+    } else if (arg == "--camera-path" && i + 1 < argc) {
+      config.camera_path = argv[++i];
+    } else if (arg == "--gpu" && i + 1 < argc) {
+      config.gpu = argv[++i];
+    } else {
+      spdlog::warn("Unknown argument: {}", arg);
+    }
+  }
+
+  if (!bake_path.empty()) {
+    // Offline, no window or device needed. The engine uses the default noise
+    // and chunk grid as well.
+    auto bake =
+        bake_imagery ? Terrain::BakeImageryTiles : Terrain::BakeHeightTiles;
+    bool baked = bake(TerrainNoise(), Terrain::CreateInfo{}.grid_size,
+                      bake_levels, bake_path);
+    return baked ? 0 : 1;
+  }
+
+  if (benchmark_frames > 0 || heightfield_benchmark_chunks > 0 ||
+      query_benchmark_count > 0) {
+    config.headless = true;
+    // Every run has to render the same, at the highest level.
+    config.adaptive_quality = false;
+    config.shader_hot_reload = false;
+    config.profiler_history_length =
+        std::max(config.profiler_history_length, benchmark_frames);
+  }
+
   VulkanEngine engine;
-  engine.Init();
-  engine.Run();
+  engine.Init(config);
+  bool success = true;
+  if (heightfield_benchmark_chunks > 0) {
+    success = engine.RunHeightfieldBenchmark(heightfield_benchmark_chunks,
+                                             benchmark_output);
+  } else if (query_benchmark_count > 0) {
+    success = engine.RunQueryBenchmark(query_benchmark_count, benchmark_output);
+  } else if (benchmark_frames > 0) {
+    success = engine.RunBenchmark(benchmark_frames, benchmark_output);
+  } else {
+    engine.Run();
+  }
   engine.Destroy();
-  return 0;
+  return success ? 0 : 1;
 }
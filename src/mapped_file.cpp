@@ -0,0 +1,102 @@
+#include "mapped_file.h"
+#include <spdlog/spdlog.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+bool MappedFile::Open(const std::string &path) {
+  Close();
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING,
+                            FILE_FLAG_RANDOM_ACCESS, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    spdlog::error("Failed to open {}.", path);
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    spdlog::error("{} is empty.", path);
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  const void *data =
+      mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+  if (!data) {
+    spdlog::error("Failed to map {}.", path);
+    if (mapping) {
+      CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    return false;
+  }
+  file_ = file;
+  mapping_ = mapping;
+  data_ = static_cast<const uint8_t *>(data);
+  size_ = static_cast<size_t>(size.QuadPart);
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_) {
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    CloseHandle(file_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  file_ = nullptr;
+  mapping_ = nullptr;
+}
+
+#else
+
+bool MappedFile::Open(const std::string &path) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    spdlog::error("Failed to open {}.", path);
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    spdlog::error("{} is empty.", path);
+    close(fd);
+    return false;
+  }
+  void *data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ,
+                    MAP_PRIVATE, fd, 0);
+  // The mapping keeps its own reference to the file.
+  close(fd);
+  if (data == MAP_FAILED) {
+    spdlog::error("Failed to map {}.", path);
+    return false;
+  }
+  // Tiles are read wherever the camera goes, read-ahead would mostly fetch
+  // pages nobody asked for.
+  madvise(data, static_cast<size_t>(info.st_size), MADV_RANDOM);
+  data_ = static_cast<const uint8_t *>(data);
+  size_ = static_cast<size_t>(info.st_size);
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_) {
+    munmap(const_cast<uint8_t *>(data_), size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
+
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only memory mapping of a whole file. Pages are faulted in by the OS on
+// first access, so files much larger than RAM can be opened and only the
+// parts that are read cost memory. The mapping may be read from any thread.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile() { Close(); }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool Open(const std::string &path);
+  void Close();
+
+  bool IsOpen() const { return data_ != nullptr; }
+  const uint8_t *Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+#if defined(_WIN32)
+  void *file_ = nullptr;
+  void *mapping_ = nullptr;
+#endif
+};
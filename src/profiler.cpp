@@ -0,0 +1,401 @@
+#include "profiler.h"
+#include "imgui.h"
+#include <algorithm>
+#include <fstream>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// Bits of Profiler::kStatisticsFlags.
+constexpr uint32_t kStatisticsCount = 5;
+
+} // namespace
+
+Profiler::CpuScope::CpuScope(Profiler &profiler, const char *name)
+    : profiler_(profiler), name_(name),
+      start_(std::chrono::steady_clock::now()) {}
+
+Profiler::CpuScope::~CpuScope() {
+  float milliseconds = std::chrono::duration<float, std::milli>(
+                           std::chrono::steady_clock::now() - start_)
+                           .count();
+  profiler_.AddSample(profiler_.FindOrAddScope(name_, false),
+                      profiler_.frame_number_, milliseconds);
+}
+
+bool Profiler::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(create_info_.physical_device, &properties);
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(create_info_.physical_device,
+                                           &family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(create_info_.physical_device,
+                                           &family_count, families.data());
+  uint32_t valid_bits = create_info_.queue_family < family_count
+                            ? families[create_info_.queue_family]
+                                  .timestampValidBits
+                            : 0;
+  timestamps_supported_ = valid_bits > 0 && properties.limits.timestampPeriod > 0;
+  timestamp_period_ = properties.limits.timestampPeriod;
+  timestamp_mask_ = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+  if (!timestamps_supported_) {
+    spdlog::warn("GPU timestamps are not supported, only CPU scopes are "
+                 "profiled.");
+  }
+
+  frames_.resize(create_info_.frames_in_flight);
+  for (FrameQueries &frame : frames_) {
+    if (timestamps_supported_) {
+      VkQueryPoolCreateInfo pool_info{};
+      pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+      pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+      pool_info.queryCount = 2 * create_info_.max_gpu_scopes;
+      if (vkCreateQueryPool(create_info_.device, &pool_info, nullptr,
+                            &frame.timestamp_pool) != VK_SUCCESS) {
+        spdlog::error("Failed to create timestamp query pool.");
+        return false;
+      }
+    }
+    if (create_info_.pipeline_statistics) {
+      VkQueryPoolCreateInfo pool_info{};
+      pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+      pool_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+      pool_info.queryCount = 1;
+      pool_info.pipelineStatistics = Profiler::kStatisticsFlags;
+      if (vkCreateQueryPool(create_info_.device, &pool_info, nullptr,
+                            &frame.statistics_pool) != VK_SUCCESS) {
+        spdlog::error("Failed to create pipeline statistics query pool.");
+        return false;
+      }
+    }
+  }
+  statistics_.resize(create_info_.pipeline_statistics
+                         ? create_info_.history_length
+                         : 0);
+  return true;
+}
+
+void Profiler::Destroy() {
+  for (FrameQueries &frame : frames_) {
+    vkDestroyQueryPool(create_info_.device, frame.timestamp_pool, nullptr);
+    vkDestroyQueryPool(create_info_.device, frame.statistics_pool, nullptr);
+  }
+  frames_.clear();
+}
+
+void Profiler::BeginFrame(uint32_t frame, uint64_t frame_number) {
+  current_frame_ = frame;
+  frame_number_ = frame_number;
+  FrameQueries &queries = frames_[frame];
+  if (queries.pending) {
+    ReadResults(queries);
+    queries.pending = false;
+  }
+}
+
+void Profiler::BeginCommandBuffer(VkCommandBuffer command_buffer) {
+  FrameQueries &queries = frames_[current_frame_];
+  queries.scopes.clear();
+  queries.query_count = 0;
+  queries.frame_number = frame_number_;
+  queries.pending = true;
+  open_gpu_scopes_.clear();
+
+  if (queries.timestamp_pool != VK_NULL_HANDLE) {
+    vkCmdResetQueryPool(command_buffer, queries.timestamp_pool, 0,
+                        2 * create_info_.max_gpu_scopes);
+  }
+  if (queries.statistics_pool != VK_NULL_HANDLE) {
+    vkCmdResetQueryPool(command_buffer, queries.statistics_pool, 0, 1);
+    vkCmdBeginQuery(command_buffer, queries.statistics_pool, 0, 0);
+  }
+}
+
+void Profiler::EndCommandBuffer(VkCommandBuffer command_buffer) {
+  FrameQueries &queries = frames_[current_frame_];
+  if (queries.statistics_pool != VK_NULL_HANDLE) {
+    vkCmdEndQuery(command_buffer, queries.statistics_pool, 0);
+  }
+}
+
+void Profiler::BeginGpuScope(VkCommandBuffer command_buffer,
+                             const char *name) {
+  FrameQueries &queries = frames_[current_frame_];
+  if (!timestamps_supported_ ||
+      queries.query_count + 2 > 2 * create_info_.max_gpu_scopes) {
+    // Keeps EndGpuScope() balanced.
+    open_gpu_scopes_.push_back(UINT32_MAX);
+    return;
+  }
+
+  GpuScopeRecord record{};
+  record.scope = FindOrAddScope(name, true);
+  record.begin_query = queries.query_count++;
+  record.end_query = queries.query_count++;
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                      queries.timestamp_pool, record.begin_query);
+  open_gpu_scopes_.push_back(static_cast<uint32_t>(queries.scopes.size()));
+  queries.scopes.push_back(record);
+}
+
+void Profiler::EndGpuScope(VkCommandBuffer command_buffer) {
+  if (open_gpu_scopes_.empty()) {
+    return;
+  }
+  uint32_t index = open_gpu_scopes_.back();
+  open_gpu_scopes_.pop_back();
+  if (index == UINT32_MAX) {
+    return;
+  }
+  FrameQueries &queries = frames_[current_frame_];
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                      queries.timestamp_pool, queries.scopes[index].end_query);
+}
+
+void Profiler::AddCpuSample(const char *name, float milliseconds) {
+  AddSample(FindOrAddScope(name, false), frame_number_, milliseconds);
+}
+
+void Profiler::CollectAll() {
+  // Oldest frame first, samples are appended in frame order.
+  std::vector<FrameQueries *> pending;
+  for (FrameQueries &queries : frames_) {
+    if (queries.pending) {
+      pending.push_back(&queries);
+    }
+  }
+  std::sort(pending.begin(), pending.end(),
+            [](const FrameQueries *a, const FrameQueries *b) {
+              return a->frame_number < b->frame_number;
+            });
+  for (FrameQueries *queries : pending) {
+    ReadResults(*queries);
+    queries->pending = false;
+  }
+}
+
+std::vector<float> Profiler::ScopeSamples(const std::string &name,
+                                          bool gpu) const {
+  std::vector<float> samples;
+  for (const Scope &scope : scopes_) {
+    if (scope.gpu != gpu || scope.name != name) {
+      continue;
+    }
+    uint32_t first = scope.count == create_info_.history_length ? scope.next : 0;
+    for (uint32_t i = 0; i < scope.count; ++i) {
+      samples.push_back(
+          scope.samples[(first + i) % create_info_.history_length]
+              .milliseconds);
+    }
+  }
+  return samples;
+}
+
+std::optional<Profiler::Sample>
+Profiler::LatestSample(const std::string &name, bool gpu) const {
+  for (const Scope &scope : scopes_) {
+    if (scope.gpu == gpu && scope.name == name && scope.count > 0) {
+      uint32_t history_length = create_info_.history_length;
+      return scope.samples[(scope.next + history_length - 1) % history_length];
+    }
+  }
+  return std::nullopt;
+}
+
+void Profiler::ReadResults(FrameQueries &queries) {
+  if (queries.query_count > 0) {
+    std::vector<uint64_t> timestamps(queries.query_count);
+    // The frame's fence was waited on, everything is available.
+    if (vkGetQueryPoolResults(create_info_.device, queries.timestamp_pool, 0,
+                              queries.query_count,
+                              sizeof(uint64_t) * timestamps.size(),
+                              timestamps.data(), sizeof(uint64_t),
+                              VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+      for (const GpuScopeRecord &record : queries.scopes) {
+        uint64_t ticks = (timestamps[record.end_query] -
+                          timestamps[record.begin_query]) &
+                         timestamp_mask_;
+        AddSample(record.scope, queries.frame_number,
+                  static_cast<float>(ticks * timestamp_period_ * 1e-6));
+      }
+    }
+  }
+
+  if (queries.statistics_pool != VK_NULL_HANDLE) {
+    std::array<uint64_t, kStatisticsCount> values{};
+    if (vkGetQueryPoolResults(create_info_.device, queries.statistics_pool, 0,
+                              1, sizeof(values), values.data(),
+                              sizeof(values),
+                              VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+      PipelineStatistics &statistics = statistics_[statistics_next_];
+      statistics.frame_number = queries.frame_number;
+      statistics.input_assembly_primitives = values[0];
+      statistics.vertex_shader_invocations = values[1];
+      statistics.clipping_primitives = values[2];
+      statistics.fragment_shader_invocations = values[3];
+      statistics.compute_shader_invocations = values[4];
+      last_statistics_ = statistics;
+      statistics_next_ = (statistics_next_ + 1) % statistics_.size();
+      statistics_count_ = std::min(
+          statistics_count_ + 1, static_cast<uint32_t>(statistics_.size()));
+    }
+  }
+}
+
+uint32_t Profiler::FindOrAddScope(const char *name, bool gpu) {
+  for (uint32_t i = 0; i < scopes_.size(); ++i) {
+    if (scopes_[i].gpu == gpu && scopes_[i].name == name) {
+      return i;
+    }
+  }
+  Scope scope;
+  scope.name = name;
+  scope.gpu = gpu;
+  scope.samples.resize(create_info_.history_length);
+  scope.plot_values.resize(create_info_.history_length, 0.0f);
+  scopes_.push_back(std::move(scope));
+  return static_cast<uint32_t>(scopes_.size() - 1);
+}
+
+void Profiler::AddSample(uint32_t scope_index, uint64_t frame_number,
+                         float milliseconds) {
+  Scope &scope = scopes_[scope_index];
+  // A CPU scope entered several times per frame accumulates.
+  uint32_t last = (scope.next + create_info_.history_length - 1) %
+                  create_info_.history_length;
+  if (scope.count > 0 && scope.samples[last].frame_number == frame_number) {
+    scope.samples[last].milliseconds += milliseconds;
+    scope.plot_values[last] = scope.samples[last].milliseconds;
+    return;
+  }
+  scope.samples[scope.next] = {frame_number, milliseconds};
+  scope.plot_values[scope.next] = milliseconds;
+  scope.next = (scope.next + 1) % create_info_.history_length;
+  scope.count = std::min(scope.count + 1, create_info_.history_length);
+}
+
+void Profiler::DrawImGui() {
+  ImGui::Begin("Profiler");
+  for (int gpu = 0; gpu < 2; ++gpu) {
+    ImGui::SeparatorText(gpu ? "GPU" : "CPU");
+    for (const Scope &scope : scopes_) {
+      if (scope.gpu != static_cast<bool>(gpu) || scope.count == 0) {
+        continue;
+      }
+      float sum = 0.0f;
+      float max = 0.0f;
+      for (uint32_t i = 0; i < scope.count; ++i) {
+        sum += scope.plot_values[i];
+        max = std::max(max, scope.plot_values[i]);
+      }
+      std::string overlay = fmt::format("avg {:.3f} ms, max {:.3f} ms",
+                                        sum / scope.count, max);
+      ImGui::PlotLines(scope.name.c_str(), scope.plot_values.data(),
+                       static_cast<int>(scope.count),
+                       scope.count == create_info_.history_length
+                           ? static_cast<int>(scope.next)
+                           : 0,
+                       overlay.c_str(), 0.0f, max * 1.2f, ImVec2(0, 48));
+    }
+  }
+
+  if (create_info_.pipeline_statistics) {
+    ImGui::SeparatorText("Pipeline statistics");
+    ImGui::Text("Input assembly primitives: %llu",
+                static_cast<unsigned long long>(
+                    last_statistics_.input_assembly_primitives));
+    ImGui::Text("Vertex shader invocations: %llu",
+                static_cast<unsigned long long>(
+                    last_statistics_.vertex_shader_invocations));
+    ImGui::Text("Clipping primitives: %llu",
+                static_cast<unsigned long long>(
+                    last_statistics_.clipping_primitives));
+    ImGui::Text("Fragment shader invocations: %llu",
+                static_cast<unsigned long long>(
+                    last_statistics_.fragment_shader_invocations));
+    ImGui::Text("Compute shader invocations: %llu",
+                static_cast<unsigned long long>(
+                    last_statistics_.compute_shader_invocations));
+  }
+
+  ImGui::Separator();
+  if (ImGui::Button("Dump CSV")) {
+    DumpCsv("profile.csv");
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Dump JSON")) {
+    DumpJson("profile.json");
+  }
+  ImGui::End();
+}
+
+bool Profiler::DumpCsv(const std::string &path) const {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file.is_open()) {
+    spdlog::error("Failed to write profile {}.", path);
+    return false;
+  }
+  file << "frame,type,scope,milliseconds\n";
+  for (const Scope &scope : scopes_) {
+    // Oldest sample first.
+    uint32_t first = scope.count == create_info_.history_length ? scope.next : 0;
+    for (uint32_t i = 0; i < scope.count; ++i) {
+      const Sample &sample =
+          scope.samples[(first + i) % create_info_.history_length];
+      file << fmt::format("{},{},\"{}\",{:.4f}\n", sample.frame_number,
+                          scope.gpu ? "gpu" : "cpu", scope.name,
+                          sample.milliseconds);
+    }
+  }
+  spdlog::info("Wrote profile {}.", path);
+  return true;
+}
+
+bool Profiler::DumpJson(const std::string &path) const {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file.is_open()) {
+    spdlog::error("Failed to write profile {}.", path);
+    return false;
+  }
+  file << "{\n  \"scopes\": [";
+  for (size_t s = 0; s < scopes_.size(); ++s) {
+    const Scope &scope = scopes_[s];
+    file << (s > 0 ? "," : "") << "\n    {\"name\": \"" << scope.name
+         << "\", \"type\": \"" << (scope.gpu ? "gpu" : "cpu")
+         << "\", \"samples\": [";
+    uint32_t first = scope.count == create_info_.history_length ? scope.next : 0;
+    for (uint32_t i = 0; i < scope.count; ++i) {
+      const Sample &sample =
+          scope.samples[(first + i) % create_info_.history_length];
+      file << (i > 0 ? ", " : "")
+           << fmt::format("[{}, {:.4f}]", sample.frame_number,
+                          sample.milliseconds);
+    }
+    file << "]}";
+  }
+  file << "\n  ],\n  \"pipeline_statistics\": [";
+  uint32_t first_statistics =
+      statistics_count_ == statistics_.size() ? statistics_next_ : 0;
+  for (uint32_t i = 0; i < statistics_count_; ++i) {
+    const PipelineStatistics &statistics =
+        statistics_[(first_statistics + i) % statistics_.size()];
+    file << (i > 0 ? "," : "")
+         << fmt::format(
+                "\n    {{\"frame\": {}, \"input_assembly_primitives\": {}, "
+                "\"vertex_shader_invocations\": {}, "
+                "\"clipping_primitives\": {}, "
+                "\"fragment_shader_invocations\": {}, "
+                "\"compute_shader_invocations\": {}}}",
+                statistics.frame_number, statistics.input_assembly_primitives,
+                statistics.vertex_shader_invocations,
+                statistics.clipping_primitives,
+                statistics.fragment_shader_invocations,
+                statistics.compute_shader_invocations);
+  }
+  file << "\n  ]\n}\n";
+  spdlog::info("Wrote profile {}.", path);
+  return true;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Frame profiler for CPU scopes, GPU timestamp scopes and optional pipeline
+// statistics. GPU queries are written into per-frame-in-flight query pools and
+// read back when the frame's fence has been waited on again, frames_in_flight
+// frames later, so reading them never stalls.
+//
+// All scopes keep a rolling history that is plotted by DrawImGui() and can be
+// dumped to CSV or JSON.
+class Profiler {
+public:
+  // What the pipeline statistics query counts, results in the bit order of
+  // the flags. The query is active for the whole primary command buffer, so
+  // secondaries executed by it have to inherit these, see
+  // VkCommandBufferInheritanceInfo::pipelineStatistics, which needs the
+  // inheritedQueries device feature.
+  static constexpr VkQueryPipelineStatisticFlags kStatisticsFlags =
+      VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT |
+      VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+      VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+      VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT |
+      VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+
+  struct CreateInfo {
+    VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+    VkDevice device = VK_NULL_HANDLE;
+    // Family of the queue the profiled command buffers are submitted to.
+    uint32_t queue_family = 0;
+    uint32_t frames_in_flight = 2;
+    // Needs the pipelineStatisticsQuery device feature to be enabled.
+    bool pipeline_statistics = false;
+    uint32_t max_gpu_scopes = 32;
+    // Frames of history kept per scope.
+    uint32_t history_length = 1024;
+  };
+
+  struct Sample {
+    uint64_t frame_number = 0;
+    float milliseconds = 0.0f;
+  };
+
+  struct PipelineStatistics {
+    uint64_t frame_number = 0;
+    uint64_t input_assembly_primitives = 0;
+    uint64_t vertex_shader_invocations = 0;
+    uint64_t clipping_primitives = 0;
+    uint64_t fragment_shader_invocations = 0;
+    uint64_t compute_shader_invocations = 0;
+  };
+
+  // Measures the CPU time until it goes out of scope.
+  class CpuScope {
+  public:
+    CpuScope(Profiler &profiler, const char *name);
+    ~CpuScope();
+    CpuScope(const CpuScope &) = delete;
+    CpuScope &operator=(const CpuScope &) = delete;
+
+  private:
+    Profiler &profiler_;
+    const char *name_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  void Destroy();
+
+  // Call after the fence of `frame` has been waited on. Collects the results
+  // the GPU wrote the last time this frame slot was used.
+  void BeginFrame(uint32_t frame, uint64_t frame_number);
+  // Resets the frame's queries and begins the pipeline statistics query, has
+  // to be recorded outside a render pass before any other profiler command.
+  void BeginCommandBuffer(VkCommandBuffer command_buffer);
+  // Ends the pipeline statistics query, outside a render pass.
+  void EndCommandBuffer(VkCommandBuffer command_buffer);
+
+  // GPU scopes may nest. Both ends have to be recorded into the same command
+  // buffer.
+  void BeginGpuScope(VkCommandBuffer command_buffer, const char *name);
+  void EndGpuScope(VkCommandBuffer command_buffer);
+
+  // Adds a CPU sample measured elsewhere to the frame being recorded, for
+  // times that do not fit a scope.
+  void AddCpuSample(const char *name, float milliseconds);
+
+  // Reads the results of every recorded frame. The device has to be idle.
+  void CollectAll();
+
+  // Samples of a scope in the history, oldest first. Empty if the scope was
+  // never entered.
+  std::vector<float> ScopeSamples(const std::string &name, bool gpu) const;
+  // Newest sample of a scope, std::nullopt if the scope was never entered.
+  std::optional<Sample> LatestSample(const std::string &name, bool gpu) const;
+
+  // Window with rolling graphs of all scopes and the dump buttons.
+  void DrawImGui();
+
+  bool DumpCsv(const std::string &path) const;
+  bool DumpJson(const std::string &path) const;
+
+private:
+  struct Scope {
+    std::string name;
+    bool gpu = false;
+    // Ring buffer of the last history_length samples.
+    std::vector<Sample> samples;
+    // Milliseconds only, in ring order, for ImGui::PlotLines.
+    std::vector<float> plot_values;
+    uint32_t next = 0;
+    uint32_t count = 0;
+  };
+
+  struct GpuScopeRecord {
+    uint32_t scope;
+    uint32_t begin_query;
+    uint32_t end_query;
+  };
+
+  struct FrameQueries {
+    VkQueryPool timestamp_pool = VK_NULL_HANDLE;
+    VkQueryPool statistics_pool = VK_NULL_HANDLE;
+    std::vector<GpuScopeRecord> scopes;
+    uint32_t query_count = 0;
+    uint64_t frame_number = 0;
+    // Set once recorded, cleared when the results were read.
+    bool pending = false;
+  };
+
+  uint32_t FindOrAddScope(const char *name, bool gpu);
+  void AddSample(uint32_t scope, uint64_t frame_number, float milliseconds);
+  void ReadResults(FrameQueries &queries);
+
+  CreateInfo create_info_;
+  bool timestamps_supported_ = false;
+  // Nanoseconds per timestamp tick.
+  double timestamp_period_ = 1.0;
+  uint64_t timestamp_mask_ = ~0ull;
+
+  std::vector<FrameQueries> frames_;
+  uint32_t current_frame_ = 0;
+  uint64_t frame_number_ = 0;
+  // Open GPU scopes of the frame being recorded.
+  std::vector<uint32_t> open_gpu_scopes_;
+
+  std::vector<Scope> scopes_;
+  std::vector<PipelineStatistics> statistics_;
+  uint32_t statistics_next_ = 0;
+  uint32_t statistics_count_ = 0;
+  PipelineStatistics last_statistics_;
+};
@@ -0,0 +1,74 @@
+#include "quality_governor.h"
+#include <algorithm>
+
+namespace {
+
+// Weight of a new sample in the smoothed frame time.
+const float kSmoothing = 0.1f;
+// Upper bound of the raise backoff, in multiples of raise_samples.
+const uint32_t kMaxBackoff = 16;
+
+} // namespace
+
+void QualityGovernor::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  levels_.clear();
+  uint32_t samples = create_info_.max_samples;
+  levels_.push_back({static_cast<VkSampleCountFlagBits>(samples), 1.0f});
+  for (samples >>= 1; samples >= VK_SAMPLE_COUNT_2_BIT; samples >>= 1) {
+    levels_.push_back({static_cast<VkSampleCountFlagBits>(samples), 1.0f});
+  }
+  if (create_info_.render_scaling) {
+    VkSampleCountFlagBits lowest = levels_.back().samples;
+    for (float scale : {0.85f, 0.7f, 0.6f, 0.5f}) {
+      if (scale >= create_info_.min_render_scale) {
+        levels_.push_back({lowest, scale});
+      }
+    }
+  }
+  raise_backoff_.assign(levels_.size(), 0);
+  SetLevel(0);
+}
+
+bool QualityGovernor::AddSample(float gpu_ms) {
+  if (settle_ > 0) {
+    // Restarts the average on the first sample of the new level.
+    --settle_;
+    smoothed_ms_ = gpu_ms;
+    return false;
+  }
+  smoothed_ms_ += (gpu_ms - smoothed_ms_) * kSmoothing;
+
+  if (smoothed_ms_ > create_info_.target_ms) {
+    ++over_;
+    under_ = 0;
+  } else if (smoothed_ms_ <
+             create_info_.target_ms * create_info_.raise_threshold) {
+    ++under_;
+    over_ = 0;
+  } else {
+    over_ = 0;
+    under_ = 0;
+  }
+
+  if (over_ >= create_info_.drop_samples && current_ + 1 < levels_.size()) {
+    uint32_t &backoff = raise_backoff_[current_];
+    backoff = std::min(std::max(backoff * 2, create_info_.raise_samples),
+                       create_info_.raise_samples * kMaxBackoff);
+    SetLevel(current_ + 1);
+    return true;
+  }
+  if (current_ > 0 && under_ >= create_info_.raise_samples +
+                                    raise_backoff_[current_ - 1]) {
+    SetLevel(current_ - 1);
+    return true;
+  }
+  return false;
+}
+
+void QualityGovernor::SetLevel(uint32_t level) {
+  current_ = std::min(level, static_cast<uint32_t>(levels_.size()) - 1);
+  settle_ = create_info_.settle_samples;
+  over_ = 0;
+  under_ = 0;
+}
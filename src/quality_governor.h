@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Picks the MSAA sample count and internal render resolution from the
+// measured GPU frame time. Levels go from the best quality to the cheapest:
+// the sample count is halved down to two samples first, then the render scale
+// is lowered.
+//
+// Timestamps arrive frames_in_flight frames late and a new level takes a few
+// frames to show in them, so the governor works on a smoothed frame time and
+// has hysteresis in three places: dropping a level needs the time to stay over
+// the target for a while, raising one needs clear headroom for much longer,
+// and after every change the samples are ignored until they reflect the new
+// level. A level that had to be left again is retried later and later.
+class QualityGovernor {
+public:
+  struct CreateInfo {
+    // Highest sample count to use, from the device's supported counts.
+    VkSampleCountFlagBits max_samples = VK_SAMPLE_COUNT_4_BIT;
+    // Lowest render scale, and whether the engine can scale at all.
+    float min_render_scale = 0.5f;
+    bool render_scaling = true;
+    float target_ms = 14.0f;
+    // Smoothed time over target_ms for this many samples drops a level,
+    // below target_ms * raise_threshold for raise_samples raises one.
+    uint32_t drop_samples = 20;
+    uint32_t raise_samples = 120;
+    float raise_threshold = 0.7f;
+    // Samples ignored after a change.
+    uint32_t settle_samples = 10;
+  };
+
+  struct Level {
+    VkSampleCountFlagBits samples;
+    float render_scale;
+  };
+
+  void Init(const CreateInfo &create_info);
+
+  // Takes the GPU time of one frame. Returns true if the level changed.
+  bool AddSample(float gpu_ms);
+  // Jumps to `level` and starts settling again, for manual overrides.
+  void SetLevel(uint32_t level);
+
+  void SetTargetMs(float target_ms) { create_info_.target_ms = target_ms; }
+  float TargetMs() const { return create_info_.target_ms; }
+  const std::vector<Level> &Levels() const { return levels_; }
+  uint32_t CurrentLevel() const { return current_; }
+  const Level &Current() const { return levels_[current_]; }
+  float SmoothedMs() const { return smoothed_ms_; }
+
+private:
+  CreateInfo create_info_;
+  std::vector<Level> levels_;
+  uint32_t current_ = 0;
+  float smoothed_ms_ = 0.0f;
+  uint32_t settle_ = 0;
+  uint32_t over_ = 0;
+  uint32_t under_ = 0;
+  // Extra samples of headroom needed to raise into each level, doubled every
+  // time the level turned out too expensive.
+  std::vector<uint32_t> raise_backoff_;
+};
@@ -0,0 +1,304 @@
+#include "shader_library.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <string_view>
+#include <system_error>
+#ifdef PLANET_HAS_SHADERC
+#include <shaderc/shaderc.hpp>
+#endif
+
+namespace {
+
+std::vector<char> ReadFile(const std::filesystem::path &path) {
+  std::ifstream file(path, std::ios::ate | std::ios::binary);
+  if (!file.is_open()) {
+    return {};
+  }
+  std::vector<char> buffer(static_cast<size_t>(file.tellg()));
+  file.seekg(0);
+  file.read(buffer.data(), buffer.size());
+  return buffer;
+}
+
+// Also rejects files that are still being written.
+bool IsSpirv(const std::vector<char> &code) {
+  const uint32_t kMagic = 0x07230203;
+  if (code.size() < 5 * sizeof(uint32_t) || code.size() % sizeof(uint32_t)) {
+    return false;
+  }
+  uint32_t magic;
+  std::memcpy(&magic, code.data(), sizeof(magic));
+  return magic == kMagic;
+}
+
+// The stages the compile_shaders target compiles.
+const char *const kSourceExtensions[] = {".vert", ".frag", ".comp", ".task",
+                                         ".mesh"};
+
+#ifdef PLANET_HAS_SHADERC
+// Through a temporary file, so another instance never reads half of it.
+bool WriteFile(const std::filesystem::path &path,
+               const std::vector<char> &data) {
+  std::filesystem::path temporary = path;
+  temporary += ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file.write(data.data(), data.size())) {
+      return false;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(temporary, path, error);
+  return !error;
+}
+
+// 64-bit FNV-1a, chained through `hash`.
+uint64_t Hash(std::string_view data, uint64_t hash = 14695981039346656037ull) {
+  for (char c : data) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+std::optional<shaderc_shader_kind>
+ShaderKind(const std::filesystem::path &path) {
+  std::filesystem::path extension = path.extension();
+  if (extension == ".vert") {
+    return shaderc_vertex_shader;
+  } else if (extension == ".frag") {
+    return shaderc_fragment_shader;
+  } else if (extension == ".comp") {
+    return shaderc_compute_shader;
+  } else if (extension == ".task") {
+    return shaderc_task_shader;
+  } else if (extension == ".mesh") {
+    return shaderc_mesh_shader;
+  }
+  return std::nullopt;
+}
+#endif
+
+} // namespace
+
+bool ShaderLibrary::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  if (!create_info_.hot_reload) {
+    return true;
+  }
+  std::error_code error;
+  if (!std::filesystem::is_directory(WatchedDir(), error)) {
+    spdlog::error("Shader directory {} not found.", WatchedDir().string());
+    return false;
+  }
+  if (!create_info_.cache_dir.empty()) {
+    std::filesystem::create_directories(create_info_.cache_dir, error);
+  }
+
+  // Before the watcher starts, so nothing saved after Init() is missed.
+  Scan(true);
+  stop_ = false;
+  watcher_ = std::thread(&ShaderLibrary::WatcherLoop, this);
+  if (CanCompile()) {
+    spdlog::info("Compiling shaders from {} when they change.",
+                 WatchedDir().string());
+  } else {
+    spdlog::info("Reloading shaders from {} when compile_shaders rebuilds "
+                 "them.",
+                 WatchedDir().string());
+  }
+  return true;
+}
+
+void ShaderLibrary::Destroy() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  if (watcher_.joinable()) {
+    watcher_.join();
+  }
+  write_times_.clear();
+  spirv_.clear();
+  changed_.clear();
+  errors_.clear();
+}
+
+std::vector<char> ShaderLibrary::Get(const std::string &name) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto spirv = spirv_.find(name);
+    if (spirv != spirv_.end()) {
+      return spirv->second;
+    }
+  }
+  std::filesystem::path path =
+      std::filesystem::path(create_info_.spirv_dir) / (name + ".spv");
+  std::vector<char> spirv = ReadFile(path);
+  if (spirv.empty()) {
+    spdlog::error("Failed to read file: {}", path.string());
+  }
+  return spirv;
+}
+
+std::vector<std::string> ShaderLibrary::TakeChanged() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> changed(changed_.begin(), changed_.end());
+  changed_.clear();
+  return changed;
+}
+
+std::string ShaderLibrary::Errors() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string errors;
+  for (const auto &[name, error] : errors_) {
+    errors += error;
+    errors += '\n';
+  }
+  return errors;
+}
+
+bool ShaderLibrary::CanCompile() {
+#ifdef PLANET_HAS_SHADERC
+  return true;
+#else
+  return false;
+#endif
+}
+
+std::filesystem::path ShaderLibrary::WatchedDir() const {
+  return CanCompile() ? create_info_.source_dir : create_info_.spirv_dir;
+}
+
+void ShaderLibrary::WatcherLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    wake_.wait_for(lock,
+                   std::chrono::milliseconds(create_info_.poll_interval_ms),
+                   [this] { return stop_; });
+    if (stop_) {
+      break;
+    }
+    lock.unlock();
+    Scan(false);
+    lock.lock();
+  }
+}
+
+void ShaderLibrary::Scan(bool first) {
+  std::error_code error;
+  for (auto entry = std::filesystem::directory_iterator(WatchedDir(), error);
+       !error && entry != std::filesystem::directory_iterator();
+       entry.increment(error)) {
+    const std::filesystem::path &path = entry->path();
+    bool watched = false;
+    if (CanCompile()) {
+      for (const char *extension : kSourceExtensions) {
+        watched |= path.extension() == extension;
+      }
+    } else {
+      watched = path.extension() == ".spv";
+    }
+    std::error_code time_error;
+    std::filesystem::file_time_type write_time =
+        entry->last_write_time(time_error);
+    if (!watched || time_error) {
+      continue;
+    }
+    auto [time, inserted] =
+        write_times_.try_emplace(path.filename().string(), write_time);
+    if (!inserted && time->second == write_time) {
+      continue;
+    }
+    time->second = write_time;
+    if (!first) {
+      Reload(path);
+    }
+  }
+}
+
+void ShaderLibrary::Reload(const std::filesystem::path &path) {
+  std::string name;
+  std::vector<char> spirv;
+  std::string error;
+  if (CanCompile()) {
+    name = path.filename().string();
+    std::vector<char> source = ReadFile(path);
+    Compile(name, std::string(source.begin(), source.end()), spirv, error);
+  } else {
+    // "shader.vert.spv" is "shader.vert".
+    name = path.stem().string();
+    spirv = ReadFile(path);
+    if (!IsSpirv(spirv)) {
+      error = fmt::format("{} is not valid SPIR-V.", path.string());
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!error.empty()) {
+    spdlog::error("Failed to reload {}: {}", name, error);
+    errors_[name] = std::move(error);
+    return;
+  }
+  spdlog::info("Reloaded {}.", name);
+  errors_.erase(name);
+  spirv_[name] = std::move(spirv);
+  changed_.insert(name);
+}
+
+bool ShaderLibrary::Compile(const std::string &name, const std::string &source,
+                            std::vector<char> &spirv,
+                            std::string &error) const {
+#ifdef PLANET_HAS_SHADERC
+  std::optional<shaderc_shader_kind> kind = ShaderKind(name);
+  if (!kind) {
+    error = "Unknown shader stage.";
+    return false;
+  }
+
+  // Another compiler may give other SPIR-V for the same source.
+  unsigned int spirv_version = 0;
+  unsigned int spirv_revision = 0;
+  shaderc_get_spv_version(&spirv_version, &spirv_revision);
+  uint64_t hash =
+      Hash(source, Hash(name, Hash(fmt::format("{}.{}", spirv_version,
+                                               spirv_revision))));
+  std::filesystem::path cache_path;
+  if (!create_info_.cache_dir.empty()) {
+    cache_path = std::filesystem::path(create_info_.cache_dir) /
+                 fmt::format("{}-{:016x}.spv", name, hash);
+    spirv = ReadFile(cache_path);
+    if (IsSpirv(spirv)) {
+      return true;
+    }
+  }
+
+  // Default options, like glslc in the compile_shaders target. Mesh shading
+  // needs SPIR-V 1.4, Vulkan 1.2 targets 1.5.
+  shaderc::Compiler compiler;
+  shaderc::CompileOptions options;
+  if (*kind == shaderc_task_shader || *kind == shaderc_mesh_shader) {
+    options.SetTargetEnvironment(shaderc_target_env_vulkan,
+                                 shaderc_env_version_vulkan_1_2);
+  }
+  shaderc::SpvCompilationResult result =
+      compiler.CompileGlslToSpv(source, *kind, name.c_str(), options);
+  if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
+    error = result.GetErrorMessage();
+    return false;
+  }
+  spirv.assign(reinterpret_cast<const char *>(result.cbegin()),
+               reinterpret_cast<const char *>(result.cend()));
+  if (!cache_path.empty() && !WriteFile(cache_path, spirv)) {
+    spdlog::warn("Failed to write {}.", cache_path.string());
+  }
+  return true;
+#else
+  error = "Built without shaderc.";
+  return false;
+#endif
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <initializer_list>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Specialization constants 0, 1, ... of one pipeline permutation, 32 bits
+// each. Permutations of a shader are picked with these instead of separate
+// source files. Info() points into the object, which has to outlive the
+// pipeline creation that uses it.
+class SpecializationConstants {
+public:
+  SpecializationConstants(std::initializer_list<uint32_t> values)
+      : values_(values) {}
+
+  const VkSpecializationInfo *Info() {
+    entries_.resize(values_.size());
+    for (uint32_t i = 0; i < entries_.size(); ++i) {
+      entries_[i].constantID = i;
+      entries_[i].offset = i * sizeof(uint32_t);
+      entries_[i].size = sizeof(uint32_t);
+    }
+    info_.mapEntryCount = static_cast<uint32_t>(entries_.size());
+    info_.pMapEntries = entries_.data();
+    info_.dataSize = values_.size() * sizeof(uint32_t);
+    info_.pData = values_.data();
+    return &info_;
+  }
+
+private:
+  std::vector<uint32_t> values_;
+  std::vector<VkSpecializationMapEntry> entries_;
+  VkSpecializationInfo info_{};
+};
+
+// Hands out the SPIR-V of the shaders in src/shaders by file name, e.g.
+// "shader.vert", and with hot reload watches them on a background thread.
+//
+// Built with shaderc, a changed GLSL source is compiled in process. The
+// result is kept in a cache directory under the hash of the source, so
+// switching back and forth between versions, or restarting, does not compile
+// again. Without shaderc the watcher picks up the SPIR-V the compile_shaders
+// target writes instead. Either way the engine asks for the changed names at
+// a frame boundary with TakeChanged() and rebuilds the pipelines using them.
+//
+// Everything but the watcher thread belongs to the render thread.
+class ShaderLibrary {
+public:
+  struct CreateInfo {
+    // SPIR-V written by the compile_shaders target, used for every shader
+    // not compiled at runtime.
+    std::string spirv_dir = "shaders";
+    // GLSL sources, only needed with shaderc.
+    std::string source_dir;
+    // Runtime compiles by source hash. Nothing is cached if empty.
+    std::string cache_dir;
+    bool hot_reload = true;
+    uint32_t poll_interval_ms = 250;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  void Destroy();
+
+  // SPIR-V of the shader file `name`, the newest runtime compile if there is
+  // one. Empty if it cannot be read.
+  std::vector<char> Get(const std::string &name) const;
+  // Names whose SPIR-V changed since the last call.
+  std::vector<std::string> TakeChanged();
+  // Errors of the files whose last reload failed, one per line. A file's
+  // error goes away once it compiles again.
+  std::string Errors() const;
+
+  // Whether GLSL is compiled at runtime, or only SPIR-V reloaded.
+  static bool CanCompile();
+
+private:
+  // Sources with shaderc, the compile_shaders output without.
+  std::filesystem::path WatchedDir() const;
+  void WatcherLoop();
+  // Compares the watched files' write times with the last scan and reloads
+  // the changed ones. The first scan only records the times.
+  void Scan(bool first);
+  void Reload(const std::filesystem::path &path);
+  bool Compile(const std::string &name, const std::string &source,
+               std::vector<char> &spirv, std::string &error) const;
+
+  CreateInfo create_info_;
+
+  // Watcher thread only.
+  std::unordered_map<std::string, std::filesystem::file_time_type>
+      write_times_;
+
+  // Shared with the watcher thread.
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  std::unordered_map<std::string, std::vector<char>> spirv_;
+  std::set<std::string> changed_;
+  std::unordered_map<std::string, std::string> errors_;
+  bool stop_ = false;
+  std::thread watcher_;
+};
@@ -1,8 +1,219 @@
 #version 460
+#extension GL_EXT_nonuniform_qualifier : require
+
+// See BindlessTextures. The chunks of one draw pick different textures, so the
+// indices are not uniform.
+layout(set = 1, binding = 0) uniform texture2D textures[];
+layout(set = 1, binding = 1) uniform sampler samplers[2];
+
+// See AtmosphereGpuData.
+layout(set = 2, binding = 0) uniform AtmosphereUniforms {
+    vec4 rayleighScattering;
+    vec4 mieScattering;
+    vec4 mieAbsorption;
+    vec4 ozoneAbsorption;
+    vec4 groundAlbedo;
+    vec4 sunDirection;
+    vec4 sunIlluminance;
+    vec4 camera;
+    vec4 planet;
+    vec4 screen;
+    mat4 inverseViewProjection;
+} atmosphere;
+
+// Luminance scattered towards the camera and transmittance, with the slices
+// spaced quadratically up to atmosphere.planet.z, see Atmosphere.
+layout(set = 2, binding = 3) uniform sampler3D aerialPerspectiveLut;
+
+// See VirtualTexture. Each texel of the page table holds the pages of the
+// four children of the tile in the page at its position.
+layout(set = 3, binding = 0) uniform usampler2D pageTable;
+layout(set = 3, binding = 1) uniform sampler2D imageryCache;
+layout(std430, set = 3, binding = 2) buffer Feedback {
+    uint count;
+    uint capacity;
+    // Pixel of every 8 x 8 block that writes, x | y << 3.
+    uint pixel;
+    uint maxLevel;
+    // x: tile x | face << 25, y: tile y | level << 25.
+    uvec2 entries[];
+} feedback;
+
+// See ShadowGpuData and ShadowMaps.
+layout(binding = 5) uniform ShadowUniforms {
+    mat4 cascades[4];
+    vec4 texelSizes;
+    vec4 params;
+} shadow;
+
+layout(binding = 6) uniform sampler2DArrayShadow shadowMaps;
+
+// Same as in shaders/shader.vert.
+layout(constant_id = 1) const uint kDebugView = 0;
+// A virtual texture with imagery is bound.
+layout(constant_id = 2) const bool kImagery = false;
+
+const uint kLinearRepeat = 0;
+const uint kNoDetailTextures = 0xffffffffu;
+const uint kNoPage = 0xffffffffu;
+const vec3 kGroundColor = vec3(0.35, 0.45, 0.3);
 
 layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragDetailUv;
+layout(location = 2) in float fragSteepness;
+layout(location = 3) flat in uint fragDetailTextures;
+layout(location = 4) in vec3 fragPosition;
+layout(location = 5) flat in uvec4 fragImageryNode;
+layout(location = 6) in vec2 fragImageryUv;
+layout(location = 7) in vec3 fragDirect;
 layout(location = 0) out vec4 outColor;
 
+// The tile of `level` under the fragment and the fragment's position in it.
+uvec2 ImageryTile(uint level, out vec2 uv) {
+    uint nodeLevel = fragImageryNode.y;
+    uvec2 node = fragImageryNode.zw;
+    if (level <= nodeLevel) {
+        uint shift = nodeLevel - level;
+        uvec2 tile = node >> shift;
+        uv = (vec2(node - (tile << shift)) + fragImageryUv) /
+             float(1u << shift);
+        return tile;
+    }
+    uint shift = level - nodeLevel;
+    float scale = float(1u << shift);
+    uvec2 inNode =
+        min(uvec2(fragImageryUv * scale), uvec2((1u << shift) - 1u));
+    uv = fragImageryUv * scale - vec2(inNode);
+    return (node << shift) + inNode;
+}
+
+// The deepest resident tile down to `wantedLevel`, found from the face's
+// root, which is always resident.
+vec3 Imagery(uint wantedLevel) {
+    uint pagesPerAxis = uint(textureSize(pageTable, 0).x);
+    float tileSize = float(textureSize(imageryCache, 0).x / pagesPerAxis);
+    uint page = fragImageryNode.x;
+    uint level = 0;
+    vec2 uv;
+    for (uint next = 1; next <= wantedLevel; ++next) {
+        uvec2 tile = ImageryTile(next, uv);
+        uvec4 children = texelFetch(
+            pageTable, ivec2(page % pagesPerAxis, page / pagesPerAxis), 0);
+        uint child = children[(tile.x & 1u) | (tile.y & 1u) << 1];
+        if (child == kNoPage) {
+            break;
+        }
+        page = child;
+        level = next;
+    }
+    ImageryTile(level, uv);
+    // Past the border sample, the tile's samples sit on the node's corners.
+    vec2 texel = vec2(page % pagesPerAxis, page / pagesPerAxis) * tileSize +
+                 1.5 + uv * (tileSize - 3.0);
+    return textureLod(imageryCache,
+                      texel / vec2(textureSize(imageryCache, 0)), 0.0).rgb;
+}
+
+// Share of the direct sunlight that reaches the fragment. The finest cascade
+// whose map covers the fragment decides, a cached cascade may lag behind the
+// camera until it is rendered again. The position moves along the surface
+// normal by a texel against acne, four bilinear compares around it soften
+// the edges. Fades out towards the end of the shadow distance.
+float Shadow(vec3 normal) {
+    uint cascadeCount = uint(shadow.params.x);
+    float distance = length(fragPosition);
+    if (cascadeCount == 0 || distance >= shadow.params.z) {
+        return 1.0;
+    }
+    for (uint i = 0; i < cascadeCount; ++i) {
+        vec3 position = fragPosition + normal * shadow.texelSizes[i] * 1.5;
+        vec4 clip = shadow.cascades[i] * vec4(position, 1.0);
+        vec2 uv = clip.xy * 0.5 + 0.5;
+        float border = 2.0 * shadow.params.y;
+        if (any(lessThan(uv, vec2(border))) ||
+            any(greaterThan(uv, vec2(1.0 - border))) || clip.z < 0.0 ||
+            clip.z > 1.0) {
+            continue;
+        }
+        float texel = shadow.params.y;
+        float lit = 0.0;
+        for (int k = 0; k < 4; ++k) {
+            vec2 offset = vec2((k & 1) != 0 ? 0.5 : -0.5,
+                               (k & 2) != 0 ? 0.5 : -0.5) * texel;
+            // Outside uniform control flow, the maps have a single level.
+            lit += textureGrad(shadowMaps,
+                               vec4(uv + offset, float(i), clip.z),
+                               vec2(0.0), vec2(0.0));
+        }
+        return mix(lit * 0.25, 1.0,
+                   smoothstep(shadow.params.w, shadow.params.z, distance));
+    }
+    return 1.0;
+}
+
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    vec3 color = fragColor;
+    if (kDebugView == 0) {
+        // The face normal from the derivatives, in uniform control flow,
+        // turned towards the camera.
+        vec3 normal = normalize(cross(dFdx(fragPosition), dFdy(fragPosition)));
+        normal = dot(normal, fragPosition) > 0.0 ? -normal : normal;
+        color += fragDirect * Shadow(normal);
+    }
+    if (kDebugView == 0 && kImagery) {
+        // In uniform control flow for the derivatives. Samples of the node's
+        // tile per pixel give the level with about one sample per pixel.
+        float samples = float(textureSize(imageryCache, 0).x /
+                              textureSize(pageTable, 0).x) - 3.0;
+        vec2 footprint = max(abs(dFdx(fragImageryUv)),
+                             abs(dFdy(fragImageryUv))) * samples;
+        float finer = floor(-log2(max(max(footprint.x, footprint.y), 1e-8)));
+        uint wantedLevel = uint(clamp(float(fragImageryNode.y) + finer, 0.0,
+                                      float(feedback.maxLevel)));
+        color *= Imagery(wantedLevel);
+
+        uvec2 block = uvec2(gl_FragCoord.xy) & 7u;
+        if (block == uvec2(feedback.pixel & 7u, feedback.pixel >> 3)) {
+            uint entry = atomicAdd(feedback.count, 1u);
+            if (entry < feedback.capacity) {
+                vec2 uv;
+                uvec2 tile = ImageryTile(wantedLevel, uv);
+                feedback.entries[entry] =
+                    uvec2(tile.x | fragImageryNode.x << 25,
+                          tile.y | wantedLevel << 25);
+            }
+        }
+    } else if (kDebugView == 0) {
+        color *= kGroundColor;
+    }
+    if (fragDetailTextures != kNoDetailTextures) {
+        // 0.5 leaves the colour as it is, see DetailTexture.
+        uint flatTexture = fragDetailTextures & 0xffffu;
+        uint steepTexture = fragDetailTextures >> 16;
+        float flatDetail = texture(
+            nonuniformEXT(sampler2D(textures[nonuniformEXT(flatTexture)],
+                                   samplers[kLinearRepeat])),
+            fragDetailUv).r;
+        float steepDetail = texture(
+            nonuniformEXT(sampler2D(textures[nonuniformEXT(steepTexture)],
+                                   samplers[kLinearRepeat])),
+            fragDetailUv).r;
+        color *= 2.0 * mix(flatDetail, steepDetail, fragSteepness);
+    }
+    if (kDebugView == 0) {
+        // Slice 0 is centred half a slice away from the camera, the haze fades
+        // out towards it.
+        float distanceKm = length(fragPosition) * atmosphere.camera.w;
+        float slice = sqrt(distanceKm / atmosphere.planet.z);
+        vec4 aerialPerspective = textureLod(
+            aerialPerspectiveLut,
+            vec3(gl_FragCoord.xy * atmosphere.screen.xy, slice), 0.0);
+        float slices = float(textureSize(aerialPerspectiveLut, 0).z);
+        aerialPerspective = mix(vec4(0.0, 0.0, 0.0, 1.0), aerialPerspective,
+                                min(slice * slices * 2.0, 1.0));
+        color = color * aerialPerspective.a + aerialPerspective.rgb;
+        // Same tone mapping as shaders/sky.frag.
+        color = 1.0 - exp(-color * atmosphere.sunIlluminance.w);
+    }
+    outColor = vec4(color, 1.0);
 }
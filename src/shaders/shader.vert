@@ -1,18 +1,198 @@
 #version 460
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 projection;
 } ubo;
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inColor;
+// Terrain::CreateInfo::grid_size.
+layout(constant_id = 0) const uint kGridSize = 33;
+// 0: shaded, 1: normals, 2: colour by chunk size, which is the LOD level.
+layout(constant_id = 1) const uint kDebugView = 0;
+
+// See ChunkGpuData.
+struct Chunk {
+    // xyz: chunk origin relative to the camera, w: bounding radius.
+    vec4 sphere;
+    vec4 centerDirection;
+    vec4 centerCube;
+    vec4 stepU;
+    vec4 stepV;
+    uint vertexOffset;
+    uint firstIndex;
+    uint indexCount;
+    float skirtDepth;
+    uint detailTextures;
+    float detailStep;
+    vec2 detailOrigin;
+    uint nodeFaceLevel;
+    uint nodeX;
+    uint nodeY;
+    uint stitchMask;
+};
+
+// Indexed by the firstInstance the culling pass wrote, the view matrix only
+// rotates.
+layout(std430, binding = 1) readonly buffer Chunks {
+    Chunk chunks[];
+};
+
+// See AtmosphereGpuData.
+layout(set = 2, binding = 0) uniform AtmosphereUniforms {
+    vec4 rayleighScattering;
+    vec4 mieScattering;
+    vec4 mieAbsorption;
+    vec4 ozoneAbsorption;
+    vec4 groundAlbedo;
+    vec4 sunDirection;
+    vec4 sunIlluminance;
+    vec4 camera;
+    vec4 planet;
+    vec4 screen;
+    mat4 inverseViewProjection;
+} atmosphere;
+
+layout(set = 2, binding = 1) uniform sampler2D transmittanceLut;
+
+// See Vertex.
+layout(location = 0) in float inHeight;
+layout(location = 1) in vec2 inNormal;
 
 layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragDetailUv;
+// Steep ground 1, flat ground 0.
+layout(location = 2) out float fragSteepness;
+layout(location = 3) flat out uint fragDetailTextures;
+// Relative to the camera, for the aerial perspective.
+layout(location = 4) out vec3 fragPosition;
+// The chunk's node, face, level, x and y, and the position in it, for the
+// imagery.
+layout(location = 5) flat out uvec4 fragImageryNode;
+layout(location = 6) out vec2 fragImageryUv;
+// Sunlight that reaches the ground directly, the fragment shader dims it with
+// the shadow maps. fragColor holds the rest.
+layout(location = 7) out vec3 fragDirect;
 
-void main() {
-    gl_Position = ubo.projection * ubo.view * ubo.model * vec4(inPosition, 1.0);
-    fragColor = inColor;
+const float kPi = 3.14159265;
+
+vec3 DecodeOctahedral(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) {
+        n.xy = (1.0 - abs(n.yx)) *
+               vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
+
+// Same as in shaders/atmosphere.comp.
+vec2 TransmittanceUv(float radius, float mu) {
+    float bottom = atmosphere.planet.x;
+    float top = atmosphere.planet.y;
+    float horizon = sqrt(top * top - bottom * bottom);
+    float rho = sqrt(max(radius * radius - bottom * bottom, 0.0));
+    float discriminant = radius * radius * (mu * mu - 1.0) + top * top;
+    float rayLength = max(-radius * mu + sqrt(max(discriminant, 0.0)), 0.0);
+    float minLength = top - radius;
+    float maxLength = rho + horizon;
+    return vec2((rayLength - minLength) / (maxLength - minLength),
+                rho / horizon);
 }
 
+// Same as in shaders/atmosphere.comp.
+vec3 SunTransmittance(float radius, float mu) {
+    float sinHorizon = atmosphere.planet.x / radius;
+    if (mu < -sqrt(max(1.0 - sinHorizon * sinHorizon, 0.0))) {
+        return vec3(0.0);
+    }
+    return textureLod(transmittanceLut, TransmittanceUv(radius, mu), 0.0).rgb;
+}
+
+void main() {
+    Chunk chunk = chunks[gl_InstanceIndex];
+    const int halfGrid = int(kGridSize / 2);
+
+    // Place in the grid, the skirt follows it with one copy of every edge, see
+    // Terrain::CreateMeshBuffer().
+    uint local = uint(gl_VertexIndex) - chunk.vertexOffset;
+    int i;
+    int j;
+    bool skirt = local >= kGridSize * kGridSize;
+    if (skirt) {
+        uint edge = (local - kGridSize * kGridSize) / kGridSize;
+        int along = int((local - kGridSize * kGridSize) % kGridSize);
+        int last = int(kGridSize) - 1;
+        i = edge == 0 ? 0 : edge == 1 ? last : along;
+        j = edge < 2 ? along : edge == 2 ? 0 : last;
+    } else {
+        i = int(local % kGridSize);
+        j = int(local / kGridSize);
+    }
+    float height = chunk.stepU.w + inHeight * chunk.stepV.w;
+
+    // Offset from the centre on the cube, exact. Mapping it through the
+    // differences of the squares instead of the absolute positions keeps float
+    // precision relative to the chunk, not to the planet. The same mapping as
+    // shaders/heightfield.comp.
+    vec3 centerCube = chunk.centerCube.xyz;
+    vec3 centerSquared = centerCube * centerCube;
+    vec3 centerTerm = 1.0 - centerSquared.yzx * 0.5 - centerSquared.zxy * 0.5 +
+                      centerSquared.yzx * centerSquared.zxy / 3.0;
+    vec3 centerScale = sqrt(centerTerm);
+    vec3 delta = chunk.stepU.xyz * float(i - halfGrid) +
+                 chunk.stepV.xyz * float(j - halfGrid);
+    vec3 cube = centerCube + delta;
+    vec3 squared = cube * cube;
+    vec3 deltaSquared = delta * (2.0 * centerCube + delta);
+    vec3 deltaTerm = -deltaSquared.yzx * 0.5 - deltaSquared.zxy * 0.5 +
+                     (deltaSquared.yzx * squared.zxy +
+                      centerSquared.yzx * deltaSquared.zxy) / 3.0;
+    vec3 scale = sqrt(centerTerm + deltaTerm);
+    vec3 deltaDirection =
+        delta * scale + centerCube * deltaTerm / (scale + centerScale);
+
+    float radius = chunk.centerDirection.w;
+    float centerHeight = chunk.centerCube.w;
+    vec3 position = deltaDirection * (radius + height) +
+                    chunk.centerDirection.xyz * (height - centerHeight);
+    if (skirt) {
+        position -= normalize(chunk.centerDirection.xyz + deltaDirection) *
+                    chunk.skirtDepth;
+    }
+
+    fragPosition = position + chunk.sphere.xyz;
+    gl_Position = ubo.projection * ubo.view * vec4(fragPosition, 1.0);
+    vec3 sun = atmosphere.sunDirection.xyz;
+    vec3 normal = DecodeOctahedral(inNormal);
+    vec3 up = normalize(chunk.centerDirection.xyz + deltaDirection);
+    fragSteepness = 1.0 - smoothstep(0.8, 0.95, dot(normal, up));
+    fragDetailUv = chunk.detailOrigin +
+                   vec2(i - halfGrid, j - halfGrid) * chunk.detailStep;
+    fragDetailTextures = kDebugView == 0 ? chunk.detailTextures : 0xffffffffu;
+    fragImageryNode = uvec4(chunk.nodeFaceLevel & 0xffu,
+                            chunk.nodeFaceLevel >> 8, chunk.nodeX, chunk.nodeY);
+    fragImageryUv = vec2(i, j) / float(kGridSize - 1);
+    fragDirect = vec3(0.0);
+    if (kDebugView == 1) {
+        fragColor = normal * 0.5 + 0.5;
+    } else if (kDebugView == 2) {
+        // The cube step halves with every level.
+        float hue = fract(-log2(length(chunk.stepU.xyz)) * 0.15);
+        vec3 levelColor = clamp(
+            abs(fract(hue + vec3(0.0, 2.0, 1.0) / 3.0) * 6.0 - 3.0) - 1.0,
+            0.0, 1.0);
+        fragColor = levelColor * (0.5 + 0.5 * max(dot(normal, sun), 0.0));
+    } else {
+        // Lambertian under the sunlight that reaches the vertex, the ambient
+        // share dims with it. The fragment shader multiplies in the albedo.
+        vec3 planetPosition =
+            atmosphere.camera.xyz + fragPosition * atmosphere.camera.w;
+        float planetRadius =
+            max(length(planetPosition), atmosphere.planet.x + 1e-3);
+        vec3 sunlight =
+            atmosphere.sunIlluminance.xyz *
+            SunTransmittance(planetRadius,
+                             dot(planetPosition, sun) / planetRadius);
+        fragColor = sunlight / kPi * 0.25;
+        fragDirect = sunlight / kPi * 0.75 * max(dot(normal, sun), 0.0);
+    }
+}
@@ -0,0 +1,97 @@
+#version 460
+
+// Depth only terrain for the shadow maps, see ShadowMaps. The placement of
+// shaders/shader.vert, projected by the cascade's light matrix instead of the
+// camera.
+
+// Same as in shaders/shader.vert.
+layout(constant_id = 0) const uint kGridSize = 33;
+
+// See ShadowGpuData.
+layout(binding = 0) uniform ShadowUniforms {
+    mat4 cascades[4];
+    vec4 texelSizes;
+    vec4 params;
+} shadow;
+
+// See ChunkGpuData.
+struct Chunk {
+    vec4 sphere;
+    vec4 centerDirection;
+    vec4 centerCube;
+    vec4 stepU;
+    vec4 stepV;
+    uint vertexOffset;
+    uint firstIndex;
+    uint indexCount;
+    float skirtDepth;
+    uint detailTextures;
+    float detailStep;
+    vec2 detailOrigin;
+    uint nodeFaceLevel;
+    uint nodeX;
+    uint nodeY;
+    uint stitchMask;
+};
+
+// Indexed by the firstInstance shaders/shadow_cull.comp wrote.
+layout(std430, binding = 1) readonly buffer Chunks {
+    Chunk chunks[];
+};
+
+// See ShadowMaps::Record().
+layout(push_constant) uniform ShadowConstants {
+    uint cascade;
+} constants;
+
+// See Vertex, the normal is not needed.
+layout(location = 0) in float inHeight;
+
+void main() {
+    Chunk chunk = chunks[gl_InstanceIndex];
+    const int halfGrid = int(kGridSize / 2);
+
+    uint local = uint(gl_VertexIndex) - chunk.vertexOffset;
+    int i;
+    int j;
+    bool skirt = local >= kGridSize * kGridSize;
+    if (skirt) {
+        uint edge = (local - kGridSize * kGridSize) / kGridSize;
+        int along = int((local - kGridSize * kGridSize) % kGridSize);
+        int last = int(kGridSize) - 1;
+        i = edge == 0 ? 0 : edge == 1 ? last : along;
+        j = edge < 2 ? along : edge == 2 ? 0 : last;
+    } else {
+        i = int(local % kGridSize);
+        j = int(local / kGridSize);
+    }
+    float height = chunk.stepU.w + inHeight * chunk.stepV.w;
+
+    vec3 centerCube = chunk.centerCube.xyz;
+    vec3 centerSquared = centerCube * centerCube;
+    vec3 centerTerm = 1.0 - centerSquared.yzx * 0.5 - centerSquared.zxy * 0.5 +
+                      centerSquared.yzx * centerSquared.zxy / 3.0;
+    vec3 centerScale = sqrt(centerTerm);
+    vec3 delta = chunk.stepU.xyz * float(i - halfGrid) +
+                 chunk.stepV.xyz * float(j - halfGrid);
+    vec3 cube = centerCube + delta;
+    vec3 squared = cube * cube;
+    vec3 deltaSquared = delta * (2.0 * centerCube + delta);
+    vec3 deltaTerm = -deltaSquared.yzx * 0.5 - deltaSquared.zxy * 0.5 +
+                     (deltaSquared.yzx * squared.zxy +
+                      centerSquared.yzx * deltaSquared.zxy) / 3.0;
+    vec3 scale = sqrt(centerTerm + deltaTerm);
+    vec3 deltaDirection =
+        delta * scale + centerCube * deltaTerm / (scale + centerScale);
+
+    float radius = chunk.centerDirection.w;
+    float centerHeight = chunk.centerCube.w;
+    vec3 position = deltaDirection * (radius + height) +
+                    chunk.centerDirection.xyz * (height - centerHeight);
+    if (skirt) {
+        position -= normalize(chunk.centerDirection.xyz + deltaDirection) *
+                    chunk.skirtDepth;
+    }
+    gl_Position = shadow.cascades[constants.cascade] *
+                  vec4(position + chunk.sphere.xyz, 1.0);
+}
@@ -0,0 +1,124 @@
+#version 460
+
+// The sky from the sky view LUT and the sun's disk, see Atmosphere.
+// Distances are in kilometres and positions relative to the planet's centre,
+// as in shaders/atmosphere.comp.
+
+// See AtmosphereGpuData.
+layout(binding = 0) uniform AtmosphereUniforms {
+    vec4 rayleighScattering;
+    vec4 mieScattering;
+    vec4 mieAbsorption;
+    vec4 ozoneAbsorption;
+    vec4 groundAlbedo;
+    vec4 sunDirection;
+    vec4 sunIlluminance;
+    vec4 camera;
+    vec4 planet;
+    vec4 screen;
+    mat4 inverseViewProjection;
+} atmosphere;
+
+layout(binding = 1) uniform sampler2D transmittanceLut;
+layout(binding = 2) uniform sampler2D skyViewLut;
+
+layout(location = 0) out vec4 outColor;
+
+const float kPi = 3.14159265;
+
+// Same as in shaders/atmosphere.comp.
+vec2 RaySphere(vec3 origin, vec3 direction, float radius) {
+    float b = dot(origin, direction);
+    float c = dot(origin, origin) - radius * radius;
+    float discriminant = b * b - c;
+    if (discriminant < 0.0) {
+        return vec2(-1.0);
+    }
+    float root = sqrt(discriminant);
+    return vec2(-b - root, -b + root);
+}
+
+// Same as in shaders/atmosphere.comp.
+vec2 TransmittanceUv(float radius, float mu) {
+    float bottom = atmosphere.planet.x;
+    float top = atmosphere.planet.y;
+    float horizon = sqrt(top * top - bottom * bottom);
+    float rho = sqrt(max(radius * radius - bottom * bottom, 0.0));
+    float discriminant = radius * radius * (mu * mu - 1.0) + top * top;
+    float rayLength = max(-radius * mu + sqrt(max(discriminant, 0.0)), 0.0);
+    float minLength = top - radius;
+    float maxLength = rho + horizon;
+    return vec2((rayLength - minLength) / (maxLength - minLength),
+                rho / horizon);
+}
+
+// Same as in shaders/atmosphere.comp.
+vec3 ViewDirection(vec2 uv) {
+    vec4 point = atmosphere.inverseViewProjection *
+                 vec4(uv * 2.0 - 1.0, atmosphere.screen.z, 1.0);
+    return normalize(point.xyz / point.w);
+}
+
+// Inverse of the mapping SkyView() in shaders/atmosphere.comp renders with,
+// whose first and last texels lie on the LUT's edges.
+vec2 SkyViewUv(float radius, float viewZenithCos, float lightViewCos) {
+    float beta = asin(atmosphere.planet.x / radius);
+    float horizonZenith = kPi - beta;
+    float viewZenith = acos(viewZenithCos);
+    vec2 uv;
+    if (viewZenith < horizonZenith) {
+        uv.y = (1.0 - sqrt(1.0 - viewZenith / horizonZenith)) * 0.5;
+    } else {
+        uv.y = sqrt((viewZenith - horizonZenith) / beta) * 0.5 + 0.5;
+    }
+    uv.x = sqrt(-lightViewCos * 0.5 + 0.5);
+    vec2 size = vec2(textureSize(skyViewLut, 0));
+    return (uv * (size - 1.0) + 0.5) / size;
+}
+
+void main() {
+    vec3 direction = ViewDirection(gl_FragCoord.xy * atmosphere.screen.xy);
+    vec3 camera = atmosphere.camera.xyz;
+    vec3 sun = atmosphere.sunDirection.xyz;
+    float radius = max(length(camera), atmosphere.planet.x + 1e-3);
+    vec3 up = normalize(camera);
+
+    // The azimuth to the sun is measured in the camera's horizontal plane.
+    float viewZenithCos = dot(direction, up);
+    vec3 viewSide = direction - up * viewZenithCos;
+    vec3 sunSide = sun - up * dot(sun, up);
+    float lightViewCos = clamp(
+        dot(viewSide, sunSide) /
+            max(length(viewSide) * length(sunSide), 1e-6),
+        -1.0, 1.0);
+    vec3 luminance =
+        textureLod(skyViewLut,
+                   SkyViewUv(radius, clamp(viewZenithCos, -1.0, 1.0),
+                             lightViewCos),
+                   0.0).rgb;
+
+    // The sun's illuminance spread over its disk, seen through the
+    // atmosphere from where the ray enters it, unless the planet is in the
+    // way.
+    if (dot(direction, sun) > atmosphere.sunDirection.w) {
+        vec3 transmittance = vec3(1.0);
+        vec2 top = RaySphere(camera, sun, atmosphere.planet.y);
+        if (RaySphere(camera, sun, atmosphere.planet.x).x > 0.0) {
+            transmittance = vec3(0.0);
+        } else if (top.y > 0.0) {
+            vec3 entry = camera + sun * max(top.x, 0.0);
+            float entryRadius = length(entry);
+            transmittance =
+                textureLod(transmittanceLut,
+                           TransmittanceUv(entryRadius,
+                                           dot(entry, sun) / entryRadius),
+                           0.0).rgb;
+        }
+        float solidAngle = 2.0 * kPi * (1.0 - atmosphere.sunDirection.w);
+        luminance += atmosphere.sunIlluminance.xyz / solidAngle * transmittance;
+    }
+
+    // Same tone mapping as shaders/shader.frag.
+    outColor =
+        vec4(1.0 - exp(-luminance * atmosphere.sunIlluminance.w), 1.0);
+}
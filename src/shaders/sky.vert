@@ -0,0 +1,12 @@
+#version 460
+
+// One triangle over the whole screen for shaders/sky.frag at the far plane,
+// the depth test keeps it where the terrain drew nothing.
+
+// Whether depth 0 or 1 is the farthest.
+layout(constant_id = 0) const bool kReversedZ = true;
+
+void main() {
+    vec2 position = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+    gl_Position = vec4(position * 2.0 - 1.0, kReversedZ ? 0.0 : 1.0, 1.0);
+}
@@ -0,0 +1,937 @@
+#include "shadow_maps.h"
+#include "shader_library.h"
+#include "vertex.h"
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <utility>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// Must match local_size_x in shaders/shadow_cull.comp.
+constexpr uint32_t kCullGroupSize = 64;
+
+// Weight of the logarithmic splits against the uniform ones.
+constexpr double kSplitLambda = 0.9;
+// Cached cascades cover this much more than their slice, so the camera can
+// move a while before their map has to follow.
+constexpr double kCachedMargin = 1.25;
+// Cosine of the angle the sun may turn before a cached map is stale.
+constexpr double kSunTolerance = 0.99999;
+// Frames a cached map keeps a selection that changed since it was rendered.
+constexpr uint64_t kTerrainRefreshFrames = 16;
+// Sine of the lowest sun elevation the light box reaches out for, lower suns
+// cast terrain from farther away than is worth covering.
+constexpr double kMinSunSine = 0.1;
+// Shadows fade out over the last part of the shadow distance.
+constexpr float kFadeStart = 0.9f;
+
+// Frames and cascades start at multiples of 256 bytes, the largest
+// minStorageBufferOffsetAlignment a device may have.
+uint32_t AlignedRegion(VkDeviceSize size, uint32_t region) {
+  return static_cast<uint32_t>((size + 255) & ~VkDeviceSize{255}) * region;
+}
+
+// Gribb/Hartmann planes of a light box, depth in [0, 1].
+void BoxPlanes(const glm::mat4 &m, glm::vec4 (&planes)[6]) {
+  glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+  glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+  glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+  glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+  planes[0] = row3 + row0;
+  planes[1] = row3 - row0;
+  planes[2] = row3 + row1;
+  planes[3] = row3 - row1;
+  planes[4] = row2;
+  planes[5] = row3 - row2;
+  for (glm::vec4 &plane : planes) {
+    plane /= glm::length(glm::vec3(plane));
+  }
+}
+
+} // namespace
+
+bool ShadowMaps::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  device_ = create_info.device;
+  if (!create_info_.terrain) {
+    spdlog::error("Shadow maps need a terrain.");
+    return false;
+  }
+  cascade_count_ = std::min(create_info_.cascade_count, kMaxShadowCascades);
+  create_info_.dynamic_cascades =
+      std::min(create_info_.dynamic_cascades, cascade_count_);
+  create_info_.resolution = std::max(create_info_.resolution, 64u);
+  layer_count_ = std::max(cascade_count_, 1u);
+  defer_destroy_ = create_info_.defer_destroy;
+
+  if (!CreateImage()) {
+    return false;
+  }
+  const uint32_t region_count =
+      create_info_.frames_in_flight * kMaxShadowCascades;
+  if (!CreateBuffer(DrawRegionOffset(create_info_.frames_in_flight, 0),
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                    draw_buffer_, draw_allocation_) ||
+      !CreateBuffer(AlignedRegion(sizeof(uint32_t), region_count),
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    count_buffer_, count_allocation_)) {
+    spdlog::error("Failed to create shadow draw buffers.");
+    return false;
+  }
+  if (!create_info_.dynamic_rendering && !CreateRenderPass()) {
+    return false;
+  }
+  if (!CreateDescriptorSet()) {
+    return false;
+  }
+
+  VkPushConstantRange push_constant_range{};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = sizeof(uint32_t);
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &set_layout_;
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+  VkPushConstantRange cull_push_constant_range{};
+  cull_push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  cull_push_constant_range.offset = 0;
+  cull_push_constant_range.size = sizeof(ShadowCullPushConstants);
+  VkPipelineLayoutCreateInfo cull_pipeline_layout_info = pipeline_layout_info;
+  cull_pipeline_layout_info.pPushConstantRanges = &cull_push_constant_range;
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &pipeline_layout_) != VK_SUCCESS ||
+      vkCreatePipelineLayout(device_, &cull_pipeline_layout_info, nullptr,
+                             &cull_pipeline_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create shadow pipeline layouts.");
+    return false;
+  }
+  return CreatePipelines(create_info_.vertex_shader_code,
+                         create_info_.cull_shader_code, pipeline_,
+                         cull_pipeline_);
+}
+
+void ShadowMaps::Destroy() {
+  if (device_ == VK_NULL_HANDLE) {
+    return;
+  }
+  vkDestroyPipeline(device_, cull_pipeline_, nullptr);
+  vkDestroyPipeline(device_, pipeline_, nullptr);
+  vkDestroyPipelineLayout(device_, cull_pipeline_layout_, nullptr);
+  vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr);
+  vkDestroyDescriptorPool(device_, pool_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, set_layout_, nullptr);
+  for (VkFramebuffer framebuffer : framebuffers_) {
+    vkDestroyFramebuffer(device_, framebuffer, nullptr);
+  }
+  framebuffers_.clear();
+  vkDestroyRenderPass(device_, render_pass_, nullptr);
+  for (auto [buffer, allocation] :
+       {std::pair{draw_buffer_, draw_allocation_},
+        std::pair{count_buffer_, count_allocation_}}) {
+    if (buffer != VK_NULL_HANDLE) {
+      vkDestroyBuffer(device_, buffer, nullptr);
+      create_info_.allocator->Free(allocation);
+    }
+  }
+  vkDestroySampler(device_, sampler_, nullptr);
+  for (VkImageView view : layer_views_) {
+    vkDestroyImageView(device_, view, nullptr);
+  }
+  layer_views_.clear();
+  vkDestroyImageView(device_, array_view_, nullptr);
+  if (image_ != VK_NULL_HANDLE) {
+    vkDestroyImage(device_, image_, nullptr);
+    create_info_.allocator->Free(image_allocation_);
+  }
+  cull_pipeline_ = VK_NULL_HANDLE;
+  pipeline_ = VK_NULL_HANDLE;
+  cull_pipeline_layout_ = VK_NULL_HANDLE;
+  pipeline_layout_ = VK_NULL_HANDLE;
+  pool_ = VK_NULL_HANDLE;
+  set_layout_ = VK_NULL_HANDLE;
+  render_pass_ = VK_NULL_HANDLE;
+  draw_buffer_ = VK_NULL_HANDLE;
+  count_buffer_ = VK_NULL_HANDLE;
+  sampler_ = VK_NULL_HANDLE;
+  array_view_ = VK_NULL_HANDLE;
+  image_ = VK_NULL_HANDLE;
+}
+
+ShadowGpuData ShadowMaps::Update(const View &view) {
+  ++frame_;
+  stats_.rendered_mask = 0;
+  ShadowGpuData data{};
+  if (cascade_count_ == 0) {
+    return data;
+  }
+
+  // From the nearest the terrain can be to the horizon over the highest
+  // terrain, at most max_distance.
+  const Terrain &terrain = *create_info_.terrain;
+  double bottom = view.planet_radius + terrain.MinHeight();
+  double top = view.planet_radius + terrain.MaxHeight();
+  double camera_distance = glm::length(view.camera_position);
+  double horizon =
+      (camera_distance > bottom
+           ? glm::sqrt((camera_distance - bottom) * (camera_distance + bottom))
+           : 0.0) +
+      glm::sqrt((top - bottom) * (top + bottom));
+  double near_distance =
+      std::max<double>(view.near_plane, camera_distance - top);
+  double far_distance = std::max(
+      std::min(horizon, near_distance + create_info_.max_distance),
+      near_distance * 2.0);
+  stats_.distance = static_cast<float>(far_distance);
+
+  // Squared tangent of the angle between the view axis and the frustum's
+  // corner edges.
+  double tan_y = std::tan(static_cast<double>(view.fov_y) * 0.5);
+  double corner = tan_y * tan_y * (1.0 + view.aspect * view.aspect);
+  glm::dvec3 forward = glm::normalize(view.camera_forward);
+  glm::dvec3 sun = glm::normalize(glm::dvec3(view.sun_direction));
+
+  std::array<glm::dvec3, kMaxShadowCascades> centers{};
+  std::array<double, kMaxShadowCascades> radii{};
+  double split_near = near_distance;
+  for (uint32_t i = 0; i < cascade_count_; ++i) {
+    double t = static_cast<double>(i + 1) / cascade_count_;
+    double split_far =
+        kSplitLambda * near_distance *
+            std::pow(far_distance / near_distance, t) +
+        (1.0 - kSplitLambda) *
+            (near_distance + (far_distance - near_distance) * t);
+    // Centre on the view axis equally far from the slice's near and far
+    // corners, or the far plane's centre when that is nearer.
+    double z = std::min(split_far, 0.5 * (split_near + split_far) *
+                                       (1.0 + corner));
+    double radius = glm::sqrt(
+        std::max((split_far - z) * (split_far - z) +
+                     split_far * split_far * corner,
+                 (z - split_near) * (z - split_near) +
+                     split_near * split_near * corner));
+    // In quarter octaves, so the radius stays the same until the slice
+    // changes noticeably.
+    radii[i] = std::exp2(std::ceil(std::log2(radius) * 4.0) / 4.0);
+    centers[i] = view.camera_position + forward * z;
+    split_near = split_far;
+  }
+
+  auto render = [&](uint32_t i, double radius) {
+    cascades_[i] = Fit(view, centers[i], radius);
+    cascades_[i].selection_version = terrain.SelectionVersion();
+    cascades_[i].rendered_frame = frame_;
+    stats_.rendered_mask |= 1u << i;
+  };
+  auto stale = [&](uint32_t i, double radius) {
+    const Cascade &cascade = cascades_[i];
+    return !cascade.rendered || cascade.radius != radius ||
+           glm::dot(cascade.forward, sun) < kSunTolerance ||
+           glm::length(centers[i] - cascade.center) + radii[i] >
+               cascade.radius ||
+           (cascade.selection_version != terrain.SelectionVersion() &&
+            frame_ - cascade.rendered_frame >= kTerrainRefreshFrames);
+  };
+  for (uint32_t i = 0; i < create_info_.dynamic_cascades; ++i) {
+    render(i, radii[i]);
+  }
+  // Maps that were never rendered are due at once, the others take turns.
+  const uint32_t first_cached = create_info_.dynamic_cascades;
+  const uint32_t cached_count = cascade_count_ - first_cached;
+  bool refreshed = false;
+  for (uint32_t i = first_cached; i < cascade_count_; ++i) {
+    if (!cascades_[i].rendered) {
+      render(i, radii[i] * kCachedMargin);
+      refreshed = true;
+    }
+  }
+  uint32_t previous = last_cached_ >= first_cached
+                          ? last_cached_ - first_cached
+                          : cached_count - 1;
+  for (uint32_t k = 1; k <= cached_count && !refreshed; ++k) {
+    uint32_t i = first_cached + (previous + k) % cached_count;
+    if (stale(i, radii[i] * kCachedMargin)) {
+      render(i, radii[i] * kCachedMargin);
+      last_cached_ = i;
+      refreshed = true;
+    }
+  }
+  if (refreshed) {
+    ++stats_.cached_renders;
+  }
+
+  for (uint32_t i = 0; i < cascade_count_; ++i) {
+    cascades_[i].rendered = true;
+    matrices_[i] = Matrix(cascades_[i], view.camera_position);
+    data.cascades[i] = matrices_[i];
+    data.texel_sizes[i] = static_cast<float>(
+        2.0 * cascades_[i].radius / create_info_.resolution);
+  }
+  data.params = glm::vec4(static_cast<float>(cascade_count_),
+                          1.0f / static_cast<float>(create_info_.resolution),
+                          static_cast<float>(far_distance),
+                          static_cast<float>(far_distance) * kFadeStart);
+  return data;
+}
+
+ShadowMaps::Cascade ShadowMaps::Fit(const View &view,
+                                    const glm::dvec3 &center,
+                                    double radius) const {
+  Cascade cascade;
+  cascade.rendered = true;
+  cascade.radius = radius;
+  cascade.forward = glm::normalize(glm::dvec3(view.sun_direction));
+  glm::dvec3 reference = std::abs(cascade.forward.y) < 0.99
+                             ? glm::dvec3(0.0, 1.0, 0.0)
+                             : glm::dvec3(1.0, 0.0, 0.0);
+  cascade.right = glm::normalize(glm::cross(reference, cascade.forward));
+  cascade.up = glm::cross(cascade.forward, cascade.right);
+
+  // Whole texels across the map, along the sun it does not matter.
+  double texel = 2.0 * radius / create_info_.resolution;
+  double x = std::floor(glm::dot(center, cascade.right) / texel) * texel;
+  double y = std::floor(glm::dot(center, cascade.up) / texel) * texel;
+  cascade.center = cascade.right * x + cascade.up * y +
+                   cascade.forward * glm::dot(center, cascade.forward);
+
+  // Terrain up to the height range above the slice casts onto it from as
+  // far along the sun as that height takes at the sun's elevation.
+  const Terrain &terrain = *create_info_.terrain;
+  double sun_sine =
+      std::max(glm::dot(cascade.forward, glm::normalize(cascade.center)),
+               kMinSunSine);
+  cascade.depth_back = radius;
+  cascade.depth_front =
+      radius + (terrain.MaxHeight() - terrain.MinHeight()) / sun_sine;
+  return cascade;
+}
+
+glm::mat4 ShadowMaps::Matrix(const Cascade &cascade,
+                             const glm::dvec3 &camera_position) {
+  // Rebased to the camera in double precision, the offset from the camera to
+  // the map's centre is small enough for float.
+  glm::dvec3 offset = camera_position - cascade.center;
+  double inverse_radius = 1.0 / cascade.radius;
+  double depth = cascade.depth_front + cascade.depth_back;
+  glm::dmat4 m(0.0);
+  for (int axis = 0; axis < 3; ++axis) {
+    m[axis][0] = cascade.right[axis] * inverse_radius;
+    m[axis][1] = cascade.up[axis] * inverse_radius;
+    m[axis][2] = -cascade.forward[axis] / depth;
+  }
+  m[3][0] = glm::dot(offset, cascade.right) * inverse_radius;
+  m[3][1] = glm::dot(offset, cascade.up) * inverse_radius;
+  m[3][2] = (cascade.depth_front - glm::dot(offset, cascade.forward)) / depth;
+  m[3][3] = 1.0;
+  return glm::mat4(m);
+}
+
+void ShadowMaps::Record(VkCommandBuffer command_buffer, uint32_t frame,
+                        uint32_t uniform_offset) {
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image_;
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+  if (cascade_count_ == 0) {
+    // The placeholder only has to be in the layout the descriptors expect.
+    if (!laid_out_) {
+      barrier.srcAccessMask = 0;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0,
+                           nullptr, 0, nullptr, 1, &barrier);
+      laid_out_ = true;
+    }
+    return;
+  }
+  if (stats_.rendered_mask == 0) {
+    return;
+  }
+  const Terrain &terrain = *create_info_.terrain;
+  const uint32_t chunk_count = terrain.ChunkCount(frame);
+  auto bind_set = [&](VkPipelineBindPoint bind_point,
+                      VkPipelineLayout layout, uint32_t cascade) {
+    // In binding order: the ShadowGpuData, chunks, draws and draw count.
+    std::array<uint32_t, 4> offsets = {uniform_offset,
+                                       terrain.ChunkBufferOffset(frame),
+                                       DrawRegionOffset(frame, cascade),
+                                       CountRegionOffset(frame, cascade)};
+    vkCmdBindDescriptorSets(command_buffer, bind_point, layout, 0, 1, &set_,
+                            static_cast<uint32_t>(offsets.size()),
+                            offsets.data());
+  };
+
+  VkBufferMemoryBarrier count_barrier{};
+  count_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  count_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  count_barrier.dstAccessMask =
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  count_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  count_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  count_barrier.buffer = count_buffer_;
+  count_barrier.offset = CountRegionOffset(frame, 0);
+  count_barrier.size = CountRegionOffset(frame + 1, 0) - count_barrier.offset;
+  for (uint32_t i = 0; i < cascade_count_; ++i) {
+    if (stats_.rendered_mask & (1u << i)) {
+      vkCmdFillBuffer(command_buffer, count_buffer_,
+                      CountRegionOffset(frame, i), sizeof(uint32_t), 0);
+    }
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1,
+                       &count_barrier, 0, nullptr);
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    cull_pipeline_);
+  for (uint32_t i = 0; i < cascade_count_; ++i) {
+    if (!(stats_.rendered_mask & (1u << i))) {
+      continue;
+    }
+    bind_set(VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline_layout_, i);
+    ShadowCullPushConstants cull{};
+    BoxPlanes(matrices_[i], cull.planes);
+    cull.chunk_count = chunk_count;
+    vkCmdPushConstants(command_buffer, cull_pipeline_layout_,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(cull), &cull);
+    vkCmdDispatch(command_buffer,
+                  (chunk_count + kCullGroupSize - 1) / kCullGroupSize, 1, 1);
+  }
+
+  // The draws for the indirect commands, and the layers for the depth
+  // writes after the previous frames' reads. Their contents are cleared.
+  std::array<VkBufferMemoryBarrier, 2> indirect_barriers{count_barrier,
+                                                         count_barrier};
+  for (VkBufferMemoryBarrier &indirect_barrier : indirect_barriers) {
+    indirect_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    indirect_barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  }
+  indirect_barriers[1].buffer = draw_buffer_;
+  indirect_barriers[1].offset = DrawRegionOffset(frame, 0);
+  indirect_barriers[1].size =
+      DrawRegionOffset(frame + 1, 0) - indirect_barriers[1].offset;
+  std::vector<VkImageMemoryBarrier> layer_barriers;
+  for (uint32_t i = 0; i < cascade_count_; ++i) {
+    if (stats_.rendered_mask & (1u << i)) {
+      barrier.srcAccessMask = 0;
+      barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                              VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+      barrier.subresourceRange.baseArrayLayer = i;
+      layer_barriers.push_back(barrier);
+    }
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 0, nullptr,
+                       static_cast<uint32_t>(indirect_barriers.size()),
+                       indirect_barriers.data(), 0, nullptr);
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                           VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                       0, 0, nullptr, 0, nullptr,
+                       static_cast<uint32_t>(layer_barriers.size()),
+                       layer_barriers.data());
+
+  const VkExtent2D extent = {create_info_.resolution, create_info_.resolution};
+  for (uint32_t i = 0; i < cascade_count_; ++i) {
+    if (!(stats_.rendered_mask & (1u << i))) {
+      continue;
+    }
+    VkClearValue clear_value{};
+    clear_value.depthStencil = {1.0f, 0};
+    if (create_info_.dynamic_rendering) {
+      VkRenderingAttachmentInfo depth_attachment{};
+      depth_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+      depth_attachment.imageView = layer_views_[i];
+      depth_attachment.imageLayout =
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+      depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+      depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+      depth_attachment.clearValue = clear_value;
+      VkRenderingInfo rendering_info{};
+      rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+      rendering_info.renderArea.extent = extent;
+      rendering_info.layerCount = 1;
+      rendering_info.pDepthAttachment = &depth_attachment;
+      vkCmdBeginRendering(command_buffer, &rendering_info);
+    } else {
+      VkRenderPassBeginInfo render_pass_info{};
+      render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+      render_pass_info.renderPass = render_pass_;
+      render_pass_info.framebuffer = framebuffers_[i];
+      render_pass_info.renderArea.extent = extent;
+      render_pass_info.clearValueCount = 1;
+      render_pass_info.pClearValues = &clear_value;
+      vkCmdBeginRenderPass(command_buffer, &render_pass_info,
+                           VK_SUBPASS_CONTENTS_INLINE);
+    }
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      pipeline_);
+    VkViewport viewport{};
+    viewport.width = static_cast<float>(extent.width);
+    viewport.height = static_cast<float>(extent.height);
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+    VkRect2D scissor{};
+    scissor.extent = extent;
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+    bind_set(VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, i);
+    vkCmdPushConstants(command_buffer, pipeline_layout_,
+                       VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(uint32_t), &i);
+    if (chunk_count > 0) {
+      terrain.BindMesh(command_buffer);
+      vkCmdDrawIndexedIndirectCount(
+          command_buffer, draw_buffer_, DrawRegionOffset(frame, i),
+          count_buffer_, CountRegionOffset(frame, i), chunk_count,
+          sizeof(VkDrawIndexedIndirectCommand));
+    }
+
+    if (create_info_.dynamic_rendering) {
+      vkCmdEndRendering(command_buffer);
+    } else {
+      vkCmdEndRenderPass(command_buffer);
+    }
+  }
+
+  for (VkImageMemoryBarrier &layer_barrier : layer_barriers) {
+    layer_barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    layer_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    layer_barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    layer_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  }
+  vkCmdPipelineBarrier(command_buffer,
+                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0,
+                       nullptr, static_cast<uint32_t>(layer_barriers.size()),
+                       layer_barriers.data());
+}
+
+bool ShadowMaps::ReloadShaders(const std::vector<char> &vertex_shader_code,
+                               const std::vector<char> &cull_shader_code) {
+  VkPipeline pipeline;
+  VkPipeline cull_pipeline;
+  if (!CreatePipelines(vertex_shader_code, cull_shader_code, pipeline,
+                       cull_pipeline)) {
+    return false;
+  }
+  defer_destroy_([device = device_, old_pipeline = pipeline_,
+                  old_cull_pipeline = cull_pipeline_]() {
+    vkDestroyPipeline(device, old_pipeline, nullptr);
+    vkDestroyPipeline(device, old_cull_pipeline, nullptr);
+  });
+  pipeline_ = pipeline;
+  cull_pipeline_ = cull_pipeline;
+  return true;
+}
+
+uint32_t ShadowMaps::DrawRegionOffset(uint32_t frame,
+                                      uint32_t cascade) const {
+  return AlignedRegion(create_info_.terrain->DrawBufferSize(),
+                       frame * kMaxShadowCascades + cascade);
+}
+
+uint32_t ShadowMaps::CountRegionOffset(uint32_t frame,
+                                       uint32_t cascade) const {
+  return AlignedRegion(sizeof(uint32_t), frame * kMaxShadowCascades + cascade);
+}
+
+bool ShadowMaps::CreateImage() {
+  // Linear filtering of a comparing sampler blends four compares, which
+  // softens the edges for free where the format supports it.
+  const VkFormatFeatureFlags required =
+      VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT |
+      VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+  bool linear = false;
+  for (VkFormat candidate : {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D16_UNORM}) {
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(create_info_.physical_device,
+                                        candidate, &properties);
+    if ((properties.optimalTilingFeatures & required) == required) {
+      format_ = candidate;
+      linear = (properties.optimalTilingFeatures &
+                VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) != 0;
+      break;
+    }
+  }
+  if (format_ == VK_FORMAT_UNDEFINED) {
+    spdlog::error("No sampleable depth format for the shadow maps.");
+    return false;
+  }
+
+  VkImageCreateInfo image_info{};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = format_;
+  image_info.extent = {create_info_.resolution, create_info_.resolution, 1};
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = layer_count_;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                     VK_IMAGE_USAGE_SAMPLED_BIT;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  if (vkCreateImage(device_, &image_info, nullptr, &image_) != VK_SUCCESS) {
+    spdlog::error("Failed to create shadow map image.");
+    return false;
+  }
+  std::optional<GpuAllocation> allocation =
+      create_info_.allocator->AllocateForImage(
+          image_, VK_IMAGE_TILING_OPTIMAL, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+          true);
+  if (!allocation) {
+    spdlog::error("Failed to allocate shadow map memory.");
+    vkDestroyImage(device_, image_, nullptr);
+    image_ = VK_NULL_HANDLE;
+    return false;
+  }
+  image_allocation_ = *allocation;
+
+  VkImageViewCreateInfo view_info{};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = image_;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+  view_info.format = format_;
+  view_info.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0,
+                                layer_count_};
+  if (vkCreateImageView(device_, &view_info, nullptr, &array_view_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create shadow map view.");
+    return false;
+  }
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.subresourceRange.layerCount = 1;
+  for (uint32_t layer = 0; layer < layer_count_; ++layer) {
+    view_info.subresourceRange.baseArrayLayer = layer;
+    VkImageView view;
+    if (vkCreateImageView(device_, &view_info, nullptr, &view) !=
+        VK_SUCCESS) {
+      spdlog::error("Failed to create shadow map layer view.");
+      return false;
+    }
+    layer_views_.push_back(view);
+  }
+
+  // Depth 0 is towards the sun, a fragment is lit if it is no farther than
+  // what the map holds. Outside the map is lit.
+  VkSamplerCreateInfo sampler_info{};
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = linear ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+  sampler_info.minFilter = sampler_info.magFilter;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+  sampler_info.compareEnable = VK_TRUE;
+  sampler_info.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+  if (vkCreateSampler(device_, &sampler_info, nullptr, &sampler_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create shadow map sampler.");
+    return false;
+  }
+  return true;
+}
+
+bool ShadowMaps::CreateRenderPass() {
+  // The layers are transitioned by Record(), the pass keeps their layout.
+  VkAttachmentDescription depth_attachment{};
+  depth_attachment.format = format_;
+  depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  depth_attachment.initialLayout =
+      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  depth_attachment.finalLayout =
+      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  VkAttachmentReference depth_attachment_ref{};
+  depth_attachment_ref.attachment = 0;
+  depth_attachment_ref.layout =
+      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  VkSubpassDescription subpass{};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.pDepthStencilAttachment = &depth_attachment_ref;
+  VkRenderPassCreateInfo render_pass_info{};
+  render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  render_pass_info.attachmentCount = 1;
+  render_pass_info.pAttachments = &depth_attachment;
+  render_pass_info.subpassCount = 1;
+  render_pass_info.pSubpasses = &subpass;
+  if (vkCreateRenderPass(device_, &render_pass_info, nullptr,
+                         &render_pass_) != VK_SUCCESS) {
+    spdlog::error("Failed to create shadow render pass.");
+    return false;
+  }
+
+  for (VkImageView view : layer_views_) {
+    VkFramebufferCreateInfo framebuffer_info{};
+    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_info.renderPass = render_pass_;
+    framebuffer_info.attachmentCount = 1;
+    framebuffer_info.pAttachments = &view;
+    framebuffer_info.width = create_info_.resolution;
+    framebuffer_info.height = create_info_.resolution;
+    framebuffer_info.layers = 1;
+    VkFramebuffer framebuffer;
+    if (vkCreateFramebuffer(device_, &framebuffer_info, nullptr,
+                            &framebuffer) != VK_SUCCESS) {
+      spdlog::error("Failed to create shadow framebuffer.");
+      return false;
+    }
+    framebuffers_.push_back(framebuffer);
+  }
+  return true;
+}
+
+bool ShadowMaps::CreateDescriptorSet() {
+  std::array<VkDescriptorSetLayoutBinding, 4> bindings{};
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  bindings[1] = bindings[0];
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  bindings[1].stageFlags =
+      VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[2] = bindings[1];
+  bindings[2].binding = 2;
+  bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[3] = bindings[2];
+  bindings[3].binding = 3;
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+  layout_info.pBindings = bindings.data();
+  if (vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
+                                  &set_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create shadow descriptor set layout.");
+    return false;
+  }
+
+  std::array<VkDescriptorPoolSize, 2> pool_sizes{};
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  pool_sizes[0].descriptorCount = 1;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  pool_sizes[1].descriptorCount = 3;
+  VkDescriptorPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+  pool_info.pPoolSizes = pool_sizes.data();
+  pool_info.maxSets = 1;
+  if (vkCreateDescriptorPool(device_, &pool_info, nullptr, &pool_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create shadow descriptor pool.");
+    return false;
+  }
+  VkDescriptorSetAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.descriptorPool = pool_;
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &set_layout_;
+  if (vkAllocateDescriptorSets(device_, &allocate_info, &set_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to allocate shadow descriptor set.");
+    return false;
+  }
+
+  // Ranges are one frame's or cascade's worth, the dynamic offsets pick it.
+  const Terrain &terrain = *create_info_.terrain;
+  std::array<VkDescriptorBufferInfo, 4> buffer_infos = {{
+      {create_info_.uniform_buffer, 0, sizeof(ShadowGpuData)},
+      {terrain.ChunkBuffer(), 0, terrain.ChunkBufferSize()},
+      {draw_buffer_, 0, terrain.DrawBufferSize()},
+      {count_buffer_, 0, sizeof(uint32_t)},
+  }};
+  std::array<VkWriteDescriptorSet, 4> writes{};
+  for (uint32_t i = 0; i < writes.size(); ++i) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = set_;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = bindings[i].descriptorType;
+    writes[i].pBufferInfo = &buffer_infos[i];
+  }
+  vkUpdateDescriptorSets(device_, static_cast<uint32_t>(writes.size()),
+                         writes.data(), 0, nullptr);
+  return true;
+}
+
+bool ShadowMaps::CreatePipelines(const std::vector<char> &vertex_shader_code,
+                                 const std::vector<char> &cull_shader_code,
+                                 VkPipeline &pipeline,
+                                 VkPipeline &cull_pipeline) {
+  auto create_module = [this](const std::vector<char> &code,
+                              VkShaderModule &shader_module) {
+    VkShaderModuleCreateInfo module_info{};
+    module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_info.codeSize = code.size();
+    module_info.pCode = reinterpret_cast<const uint32_t *>(code.data());
+    return !code.empty() && vkCreateShaderModule(device_, &module_info,
+                                                 nullptr, &shader_module) ==
+                                VK_SUCCESS;
+  };
+  VkShaderModule vertex_module = VK_NULL_HANDLE;
+  VkShaderModule cull_module = VK_NULL_HANDLE;
+  if (!create_module(vertex_shader_code, vertex_module) ||
+      !create_module(cull_shader_code, cull_module)) {
+    spdlog::error("Failed to create shadow shader modules.");
+    vkDestroyShaderModule(device_, vertex_module, nullptr);
+    return false;
+  }
+
+  // Only the vertex stage, the depth is all the pass writes.
+  SpecializationConstants specialization{create_info_.grid_size};
+  VkPipelineShaderStageCreateInfo stage{};
+  stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  stage.stage = VK_SHADER_STAGE_VERTEX_BIT;
+  stage.module = vertex_module;
+  stage.pName = "main";
+  stage.pSpecializationInfo = specialization.Info();
+
+  VkVertexInputBindingDescription binding_description =
+      Vertex::GetBindingDescription();
+  VkVertexInputAttributeDescription height_attribute =
+      Vertex::GetAttributeDescriptions()[0];
+  VkPipelineVertexInputStateCreateInfo vertex_input{};
+  vertex_input.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vertex_input.vertexBindingDescriptionCount = 1;
+  vertex_input.pVertexBindingDescriptions = &binding_description;
+  vertex_input.vertexAttributeDescriptionCount = 1;
+  vertex_input.pVertexAttributeDescriptions = &height_attribute;
+
+  VkPipelineInputAssemblyStateCreateInfo input_assembly{};
+  input_assembly.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+  VkPipelineViewportStateCreateInfo viewport_state{};
+  viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewport_state.viewportCount = 1;
+  viewport_state.scissorCount = 1;
+
+  // Both sides, ground seen edge on from the sun casts either way. The bias
+  // grows with the slope, the fragment shader's normal offset does the rest.
+  VkPipelineRasterizationStateCreateInfo rasterizer{};
+  rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+  rasterizer.cullMode = VK_CULL_MODE_NONE;
+  rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  rasterizer.depthBiasEnable = VK_TRUE;
+  rasterizer.depthBiasConstantFactor = 1.0f;
+  rasterizer.depthBiasSlopeFactor = 1.5f;
+  rasterizer.lineWidth = 1.0f;
+
+  VkPipelineMultisampleStateCreateInfo multisampling{};
+  multisampling.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  VkPipelineDepthStencilStateCreateInfo depth_stencil{};
+  depth_stencil.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  depth_stencil.depthTestEnable = VK_TRUE;
+  depth_stencil.depthWriteEnable = VK_TRUE;
+  depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+  depth_stencil.maxDepthBounds = 1.0f;
+
+  VkPipelineColorBlendStateCreateInfo color_blending{};
+  color_blending.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+
+  std::array<VkDynamicState, 2> dynamic_states = {VK_DYNAMIC_STATE_VIEWPORT,
+                                                  VK_DYNAMIC_STATE_SCISSOR};
+  VkPipelineDynamicStateCreateInfo dynamic_state{};
+  dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamic_state.dynamicStateCount =
+      static_cast<uint32_t>(dynamic_states.size());
+  dynamic_state.pDynamicStates = dynamic_states.data();
+
+  VkPipelineRenderingCreateInfo rendering_info{};
+  rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+  rendering_info.depthAttachmentFormat = format_;
+
+  VkGraphicsPipelineCreateInfo pipeline_info{};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  if (create_info_.dynamic_rendering) {
+    pipeline_info.pNext = &rendering_info;
+  }
+  pipeline_info.stageCount = 1;
+  pipeline_info.pStages = &stage;
+  pipeline_info.pVertexInputState = &vertex_input;
+  pipeline_info.pInputAssemblyState = &input_assembly;
+  pipeline_info.pViewportState = &viewport_state;
+  pipeline_info.pRasterizationState = &rasterizer;
+  pipeline_info.pMultisampleState = &multisampling;
+  pipeline_info.pDepthStencilState = &depth_stencil;
+  pipeline_info.pColorBlendState = &color_blending;
+  pipeline_info.pDynamicState = &dynamic_state;
+  pipeline_info.layout = pipeline_layout_;
+  pipeline_info.renderPass = render_pass_;
+  VkResult result = vkCreateGraphicsPipelines(
+      device_, create_info_.pipeline_cache, 1, &pipeline_info, nullptr,
+      &pipeline);
+  vkDestroyShaderModule(device_, vertex_module, nullptr);
+  if (result != VK_SUCCESS) {
+    vkDestroyShaderModule(device_, cull_module, nullptr);
+    spdlog::error("Failed to create shadow pipeline.");
+    return false;
+  }
+
+  VkComputePipelineCreateInfo cull_pipeline_info{};
+  cull_pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  cull_pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  cull_pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  cull_pipeline_info.stage.module = cull_module;
+  cull_pipeline_info.stage.pName = "main";
+  cull_pipeline_info.layout = cull_pipeline_layout_;
+  result = vkCreateComputePipelines(device_, create_info_.pipeline_cache, 1,
+                                    &cull_pipeline_info, nullptr,
+                                    &cull_pipeline);
+  vkDestroyShaderModule(device_, cull_module, nullptr);
+  if (result != VK_SUCCESS) {
+    vkDestroyPipeline(device_, pipeline, nullptr);
+    spdlog::error("Failed to create shadow cull pipeline.");
+    return false;
+  }
+  return true;
+}
+
+bool ShadowMaps::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                              VkBuffer &buffer, GpuAllocation &allocation) {
+  VkBufferCreateInfo buffer_info{};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = size;
+  buffer_info.usage = usage;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  if (vkCreateBuffer(device_, &buffer_info, nullptr, &buffer) !=
+      VK_SUCCESS) {
+    return false;
+  }
+  std::optional<GpuAllocation> buffer_allocation =
+      create_info_.allocator->AllocateForBuffer(
+          buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  if (!buffer_allocation) {
+    vkDestroyBuffer(device_, buffer, nullptr);
+    buffer = VK_NULL_HANDLE;
+    return false;
+  }
+  allocation = *buffer_allocation;
+  return true;
+}
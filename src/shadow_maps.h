@@ -0,0 +1,221 @@
+#pragma once
+
+#include "gpu_allocator.h"
+#include "terrain.h"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <glm/glm.hpp>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+constexpr uint32_t kMaxShadowCascades = 4;
+
+// Layout of the ShadowUniforms block of shaders/shadow.vert and
+// shaders/shader.frag, std140. Pushed into the uniform arena every frame.
+struct ShadowGpuData {
+  // Camera relative positions to each cascade's light space: xy in [-1, 1]
+  // across the map, z the depth in [0, 1], 0 towards the sun.
+  glm::mat4 cascades[kMaxShadowCascades];
+  // World size of a texel of each cascade.
+  glm::vec4 texel_sizes;
+  // x: cascades, 0 without shadows, y: 1 / resolution, z: distance from the
+  // camera where the shadows end, w: where they start to fade out.
+  glm::vec4 params;
+};
+static_assert(sizeof(ShadowGpuData) == 288,
+              "ShadowGpuData has to match the shaders' std140 layout");
+
+// Push constants of shaders/shadow_cull.comp, camera relative.
+struct ShadowCullPushConstants {
+  // Of the cascade's light box, normalized, with the inside where
+  // dot(plane.xyz, p) + plane.w >= 0.
+  glm::vec4 planes[6];
+  uint32_t chunk_count;
+};
+static_assert(sizeof(ShadowCullPushConstants) <= 128,
+              "Vulkan only guarantees 128 bytes of push constants.");
+
+// Cascaded shadow maps of the sunlight on the terrain, one layer of a depth
+// array image per cascade. The cascades split the view from the near plane to
+// the shadow distance, which ends at the horizon over the highest terrain,
+// with the practical split scheme, and each one's map covers the bounding
+// sphere of its slice, so its size does not change as the camera turns. The
+// centre moves in whole texels along the map, which keeps the edges of the
+// shadows from crawling.
+//
+// The light box reaches past the slice towards the sun as far as terrain
+// between the lowest and the highest height can cast onto it for the sun's
+// elevation there, so mountains off screen still cast.
+//
+// The first CreateInfo::dynamic_cascades cascades follow the camera every
+// frame. The rest are cached: they cover a sphere a bit larger than their
+// slice and keep their map until the sun turns, the slice moves out of it or
+// the terrain selection changed some frames ago, and only one of them is
+// rendered again per frame, round robin, so the distant cascades cost next to
+// nothing while the camera flies. A cascade whose map lags behind simply
+// does not cover every fragment of its slice for a few frames, the fragment
+// shader then falls back to the next one.
+//
+// Every cascade that is rendered culls the terrain chunks against its light
+// box with shaders/shadow_cull.comp into its own indirect draws and draws
+// them depth only with shaders/shadow.vert, from the terrain's chunk buffer
+// and mesh buffer.
+//
+// The maps are shared by all frames in flight, which use them in the order
+// they are submitted to the graphics queue. The draw buffers have a part per
+// frame.
+//
+// Render thread only.
+class ShadowMaps {
+public:
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+    GpuAllocator *allocator = nullptr;
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    // SPIR-V of shaders/shadow.vert and shaders/shadow_cull.comp.
+    std::vector<char> vertex_shader_code;
+    std::vector<char> cull_shader_code;
+    // Has to outlive the shadow maps. Its chunk and mesh buffers are drawn.
+    const Terrain *terrain = nullptr;
+    uint32_t grid_size = 33;
+    // UniformArena::Buffer(), the frame's ShadowGpuData is bound at a
+    // dynamic offset into it.
+    VkBuffer uniform_buffer = VK_NULL_HANDLE;
+    uint32_t frames_in_flight = 2;
+    // Up to kMaxShadowCascades, 0 turns the shadows off and leaves a single
+    // placeholder layer for the descriptors.
+    uint32_t cascade_count = 4;
+    // Texels along each side of every map.
+    uint32_t resolution = 2048;
+    // Cascades rendered every frame, the nearest ones.
+    uint32_t dynamic_cascades = 2;
+    // Metres, shadows end here or at the horizon, whichever is nearer.
+    double max_distance = 20000.0;
+    // Renders without a VkRenderPass, like the main pass.
+    bool dynamic_rendering = true;
+    // Destroys a GPU resource once the frames using it have retired.
+    std::function<void(std::function<void()> &&)> defer_destroy;
+  };
+
+  struct View {
+    // In world units from the planet's centre, metres.
+    glm::dvec3 camera_position{0.0};
+    glm::dvec3 camera_forward{0.0, 0.0, -1.0};
+    float fov_y = 0.785f;
+    float aspect = 1.0f;
+    float near_plane = 0.1f;
+    // World space, towards the sun.
+    glm::vec3 sun_direction{0.0f, 1.0f, 0.0f};
+    double planet_radius = 6371000.0;
+  };
+
+  struct Stats {
+    // Bit i is set if cascade i is rendered this frame.
+    uint32_t rendered_mask = 0;
+    // Cached cascade renders since Init().
+    uint64_t cached_renders = 0;
+    float distance = 0.0f;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  // The device has to be idle.
+  void Destroy();
+
+  // Fits the cascades to the view, decides which cascades are rendered this
+  // frame and returns the frame's uniform data.
+  ShadowGpuData Update(const View &view);
+  // Culls and renders this frame's cascades with the frame's chunk buffer
+  // and the ShadowGpuData at `uniform_offset`, outside a render pass, and
+  // leaves the maps readable by fragment shaders.
+  void Record(VkCommandBuffer command_buffer, uint32_t frame,
+              uint32_t uniform_offset);
+  bool ReloadShaders(const std::vector<char> &vertex_shader_code,
+                     const std::vector<char> &cull_shader_code);
+
+  // All layers as a 2D array in SHADER_READ_ONLY_OPTIMAL and a comparing
+  // sampler for it, for sampler2DArrayShadow.
+  VkImageView View() const { return array_view_; }
+  VkSampler Sampler() const { return sampler_; }
+  uint32_t CascadeCount() const { return cascade_count_; }
+  uint32_t Resolution() const { return create_info_.resolution; }
+  const Stats &GetStats() const { return stats_; }
+
+private:
+  // Where a cascade's map was rendered from, world space.
+  struct Cascade {
+    bool rendered = false;
+    glm::dvec3 center{0.0};
+    double radius = 0.0;
+    // Light space axes, `forward` towards the sun.
+    glm::dvec3 right{1.0, 0.0, 0.0};
+    glm::dvec3 up{0.0, 1.0, 0.0};
+    glm::dvec3 forward{0.0, 0.0, 1.0};
+    // How far the box reaches towards the sun and away from it.
+    double depth_front = 0.0;
+    double depth_back = 0.0;
+    uint64_t selection_version = 0;
+    uint64_t rendered_frame = 0;
+  };
+
+  bool CreateImage();
+  bool CreateRenderPass();
+  bool CreateDescriptorSet();
+  bool CreatePipelines(const std::vector<char> &vertex_shader_code,
+                       const std::vector<char> &cull_shader_code,
+                       VkPipeline &pipeline, VkPipeline &cull_pipeline);
+  bool CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                    VkBuffer &buffer, GpuAllocation &allocation);
+  // The cascade centred on `center` with `radius` for the sun of `view`.
+  Cascade Fit(const View &view, const glm::dvec3 &center,
+              double radius) const;
+  // Camera relative positions to the cascade's light space.
+  static glm::mat4 Matrix(const Cascade &cascade,
+                          const glm::dvec3 &camera_position);
+  // Region of a frame and cascade in the draw and count buffers.
+  uint32_t DrawRegionOffset(uint32_t frame, uint32_t cascade) const;
+  uint32_t CountRegionOffset(uint32_t frame, uint32_t cascade) const;
+
+  CreateInfo create_info_;
+  VkDevice device_ = VK_NULL_HANDLE;
+  // Of the image, at least one.
+  uint32_t layer_count_ = 1;
+  uint32_t cascade_count_ = 0;
+  std::function<void(std::function<void()> &&)> defer_destroy_;
+
+  VkFormat format_ = VK_FORMAT_UNDEFINED;
+  VkImage image_ = VK_NULL_HANDLE;
+  GpuAllocation image_allocation_;
+  VkImageView array_view_ = VK_NULL_HANDLE;
+  std::vector<VkImageView> layer_views_;
+  VkSampler sampler_ = VK_NULL_HANDLE;
+  // Only without dynamic rendering, one framebuffer per layer.
+  VkRenderPass render_pass_ = VK_NULL_HANDLE;
+  std::vector<VkFramebuffer> framebuffers_;
+
+  // Of every frame in flight and cascade.
+  VkBuffer draw_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation draw_allocation_;
+  VkBuffer count_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation count_allocation_;
+
+  // Binding 0 the ShadowGpuData, binding 1 the chunks, binding 2 the
+  // cascade's draws and binding 3 its draw count, all at dynamic offsets.
+  VkDescriptorSetLayout set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorPool pool_ = VK_NULL_HANDLE;
+  VkDescriptorSet set_ = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout cull_pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline pipeline_ = VK_NULL_HANDLE;
+  VkPipeline cull_pipeline_ = VK_NULL_HANDLE;
+
+  std::array<Cascade, kMaxShadowCascades> cascades_{};
+  // The frame's camera relative light boxes.
+  std::array<glm::mat4, kMaxShadowCascades> matrices_{};
+  // The cached cascade rendered last, where the round robin goes on.
+  uint32_t last_cached_ = 0;
+  bool laid_out_ = false;
+  uint64_t frame_ = 0;
+  Stats stats_;
+};
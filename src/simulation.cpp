@@ -0,0 +1,157 @@
+#include "simulation.h"
+#include <algorithm>
+#include <cmath>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// a + (b - a) * t, exactly a where they are equal.
+glm::dvec3 Lerp(const glm::dvec3 &a, const glm::dvec3 &b, double t) {
+  return a + (b - a) * t;
+}
+
+} // namespace
+
+bool Simulation::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  if (!create_info_.camera_path) {
+    spdlog::error("Simulation needs a camera path.");
+    return false;
+  }
+  create_info_.tick_rate = std::clamp(create_info_.tick_rate, 1.0, 1000.0);
+  tick_length_ = std::chrono::duration<double>(1.0 / create_info_.tick_rate);
+
+  state_ = SimulationState{};
+  state_.sun_direction = glm::normalize(create_info_.sun_direction);
+  create_info_.camera_path->Apply(0.0, state_.camera);
+  FrameSnapshot snapshot{state_, state_, std::chrono::steady_clock::now()};
+  snapshots_.Reset(snapshot);
+  SimulationInput input{};
+  input.sun_direction = state_.sun_direction;
+  inputs_.Reset(input);
+  spdlog::info("Simulation: {:.0f} ticks per second.", create_info_.tick_rate);
+  return true;
+}
+
+void Simulation::Destroy() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void Simulation::Start() {
+  if (thread_.joinable()) {
+    return;
+  }
+  // The snapshot of time 0 is due now, the first tick one tick later.
+  due_ = std::chrono::steady_clock::now();
+  FrameSnapshot snapshot{state_, state_, due_};
+  snapshots_.Reset(snapshot);
+  stop_ = false;
+  thread_ = std::thread(&Simulation::Loop, this);
+}
+
+SimulationState
+Simulation::Sample(std::chrono::steady_clock::time_point time) {
+  snapshots_.Update();
+  const FrameSnapshot &snapshot = snapshots_.Front();
+  double t = std::chrono::duration<double>(time - snapshot.due) / tick_length_;
+  if (t >= 1.0) {
+    return snapshot.current;
+  }
+  t = std::max(t, 0.0);
+
+  const SimulationState &a = snapshot.previous;
+  const SimulationState &b = snapshot.current;
+  SimulationState state = b;
+  state.time = a.time + (b.time - a.time) * t;
+  state.camera.position = Lerp(a.camera.position, b.camera.position, t);
+  state.camera.forward =
+      glm::normalize(Lerp(a.camera.forward, b.camera.forward, t));
+  state.camera.up = glm::normalize(Lerp(a.camera.up, b.camera.up, t));
+  state.camera.fov_y = a.camera.fov_y + (b.camera.fov_y - a.camera.fov_y) *
+                                           static_cast<float>(t);
+  // Kept exactly while it does not turn, the atmosphere rebuilds its LUTs
+  // when it changes.
+  if (a.sun_direction != b.sun_direction) {
+    state.sun_direction = glm::normalize(
+        a.sun_direction +
+        (b.sun_direction - a.sun_direction) * static_cast<float>(t));
+  }
+  return state;
+}
+
+void Simulation::RequestSun(const glm::vec3 &direction) {
+  inputs_.Back().sun_direction = glm::normalize(direction);
+  inputs_.Publish();
+}
+
+Simulation::Stats Simulation::GetStats() const {
+  Stats stats;
+  stats.ticks = ticks_.load(std::memory_order_relaxed);
+  stats.skipped_ticks = skipped_ticks_.load(std::memory_order_relaxed);
+  stats.tick_ms = tick_ms_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void Simulation::Loop() {
+  auto tick_length =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          tick_length_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    if (wake_.wait_until(lock, due_ + tick_length, [this] { return stop_; })) {
+      break;
+    }
+    lock.unlock();
+
+    auto now = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < kMaxCatchUpTicks && due_ + tick_length <= now;
+         ++i) {
+      auto tick_start = std::chrono::steady_clock::now();
+      // The newest input only, on the tick's start, so the UI's change shows
+      // with the next snapshot.
+      if (inputs_.Update()) {
+        state_.sun_direction = inputs_.Front().sun_direction;
+      }
+      due_ += tick_length;
+      FrameSnapshot &snapshot = snapshots_.Back();
+      snapshot.previous = state_;
+      state_ = Step(state_);
+      snapshot.current = state_;
+      snapshot.due = due_;
+      snapshots_.Publish();
+
+      ticks_.fetch_add(1, std::memory_order_relaxed);
+      tick_ms_.store(std::chrono::duration<float, std::milli>(
+                         std::chrono::steady_clock::now() - tick_start)
+                         .count(),
+                     std::memory_order_relaxed);
+    }
+    if (due_ + tick_length <= now) {
+      auto behind = (now - due_) / tick_length;
+      due_ += behind * tick_length;
+      skipped_ticks_.fetch_add(static_cast<uint64_t>(behind),
+                               std::memory_order_relaxed);
+    }
+
+    lock.lock();
+  }
+}
+
+SimulationState Simulation::Step(const SimulationState &state) const {
+  SimulationState next = state;
+  next.tick = state.tick + 1;
+  next.time = static_cast<double>(next.tick) / create_info_.tick_rate;
+  // The flight goes back and forth along the camera path.
+  double duration = std::max(create_info_.camera_path->Duration(), 1.0);
+  double path_time =
+      duration - std::abs(std::fmod(next.time, 2.0 * duration) - duration);
+  create_info_.camera_path->Apply(path_time, next.camera);
+  return next;
+}
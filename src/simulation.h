@@ -0,0 +1,115 @@
+#pragma once
+
+#include "camera.h"
+#include "camera_path.h"
+#include "triple_buffer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <mutex>
+#include <thread>
+
+// Everything the renderer needs from one simulation tick.
+struct SimulationState {
+  uint64_t tick = 0;
+  // Simulated seconds, tick / tick rate.
+  double time = 0.0;
+  // Along the camera path. The terrain selects its chunks for this camera.
+  Camera camera;
+  // World space, towards the sun.
+  glm::vec3 sun_direction{0.0f, 1.0f, 0.0f};
+};
+
+// The last two ticks, immutable once published. The renderer interpolates
+// between them, one tick behind the simulation.
+struct FrameSnapshot {
+  SimulationState previous;
+  SimulationState current;
+  // When `current` was due. The renderer reaches it one tick later.
+  std::chrono::steady_clock::time_point due;
+};
+
+// Requests from the render thread's UI, the newest one wins.
+struct SimulationInput {
+  glm::vec3 sun_direction{0.0f, 1.0f, 0.0f};
+};
+
+// Fixed time step simulation on its own thread, so a slow tick never holds
+// up a frame and a slow frame never slows down the simulation. Each tick
+// flies the camera back and forth along the camera path and applies the
+// newest input, then publishes a FrameSnapshot through a triple buffer. The
+// render thread samples the newest snapshot every frame, interpolated to
+// the frame's time, at whatever rate it renders.
+//
+// A thread that falls behind catches up with up to kMaxCatchUpTicks ticks at
+// once and skips the rest, the simulated time then lags behind the clock
+// instead of spiralling further behind.
+//
+// Init(), Start() and Destroy() on the render thread, as are Sample() and
+// RequestSun(), the other end of the triple buffers.
+class Simulation {
+public:
+  struct CreateInfo {
+    // Has to outlive the simulation.
+    const CameraPath *camera_path = nullptr;
+    // Ticks per second, clamped to [1, 1000].
+    double tick_rate = 60.0;
+    glm::vec3 sun_direction{0.0f, 1.0f, 0.0f};
+  };
+
+  struct Stats {
+    uint64_t ticks = 0;
+    // Ticks skipped because the thread fell too far behind.
+    uint64_t skipped_ticks = 0;
+    // Of the newest tick.
+    float tick_ms = 0.0f;
+  };
+
+  static constexpr uint32_t kMaxCatchUpTicks = 8;
+
+  // Publishes the state at time 0 and does not start the thread yet.
+  bool Init(const CreateInfo &create_info);
+  // Stops the thread if it runs.
+  void Destroy();
+
+  // Starts ticking from time 0, now.
+  void Start();
+  bool Running() const { return thread_.joinable(); }
+
+  // The state at `time`, between the newest snapshot's two ticks. Holds the
+  // newest tick if the simulation stalls.
+  SimulationState Sample(std::chrono::steady_clock::time_point time);
+  // Turns the sun on the next tick.
+  void RequestSun(const glm::vec3 &direction);
+
+  double TickRate() const { return create_info_.tick_rate; }
+  Stats GetStats() const;
+
+private:
+  void Loop();
+  // The tick after `state`.
+  SimulationState Step(const SimulationState &state) const;
+
+  CreateInfo create_info_;
+  std::chrono::duration<double> tick_length_{0.0};
+
+  // Simulation thread only, after Start().
+  SimulationState state_;
+  // When state_ was due, the next tick is one tick length later.
+  std::chrono::steady_clock::time_point due_;
+
+  TripleBuffer<FrameSnapshot> snapshots_;
+  TripleBuffer<SimulationInput> inputs_;
+
+  std::atomic<uint64_t> ticks_{0};
+  std::atomic<uint64_t> skipped_ticks_{0};
+  std::atomic<float> tick_ms_{0.0f};
+
+  // Only to stop the thread, the handoff does not lock.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+  std::thread thread_;
+};
@@ -0,0 +1,1225 @@
+#include "terrain.h"
+#include "vertex.h"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// Subtrees not visited by the refinement for this many frames are dropped.
+constexpr uint64_t kEvictAfterFrames = 120;
+
+// Must match local_size_x in shaders/cull.comp.
+constexpr uint32_t kCullGroupSize = 64;
+
+// Frames the camera's motion is extrapolated for the tile prefetch, and the
+// weight of prefetches against the tiles the current view needs.
+constexpr double kPrefetchFrames = 30.0;
+constexpr float kPrefetchPriority = 0.5f;
+
+double MilliSecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Gribb/Hartmann plane extraction for Vulkan's [0, 1] depth range. Planes with
+// a zero normal (the far plane of an infinite projection) are left as they
+// are, their constant term is positive so they never cull anything.
+void ExtractFrustumPlanes(const glm::mat4 &m, glm::vec4 (&planes)[6]) {
+  glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+  glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+  glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+  glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+  planes[0] = row3 + row0;
+  planes[1] = row3 - row0;
+  planes[2] = row3 + row1;
+  planes[3] = row3 - row1;
+  planes[4] = row2;
+  planes[5] = row3 - row2;
+  for (glm::vec4 &plane : planes) {
+    float length = glm::length(glm::vec3(plane));
+    if (length > 0.0f) {
+      plane /= length;
+    }
+  }
+}
+
+} // namespace
+
+bool Terrain::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  create_info_.draw_groups = std::max(create_info_.draw_groups, 1u);
+  if (!create_info_.noise) {
+    spdlog::error("Terrain needs a heightfield.");
+    return false;
+  }
+  if (!ConfigureLattice()) {
+    return false;
+  }
+  min_height_ = create_info_.noise->MinHeight();
+  max_height_ = create_info_.noise->MaxHeight();
+  if (create_info_.height_tiles) {
+    const TileFile::Header &header =
+        create_info_.height_tiles->File().GetHeader();
+    if (header.format != TileFormat::kHeightFloat32 ||
+        header.tile_size != create_info_.grid_size + 2) {
+      spdlog::error("Height tiles have to be {}x{} floats, ignoring them.",
+                    create_info_.grid_size + 2, create_info_.grid_size + 2);
+      create_info_.height_tiles = nullptr;
+    } else if (header.tile_count > 0) {
+      min_height_ = std::min<double>(min_height_, header.min_value);
+      max_height_ = std::max<double>(max_height_, header.max_value);
+    }
+  }
+  if (!CreateMeshBuffer()) {
+    return false;
+  }
+
+  const uint32_t slot_count = create_info_.max_resident_chunks;
+  const VkDeviceSize vertex_count =
+      static_cast<VkDeviceSize>(VerticesPerChunk()) * slot_count;
+  if (!CreateBuffer(sizeof(float) * vertex_count,
+                    VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                        VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, height_buffer_,
+                    height_allocation_)) {
+    spdlog::error("Failed to create terrain height buffer.");
+    return false;
+  }
+  if (create_info_.generator) {
+    create_info_.generator->SetTargets(mesh_buffer_, vertex_data_offset_,
+                                       sizeof(Vertex) * vertex_count,
+                                       height_buffer_,
+                                       sizeof(float) * vertex_count);
+  }
+  // Handed out from the back, so low slots are used first.
+  free_slots_.resize(slot_count);
+  for (uint32_t i = 0; i < slot_count; ++i) {
+    free_slots_[i] = slot_count - 1 - i;
+  }
+
+  frames_.resize(create_info_.frames_in_flight);
+  const uint32_t frame_count = create_info_.frames_in_flight;
+  if (!CreateBuffer(ChunkBufferOffset(frame_count),
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                    chunk_buffer_, chunk_allocation_) ||
+      !CreateBuffer(DrawBufferOffset(frame_count, CullPhase::kAll),
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, draw_buffer_,
+                    draw_allocation_) ||
+      !CreateBuffer(CountBufferOffset(frame_count, CullPhase::kAll),
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, count_buffer_,
+                    count_allocation_) ||
+      !CreateBuffer(VisibilityBufferSize(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, visibility_buffer_,
+                    visibility_allocation_)) {
+    spdlog::error("Failed to create terrain draw buffers.");
+    return false;
+  }
+
+  // Roots are always resident, they are the fallback for the whole planet.
+  for (uint32_t face = 0; face < roots_.size(); ++face) {
+    roots_[face] = std::make_unique<Node>();
+    InitNode(*roots_[face], face, 0, 0, 0);
+    if (create_info_.height_tiles) {
+      create_info_.height_tiles->Load(TileKeyOf(*roots_[face]));
+    }
+    if (!BuildMesh(*roots_[face], 0.0f, false)) {
+      spdlog::error("Failed to build terrain root chunk for face {}.", face);
+      return false;
+    }
+  }
+  return true;
+}
+
+void Terrain::Destroy() {
+  // The builds point to the nodes.
+  if (create_info_.job_system) {
+    create_info_.job_system->Wait(build_jobs_);
+  }
+  queued_builds_.clear();
+  launched_builds_.clear();
+  // Chunk meshes only own a slot of the shared mesh buffer.
+  for (auto &root : roots_) {
+    root.reset();
+  }
+  selected_.clear();
+  selected_keys_.clear();
+  free_slots_.clear();
+
+  DestroyBuffer(chunk_buffer_, chunk_allocation_);
+  DestroyBuffer(draw_buffer_, draw_allocation_);
+  DestroyBuffer(count_buffer_, count_allocation_);
+  DestroyBuffer(visibility_buffer_, visibility_allocation_);
+  frames_.clear();
+  DestroyBuffer(mesh_buffer_, mesh_allocation_);
+  DestroyBuffer(height_buffer_, height_allocation_);
+}
+
+void Terrain::Update(uint32_t frame, const glm::dvec3 &camera_position,
+                     const glm::mat4 &view_projection,
+                     float projection_scale) {
+  ++frame_;
+  selected_.clear();
+  stats_.chunks_built = 0;
+  stats_.max_selected_level = 0;
+  stats_.chunks_waiting_for_tiles = 0;
+
+  // Only build time counts against the budget, the refinement itself has to
+  // run every frame to select what is drawn.
+  const double budget_ms = create_info_.build_budget_ms;
+  double build_ms = CollectBuilds(budget_ms);
+
+  if (frame_ == 1) {
+    last_camera_position_ = camera_position;
+  }
+  glm::dvec3 predicted_camera_position =
+      camera_position +
+      (camera_position - last_camera_position_) * kPrefetchFrames;
+  last_camera_position_ = camera_position;
+
+  struct Candidate {
+    float error;
+    Node *node;
+    bool operator<(const Candidate &other) const {
+      return error < other.error;
+    }
+  };
+
+  // Nodes with the largest screen-space error are refined first, so when the
+  // vertex budget runs out it was spent where it is most visible.
+  std::priority_queue<Candidate> candidates;
+  for (auto &root : roots_) {
+    root->last_used_frame = frame_;
+    candidates.push(
+        {ScreenSpaceError(*root, camera_position, projection_scale),
+         root.get()});
+  }
+
+  const uint32_t chunk_vertices = VerticesPerChunk();
+  uint32_t vertices = static_cast<uint32_t>(roots_.size()) * chunk_vertices;
+  while (!candidates.empty()) {
+    Candidate candidate = candidates.top();
+    candidates.pop();
+    Node &node = *candidate.node;
+
+    // Splitting replaces one chunk by four.
+    bool wants_split =
+        candidate.error > create_info_.max_screen_space_error &&
+        node.level < create_info_.max_level &&
+        vertices + 3 * chunk_vertices <= create_info_.vertex_budget;
+    if (wants_split) {
+      for (uint32_t i = 0; i < 4; ++i) {
+        if (!node.children[i]) {
+          node.children[i] = std::make_unique<Node>();
+          InitNode(*node.children[i], node.face, node.level + 1,
+                   node.x * 2 + (i & 1), node.y * 2 + (i >> 1));
+        }
+        node.children[i]->last_used_frame = frame_;
+      }
+
+      if (ChildrenResident(node)) {
+        vertices += 3 * chunk_vertices;
+        for (auto &child : node.children) {
+          candidates.push(
+              {ScreenSpaceError(*child, camera_position, projection_scale),
+               child.get()});
+        }
+        continue;
+      }
+
+      // The node keeps being drawn until its children are uploaded. The
+      // candidates come in the order of their error, so what the budget
+      // leaves out is the least visible.
+      for (auto &child : node.children) {
+        if (child->has_mesh || child->building ||
+            stats_.chunks_built >= create_info_.max_chunk_builds_per_frame ||
+            (stats_.chunks_built > 0 && build_ms >= budget_ms)) {
+          continue;
+        }
+        auto build_start = std::chrono::steady_clock::now();
+        if (BuildMesh(*child, candidate.error,
+                      create_info_.job_system != nullptr)) {
+          ++stats_.chunks_built;
+        }
+        build_ms += MilliSecondsSince(build_start);
+      }
+    } else if (create_info_.height_tiles &&
+               node.level < create_info_.max_level) {
+      // Where the camera is heading the node will want to split soon.
+      float predicted_error = ScreenSpaceError(
+          node, predicted_camera_position, projection_scale);
+      if (predicted_error > create_info_.max_screen_space_error) {
+        PrefetchChildTiles(node, predicted_error * kPrefetchPriority);
+      }
+    }
+
+    selected_.push_back(&node);
+    stats_.max_selected_level = std::max(stats_.max_selected_level, node.level);
+  }
+
+  LaunchBuilds();
+  for (auto &root : roots_) {
+    EvictUnused(*root);
+  }
+
+  stats_.chunks_in_flight = static_cast<uint32_t>(launched_builds_.size());
+  stats_.build_ms = static_cast<float>(build_ms);
+  stats_.selected_chunks = static_cast<uint32_t>(selected_.size());
+  stats_.selected_vertices = vertices;
+  stats_.resident_chunks =
+      create_info_.max_resident_chunks -
+      static_cast<uint32_t>(free_slots_.size());
+
+  std::unordered_set<uint64_t> selected_keys;
+  selected_keys.reserve(selected_.size());
+  for (const Node *node : selected_) {
+    selected_keys.insert(TileKeyOf(*node).Pack());
+  }
+  if (selected_keys != selected_keys_) {
+    selected_keys_ = std::move(selected_keys);
+    ++selection_version_;
+  }
+
+  FrameResources &resources = frames_[frame];
+  auto *chunks = reinterpret_cast<ChunkGpuData *>(
+      static_cast<uint8_t *>(chunk_allocation_.mapped) +
+      ChunkBufferOffset(frame));
+  const float inverse_lattice = 1.0f / TerrainLattice::kHalfExtent;
+  auto along = [](const glm::ivec3 &point, const glm::ivec3 &step) {
+    glm::ivec3 axis = glm::sign(step);
+    return point.x * axis.x + point.y * axis.y + point.z * axis.z;
+  };
+  const int32_t repeat_mask = (1 << detail_shift_) - 1;
+  const float inverse_repeat = 1.0f / static_cast<float>(1 << detail_shift_);
+  for (size_t i = 0; i < selected_.size(); ++i) {
+    const Node &node = *selected_[i];
+    ChunkLattice lattice = LatticeOf(node);
+    uint32_t stitch_mask = StitchMask(node);
+    ChunkGpuData &chunk = chunks[i];
+    chunk.sphere = glm::vec4(glm::vec3(node.center - camera_position),
+                             static_cast<float>(node.bounding_radius));
+    chunk.center_direction =
+        glm::vec4(glm::vec3(TerrainLattice::LatticeToSphere(lattice.center)),
+                  static_cast<float>(create_info_.radius));
+    // Lattice coordinates and steps are small enough integers and powers of
+    // two, so these are exact in float.
+    chunk.center_cube = glm::vec4(glm::vec3(lattice.center) * inverse_lattice,
+                                  node.center_height);
+    chunk.step_u = glm::vec4(glm::vec3(lattice.step_u) * inverse_lattice,
+                             node.height_min);
+    chunk.step_v = glm::vec4(glm::vec3(lattice.step_v) * inverse_lattice,
+                             node.height_range);
+    chunk.vertex_offset = node.slot * VerticesPerChunk();
+    chunk.first_index = first_index_[stitch_mask];
+    chunk.index_count = index_count_[stitch_mask];
+    // One vertex spacing plus a quantization step covers the cracks between
+    // neighbouring levels.
+    chunk.skirt_depth = static_cast<float>(node.geometric_error) +
+                        node.height_range / 65535.0f;
+    chunk.detail_textures = create_info_.detail_textures;
+    chunk.detail_step = along(lattice.step_u, lattice.step_u) * inverse_repeat;
+    // The centre's lattice coordinates along the face axes, modulo a repeat.
+    chunk.detail_origin =
+        glm::vec2(along(lattice.center, lattice.step_u) & repeat_mask,
+                  along(lattice.center, lattice.step_v) & repeat_mask) *
+        inverse_repeat;
+    chunk.node_face_level = node.face | node.level << 8;
+    chunk.node_x = node.x;
+    chunk.node_y = node.y;
+    chunk.stitch_mask = stitch_mask;
+  }
+
+  CullPushConstants &cull = resources.cull_constants;
+  ExtractFrustumPlanes(view_projection, cull.frustum_planes);
+  double occluder_radius = create_info_.radius + min_height_;
+  double camera_distance = glm::length(camera_position);
+  cull.planet = glm::vec4(glm::vec3(-camera_position),
+                          static_cast<float>(occluder_radius));
+  // (d - r)(d + r) instead of d^2 - r^2, the squares of planet-sized numbers
+  // would cancel out near the ground.
+  cull.camera_horizon = static_cast<float>(
+      camera_distance > occluder_radius
+          ? glm::sqrt((camera_distance - occluder_radius) *
+                      (camera_distance + occluder_radius))
+          : 0.0);
+  cull.chunk_count = static_cast<uint32_t>(selected_.size());
+  // Consecutive chunks come from the same part of the quadtree, so a group
+  // stays spatially coherent.
+  cull.chunks_per_group = std::max(
+      (cull.chunk_count + create_info_.draw_groups - 1) /
+          create_info_.draw_groups,
+      1u);
+
+  resources.occlusion.view_projection = view_projection;
+  resources.occlusion.vertices_per_chunk = VerticesPerChunk();
+}
+
+void Terrain::RecordCulling(VkCommandBuffer command_buffer, uint32_t frame,
+                            CullPhase phase,
+                            VkPipelineLayout cull_pipeline_layout) const {
+  const FrameResources &resources = frames_[frame];
+  vkCmdFillBuffer(command_buffer, count_buffer_,
+                  CountBufferOffset(frame, phase), CountBufferSize(), 0);
+
+  VkBufferMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = count_buffer_;
+  barrier.offset = CountBufferOffset(frame, phase);
+  barrier.size = CountBufferSize();
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1,
+                       &barrier, 0, nullptr);
+  if (phase != CullPhase::kAll) {
+    // The visibility written by the last kNewlyVisible dispatch, which for
+    // kNewlyVisible also has to wait for this frame's kLastVisible reads.
+    VkBufferMemoryBarrier visibility_barrier = barrier;
+    visibility_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    visibility_barrier.buffer = visibility_buffer_;
+    visibility_barrier.offset = 0;
+    visibility_barrier.size = VisibilityBufferSize();
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr,
+                         1, &visibility_barrier, 0, nullptr);
+  }
+
+  CullPushConstants cull = resources.cull_constants;
+  cull.phase = static_cast<uint32_t>(phase);
+  vkCmdPushConstants(command_buffer, cull_pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants),
+                     &cull);
+  vkCmdDispatch(command_buffer,
+                (cull.chunk_count + kCullGroupSize - 1) / kCullGroupSize, 1,
+                1);
+
+  std::array<VkBufferMemoryBarrier, 2> indirect_barriers{barrier, barrier};
+  for (VkBufferMemoryBarrier &indirect_barrier : indirect_barriers) {
+    indirect_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    indirect_barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  }
+  indirect_barriers[1].buffer = draw_buffer_;
+  indirect_barriers[1].offset = DrawBufferOffset(frame, phase);
+  indirect_barriers[1].size = DrawBufferSize();
+  // The task shader looks up its chunk in the draws.
+  VkPipelineStageFlags indirect_stages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+  if (create_info_.draw_mesh_tasks) {
+    indirect_barriers[1].dstAccessMask |= VK_ACCESS_SHADER_READ_BIT;
+    indirect_stages |= VK_PIPELINE_STAGE_TASK_SHADER_BIT_EXT;
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       indirect_stages, 0, 0, nullptr,
+                       static_cast<uint32_t>(indirect_barriers.size()),
+                       indirect_barriers.data(), 0, nullptr);
+}
+
+void Terrain::Draw(VkCommandBuffer command_buffer, uint32_t frame,
+                   uint32_t group, CullPhase phase) const {
+  const FrameResources &resources = frames_[frame];
+  const CullPushConstants &cull = resources.cull_constants;
+  uint32_t first_chunk = group * cull.chunks_per_group;
+  if (first_chunk >= cull.chunk_count) {
+    return;
+  }
+  BindMesh(command_buffer);
+  vkCmdDrawIndexedIndirectCount(
+      command_buffer, draw_buffer_,
+      DrawBufferOffset(frame, phase) +
+          sizeof(VkDrawIndexedIndirectCommand) * first_chunk,
+      count_buffer_,
+      CountBufferOffset(frame, phase) + sizeof(uint32_t) * group,
+      std::min(cull.chunks_per_group, cull.chunk_count - first_chunk),
+      sizeof(VkDrawIndexedIndirectCommand));
+}
+
+void Terrain::BindMesh(VkCommandBuffer command_buffer) const {
+  vkCmdBindVertexBuffers(command_buffer, 0, 1, &mesh_buffer_,
+                         &vertex_data_offset_);
+  vkCmdBindIndexBuffer(command_buffer, mesh_buffer_, 0, VK_INDEX_TYPE_UINT16);
+}
+
+void Terrain::DrawMeshTasks(VkCommandBuffer command_buffer, uint32_t frame,
+                            uint32_t group, CullPhase phase,
+                            VkPipelineLayout pipeline_layout) const {
+  const FrameResources &resources = frames_[frame];
+  const CullPushConstants &cull = resources.cull_constants;
+  uint32_t first_chunk = group * cull.chunks_per_group;
+  if (first_chunk >= cull.chunk_count) {
+    return;
+  }
+  // The draws keep the stride of the indexed ones, a
+  // VkDrawMeshTasksIndirectCommandEXT followed by the chunk index in
+  // firstInstance's place.
+  VkDeviceSize first_draw = DrawBufferOffset(frame, phase) +
+                            sizeof(VkDrawIndexedIndirectCommand) * first_chunk;
+  MeshTaskPushConstants constants{};
+  constants.first_draw = static_cast<uint32_t>(first_draw / sizeof(uint32_t));
+  constants.occlusion_test = phase == CullPhase::kNewlyVisible ? 1 : 0;
+  vkCmdPushConstants(command_buffer, pipeline_layout,
+                     VK_SHADER_STAGE_TASK_BIT_EXT, 0, sizeof(constants),
+                     &constants);
+  create_info_.draw_mesh_tasks(
+      command_buffer, draw_buffer_, first_draw, count_buffer_,
+      CountBufferOffset(frame, phase) + sizeof(uint32_t) * group,
+      std::min(cull.chunks_per_group, cull.chunk_count - first_chunk),
+      sizeof(VkDrawIndexedIndirectCommand));
+}
+
+bool Terrain::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                           VkMemoryPropertyFlags properties, VkBuffer &buffer,
+                           GpuAllocation &allocation) {
+  VkBufferCreateInfo buffer_info{};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = size;
+  buffer_info.usage = usage;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  if (vkCreateBuffer(create_info_.device, &buffer_info, nullptr, &buffer) !=
+      VK_SUCCESS) {
+    return false;
+  }
+  std::optional<GpuAllocation> result =
+      create_info_.allocator->AllocateForBuffer(buffer, properties);
+  if (!result) {
+    vkDestroyBuffer(create_info_.device, buffer, nullptr);
+    buffer = VK_NULL_HANDLE;
+    return false;
+  }
+  allocation = *result;
+  return true;
+}
+
+void Terrain::DestroyBuffer(VkBuffer buffer, const GpuAllocation &allocation) {
+  if (buffer == VK_NULL_HANDLE) {
+    return;
+  }
+  vkDestroyBuffer(create_info_.device, buffer, nullptr);
+  create_info_.allocator->Free(allocation);
+}
+
+void Terrain::InitNode(Node &node, uint32_t face, uint32_t level, uint32_t x,
+                       uint32_t y) const {
+  node.face = face;
+  node.level = level;
+  node.x = x;
+  node.y = y;
+
+  double size = 2.0 / static_cast<double>(1u << level);
+  double u0 = -1.0 + size * x;
+  double v0 = -1.0 + size * y;
+  double radius = create_info_.radius;
+  const TerrainNoise &noise = *create_info_.noise;
+
+  ChunkLattice lattice = LatticeOf(node);
+  glm::dvec3 center_direction = TerrainLattice::LatticeToSphere(lattice.center);
+  const TileFile::IndexEntry *tile =
+      create_info_.height_tiles
+          ? create_info_.height_tiles->File().Find(TileKeyOf(node))
+          : nullptr;
+  // Any height works as the origin of the chunk, a tile's is taken from its
+  // index so the node can be placed before the tile is loaded.
+  node.center_height = tile ? 0.5f * (tile->min_value + tile->max_value)
+                            : noise.Height(lattice.center);
+  node.center = center_direction * (radius + node.center_height);
+
+  // No vertex is further from the centre direction than the corners, nor
+  // further from the centre height than the noise can change over half a
+  // chunk.
+  double chord = 0.0;
+  for (uint32_t corner = 0; corner < 4; ++corner) {
+    glm::dvec3 direction = TerrainLattice::FaceToSphere(
+        face, u0 + size * (corner & 1), v0 + size * (corner >> 1));
+    chord = std::max(chord, glm::length(direction - center_direction));
+  }
+  double half_extent =
+      static_cast<double>(1u << (TerrainLattice::kShift - level));
+  double height_change =
+      tile ? 0.5 * (tile->max_value - tile->min_value)
+           : std::min<double>(noise.MaxDifference(half_extent),
+                              std::max(max_height_ - node.center_height,
+                                       node.center_height - min_height_));
+  node.bounding_radius = chord * (radius + max_height_) + height_change;
+  double height_min =
+      std::max<double>(node.center_height - height_change, min_height_);
+  double height_max =
+      std::min<double>(node.center_height + height_change, max_height_);
+  node.height_min = static_cast<float>(height_min);
+  node.height_range =
+      static_cast<float>(std::max(height_max - height_min, 0.0));
+
+  glm::dvec3 edge_start =
+      TerrainLattice::FaceToSphere(face, u0, v0) * radius;
+  glm::dvec3 edge_end =
+      TerrainLattice::FaceToSphere(face, u0 + size, v0) * radius;
+  node.geometric_error = glm::length(edge_end - edge_start) /
+                         static_cast<double>(create_info_.grid_size - 1);
+  node.bounding_radius += node.geometric_error;
+}
+
+bool Terrain::ConfigureLattice() {
+  TerrainLattice::CreateInfo lattice_info{};
+  lattice_info.radius = create_info_.radius;
+  lattice_info.grid_size = create_info_.grid_size;
+  lattice_info.max_level = create_info_.max_level;
+  if (!lattice_.Init(lattice_info)) {
+    return false;
+  }
+  create_info_.max_level = lattice_.MaxLevel();
+  if (VerticesPerChunk() > 65536) {
+    spdlog::error("Terrain grid size {} is too large for 16-bit indices.",
+                  create_info_.grid_size);
+    return false;
+  }
+  detail_shift_ = static_cast<uint32_t>(std::clamp(
+      std::round(std::log2(create_info_.detail_repeat /
+                           lattice_.MetresPerUnit())),
+      0.0, static_cast<double>(TerrainLattice::kShift)));
+  return true;
+}
+
+float Terrain::ScreenSpaceError(const Node &node,
+                                const glm::dvec3 &camera_position,
+                                float projection_scale) const {
+  double distance = std::max(
+      glm::length(camera_position - node.center) - node.bounding_radius, 1.0);
+  return static_cast<float>(node.geometric_error * projection_scale /
+                            distance);
+}
+
+bool Terrain::IsResident(const Node &node) const {
+  uint64_t acquired = node.generated_on_gpu
+                          ? create_info_.generator->AcquiredTicket()
+                          : create_info_.upload_manager->AcquiredTicket();
+  return node.has_mesh && node.upload_ticket <= acquired;
+}
+
+bool Terrain::ChildrenResident(const Node &node) const {
+  for (const auto &child : node.children) {
+    if (!child || !IsResident(*child)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Terrain::BuildMesh(Node &node, float priority, bool background) {
+  if (free_slots_.empty()) {
+    return false;
+  }
+  uint32_t slot = free_slots_.back();
+
+  MeshBuild build;
+  TileCache *tiles = create_info_.height_tiles;
+  if (tiles && tiles->File().Find(TileKeyOf(node))) {
+    const std::vector<uint8_t> *tile = tiles->Find(TileKeyOf(node));
+    if (!tile) {
+      // The parent is drawn until the tile has streamed in.
+      tiles->Request(TileKeyOf(node), priority);
+      ++stats_.chunks_waiting_for_tiles;
+      return false;
+    }
+    build.bordered_heights.resize(BorderedVerticesPerChunk());
+    std::memcpy(build.bordered_heights.data(), tile->data(), tile->size());
+  } else if (create_info_.generator) {
+    std::optional<uint64_t> ticket =
+        create_info_.generator->Generate(GeneratorConstants(node, slot));
+    if (!ticket) {
+      return false;
+    }
+    free_slots_.pop_back();
+    node.slot = slot;
+    node.upload_ticket = *ticket;
+    node.generated_on_gpu = true;
+    node.has_mesh = true;
+    return true;
+  }
+
+  if (background && !launched_builds_.empty()) {
+    return false;
+  }
+  build.node = &node;
+  build.slot = slot;
+  build.lattice = LatticeOf(node);
+  build.height_min = node.height_min;
+  build.height_range = node.height_range;
+  build.geometric_error = node.geometric_error;
+  if (background) {
+    free_slots_.pop_back();
+    node.building = true;
+    queued_builds_.push_back(std::move(build));
+    return true;
+  }
+  GenerateMesh(build);
+  if (!UploadMesh(build)) {
+    return false;
+  }
+  free_slots_.pop_back();
+  return true;
+}
+
+void Terrain::GenerateMesh(MeshBuild &build) const {
+  // CPU fallback, the same computation as shaders/heightfield.comp with the
+  // directions in double precision.
+  const int32_t grid_size = static_cast<int32_t>(create_info_.grid_size);
+  const int32_t bordered_size = grid_size + 2;
+  const int32_t half_grid = grid_size / 2;
+  const uint32_t grid_vertices = GridVerticesPerChunk();
+  const ChunkLattice &lattice = build.lattice;
+  if (build.bordered_heights.empty()) {
+    build.bordered_heights = BorderedHeights(lattice, true);
+  }
+  const std::vector<float> &bordered_heights = build.bordered_heights;
+  glm::vec3 axis_u = glm::sign(glm::vec3(lattice.step_u));
+  glm::vec3 axis_v = glm::sign(glm::vec3(lattice.step_v));
+  float slope_scale = static_cast<float>(0.5 / build.geometric_error);
+
+  std::vector<Vertex> &vertices = build.vertices;
+  std::vector<float> &heights = build.heights;
+  vertices.resize(VerticesPerChunk());
+  heights.resize(grid_vertices);
+  for (int32_t j = 0; j < grid_size; ++j) {
+    for (int32_t i = 0; i < grid_size; ++i) {
+      int32_t bordered = (j + 1) * bordered_size + i + 1;
+      float height = bordered_heights[bordered];
+      glm::vec3 up(TerrainLattice::LatticeToSphere(
+          lattice.center + lattice.step_u * (i - half_grid) +
+          lattice.step_v * (j - half_grid)));
+      glm::vec3 tangent_u =
+          glm::normalize(axis_u - up * glm::dot(axis_u, up));
+      glm::vec3 tangent_v =
+          glm::normalize(axis_v - up * glm::dot(axis_v, up));
+      float slope_u = (bordered_heights[bordered + 1] -
+                       bordered_heights[bordered - 1]) *
+                      slope_scale;
+      float slope_v = (bordered_heights[bordered + bordered_size] -
+                       bordered_heights[bordered - bordered_size]) *
+                      slope_scale;
+      glm::vec3 normal =
+          glm::normalize(up - tangent_u * slope_u - tangent_v * slope_v);
+
+      Vertex vertex =
+          Vertex::Pack(height, build.height_min, build.height_range, normal);
+      vertices[j * grid_size + i] = vertex;
+      heights[j * grid_size + i] = height;
+      // The skirt copies the edges, see CreateMeshBuffer().
+      if (i == 0) {
+        vertices[grid_vertices + j] = vertex;
+      }
+      if (i == grid_size - 1) {
+        vertices[grid_vertices + grid_size + j] = vertex;
+      }
+      if (j == 0) {
+        vertices[grid_vertices + 2 * grid_size + i] = vertex;
+      }
+      if (j == grid_size - 1) {
+        vertices[grid_vertices + 3 * grid_size + i] = vertex;
+      }
+    }
+  }
+}
+
+bool Terrain::UploadMesh(MeshBuild &build) {
+  const std::vector<Vertex> &vertices = build.vertices;
+  const std::vector<float> &heights = build.heights;
+  const uint32_t slot = build.slot;
+  VkDeviceSize chunk_size = sizeof(Vertex) * vertices.size();
+  VkDeviceSize heights_size = sizeof(float) * heights.size();
+  // The mesh shader reads the vertices as a storage buffer.
+  VkPipelineStageFlags vertex_stages = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+  VkAccessFlags vertex_access = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+  if (create_info_.draw_mesh_tasks) {
+    vertex_stages |= VK_PIPELINE_STAGE_TASK_SHADER_BIT_EXT |
+                     VK_PIPELINE_STAGE_MESH_SHADER_BIT_EXT;
+    vertex_access |= VK_ACCESS_SHADER_READ_BIT;
+  }
+  std::optional<uint64_t> ticket = create_info_.upload_manager->UploadBuffer(
+      mesh_buffer_, vertex_data_offset_ + chunk_size * slot, vertices.data(),
+      chunk_size, vertex_stages, vertex_access);
+  if (ticket) {
+    ticket = create_info_.upload_manager->UploadBuffer(
+        height_buffer_, sizeof(float) * VerticesPerChunk() * slot,
+        heights.data(), heights_size,
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_ACCESS_SHADER_READ_BIT);
+  }
+  if (!ticket) {
+    // Staging ring is full, retried on a later frame.
+    return false;
+  }
+
+  Node &node = *build.node;
+  node.slot = slot;
+  node.upload_ticket = *ticket;
+  node.generated_on_gpu = false;
+  node.has_mesh = true;
+  node.building = false;
+  return true;
+}
+
+void Terrain::LaunchBuilds() {
+  if (queued_builds_.empty()) {
+    return;
+  }
+  launched_builds_ = std::move(queued_builds_);
+  queued_builds_.clear();
+  // Nothing touches launched_builds_ until the jobs are done.
+  build_jobs_ = create_info_.job_system->Launch(
+      static_cast<uint32_t>(launched_builds_.size()),
+      [this](uint32_t index, uint32_t) {
+        GenerateMesh(launched_builds_[index]);
+      });
+}
+
+double Terrain::CollectBuilds(double budget_ms) {
+  if (launched_builds_.empty() || !build_jobs_.Done()) {
+    return 0.0;
+  }
+  auto start = std::chrono::steady_clock::now();
+  size_t uploaded = 0;
+  while (uploaded < launched_builds_.size() &&
+         (uploaded == 0 || MilliSecondsSince(start) < budget_ms) &&
+         UploadMesh(launched_builds_[uploaded])) {
+    ++uploaded;
+  }
+  launched_builds_.erase(launched_builds_.begin(),
+                         launched_builds_.begin() + uploaded);
+  stats_.chunks_built += static_cast<uint32_t>(uploaded);
+  return MilliSecondsSince(start);
+}
+
+void Terrain::PrefetchChildTiles(const Node &node, float priority) {
+  for (uint32_t i = 0; i < 4; ++i) {
+    create_info_.height_tiles->Request({node.face, node.level + 1,
+                                        node.x * 2 + (i & 1),
+                                        node.y * 2 + (i >> 1)},
+                                       priority);
+  }
+}
+
+HeightfieldPushConstants Terrain::GeneratorConstants(const Node &node,
+                                                     uint32_t slot) const {
+  const terrain_noise::Params &params = create_info_.noise->GetParams();
+  ChunkLattice lattice = LatticeOf(node);
+
+  HeightfieldPushConstants constants{};
+  constants.seed = params.seed;
+  constants.base_cell_shift = params.base_cell_shift;
+  constants.octaves = params.octaves;
+  constants.ridge_octaves = params.ridge_octaves;
+  constants.continent_amplitude = params.continent_amplitude;
+  constants.ridge_amplitude = params.ridge_amplitude;
+  constants.warp_amount = params.warp_amount;
+  constants.vertex_offset = slot * VerticesPerChunk();
+  constants.center = glm::ivec4(lattice.center, 0);
+  constants.step_u = glm::ivec4(lattice.step_u, 0);
+  constants.step_v = glm::ivec4(lattice.step_v, 0);
+  constants.center_direction =
+      glm::vec4(glm::vec3(TerrainLattice::LatticeToSphere(lattice.center)),
+                0.0f);
+  constants.params = glm::vec4(node.height_min, node.height_range,
+                               static_cast<float>(node.geometric_error),
+                               1.0f / TerrainLattice::kHalfExtent);
+  return constants;
+}
+
+std::vector<float> Terrain::BorderedHeights(const ChunkLattice &lattice,
+                                            bool simd) const {
+  const int32_t bordered_size =
+      static_cast<int32_t>(create_info_.grid_size) + 2;
+  const int32_t first = -1 - static_cast<int32_t>(create_info_.grid_size / 2);
+  std::vector<glm::ivec3> points;
+  points.reserve(BorderedVerticesPerChunk());
+  for (int32_t j = 0; j < bordered_size; ++j) {
+    for (int32_t i = 0; i < bordered_size; ++i) {
+      points.push_back(lattice.center + lattice.step_u * (first + i) +
+                       lattice.step_v * (first + j));
+    }
+  }
+
+  std::vector<float> heights(points.size());
+  if (simd) {
+    create_info_.noise->Heights(points.data(), heights.data(), points.size());
+  } else {
+    create_info_.noise->HeightsScalar(points.data(), heights.data(),
+                                      points.size());
+  }
+  return heights;
+}
+
+bool Terrain::BakeHeightTiles(const TerrainNoise &noise, uint32_t grid_size,
+                              uint32_t levels, const std::string &path) {
+  return BakeTiles(noise, grid_size, levels, path, TileFormat::kHeightFloat32,
+                   [](const std::vector<float> &heights) {
+                     std::vector<uint8_t> samples(sizeof(float) *
+                                                  heights.size());
+                     std::memcpy(samples.data(), heights.data(),
+                                 samples.size());
+                     return samples;
+                   });
+}
+
+bool Terrain::BakeImageryTiles(const TerrainNoise &noise, uint32_t grid_size,
+                               uint32_t levels, const std::string &path) {
+  // Sea floor, shore, grass, rock and snow, in sRGB.
+  static constexpr std::array<std::array<uint8_t, 3>, 5> kRamp = {{
+      {40, 60, 110},
+      {190, 180, 130},
+      {90, 120, 70},
+      {110, 100, 90},
+      {240, 240, 245},
+  }};
+  const float min_height = noise.MinHeight();
+  const float scale = (kRamp.size() - 1) /
+                      std::max(noise.MaxHeight() - min_height, 1.0f);
+  return BakeTiles(
+      noise, grid_size, levels, path, TileFormat::kRgba8,
+      [&](const std::vector<float> &heights) {
+        std::vector<uint8_t> samples(4 * heights.size());
+        for (size_t i = 0; i < heights.size(); ++i) {
+          float t = std::clamp((heights[i] - min_height) * scale, 0.0f,
+                               kRamp.size() - 1.0f);
+          size_t low = std::min(static_cast<size_t>(t), kRamp.size() - 2);
+          float blend = t - static_cast<float>(low);
+          for (size_t c = 0; c < 3; ++c) {
+            samples[4 * i + c] = static_cast<uint8_t>(
+                kRamp[low][c] + (kRamp[low + 1][c] - kRamp[low][c]) * blend +
+                0.5f);
+          }
+          samples[4 * i + 3] = 255;
+        }
+        return samples;
+      });
+}
+
+bool Terrain::BakeTiles(
+    const TerrainNoise &noise, uint32_t grid_size, uint32_t levels,
+    const std::string &path, TileFormat format,
+    const std::function<std::vector<uint8_t>(const std::vector<float> &)>
+        &encode) {
+  // Only the lattice helpers are used, nothing touches the GPU.
+  Terrain terrain;
+  terrain.create_info_.noise = &noise;
+  terrain.create_info_.grid_size = grid_size;
+  terrain.create_info_.max_level = levels;
+  if (!terrain.ConfigureLattice()) {
+    return false;
+  }
+  levels = terrain.create_info_.max_level;
+
+  TileFileWriter writer;
+  if (!writer.Open(path, format, grid_size + 2)) {
+    return false;
+  }
+  // Coarse levels first, like the file's index.
+  for (uint32_t level = 0; level <= levels; ++level) {
+    const uint32_t nodes_per_axis = 1u << level;
+    for (uint32_t face = 0; face < TerrainLattice::kFaceCount; ++face) {
+      for (uint32_t y = 0; y < nodes_per_axis; ++y) {
+        for (uint32_t x = 0; x < nodes_per_axis; ++x) {
+          Node node;
+          node.face = face;
+          node.level = level;
+          node.x = x;
+          node.y = y;
+          std::vector<uint8_t> samples = encode(
+              terrain.BorderedHeights(terrain.LatticeOf(node), true));
+          if (!writer.Add(TileKeyOf(node), samples.data())) {
+            return false;
+          }
+        }
+      }
+    }
+    spdlog::info("Baked tiles of level {}.", level);
+  }
+  return writer.Finish();
+}
+
+Terrain::GenerationBenchmark
+Terrain::BenchmarkGeneration(uint32_t chunk_count) {
+  GenerationBenchmark result;
+  result.chunks = chunk_count;
+  result.simd_path = create_info_.noise->SimdPath();
+
+  // A fixed, scattered set of mid-level chunks, so runs are comparable.
+  const uint32_t level = std::min(create_info_.max_level, 10u);
+  const uint32_t mask = (1u << level) - 1;
+  std::vector<Node> nodes(chunk_count);
+  for (uint32_t k = 0; k < chunk_count; ++k) {
+    InitNode(nodes[k], k % 6, level, (k * 7919u) & mask, (k * 104729u) & mask);
+  }
+
+  std::vector<std::vector<float>> reference(chunk_count);
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t k = 0; k < chunk_count; ++k) {
+    reference[k] = BorderedHeights(LatticeOf(nodes[k]), false);
+  }
+  result.scalar_ms = MilliSecondsSince(start);
+
+  std::vector<std::vector<float>> simd(chunk_count);
+  start = std::chrono::steady_clock::now();
+  for (uint32_t k = 0; k < chunk_count; ++k) {
+    simd[k] = BorderedHeights(LatticeOf(nodes[k]), true);
+  }
+  result.simd_ms = MilliSecondsSince(start);
+  for (uint32_t k = 0; k < chunk_count; ++k) {
+    for (size_t i = 0; i < simd[k].size(); ++i) {
+      // Bitwise, so a -0.0 or a NaN would count as well.
+      result.simd_mismatches += std::bit_cast<uint32_t>(simd[k][i]) !=
+                                std::bit_cast<uint32_t>(reference[k][i]);
+    }
+  }
+
+  TerrainGenerator *generator = create_info_.generator;
+  const uint32_t gpu_chunks =
+      std::min(chunk_count, static_cast<uint32_t>(free_slots_.size()));
+  if (!generator || gpu_chunks == 0) {
+    return result;
+  }
+  result.gpu_chunks = gpu_chunks;
+
+  const VkDeviceSize chunk_heights_size =
+      sizeof(float) * GridVerticesPerChunk();
+  VkBuffer readback_buffer = VK_NULL_HANDLE;
+  GpuAllocation readback_allocation;
+  if (!CreateBuffer(chunk_heights_size * gpu_chunks,
+                    VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                    readback_buffer, readback_allocation)) {
+    spdlog::error("Failed to create heightfield readback buffer.");
+    return result;
+  }
+
+  // The slots are only borrowed, nothing draws from them yet.
+  std::vector<VkBufferCopy> copies(gpu_chunks);
+  start = std::chrono::steady_clock::now();
+  for (uint32_t k = 0; k < gpu_chunks; ++k) {
+    uint32_t slot = free_slots_[free_slots_.size() - 1 - k];
+    generator->Generate(GeneratorConstants(nodes[k], slot));
+    copies[k] = {sizeof(float) * VerticesPerChunk() * slot,
+                 chunk_heights_size * k, chunk_heights_size};
+  }
+  generator->RecordHeightReadback(readback_buffer, copies);
+  generator->Flush();
+  generator->WaitIdle();
+  result.gpu_ms = MilliSecondsSince(start);
+
+  const int32_t grid_size = static_cast<int32_t>(create_info_.grid_size);
+  const auto *gpu_heights =
+      static_cast<const float *>(readback_allocation.mapped);
+  for (uint32_t k = 0; k < gpu_chunks; ++k) {
+    for (int32_t j = 0; j < grid_size; ++j) {
+      for (int32_t i = 0; i < grid_size; ++i) {
+        float height = gpu_heights[(k * grid_size + j) * grid_size + i];
+        float expected = reference[k][(j + 1) * (grid_size + 2) + i + 1];
+        result.gpu_mismatches += std::bit_cast<uint32_t>(height) !=
+                                 std::bit_cast<uint32_t>(expected);
+      }
+    }
+  }
+  DestroyBuffer(readback_buffer, readback_allocation);
+  return result;
+}
+
+void Terrain::ReleaseMesh(Node &node) {
+  if (!node.has_mesh) {
+    return;
+  }
+  // Frames in flight may still draw from the slot.
+  create_info_.defer_destroy(
+      [this, slot = node.slot]() { free_slots_.push_back(slot); });
+  node.has_mesh = false;
+}
+
+void Terrain::ReleaseChildren(Node &node) {
+  for (auto &child : node.children) {
+    if (!child) {
+      continue;
+    }
+    ReleaseChildren(*child);
+    ReleaseMesh(*child);
+    child.reset();
+  }
+}
+
+void Terrain::EvictUnused(Node &node) {
+  if (!node.children[0]) {
+    return;
+  }
+
+  // Meshes with an upload still in flight are kept, the transfer queue may
+  // still be writing them.
+  std::function<bool(const Node &)> evictable = [&](const Node &n) {
+    if (n.last_used_frame + kEvictAfterFrames >= frame_ ||
+        (n.has_mesh && !IsResident(n)) || n.building) {
+      return false;
+    }
+    for (const auto &child : n.children) {
+      if (child && !evictable(*child)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  bool children_evictable = true;
+  for (const auto &child : node.children) {
+    children_evictable = children_evictable && evictable(*child);
+  }
+  if (children_evictable) {
+    ReleaseChildren(node);
+    return;
+  }
+  for (auto &child : node.children) {
+    EvictUnused(*child);
+  }
+}
+
+uint32_t Terrain::StitchMask(const Node &node) const {
+  if (node.level == 0) {
+    return 0;
+  }
+  const int32_t last = (1 << node.level) - 1;
+  // In the order of Edge.
+  const std::array<glm::ivec2, 4> neighbours = {
+      {{-1, 0}, {1, 0}, {0, -1}, {0, 1}}};
+  uint32_t mask = 0;
+  for (uint32_t edge = 0; edge < neighbours.size(); ++edge) {
+    int32_t x = static_cast<int32_t>(node.x) + neighbours[edge].x;
+    int32_t y = static_cast<int32_t>(node.y) + neighbours[edge].y;
+    // Across the edge of the cube face the skirt has to do.
+    if (x < 0 || y < 0 || x > last || y > last) {
+      continue;
+    }
+    TileKey parent{node.face, node.level - 1, static_cast<uint32_t>(x) >> 1,
+                   static_cast<uint32_t>(y) >> 1};
+    if (selected_keys_.contains(parent.Pack())) {
+      mask |= 1u << edge;
+    }
+  }
+  return mask;
+}
+
+bool Terrain::CreateMeshBuffer() {
+  const uint32_t n = create_info_.grid_size;
+  const uint32_t grid_vertices = GridVerticesPerChunk();
+  std::vector<uint16_t> indices;
+
+  for (uint32_t mask = 0; mask < kStitchVariants; ++mask) {
+    // Odd vertices of a stitched edge are moved onto their even neighbour,
+    // which leaves exactly the edge of the coarser chunk next to it. The
+    // triangles that collapse are dropped.
+    auto snap = [&](glm::uvec2 p) {
+      if ((p.x == 0 && (mask & kEdgeMinusU)) ||
+          (p.x == n - 1 && (mask & kEdgePlusU))) {
+        p.y &= ~1u;
+      }
+      if ((p.y == 0 && (mask & kEdgeMinusV)) ||
+          (p.y == n - 1 && (mask & kEdgePlusV))) {
+        p.x &= ~1u;
+      }
+      return p;
+    };
+    auto triangle = [&](uint32_t a, uint32_t b, uint32_t c) {
+      if (a != b && b != c && c != a) {
+        indices.insert(indices.end(), {static_cast<uint16_t>(a),
+                                       static_cast<uint16_t>(b),
+                                       static_cast<uint16_t>(c)});
+      }
+    };
+    auto grid = [&](uint32_t i, uint32_t j) {
+      glm::uvec2 p = snap({i, j});
+      return p.y * n + p.x;
+    };
+
+    first_index_[mask] = static_cast<uint32_t>(indices.size());
+    for (uint32_t j = 0; j + 1 < n; ++j) {
+      for (uint32_t i = 0; i + 1 < n; ++i) {
+        uint32_t i00 = grid(i, j);
+        uint32_t i10 = grid(i + 1, j);
+        uint32_t i01 = grid(i, j + 1);
+        uint32_t i11 = grid(i + 1, j + 1);
+        triangle(i00, i10, i11);
+        triangle(i11, i01, i00);
+      }
+    }
+
+    // Skirt vertices follow the grid, n per edge in the order of Edge. Each
+    // edge is walked counter-clockwise around the chunk so the skirt faces
+    // outwards.
+    for (uint32_t edge = 0; edge < 4; ++edge) {
+      for (uint32_t t = 0; t + 1 < n; ++t) {
+        glm::uvec2 a, b;
+        switch (1u << edge) {
+        case kEdgeMinusU:
+          a = {0, n - 1 - t};
+          b = {0, n - 2 - t};
+          break;
+        case kEdgePlusU:
+          a = {n - 1, t};
+          b = {n - 1, t + 1};
+          break;
+        case kEdgeMinusV:
+          a = {t, 0};
+          b = {t + 1, 0};
+          break;
+        default:
+          a = {n - 1 - t, n - 1};
+          b = {n - 2 - t, n - 1};
+          break;
+        }
+        a = snap(a);
+        b = snap(b);
+        // Position of a vertex along its edge.
+        const uint32_t along = edge < 2 ? 1 : 0;
+        uint32_t skirt_a = grid_vertices + edge * n + a[along];
+        uint32_t skirt_b = grid_vertices + edge * n + b[along];
+        triangle(a.y * n + a.x, skirt_a, skirt_b);
+        triangle(a.y * n + a.x, skirt_b, b.y * n + b.x);
+      }
+    }
+    index_count_[mask] =
+        static_cast<uint32_t>(indices.size()) - first_index_[mask];
+  }
+
+  const VkDeviceSize index_size = sizeof(indices[0]) * indices.size();
+  // The generator binds the vertex data as a storage buffer, 256 bytes
+  // satisfy every device's minStorageBufferOffsetAlignment.
+  vertex_data_offset_ = (index_size + 255) & ~static_cast<VkDeviceSize>(255);
+  const VkDeviceSize vertex_data_size = sizeof(Vertex) * VerticesPerChunk() *
+                                        create_info_.max_resident_chunks;
+  if (!CreateBuffer(vertex_data_offset_ + vertex_data_size,
+                    VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                        VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh_buffer_,
+                    mesh_allocation_)) {
+    spdlog::error("Failed to create terrain mesh buffer.");
+    return false;
+  }
+
+  if (!create_info_.upload_manager->UploadBuffer(
+          mesh_buffer_, 0, indices.data(), index_size,
+          VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT)) {
+    spdlog::error("Failed to upload terrain index buffer.");
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,547 @@
+#pragma once
+
+#include "gpu_allocator.h"
+#include "job_system.h"
+#include "terrain_generator.h"
+#include "terrain_lattice.h"
+#include "terrain_noise.h"
+#include "tile_cache.h"
+#include "upload_manager.h"
+#include "vertex.h"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+// Layout of one entry of the per-frame chunk buffer, read by the culling
+// shader and the vertex shader (indexed by gl_InstanceIndex), or the task and
+// mesh shaders.
+struct ChunkGpuData {
+  // xyz: chunk origin relative to the camera, computed in double precision on
+  // the CPU so the shaders only ever see small numbers. w: bounding radius.
+  glm::vec4 sphere;
+  // xyz: unit direction of the centre vertex, w: planet radius.
+  glm::vec4 center_direction;
+  // xyz: centre vertex on the [-1, 1]^3 cube, w: its height, which places the
+  // chunk origin.
+  glm::vec4 center_cube;
+  // xyz: cube offset from one vertex to the next along the face's u axis,
+  // w: lowest height of the chunk's vertices.
+  glm::vec4 step_u;
+  // xyz: the same along v, w: range spanned by the vertices' 16-bit heights.
+  glm::vec4 step_v;
+  uint32_t vertex_offset;
+  // Stitch variant of the chunk in the shared index buffer.
+  uint32_t first_index;
+  uint32_t index_count;
+  // How far the skirt hangs below the chunk's edges.
+  float skirt_depth;
+  // BindlessTextures indices of the detail textures of flat ground in the low
+  // 16 bits and of steep ground in the high ones. kNoDetailTextures for none.
+  uint32_t detail_textures;
+  // Change of the detail texture coordinates from one vertex to the next,
+  // along u and v alike.
+  float detail_step;
+  // Detail texture coordinates of the centre vertex, wrapped into [0, 1).
+  // Derived from the lattice, so they continue across chunks of every level.
+  glm::vec2 detail_origin;
+  // The node's TileKey, which addresses its imagery, see VirtualTexture.
+  // face | level << 8.
+  uint32_t node_face_level;
+  uint32_t node_x;
+  uint32_t node_y;
+  // Edges bordering a selected chunk one level coarser, Terrain's Edge bits.
+  // The mesh shader stitches with it, the index variant has it built in.
+  uint32_t stitch_mask;
+};
+static_assert(sizeof(ChunkGpuData) == 128);
+
+constexpr uint32_t kNoDetailTextures = 0xffffffffu;
+
+// Push constants of shaders/cull.comp. Everything is camera relative.
+struct CullPushConstants {
+  // Normalized planes with the inside where dot(plane.xyz, p) + plane.w >= 0.
+  glm::vec4 frustum_planes[6];
+  // xyz: planet centre, w: radius of the occluding sphere.
+  glm::vec4 planet;
+  uint32_t chunk_count;
+  // Distance from the camera to its horizon on the occluding sphere, 0 when
+  // the camera is below it.
+  float camera_horizon;
+  // Chunks [g * chunks_per_group, (g + 1) * chunks_per_group) form draw
+  // group g and emit their draws into the same range of the draw buffer.
+  uint32_t chunks_per_group;
+  // CullPhase of the dispatch.
+  uint32_t phase;
+};
+static_assert(sizeof(CullPushConstants) <= 128,
+              "Vulkan only guarantees 128 bytes of push constants.");
+
+// Occlusion test of shaders/cull.comp against a Hi-Z pyramid of the depth
+// buffer, std140 at binding 4 of the cull set. shaders/terrain.task tests its
+// meshlets with the same.
+struct CullOcclusionData {
+  // Camera relative positions to the clip space of the depth buffer.
+  glm::mat4 view_projection;
+  // Of the depth buffer the pyramid is built from, in pixels.
+  glm::vec2 depth_size;
+  uint32_t hiz_levels;
+  // Turns a chunk's vertex offset into its slot in the mesh buffer, which
+  // indexes the visibility buffer.
+  uint32_t vertices_per_chunk;
+};
+static_assert(sizeof(CullOcclusionData) == 80);
+
+// Push constants of shaders/terrain.task, see Terrain::DrawMeshTasks().
+struct MeshTaskPushConstants {
+  // Of the group's first draw in the draw buffer, in 32-bit words.
+  uint32_t first_draw;
+  // Non-zero to test the meshlets against the Hi-Z pyramid, which only holds
+  // this frame's depth in kNewlyVisible.
+  uint32_t occlusion_test;
+};
+
+// The dispatches of the culling shader in a frame. Either one kAll or, with
+// occlusion culling, kLastVisible, then the depth of its draws is reduced to
+// the Hi-Z pyramid and kNewlyVisible tests against it. Each of the two draws
+// into its own part of the draw and count buffers.
+enum class CullPhase : uint32_t {
+  // Frustum and horizon culling only.
+  kAll = 0,
+  // What passes those and was visible last frame, by the visibility buffer.
+  kLastVisible = 1,
+  // What passes those and the Hi-Z pyramid but was not drawn by
+  // kLastVisible. Writes the visibility buffer for the next frame.
+  kNewlyVisible = 2,
+};
+
+// Planet terrain as a cube-sphere: each of the six cube faces is the root of a
+// quadtree whose nodes cover a square of the face and own one fixed-resolution
+// grid mesh projected onto the sphere. Every frame the tree is refined by the
+// screen-space error of the nodes as seen from the camera, under a fixed
+// vertex budget, so the cost stays bounded from orbit down to ground level.
+//
+// Heights come from TerrainNoise on an integer lattice over the cube faces:
+// the face is 2^25 lattice units wide and every vertex of every level sits on
+// a lattice point, so a chunk's heights are exact no matter whether the compute
+// shader of TerrainGenerator or the CPU fallback produced them.
+//
+// A TileCache of a height tile file can override the heightfield: nodes that
+// have a tile take their heights from it, streamed in by screen-space error
+// and ahead of the camera's motion. Deeper nodes fall back to the noise.
+//
+// Node placement and the camera use double precision world coordinates. A
+// chunk vertex only stores a 16-bit height and an octahedral normal, see
+// Vertex; the vertex shader places it from its grid position and the chunk's
+// lattice as a float offset from the node's centre, rebased to the camera per
+// draw, which keeps precision at centimetre level even on the surface of an
+// Earth-sized planet.
+//
+// All chunks share one grid topology. The index buffer holds a variant of it
+// for every combination of edges that border a chunk one level coarser, with
+// every other vertex of those edges stitched out, and a skirt around every
+// chunk hides what stitching does not cover: quantization, neighbours more
+// than one level apart and the edges between cube faces.
+//
+// Drawing is GPU driven: the index variants and all chunk meshes, in
+// fixed-size slots, live in one buffer, the selected chunks are written to a
+// per-frame buffer and a compute pass does frustum and horizon culling and
+// emits the indirect draws,
+// so the CPU records the same handful of commands however many chunks are
+// visible. Occlusion culling splits the pass in two, see CullPhase: whether a
+// chunk passed it is kept per mesh slot, which stays the same while the chunk
+// is resident. The selection is split into a fixed number of draw groups of
+// consecutive chunks, each with its own draw count, so the groups can be
+// recorded into separate command buffers in parallel.
+//
+// With VK_EXT_mesh_shader the same draws can go to task and mesh shaders
+// instead, see DrawMeshTasks(), which cull the chunks' meshlets and build
+// their grids, stitching included, without the index buffer.
+class Terrain {
+public:
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    GpuAllocator *allocator = nullptr;
+    UploadManager *upload_manager = nullptr;
+    // Destroys a GPU resource once the frames using it have retired.
+    std::function<void(std::function<void()> &&)> defer_destroy;
+    // Heightfield of the planet, has to outlive the terrain.
+    const TerrainNoise *noise = nullptr;
+    // Generates chunks on the GPU. Chunks are generated on the CPU, using
+    // SIMD where available, and uploaded if not set.
+    TerrainGenerator *generator = nullptr;
+    // Generates the chunks built on the CPU on its workers in the background,
+    // a later Update() uploads them. On the calling thread if not set. Has to
+    // outlive the terrain.
+    JobSystem *job_system = nullptr;
+    // Height tiles, kHeightFloat32 with tile_size == grid_size + 2: the heights
+    // of a chunk's vertices plus a border of one vertex, rows along the face's
+    // v axis, see BakeHeightTiles(). Chunks with a tile are built on the CPU.
+    TileCache *height_tiles = nullptr;
+
+    double radius = 6371000.0;
+    uint32_t frames_in_flight = 2;
+    // Slots in the shared mesh buffer, bounds the chunks kept on the GPU.
+    uint32_t max_resident_chunks = 4096;
+    // Independent indirect draws the selection is split into, see Draw().
+    // Fixed rather than derived from the thread count, so the partitioning
+    // is the same on every machine.
+    uint32_t draw_groups = 1;
+    // Vertices along one edge of a chunk, 2^k + 1 so the vertices of every
+    // level stay on the lattice. Has to match the vertex shader's and the
+    // generator's.
+    uint32_t grid_size = 33;
+    // Clamped to the deepest level whose vertices are one lattice unit apart.
+    uint32_t max_level = 20;
+    uint32_t vertex_budget = 1000000;
+    // Nodes whose error projects to more pixels than this get split.
+    float max_screen_space_error = 4.0f;
+    // New chunk meshes generated and uploaded per frame.
+    uint32_t max_chunk_builds_per_frame = 16;
+    // Time one Update() may spend building chunks: generating them without a
+    // job system, uploading them and queueing them on the generator. The
+    // first build of a frame always goes ahead, so the refinement converges
+    // however small the budget.
+    float build_budget_ms = 2.0f;
+    // ChunkGpuData::detail_textures of every chunk, and roughly how many
+    // metres one repeat of the detail textures covers.
+    uint32_t detail_textures = kNoDetailTextures;
+    double detail_repeat = 32.0;
+    // Of a device with VK_EXT_mesh_shader enabled, for DrawMeshTasks(). The
+    // chunk meshes and draws are then made visible to its shaders too.
+    PFN_vkCmdDrawMeshTasksIndirectCountEXT draw_mesh_tasks = nullptr;
+  };
+
+  // Result of BenchmarkGeneration(), times in milliseconds.
+  struct GenerationBenchmark {
+    uint32_t chunks = 0;
+    const char *simd_path = "scalar";
+    double scalar_ms = 0.0;
+    double simd_ms = 0.0;
+    // Generation plus readback of the heights, 0 without a generator. Covers
+    // gpu_chunks chunks, which is less than `chunks` if the mesh buffer has
+    // fewer free slots.
+    uint32_t gpu_chunks = 0;
+    double gpu_ms = 0.0;
+    // Heights that differ from the scalar reference, should all be 0.
+    uint64_t simd_mismatches = 0;
+    uint64_t gpu_mismatches = 0;
+  };
+
+  struct Stats {
+    uint32_t node_count = 0;
+    uint32_t resident_chunks = 0;
+    uint32_t selected_chunks = 0;
+    uint32_t selected_vertices = 0;
+    uint32_t chunks_built = 0;
+    uint32_t max_selected_level = 0;
+    // Chunks that could not be built because their tile is still loading.
+    uint32_t chunks_waiting_for_tiles = 0;
+    // Generated on the job system's workers or waiting for their upload.
+    uint32_t chunks_in_flight = 0;
+    // Time the last Update() spent building chunks.
+    float build_ms = 0.0f;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  // The device has to be idle.
+  void Destroy();
+
+  // Refines the quadtree for the camera. Chunks that are missing for the
+  // refinement are generated and queued for upload, largest error first and
+  // within build_budget_ms, and nodes only split once all four children are
+  // resident so the surface never has holes. With a job system the CPU built
+  // chunks are generated in the background and uploaded by a later call.
+  // The selection is written to the chunk buffer of `frame`.
+  // `view_projection` maps camera relative positions to clip space.
+  void Update(uint32_t frame, const glm::dvec3 &camera_position,
+              const glm::mat4 &view_projection, float projection_scale);
+  // Resets the draw counts and dispatches the culling shader for `phase`.
+  // The cull pipeline and a descriptor set with the chunk buffer at binding
+  // 0, the draw buffer at binding 1 and the count buffer at binding 2, at the
+  // offsets of `frame` and `phase`, the visibility buffer at binding 3 and
+  // the occlusion data at binding 4 have to be bound. Outside a render pass.
+  void RecordCulling(VkCommandBuffer command_buffer, uint32_t frame,
+                     CullPhase phase,
+                     VkPipelineLayout cull_pipeline_layout) const;
+  // Draws whatever the culling pass of `frame` emitted for `group` in
+  // `phase`. Only reads the terrain, so different groups may be recorded
+  // concurrently.
+  void Draw(VkCommandBuffer command_buffer, uint32_t frame, uint32_t group,
+            CullPhase phase) const;
+  // The same with the pipeline of shaders/terrain.task and terrain.mesh,
+  // whose MeshTaskPushConstants it pushes through `pipeline_layout`. The
+  // culling pass has to have run with the draws of that path, which give
+  // every chunk one task workgroup. Needs CreateInfo::draw_mesh_tasks.
+  void DrawMeshTasks(VkCommandBuffer command_buffer, uint32_t frame,
+                     uint32_t group, CullPhase phase,
+                     VkPipelineLayout pipeline_layout) const;
+  uint32_t DrawGroupCount() const { return create_info_.draw_groups; }
+  // Binds the vertex slots and the index variants for draws like Draw()'s.
+  void BindMesh(VkCommandBuffer command_buffer) const;
+  // Chunks Update() wrote to the chunk buffer of `frame`.
+  uint32_t ChunkCount(uint32_t frame) const {
+    return frames_[frame].cull_constants.chunk_count;
+  }
+  // Changes whenever Update() selects other chunks than the last time.
+  uint64_t SelectionVersion() const { return selection_version_; }
+  // Bounds of every height the terrain can have.
+  double MinHeight() const { return min_height_; }
+  double MaxHeight() const { return max_height_; }
+
+  // Each buffer holds every frame in flight: frame f's part is
+  // ...BufferSize() bytes from ...BufferOffset(f), to be bound with dynamic
+  // descriptor offsets so one descriptor set serves all frames. The draw and
+  // count buffers have a part per frame and phase, kAll shares
+  // kLastVisible's.
+  VkBuffer ChunkBuffer() const { return chunk_buffer_; }
+  VkDeviceSize ChunkBufferSize() const {
+    return sizeof(ChunkGpuData) * create_info_.max_resident_chunks;
+  }
+  uint32_t ChunkBufferOffset(uint32_t frame) const {
+    return FrameOffset(ChunkBufferSize(), frame);
+  }
+  // The vertex slots for the mesh shader, from VertexDataOffset() to the end
+  // of the buffer, one Vertex per 32-bit word.
+  VkBuffer MeshBuffer() const { return mesh_buffer_; }
+  VkDeviceSize VertexDataOffset() const { return vertex_data_offset_; }
+  VkBuffer DrawBuffer() const { return draw_buffer_; }
+  VkDeviceSize DrawBufferSize() const {
+    return sizeof(VkDrawIndexedIndirectCommand) *
+           create_info_.max_resident_chunks;
+  }
+  uint32_t DrawBufferOffset(uint32_t frame, CullPhase phase) const {
+    return FrameOffset(DrawBufferSize(), PhaseRegion(frame, phase));
+  }
+  VkBuffer CountBuffer() const { return count_buffer_; }
+  VkDeviceSize CountBufferSize() const {
+    return sizeof(uint32_t) * create_info_.draw_groups;
+  }
+  uint32_t CountBufferOffset(uint32_t frame, CullPhase phase) const {
+    return FrameOffset(CountBufferSize(), PhaseRegion(frame, phase));
+  }
+  // Whether each mesh slot's chunk passed the last kNewlyVisible test, one
+  // uint per slot. Shared by all frames, which cull in submission order.
+  VkBuffer VisibilityBuffer() const { return visibility_buffer_; }
+  VkDeviceSize VisibilityBufferSize() const {
+    return sizeof(uint32_t) * create_info_.max_resident_chunks;
+  }
+  // Everything of CullOcclusionData the terrain knows, for the culling of
+  // `frame`. The Hi-Z fields are up to the caller.
+  const CullOcclusionData &OcclusionData(uint32_t frame) const {
+    return frames_[frame].occlusion;
+  }
+
+  const Stats &GetStats() const { return stats_; }
+
+  // Generates the heights of `chunk_count` chunks spread over the planet with
+  // the scalar and SIMD CPU paths and with the generator, times each and
+  // compares them. Blocks on the GPU, meant for benchmark runs only.
+  GenerationBenchmark BenchmarkGeneration(uint32_t chunk_count);
+
+  // Writes the heights of every node down to `levels` as a height tile file
+  // for CreateInfo::height_tiles.
+  static bool BakeHeightTiles(const TerrainNoise &noise, uint32_t grid_size,
+                              uint32_t levels, const std::string &path);
+  // The same nodes as a kRgba8 imagery tile file for VirtualTexture, coloured
+  // by height.
+  static bool BakeImageryTiles(const TerrainNoise &noise, uint32_t grid_size,
+                               uint32_t levels, const std::string &path);
+
+private:
+  struct Node {
+    uint32_t face = 0;
+    uint32_t level = 0;
+    // Position of the node in the 2^level x 2^level grid of its face.
+    uint32_t x = 0;
+    uint32_t y = 0;
+
+    // Also the origin of the chunk's vertices.
+    glm::dvec3 center{0.0};
+    float center_height = 0.0f;
+    // Bounds of the heights of the chunk's vertices, the range the 16-bit
+    // vertex heights are quantized to.
+    float height_min = 0.0f;
+    float height_range = 0.0f;
+    double bounding_radius = 0.0;
+    // World space error of the node's mesh, shrinks with every level.
+    double geometric_error = 0.0;
+
+    // Slot in the shared mesh buffer, valid while has_mesh is set.
+    uint32_t slot = 0;
+    // Ticket of the upload or, for generated_on_gpu, of the generator.
+    uint64_t upload_ticket = 0;
+    bool generated_on_gpu = false;
+    bool has_mesh = false;
+    // Generated in the background, has_mesh is set once it is uploaded. The
+    // node is kept until then, the build points to it.
+    bool building = false;
+
+    uint64_t last_used_frame = 0;
+    std::array<std::unique_ptr<Node>, 4> children;
+  };
+
+  struct FrameResources {
+    CullPushConstants cull_constants{};
+    CullOcclusionData occlusion{};
+  };
+
+  // Edges of a chunk in the order of the skirt vertices, also the bits of a
+  // stitch mask.
+  enum Edge : uint32_t {
+    kEdgeMinusU = 1,
+    kEdgePlusU = 2,
+    kEdgeMinusV = 4,
+    kEdgePlusV = 8,
+  };
+  static constexpr uint32_t kStitchVariants = 16;
+
+  // A chunk mesh generated on the CPU, a copy of everything GenerateMesh()
+  // reads from the node so it can run on any thread.
+  struct MeshBuild {
+    Node *node = nullptr;
+    uint32_t slot = 0;
+    ChunkLattice lattice{};
+    float height_min = 0.0f;
+    float height_range = 0.0f;
+    double geometric_error = 0.0;
+    // From the height tile, the heightfield's if empty.
+    std::vector<float> bordered_heights;
+    std::vector<Vertex> vertices;
+    std::vector<float> heights;
+  };
+
+  // Sets up lattice_, checks grid_size against the 16-bit indices and clamps
+  // max_level to the lattice.
+  bool ConfigureLattice();
+  // Frames start at multiples of 256 bytes, the largest
+  // minStorageBufferOffsetAlignment a device may have.
+  static uint32_t FrameOffset(VkDeviceSize frame_size, uint32_t frame) {
+    return static_cast<uint32_t>((frame_size + 255) & ~VkDeviceSize{255}) *
+           frame;
+  }
+  static uint32_t PhaseRegion(uint32_t frame, CullPhase phase) {
+    return 2 * frame + (phase == CullPhase::kNewlyVisible ? 1 : 0);
+  }
+  bool CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                    VkMemoryPropertyFlags properties, VkBuffer &buffer,
+                    GpuAllocation &allocation);
+  void DestroyBuffer(VkBuffer buffer, const GpuAllocation &allocation);
+  void InitNode(Node &node, uint32_t face, uint32_t level, uint32_t x,
+                uint32_t y) const;
+  float ScreenSpaceError(const Node &node, const glm::dvec3 &camera_position,
+                         float projection_scale) const;
+  bool IsResident(const Node &node) const;
+  bool ChildrenResident(const Node &node) const;
+  static TileKey TileKeyOf(const Node &node) {
+    return {node.face, node.level, node.x, node.y};
+  }
+  ChunkLattice LatticeOf(const Node &node) const {
+    return lattice_.LatticeOf(TileKeyOf(node));
+  }
+  // Writes encode(bordered heights) of every node down to `levels`.
+  static bool BakeTiles(
+      const TerrainNoise &noise, uint32_t grid_size, uint32_t levels,
+      const std::string &path, TileFormat format,
+      const std::function<std::vector<uint8_t>(const std::vector<float> &)>
+          &encode);
+  // Queues the generation of the node's mesh on the GPU or generates it on
+  // the CPU and queues its upload. `priority` orders the load of the node's
+  // height tile if it is not resident yet. With `background` a CPU mesh is
+  // only queued for LaunchBuilds(), false if the last launch is not uploaded
+  // yet.
+  bool BuildMesh(Node &node, float priority, bool background);
+  // Fills the build's vertices and heights.
+  void GenerateMesh(MeshBuild &build) const;
+  // Queues the upload of a generated mesh and gives the node its slot. False
+  // if the staging ring is full.
+  bool UploadMesh(MeshBuild &build);
+  // Hands this frame's background builds to the job system.
+  void LaunchBuilds();
+  // Uploads finished background builds until `budget_ms` runs out. Returns
+  // the time spent.
+  double CollectBuilds(double budget_ms);
+  // Requests the tiles of the node's children ahead of the refinement.
+  void PrefetchChildTiles(const Node &node, float priority);
+  HeightfieldPushConstants GeneratorConstants(const Node &node,
+                                              uint32_t slot) const;
+  // Heights of the chunk's vertices plus a border of one vertex, row by row.
+  std::vector<float> BorderedHeights(const ChunkLattice &lattice,
+                                     bool simd) const;
+  // Edges the node shares with a selected node one level coarser on the same
+  // face, from selected_keys_.
+  uint32_t StitchMask(const Node &node) const;
+  void ReleaseMesh(Node &node);
+  void ReleaseChildren(Node &node);
+  // Drops subtrees that were not visited for a while.
+  void EvictUnused(Node &node);
+  // Creates the mesh buffer and uploads the index variants.
+  bool CreateMeshBuffer();
+  uint32_t GridVerticesPerChunk() const {
+    return create_info_.grid_size * create_info_.grid_size;
+  }
+  // The grid followed by the skirt, one copy of every edge's vertices.
+  uint32_t VerticesPerChunk() const {
+    return GridVerticesPerChunk() + 4 * create_info_.grid_size;
+  }
+  uint32_t BorderedVerticesPerChunk() const {
+    return (create_info_.grid_size + 2) * (create_info_.grid_size + 2);
+  }
+
+  CreateInfo create_info_;
+  TerrainLattice lattice_;
+  // log2 of the lattice units one detail texture repeat covers.
+  uint32_t detail_shift_ = 0;
+  // Bounds of the heightfield and the height tiles.
+  double min_height_ = 0.0;
+  double max_height_ = 0.0;
+  std::array<std::unique_ptr<Node>, 6> roots_;
+  std::vector<const Node *> selected_;
+  // TileKey::Pack() of every selected node, for the stitch masks.
+  std::unordered_set<uint64_t> selected_keys_;
+  uint64_t selection_version_ = 0;
+
+  // 16-bit index variants at offset 0, the vertex slots from
+  // vertex_data_offset_.
+  VkBuffer mesh_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation mesh_allocation_;
+  VkDeviceSize vertex_data_offset_ = 0;
+  // Index range of every stitch mask's variant.
+  std::array<uint32_t, kStitchVariants> first_index_{};
+  std::array<uint32_t, kStitchVariants> index_count_{};
+
+  // One float per vertex, laid out like the vertex slots.
+  VkBuffer height_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation height_allocation_;
+  std::vector<uint32_t> free_slots_;
+  // Background builds: queued_builds_ gathers the current frame's, the ones
+  // in launched_builds_ are being generated by build_jobs_ or wait for their
+  // upload. Only one launch is in flight, its builds own their slots.
+  std::vector<MeshBuild> queued_builds_;
+  std::vector<MeshBuild> launched_builds_;
+  JobSystem::Handle build_jobs_;
+
+  VkBuffer chunk_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation chunk_allocation_;
+  VkBuffer draw_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation draw_allocation_;
+  // One draw count per group.
+  VkBuffer count_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation count_allocation_;
+  // Never cleared, whatever a slot holds only decides in which phase its
+  // chunk is tested.
+  VkBuffer visibility_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation visibility_allocation_;
+  std::vector<FrameResources> frames_;
+
+  uint64_t frame_ = 0;
+  // For the prefetch, the camera's motion is extrapolated from the last
+  // frame.
+  glm::dvec3 last_camera_position_{0.0};
+  Stats stats_;
+};
@@ -0,0 +1,472 @@
+#include "terrain_generator.h"
+#include "shader_library.h"
+#include <array>
+#include <spdlog/spdlog.h>
+
+bool TerrainGenerator::Init(const CreateInfo &create_info) {
+  device_ = create_info.device;
+  compute_queue_ = create_info.compute_queue;
+  compute_family_ = create_info.compute_family;
+  graphics_family_ = create_info.graphics_family;
+  pipeline_cache_ = create_info.pipeline_cache;
+  grid_size_ = create_info.grid_size;
+  grid_vertices_per_chunk_ = create_info.grid_size * create_info.grid_size;
+  vertices_per_chunk_ = grid_vertices_per_chunk_ + 4 * create_info.grid_size;
+  mesh_shaders_ = create_info.mesh_shaders;
+
+  VkCommandPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                    VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = compute_family_;
+  if (vkCreateCommandPool(device_, &pool_info, nullptr, &command_pool_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create terrain generator command pool.");
+    return false;
+  }
+
+  VkSemaphoreTypeCreateInfo type_info{};
+  type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  type_info.initialValue = 0;
+  VkSemaphoreCreateInfo semaphore_info{};
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphore_info.pNext = &type_info;
+  if (vkCreateSemaphore(device_, &semaphore_info, nullptr,
+                        &timeline_semaphore_) != VK_SUCCESS) {
+    spdlog::error("Failed to create terrain generator timeline semaphore.");
+    return false;
+  }
+
+  if (!CreatePipeline(create_info)) {
+    return false;
+  }
+
+  spdlog::info("Terrain generator on compute family {}{}", compute_family_,
+               NeedsOwnershipTransfer() ? " (async)" : "");
+  return true;
+}
+
+void TerrainGenerator::Destroy() {
+  if (device_ == VK_NULL_HANDLE) {
+    return;
+  }
+  WaitIdle();
+  for (const RetiredPipeline &retired : retired_pipelines_) {
+    vkDestroyPipeline(device_, retired.pipeline, nullptr);
+  }
+  retired_pipelines_.clear();
+  vkDestroyPipeline(device_, pipeline_, nullptr);
+  vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr);
+  vkDestroyDescriptorPool(device_, descriptor_pool_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_, nullptr);
+  vkDestroyCommandPool(device_, command_pool_, nullptr);
+  vkDestroySemaphore(device_, timeline_semaphore_, nullptr);
+  pipeline_ = VK_NULL_HANDLE;
+  pipeline_layout_ = VK_NULL_HANDLE;
+  descriptor_pool_ = VK_NULL_HANDLE;
+  descriptor_set_layout_ = VK_NULL_HANDLE;
+  command_pool_ = VK_NULL_HANDLE;
+  timeline_semaphore_ = VK_NULL_HANDLE;
+  free_command_buffers_.clear();
+  submitted_batches_.clear();
+  open_batch_ = Batch{};
+  next_ticket_ = 1;
+}
+
+bool TerrainGenerator::CreatePipeline(const CreateInfo &create_info) {
+  // Binding 0: vertices, binding 1: heights.
+  std::array<VkDescriptorSetLayoutBinding, 2> bindings{};
+  for (uint32_t i = 0; i < bindings.size(); ++i) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+  layout_info.pBindings = bindings.data();
+  if (vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
+                                  &descriptor_set_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create heightfield descriptor set layout.");
+    return false;
+  }
+
+  VkDescriptorPoolSize pool_size{};
+  pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  pool_size.descriptorCount = static_cast<uint32_t>(bindings.size());
+  VkDescriptorPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.poolSizeCount = 1;
+  pool_info.pPoolSizes = &pool_size;
+  pool_info.maxSets = 1;
+  VkDescriptorSetAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &descriptor_set_layout_;
+  if (vkCreateDescriptorPool(device_, &pool_info, nullptr,
+                             &descriptor_pool_) != VK_SUCCESS ||
+      (allocate_info.descriptorPool = descriptor_pool_,
+       vkAllocateDescriptorSets(device_, &allocate_info, &descriptor_set_)) !=
+          VK_SUCCESS) {
+    spdlog::error("Failed to allocate heightfield descriptor set.");
+    return false;
+  }
+
+  VkPushConstantRange push_constant_range{};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = sizeof(HeightfieldPushConstants);
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &descriptor_set_layout_;
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &pipeline_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create heightfield pipeline layout.");
+    return false;
+  }
+  return CreateComputePipeline(create_info.shader_code, pipeline_);
+}
+
+bool TerrainGenerator::CreateComputePipeline(
+    const std::vector<char> &shader_code, VkPipeline &pipeline) {
+  VkShaderModuleCreateInfo module_info{};
+  module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  module_info.codeSize = shader_code.size();
+  module_info.pCode = reinterpret_cast<const uint32_t *>(shader_code.data());
+  VkShaderModule shader_module;
+  if (shader_code.empty() ||
+      vkCreateShaderModule(device_, &module_info, nullptr, &shader_module) !=
+          VK_SUCCESS) {
+    spdlog::error("Failed to create heightfield shader module.");
+    return false;
+  }
+
+  // The grid size sizes the shader's shared memory.
+  SpecializationConstants specialization{grid_size_};
+
+  VkComputePipelineCreateInfo pipeline_info{};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = shader_module;
+  pipeline_info.stage.pName = "main";
+  pipeline_info.stage.pSpecializationInfo = specialization.Info();
+  pipeline_info.layout = pipeline_layout_;
+  VkResult result = vkCreateComputePipelines(
+      device_, pipeline_cache_, 1, &pipeline_info, nullptr, &pipeline);
+  vkDestroyShaderModule(device_, shader_module, nullptr);
+  if (result != VK_SUCCESS) {
+    spdlog::error("Failed to create heightfield pipeline.");
+    return false;
+  }
+  return true;
+}
+
+bool TerrainGenerator::ReloadShader(const std::vector<char> &shader_code) {
+  VkPipeline pipeline;
+  if (!CreateComputePipeline(shader_code, pipeline)) {
+    return false;
+  }
+  // The open batch has the old pipeline bound already.
+  uint64_t last_ticket = open_batch_.command_buffer != VK_NULL_HANDLE
+                             ? next_ticket_
+                             : next_ticket_ - 1;
+  retired_pipelines_.push_back({pipeline_, last_ticket});
+  pipeline_ = pipeline;
+  return true;
+}
+
+void TerrainGenerator::SetTargets(VkBuffer vertex_buffer,
+                                  VkDeviceSize vertex_offset,
+                                  VkDeviceSize vertex_size,
+                                  VkBuffer height_buffer,
+                                  VkDeviceSize height_size) {
+  vertex_buffer_ = vertex_buffer;
+  vertex_offset_ = vertex_offset;
+  height_buffer_ = height_buffer;
+
+  std::array<VkDescriptorBufferInfo, 2> buffer_infos{};
+  buffer_infos[0].buffer = vertex_buffer;
+  buffer_infos[0].offset = vertex_offset;
+  buffer_infos[0].range = vertex_size;
+  buffer_infos[1].buffer = height_buffer;
+  buffer_infos[1].range = height_size;
+
+  std::array<VkWriteDescriptorSet, 2> descriptor_writes{};
+  for (uint32_t i = 0; i < descriptor_writes.size(); ++i) {
+    descriptor_writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_writes[i].dstSet = descriptor_set_;
+    descriptor_writes[i].dstBinding = i;
+    descriptor_writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptor_writes[i].descriptorCount = 1;
+    descriptor_writes[i].pBufferInfo = &buffer_infos[i];
+  }
+  vkUpdateDescriptorSets(device_,
+                         static_cast<uint32_t>(descriptor_writes.size()),
+                         descriptor_writes.data(), 0, nullptr);
+}
+
+std::optional<uint64_t>
+TerrainGenerator::Generate(const HeightfieldPushConstants &chunk) {
+  Reclaim();
+
+  if (!BeginBatch()) {
+    return std::nullopt;
+  }
+
+  // Chunks of a batch write disjoint slots, the dispatches need no barriers
+  // between them.
+  vkCmdPushConstants(open_batch_.command_buffer, pipeline_layout_,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(chunk), &chunk);
+  vkCmdDispatch(open_batch_.command_buffer, 1, 1, 1);
+
+  // A vertex is one packed uint, see Vertex.
+  const VkDeviceSize vertex_size = sizeof(uint32_t);
+  VkDeviceSize first_vertex = chunk.vertex_offset;
+  open_batch_.regions.push_back(
+      {vertex_buffer_, vertex_offset_ + first_vertex * vertex_size,
+       vertices_per_chunk_ * vertex_size});
+  open_batch_.regions.push_back({height_buffer_, first_vertex * sizeof(float),
+                                 grid_vertices_per_chunk_ * sizeof(float)});
+  return next_ticket_;
+}
+
+void TerrainGenerator::RecordHeightReadback(
+    VkBuffer destination, const std::vector<VkBufferCopy> &regions) {
+  if (regions.empty() || !BeginBatch()) {
+    return;
+  }
+  VkBufferMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = height_buffer_;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(open_batch_.command_buffer,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
+                       &barrier, 0, nullptr);
+  vkCmdCopyBuffer(open_batch_.command_buffer, height_buffer_, destination,
+                  static_cast<uint32_t>(regions.size()), regions.data());
+
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  barrier.buffer = destination;
+  vkCmdPipelineBarrier(open_batch_.command_buffer,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &barrier,
+                       0, nullptr);
+}
+
+void TerrainGenerator::Flush() {
+  if (open_batch_.command_buffer == VK_NULL_HANDLE) {
+    return;
+  }
+
+  if (NeedsOwnershipTransfer() && !open_batch_.regions.empty()) {
+    std::vector<VkBufferMemoryBarrier> barriers;
+    barriers.reserve(open_batch_.regions.size());
+    for (const Region &region : open_batch_.regions) {
+      VkBufferMemoryBarrier barrier{};
+      barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+      barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      barrier.dstAccessMask = 0;
+      barrier.srcQueueFamilyIndex = compute_family_;
+      barrier.dstQueueFamilyIndex = graphics_family_;
+      barrier.buffer = region.buffer;
+      barrier.offset = region.offset;
+      barrier.size = region.size;
+      barriers.push_back(barrier);
+    }
+    vkCmdPipelineBarrier(open_batch_.command_buffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+                         static_cast<uint32_t>(barriers.size()),
+                         barriers.data(), 0, nullptr);
+  }
+  vkEndCommandBuffer(open_batch_.command_buffer);
+
+  open_batch_.ticket = next_ticket_++;
+
+  VkTimelineSemaphoreSubmitInfo timeline_info{};
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &open_batch_.ticket;
+
+  VkSubmitInfo submit_info{};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.pNext = &timeline_info;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &open_batch_.command_buffer;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = &timeline_semaphore_;
+
+  if (vkQueueSubmit(compute_queue_, 1, &submit_info, VK_NULL_HANDLE) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to submit terrain generation batch.");
+  }
+
+  submitted_batches_.push_back(std::move(open_batch_));
+  open_batch_ = Batch{};
+}
+
+uint64_t
+TerrainGenerator::RecordAcquireBarriers(VkCommandBuffer command_buffer) {
+  // Also covers a generator that was never initialized.
+  if (submitted_batches_.empty()) {
+    return 0;
+  }
+  uint64_t completed = CompletedTicket();
+  uint64_t wait_value = 0;
+  std::vector<VkBufferMemoryBarrier> barriers;
+
+  // Only finished batches are acquired, the graphics queue never waits on
+  // generation in progress.
+  for (Batch &batch : submitted_batches_) {
+    if (batch.ticket > completed) {
+      break;
+    }
+    if (batch.acquired) {
+      continue;
+    }
+    if (NeedsOwnershipTransfer()) {
+      for (const Region &region : batch.regions) {
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = region.buffer == vertex_buffer_
+                                    ? VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+                                    : VK_ACCESS_SHADER_READ_BIT;
+        if (mesh_shaders_) {
+          barrier.dstAccessMask |= VK_ACCESS_SHADER_READ_BIT;
+        }
+        barrier.srcQueueFamilyIndex = compute_family_;
+        barrier.dstQueueFamilyIndex = graphics_family_;
+        barrier.buffer = region.buffer;
+        barrier.offset = region.offset;
+        barrier.size = region.size;
+        barriers.push_back(barrier);
+      }
+    }
+    batch.acquired = true;
+    wait_value = batch.ticket;
+    acquired_ticket_ = batch.ticket;
+  }
+
+  if (!barriers.empty()) {
+    VkPipelineStageFlags dst_stages = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                                      VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                                      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    if (mesh_shaders_) {
+      dst_stages |= VK_PIPELINE_STAGE_TASK_SHADER_BIT_EXT |
+                    VK_PIPELINE_STAGE_MESH_SHADER_BIT_EXT;
+    }
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         dst_stages, 0, 0, nullptr,
+                         static_cast<uint32_t>(barriers.size()),
+                         barriers.data(), 0, nullptr);
+  }
+
+  Reclaim();
+  return wait_value;
+}
+
+bool TerrainGenerator::IsComplete(uint64_t ticket) const {
+  return ticket <= CompletedTicket();
+}
+
+void TerrainGenerator::WaitIdle() {
+  uint64_t last_ticket = next_ticket_ - 1;
+  if (last_ticket == 0) {
+    return;
+  }
+  VkSemaphoreWaitInfo wait_info{};
+  wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &timeline_semaphore_;
+  wait_info.pValues = &last_ticket;
+  vkWaitSemaphores(device_, &wait_info, UINT64_MAX);
+}
+
+uint64_t TerrainGenerator::CompletedTicket() const {
+  uint64_t value = 0;
+  vkGetSemaphoreCounterValue(device_, timeline_semaphore_, &value);
+  return value;
+}
+
+void TerrainGenerator::Reclaim() {
+  if (submitted_batches_.empty() && retired_pipelines_.empty()) {
+    return;
+  }
+  uint64_t completed = CompletedTicket();
+  std::erase_if(retired_pipelines_, [&](const RetiredPipeline &retired) {
+    if (retired.last_ticket > completed) {
+      return false;
+    }
+    vkDestroyPipeline(device_, retired.pipeline, nullptr);
+    return true;
+  });
+  for (Batch &batch : submitted_batches_) {
+    if (batch.ticket > completed) {
+      break;
+    }
+    if (batch.command_buffer != VK_NULL_HANDLE) {
+      vkResetCommandBuffer(batch.command_buffer, 0);
+      free_command_buffers_.push_back(batch.command_buffer);
+      batch.command_buffer = VK_NULL_HANDLE;
+    }
+  }
+  while (!submitted_batches_.empty() && submitted_batches_.front().acquired &&
+         submitted_batches_.front().command_buffer == VK_NULL_HANDLE) {
+    submitted_batches_.pop_front();
+  }
+}
+
+bool TerrainGenerator::BeginBatch() {
+  if (open_batch_.command_buffer != VK_NULL_HANDLE) {
+    return true;
+  }
+  open_batch_.command_buffer = AcquireCommandBuffer();
+  if (open_batch_.command_buffer == VK_NULL_HANDLE) {
+    return false;
+  }
+  VkCommandBufferBeginInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(open_batch_.command_buffer, &begin_info);
+  vkCmdBindPipeline(open_batch_.command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    pipeline_);
+  vkCmdBindDescriptorSets(open_batch_.command_buffer,
+                          VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_layout_, 0,
+                          1, &descriptor_set_, 0, nullptr);
+  return true;
+}
+
+VkCommandBuffer TerrainGenerator::AcquireCommandBuffer() {
+  if (!free_command_buffers_.empty()) {
+    VkCommandBuffer command_buffer = free_command_buffers_.back();
+    free_command_buffers_.pop_back();
+    return command_buffer;
+  }
+
+  VkCommandBufferAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = command_pool_;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  if (vkAllocateCommandBuffers(device_, &allocate_info, &command_buffer) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to allocate terrain generator command buffer.");
+  }
+  return command_buffer;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <glm/glm.hpp>
+#include <optional>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Push constants of shaders/heightfield.comp, one chunk per dispatch.
+struct HeightfieldPushConstants {
+  // terrain_noise::Params.
+  uint32_t seed;
+  int32_t base_cell_shift;
+  uint32_t octaves;
+  uint32_t ridge_octaves;
+  float continent_amplitude;
+  float ridge_amplitude;
+  float warp_amount;
+  // First vertex of the chunk's slot, in the vertex and the height buffer.
+  uint32_t vertex_offset;
+  // Lattice point of the centre vertex and the lattice steps between
+  // neighbouring vertices along the face's u and v axes. w unused.
+  glm::ivec4 center;
+  glm::ivec4 step_u;
+  glm::ivec4 step_v;
+  // xyz: unit direction of the centre vertex, w unused.
+  glm::vec4 center_direction;
+  // x: lowest height and y: height range the vertex heights are quantized
+  // to, z: metres between neighbouring vertices, w: inverse of the lattice
+  // half extent.
+  glm::vec4 params;
+};
+static_assert(sizeof(HeightfieldPushConstants) <= 128,
+              "Vulkan only guarantees 128 bytes of push constants.");
+
+// Generates terrain chunks with shaders/heightfield.comp on the compute
+// queue, which is an async compute family when the device has one. Works like
+// UploadManager: dispatches are batched into one submit per Flush(), each
+// batch signals a timeline value (its ticket) and, across queue families, the
+// ownership release is recorded with the dispatches and the acquire by the
+// render thread with RecordAcquireBarriers().
+//
+// Render thread only.
+class TerrainGenerator {
+public:
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    VkQueue compute_queue = VK_NULL_HANDLE;
+    uint32_t compute_family = 0;
+    uint32_t graphics_family = 0;
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    // SPIR-V of shaders/heightfield.comp.
+    std::vector<char> shader_code;
+    uint32_t grid_size = 33;
+    // The terrain's mesh shaders read the vertices too, as a storage buffer.
+    // Needs VK_EXT_mesh_shader enabled.
+    bool mesh_shaders = false;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  void Destroy();
+
+  // Buffers the chunks are written to: the vertex slots of Terrain's mesh
+  // buffer, `vertex_size` bytes from `vertex_offset`, which has to be aligned
+  // to minStorageBufferOffsetAlignment, and the height buffer with one float
+  // per vertex. Both need storage buffer usage.
+  void SetTargets(VkBuffer vertex_buffer, VkDeviceSize vertex_offset,
+                  VkDeviceSize vertex_size, VkBuffer height_buffer,
+                  VkDeviceSize height_size);
+
+  // Queues the generation of one chunk. Returns the ticket at which it is on
+  // the GPU, or std::nullopt if recording failed.
+  std::optional<uint64_t> Generate(const HeightfieldPushConstants &chunk);
+
+  // Copies `regions` of the height buffer into `destination`, host visible
+  // memory, once the dispatches queued so far are done. The data can be read
+  // after WaitIdle(). Meant for benchmarks, call it right before Flush().
+  void RecordHeightReadback(VkBuffer destination,
+                            const std::vector<VkBufferCopy> &regions);
+
+  // Submits every queued dispatch in one batch on the compute queue.
+  void Flush();
+
+  // Same contract as UploadManager::RecordAcquireBarriers().
+  uint64_t RecordAcquireBarriers(VkCommandBuffer command_buffer);
+  uint64_t AcquiredTicket() const { return acquired_ticket_; }
+
+  // Swaps in a new build of shaders/heightfield.comp for the chunks queued
+  // from now on, the ones generated before keep their heights. The old
+  // pipeline is destroyed once the batches using it are done. Keeps the old
+  // one and returns false if the new one fails.
+  bool ReloadShader(const std::vector<char> &shader_code);
+
+  bool IsComplete(uint64_t ticket) const;
+  // Blocks until every submitted batch is done.
+  void WaitIdle();
+
+  VkSemaphore GetTimelineSemaphore() const { return timeline_semaphore_; }
+
+private:
+  struct Region {
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+  };
+
+  struct Batch {
+    VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+    std::vector<Region> regions;
+    uint64_t ticket = 0;
+    bool acquired = false;
+  };
+
+  bool NeedsOwnershipTransfer() const {
+    return compute_family_ != graphics_family_;
+  }
+  struct RetiredPipeline {
+    VkPipeline pipeline;
+    // Last batch that may use it.
+    uint64_t last_ticket;
+  };
+
+  bool CreatePipeline(const CreateInfo &create_info);
+  bool CreateComputePipeline(const std::vector<char> &shader_code,
+                             VkPipeline &pipeline);
+  // Starts open_batch_ if there is none.
+  bool BeginBatch();
+  uint64_t CompletedTicket() const;
+  // Recycles the command buffers of retired batches.
+  void Reclaim();
+  VkCommandBuffer AcquireCommandBuffer();
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkQueue compute_queue_ = VK_NULL_HANDLE;
+  uint32_t compute_family_ = 0;
+  uint32_t graphics_family_ = 0;
+  VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
+  uint32_t grid_size_ = 0;
+  // Grid and skirt, see Terrain::VerticesPerChunk(), and the grid alone,
+  // which has heights.
+  uint32_t vertices_per_chunk_ = 0;
+  uint32_t grid_vertices_per_chunk_ = 0;
+  bool mesh_shaders_ = false;
+
+  VkDescriptorSetLayout descriptor_set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorPool descriptor_pool_ = VK_NULL_HANDLE;
+  VkDescriptorSet descriptor_set_ = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline pipeline_ = VK_NULL_HANDLE;
+  std::vector<RetiredPipeline> retired_pipelines_;
+  VkBuffer vertex_buffer_ = VK_NULL_HANDLE;
+  VkDeviceSize vertex_offset_ = 0;
+  VkBuffer height_buffer_ = VK_NULL_HANDLE;
+
+  VkCommandPool command_pool_ = VK_NULL_HANDLE;
+  std::vector<VkCommandBuffer> free_command_buffers_;
+  VkSemaphore timeline_semaphore_ = VK_NULL_HANDLE;
+
+  // Batch currently collecting dispatches, not yet submitted.
+  Batch open_batch_;
+  // Submitted batches in ticket order, dropped once retired and acquired.
+  std::deque<Batch> submitted_batches_;
+  uint64_t next_ticket_ = 1;
+  uint64_t acquired_ticket_ = 0;
+};
@@ -0,0 +1,127 @@
+#include "terrain_lattice.h"
+#include <array>
+#include <bit>
+#include <glm/gtc/constants.hpp>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+struct FaceBasis {
+  glm::dvec3 normal;
+  glm::dvec3 u;
+  glm::dvec3 v;
+};
+
+// cross(u, v) == normal, so grid triangles wound counter-clockwise in face
+// space are counter-clockwise when seen from outside the planet.
+const std::array<FaceBasis, TerrainLattice::kFaceCount> kFaces = {{
+    {{1.0, 0.0, 0.0}, {0.0, 0.0, -1.0}, {0.0, 1.0, 0.0}},
+    {{-1.0, 0.0, 0.0}, {0.0, 0.0, 1.0}, {0.0, 1.0, 0.0}},
+    {{0.0, 1.0, 0.0}, {1.0, 0.0, 0.0}, {0.0, 0.0, -1.0}},
+    {{0.0, -1.0, 0.0}, {1.0, 0.0, 0.0}, {0.0, 0.0, 1.0}},
+    {{0.0, 0.0, 1.0}, {1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}},
+    {{0.0, 0.0, -1.0}, {-1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}},
+}};
+
+// Spherified cube mapping of a point on the surface of the [-1, 1]^3 cube,
+// distributes vertices more evenly than plain normalization.
+glm::dvec3 CubeToSphere(const glm::dvec3 &p) {
+  glm::dvec3 p2 = p * p;
+  return {p.x * glm::sqrt(1.0 - p2.y * 0.5 - p2.z * 0.5 + p2.y * p2.z / 3.0),
+          p.y * glm::sqrt(1.0 - p2.z * 0.5 - p2.x * 0.5 + p2.z * p2.x / 3.0),
+          p.z * glm::sqrt(1.0 - p2.x * 0.5 - p2.y * 0.5 + p2.x * p2.y / 3.0)};
+}
+
+} // namespace
+
+bool TerrainLattice::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  const uint32_t cells = create_info_.grid_size - 1;
+  if (cells < 2 || !std::has_single_bit(cells)) {
+    spdlog::error("Terrain grid size {} is not 2^k + 1.",
+                  create_info_.grid_size);
+    return false;
+  }
+  grid_shift_ = static_cast<uint32_t>(std::countr_zero(cells));
+  // Vertices of deeper levels would fall between lattice points.
+  const uint32_t deepest_level = kShift + 1 - grid_shift_;
+  if (create_info_.max_level > deepest_level) {
+    spdlog::warn("Terrain max level clamped from {} to {}.",
+                 create_info_.max_level, deepest_level);
+    create_info_.max_level = deepest_level;
+  }
+  return true;
+}
+
+double TerrainLattice::MetresPerUnit() const {
+  // A power of two keeps the wrapped coordinates exact.
+  return create_info_.radius * glm::pi<double>() / (4.0 * kHalfExtent);
+}
+
+ChunkLattice TerrainLattice::LatticeOf(const TileKey &key) const {
+  const FaceBasis &basis = kFaces[key.face];
+  const int32_t cell = 1 << (kShift + 1 - key.level);
+  const int32_t step = cell >> grid_shift_;
+  const int32_t half_grid = static_cast<int32_t>(create_info_.grid_size / 2);
+  int32_t u = -kHalfExtent + static_cast<int32_t>(key.x) * cell +
+              half_grid * step;
+  int32_t v = -kHalfExtent + static_cast<int32_t>(key.y) * cell +
+              half_grid * step;
+
+  glm::ivec3 normal(basis.normal);
+  glm::ivec3 axis_u(basis.u);
+  glm::ivec3 axis_v(basis.v);
+  return {normal * kHalfExtent + axis_u * u + axis_v * v, axis_u * step,
+          axis_v * step};
+}
+
+glm::dvec3 TerrainLattice::FaceToSphere(uint32_t face, double u, double v) {
+  const FaceBasis &basis = kFaces[face];
+  return CubeToSphere(basis.normal + basis.u * u + basis.v * v);
+}
+
+glm::dvec3 TerrainLattice::LatticeToSphere(const glm::ivec3 &point) {
+  return CubeToSphere(glm::dvec3(point) / static_cast<double>(kHalfExtent));
+}
+
+glm::dvec2 TerrainLattice::SphereToFace(const glm::dvec3 &direction,
+                                        uint32_t &face) {
+  // The spherified cube keeps every point on the face of its largest
+  // component. Newton's method from the plain cube projection converges in a
+  // few steps, the mapping is smooth and close to it.
+  face = 0;
+  double largest = -1.0;
+  for (uint32_t f = 0; f < kFaces.size(); ++f) {
+    double d = glm::dot(direction, kFaces[f].normal);
+    if (d > largest) {
+      largest = d;
+      face = f;
+    }
+  }
+  const FaceBasis &basis = kFaces[face];
+  glm::dvec3 target = glm::normalize(direction);
+  glm::dvec2 uv = glm::clamp(
+      glm::dvec2(glm::dot(target, basis.u), glm::dot(target, basis.v)) /
+          glm::dot(target, basis.normal),
+      -1.0, 1.0);
+  constexpr double kStep = 1e-7;
+  for (int iteration = 0; iteration < 8; ++iteration) {
+    glm::dvec3 p = FaceToSphere(face, uv.x, uv.y);
+    glm::dvec3 du = (FaceToSphere(face, uv.x + kStep, uv.y) - p) / kStep;
+    glm::dvec3 dv = (FaceToSphere(face, uv.x, uv.y + kStep) - p) / kStep;
+    glm::dvec3 r = target - p;
+    // Least squares over the 2D tangent plane.
+    double a = glm::dot(du, du);
+    double b = glm::dot(du, dv);
+    double c = glm::dot(dv, dv);
+    double det = a * c - b * b;
+    glm::dvec2 delta = glm::dvec2(c * glm::dot(du, r) - b * glm::dot(dv, r),
+                                  a * glm::dot(dv, r) - b * glm::dot(du, r)) /
+                       det;
+    uv = glm::clamp(uv + delta, -1.0, 1.0);
+    if (glm::length(delta) < 1e-13) {
+      break;
+    }
+  }
+  return uv;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "tile_file.h"
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Lattice point of a chunk's centre vertex and the lattice steps from one
+// vertex to the next along the face's u and v axes.
+struct ChunkLattice {
+  glm::ivec3 center;
+  glm::ivec3 step_u;
+  glm::ivec3 step_v;
+};
+
+// The integer lattice on the [-1, 1]^3 cube the chunks' vertices sit on, and
+// the spherified cube mapping between the cube's faces and the planet. A
+// node at `level` of a face's quadtree is grid_size x grid_size lattice
+// points, every vertex of every level falls on the same points so the
+// heightfield agrees across levels. Shared by Terrain and TerrainQuery.
+class TerrainLattice {
+public:
+  struct CreateInfo {
+    double radius = 6371000.0;
+    // Vertices along a chunk's edge, 2^k + 1.
+    uint32_t grid_size = 33;
+    // Clamped to the deepest level whose vertices are still lattice points.
+    uint32_t max_level = 20;
+  };
+
+  // Half the width of a cube face in lattice units, see TerrainNoise.
+  static constexpr int32_t kShift = 24;
+  static constexpr int32_t kHalfExtent = 1 << kShift;
+  static constexpr uint32_t kFaceCount = 6;
+
+  // Checks grid_size and clamps max_level.
+  bool Init(const CreateInfo &create_info);
+
+  uint32_t MaxLevel() const { return create_info_.max_level; }
+  // A face spans a quarter of a great circle over 2 * kHalfExtent units.
+  double MetresPerUnit() const;
+
+  ChunkLattice LatticeOf(const TileKey &key) const;
+  // Maps face coordinates in [-1, 1]^2 onto the unit sphere.
+  // Double precision because deep nodes span only a few millionths of a
+  // face.
+  static glm::dvec3 FaceToSphere(uint32_t face, double u, double v);
+  // Same for a lattice point.
+  static glm::dvec3 LatticeToSphere(const glm::ivec3 &point);
+  // Inverse of FaceToSphere(): the face a direction falls on and its face
+  // coordinates. `direction` does not have to be normalized.
+  static glm::dvec2 SphereToFace(const glm::dvec3 &direction,
+                                 uint32_t &face);
+
+private:
+  CreateInfo create_info_;
+  // log2(grid_size - 1).
+  uint32_t grid_shift_ = 0;
+};
@@ -0,0 +1,128 @@
+#include "terrain_noise.h"
+#include <algorithm>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+namespace {
+
+bool CpuHasAvx2() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  int info[4];
+  __cpuid(info, 1);
+  // The OS has to save the YMM registers as well.
+  bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+  __cpuidex(info, 7, 0);
+  return os_saves_ymm && (info[1] & (1 << 5));
+#elif defined(__x86_64__) || defined(__i386__)
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+// Per axis a value noise octave changes by at most 1.5 (steepest fade) times
+// its value range of 2 over one cell.
+double OctaveDifference(double distance, int32_t shift) {
+  return std::min(2.0, 3.0 * distance / static_cast<double>(1u << shift));
+}
+
+} // namespace
+
+TerrainNoise::TerrainNoise(const Settings &settings) {
+  params_.seed = settings.seed;
+  params_.base_cell_shift =
+      static_cast<int32_t>(std::clamp(settings.base_cell_shift, 2u, 30u));
+  // No octave may get a cell smaller than one lattice unit.
+  params_.octaves = std::min<uint32_t>(settings.octaves,
+                                       params_.base_cell_shift + 1);
+  params_.ridge_octaves = std::min<uint32_t>(settings.ridge_octaves,
+                                             params_.base_cell_shift - 1);
+  params_.continent_amplitude = settings.continent_amplitude;
+  params_.ridge_amplitude = settings.ridge_amplitude;
+  params_.warp_amount = std::max(settings.warp_amount, 0.0f);
+
+  avx2_ = terrain_noise::kAvx2Compiled && CpuHasAvx2();
+  // NEON is part of every ARMv8 CPU.
+  neon_ = terrain_noise::kNeonCompiled;
+}
+
+float TerrainNoise::Height(const glm::ivec3 &point) const {
+  return terrain_noise::Height<terrain_noise::ScalarLanes>(params_, point.x,
+                                                           point.y, point.z);
+}
+
+void TerrainNoise::Heights(const glm::ivec3 *points, float *heights,
+                           size_t count) const {
+  static_assert(sizeof(glm::ivec3) == 3 * sizeof(int32_t),
+                "The kernels read the points as packed xyz triples.");
+  const int32_t *coordinates = reinterpret_cast<const int32_t *>(points);
+  size_t done = 0;
+  if (avx2_) {
+    done = terrain_noise::HeightsAvx2(params_, coordinates, heights, count);
+  } else if (neon_) {
+    done = terrain_noise::HeightsNeon(params_, coordinates, heights, count);
+  }
+  HeightsScalar(points + done, heights + done, count - done);
+}
+
+void TerrainNoise::HeightsScalar(const glm::ivec3 *points, float *heights,
+                                 size_t count) const {
+  for (size_t i = 0; i < count; ++i) {
+    heights[i] = Height(points[i]);
+  }
+}
+
+float TerrainNoise::MinHeight() const {
+  // The octave amplitudes sum up to less than 2, ridges are never negative.
+  return -2.0f * params_.continent_amplitude;
+}
+
+float TerrainNoise::MaxHeight() const {
+  return 2.0f * params_.continent_amplitude +
+         4.0f * params_.ridge_amplitude;
+}
+
+float TerrainNoise::MaxDifference(double distance) const {
+  // Summed over the three axes. The warp moves the two points apart by at
+  // most its own difference plus one unit of truncation per axis.
+  double manhattan = 3.0 * distance;
+  if (params_.warp_amount > 0.0f) {
+    manhattan += 3.0 * (params_.warp_amount *
+                            OctaveDifference(manhattan,
+                                             params_.base_cell_shift) +
+                        1.0);
+  }
+
+  double continent = 0.0;
+  double amplitude = 1.0;
+  for (uint32_t octave = 0; octave < params_.octaves; ++octave) {
+    continent +=
+        amplitude * OctaveDifference(manhattan, params_.base_cell_shift -
+                                                    int32_t(octave));
+    amplitude *= 0.5;
+  }
+  // (1 - |n|)^2 changes at most twice as fast as n and stays within [0, 1].
+  double ridges = 0.0;
+  amplitude = 1.0;
+  for (uint32_t octave = 0; octave < params_.ridge_octaves; ++octave) {
+    ridges += amplitude *
+              std::min(1.0, 2.0 * OctaveDifference(
+                                      manhattan, params_.base_cell_shift - 2 -
+                                                     int32_t(octave)));
+    amplitude *= 0.5;
+  }
+  // Both sums stay below 2 in magnitude, which bounds the product term.
+  return static_cast<float>(continent * params_.continent_amplitude +
+                            params_.ridge_amplitude *
+                                (2.0 * ridges + 2.0 * continent));
+}
+
+const char *TerrainNoise::SimdPath() const {
+  if (avx2_) {
+    return "AVX2";
+  }
+  return neon_ ? "NEON" : "scalar";
+}
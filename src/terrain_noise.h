@@ -0,0 +1,62 @@
+#pragma once
+
+#include "terrain_noise_kernel.h"
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Heightfield of the planet: domain-warped fBm value noise for continents and
+// ridged octaves for mountains on land.
+//
+// The noise is defined on an integer lattice over the surface of the cube the
+// planet is projected from (see Terrain), with power-of-two cell sizes. Cells
+// and positions inside them are therefore exact, and the rest is additions,
+// multiplications and comparisons of floats, which are correctly rounded both
+// in IEEE 754 and in Vulkan. As long as nothing is contracted into an FMA the
+// scalar and SIMD paths here and shaders/heightfield.comp agree bit for bit,
+// so collision queries on the CPU see exactly the surface the GPU generated.
+class TerrainNoise {
+public:
+  struct Settings {
+    uint32_t seed = 1;
+    // log2 of the cell size of the first octave in lattice units. The cube
+    // face is 2^25 units wide, the default gives 8 continent cells per face.
+    uint32_t base_cell_shift = 22;
+    uint32_t octaves = 14;
+    uint32_t ridge_octaves = 10;
+    // Metres per unit of noise.
+    float continent_amplitude = 1500.0f;
+    float ridge_amplitude = 1000.0f;
+    // Largest domain warp offset in lattice units, 0 disables the warp.
+    float warp_amount = 1048576.0f;
+  };
+
+  TerrainNoise() : TerrainNoise(Settings{}) {}
+  explicit TerrainNoise(const Settings &settings);
+
+  // Height in metres above the sphere at a lattice point.
+  float Height(const glm::ivec3 &point) const;
+  // Height() of `count` points, several at a time with AVX2 or NEON when the
+  // CPU has them.
+  void Heights(const glm::ivec3 *points, float *heights, size_t count) const;
+  // Heights() without SIMD, the reference the SIMD paths have to match.
+  void HeightsScalar(const glm::ivec3 *points, float *heights,
+                     size_t count) const;
+
+  // Bounds of Height().
+  float MinHeight() const;
+  float MaxHeight() const;
+  // Upper bound of |Height(p) - Height(q)| for points at most `distance`
+  // lattice units apart along every axis.
+  float MaxDifference(double distance) const;
+
+  // Noise parameters as the kernel and the shader take them.
+  const terrain_noise::Params &GetParams() const { return params_; }
+  // "AVX2", "NEON" or "scalar", whatever Heights() uses.
+  const char *SimdPath() const;
+
+private:
+  terrain_noise::Params params_;
+  bool avx2_ = false;
+  bool neon_ = false;
+};
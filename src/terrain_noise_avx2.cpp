@@ -0,0 +1,86 @@
+#include "terrain_noise_kernel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+namespace terrain_noise {
+namespace {
+
+struct Avx2Lanes {
+  struct F {
+    F(__m256 value) : v(value) {}
+    F(float value) : v(_mm256_set1_ps(value)) {}
+    __m256 v;
+  };
+  struct I {
+    I(__m256i value) : v(value) {}
+    I(int32_t value) : v(_mm256_set1_epi32(value)) {}
+    __m256i v;
+  };
+  struct U {
+    U(__m256i value) : v(value) {}
+    U(uint32_t value) : v(_mm256_set1_epi32(static_cast<int32_t>(value))) {}
+    __m256i v;
+  };
+
+  static U AsUnsigned(I a) { return a.v; }
+  static I AsSigned(U a) { return a.v; }
+  static F ToFloat(I a) { return _mm256_cvtepi32_ps(a.v); }
+  static I Truncate(F a) { return _mm256_cvttps_epi32(a.v); }
+  static F Abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+  static F Max(F a, F b) { return _mm256_max_ps(a.v, b.v); }
+};
+
+using F = Avx2Lanes::F;
+using I = Avx2Lanes::I;
+using U = Avx2Lanes::U;
+
+F operator+(F a, F b) { return _mm256_add_ps(a.v, b.v); }
+F operator-(F a, F b) { return _mm256_sub_ps(a.v, b.v); }
+F operator*(F a, F b) { return _mm256_mul_ps(a.v, b.v); }
+
+I operator+(I a, I b) { return _mm256_add_epi32(a.v, b.v); }
+I operator&(I a, I b) { return _mm256_and_si256(a.v, b.v); }
+I operator>>(I a, int32_t shift) {
+  return _mm256_sra_epi32(a.v, _mm_cvtsi32_si128(shift));
+}
+
+U operator*(U a, U b) { return _mm256_mullo_epi32(a.v, b.v); }
+U operator^(U a, U b) { return _mm256_xor_si256(a.v, b.v); }
+U operator>>(U a, int32_t shift) {
+  return _mm256_srl_epi32(a.v, _mm_cvtsi32_si128(shift));
+}
+
+} // namespace
+
+const bool kAvx2Compiled = true;
+
+size_t HeightsAvx2(const Params &params, const int32_t *points, float *heights,
+                   size_t count) {
+  const __m256i offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const int32_t *xyz = points + 3 * i;
+    I x = _mm256_i32gather_epi32(xyz, offsets, 4);
+    I y = _mm256_i32gather_epi32(xyz + 1, offsets, 4);
+    I z = _mm256_i32gather_epi32(xyz + 2, offsets, 4);
+    _mm256_storeu_ps(heights + i, Height<Avx2Lanes>(params, x, y, z).v);
+  }
+  return i;
+}
+
+} // namespace terrain_noise
+
+#else
+
+namespace terrain_noise {
+
+const bool kAvx2Compiled = false;
+
+size_t HeightsAvx2(const Params &, const int32_t *, float *, size_t) {
+  return 0;
+}
+
+} // namespace terrain_noise
+
+#endif
@@ -0,0 +1,174 @@
+#pragma once
+
+// Internal to the terrain_noise*.cpp files, which instantiate the kernel once
+// per instruction set. Everything but the entry points has internal linkage on
+// purpose: the AVX2 file is built with -mavx2, and with vague linkage the
+// linker could pick its copy of a shared template for the scalar path.
+//
+// Every operation below has a twin in shaders/heightfield.comp, in the same
+// order. Change both or neither.
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace terrain_noise {
+
+// TerrainNoise::Settings after validation.
+struct Params {
+  uint32_t seed;
+  int32_t base_cell_shift;
+  uint32_t octaves;
+  uint32_t ridge_octaves;
+  float continent_amplitude;
+  float ridge_amplitude;
+  float warp_amount;
+};
+
+// Heights of the `count` lattice points in `points` (xyz triples). Return
+// how many points they handled from the front, always a multiple of their
+// lane count and 0 if the instruction set was not compiled in.
+size_t HeightsAvx2(const Params &params, const int32_t *points, float *heights,
+                   size_t count);
+size_t HeightsNeon(const Params &params, const int32_t *points, float *heights,
+                   size_t count);
+// Whether the entry points above were compiled in.
+extern const bool kAvx2Compiled;
+extern const bool kNeonCompiled;
+
+namespace {
+
+constexpr uint32_t kWarpSeeds[3] = {0x68bc21ebu, 0x02e5be93u, 0x967a889bu};
+constexpr uint32_t kRidgeSeed = 0x1b56c4e9u;
+
+// 2^-shift, built from its bits so it is exact everywhere.
+inline float InverseCellSize(int32_t shift) {
+  return std::bit_cast<float>(static_cast<uint32_t>(127 - shift) << 23);
+}
+
+// V provides the lane types F (float), I (int32) and U (uint32) with the
+// usual arithmetic operators, including mixed with scalars, and the
+// conversions used below. ScalarLanes is the reference.
+template <typename V>
+typename V::U HashLattice(typename V::I x, typename V::I y, typename V::I z,
+                          uint32_t seed) {
+  typename V::U h = V::AsUnsigned(x) * 0x8da6b343u ^
+                    V::AsUnsigned(y) * 0xd8163841u ^
+                    V::AsUnsigned(z) * 0xcb1ab31fu ^ seed;
+  h = h ^ (h >> 16);
+  h = h * 0x7feb352du;
+  h = h ^ (h >> 15);
+  h = h * 0x846ca68bu;
+  h = h ^ (h >> 16);
+  return h;
+}
+
+// 24 bits of the hash to [-1, 1), exact.
+template <typename V> typename V::F HashToFloat(typename V::U h) {
+  return V::ToFloat(V::AsSigned(h >> 8)) * (1.0f / 8388608.0f) - 1.0f;
+}
+
+// Value noise in [-1, 1] with cells of 2^shift lattice units.
+template <typename V>
+typename V::F ValueNoise(typename V::I x, typename V::I y, typename V::I z,
+                         int32_t shift, uint32_t seed) {
+  using F = typename V::F;
+  using I = typename V::I;
+  const int32_t mask = (1 << shift) - 1;
+  const float scale = InverseCellSize(shift);
+
+  I cx = x >> shift;
+  I cy = y >> shift;
+  I cz = z >> shift;
+  F tx = V::ToFloat(x & mask) * scale;
+  F ty = V::ToFloat(y & mask) * scale;
+  F tz = V::ToFloat(z & mask) * scale;
+  F fx = tx * tx * (3.0f - 2.0f * tx);
+  F fy = ty * ty * (3.0f - 2.0f * ty);
+  F fz = tz * tz * (3.0f - 2.0f * tz);
+
+  F c000 = HashToFloat<V>(HashLattice<V>(cx, cy, cz, seed));
+  F c100 = HashToFloat<V>(HashLattice<V>(cx + 1, cy, cz, seed));
+  F c010 = HashToFloat<V>(HashLattice<V>(cx, cy + 1, cz, seed));
+  F c110 = HashToFloat<V>(HashLattice<V>(cx + 1, cy + 1, cz, seed));
+  F c001 = HashToFloat<V>(HashLattice<V>(cx, cy, cz + 1, seed));
+  F c101 = HashToFloat<V>(HashLattice<V>(cx + 1, cy, cz + 1, seed));
+  F c011 = HashToFloat<V>(HashLattice<V>(cx, cy + 1, cz + 1, seed));
+  F c111 = HashToFloat<V>(HashLattice<V>(cx + 1, cy + 1, cz + 1, seed));
+
+  F x00 = c000 + (c100 - c000) * fx;
+  F x10 = c010 + (c110 - c010) * fx;
+  F x01 = c001 + (c101 - c001) * fx;
+  F x11 = c011 + (c111 - c011) * fx;
+  F y0 = x00 + (x10 - x00) * fy;
+  F y1 = x01 + (x11 - x01) * fy;
+  return y0 + (y1 - y0) * fz;
+}
+
+template <typename V>
+typename V::F Height(const Params &params, typename V::I x, typename V::I y,
+                     typename V::I z) {
+  using F = typename V::F;
+  using I = typename V::I;
+
+  // Domain warp by whole lattice units, so the octaves below still only see
+  // integer coordinates.
+  if (params.warp_amount > 0.0f) {
+    I wx = V::Truncate(ValueNoise<V>(x, y, z, params.base_cell_shift,
+                                     params.seed ^ kWarpSeeds[0]) *
+                       params.warp_amount);
+    I wy = V::Truncate(ValueNoise<V>(x, y, z, params.base_cell_shift,
+                                     params.seed ^ kWarpSeeds[1]) *
+                       params.warp_amount);
+    I wz = V::Truncate(ValueNoise<V>(x, y, z, params.base_cell_shift,
+                                     params.seed ^ kWarpSeeds[2]) *
+                       params.warp_amount);
+    x = x + wx;
+    y = y + wy;
+    z = z + wz;
+  }
+
+  // fBm continents.
+  F continent(0.0f);
+  float amplitude = 1.0f;
+  for (uint32_t octave = 0; octave < params.octaves; ++octave) {
+    continent =
+        continent +
+        ValueNoise<V>(x, y, z, params.base_cell_shift - int32_t(octave),
+                      params.seed + octave) *
+            amplitude;
+    amplitude = amplitude * 0.5f;
+  }
+
+  // Ridged mountains, only where the continents are above sea level.
+  F ridges(0.0f);
+  amplitude = 1.0f;
+  for (uint32_t octave = 0; octave < params.ridge_octaves; ++octave) {
+    F noise = ValueNoise<V>(x, y, z,
+                            params.base_cell_shift - 2 - int32_t(octave),
+                            (params.seed ^ kRidgeSeed) + octave);
+    F ridge = 1.0f - V::Abs(noise);
+    ridges = ridges + ridge * ridge * amplitude;
+    amplitude = amplitude * 0.5f;
+  }
+
+  return continent * params.continent_amplitude +
+         ridges * params.ridge_amplitude * V::Max(continent, F(0.0f));
+}
+
+struct ScalarLanes {
+  using F = float;
+  using I = int32_t;
+  using U = uint32_t;
+  static U AsUnsigned(I v) { return static_cast<U>(v); }
+  static I AsSigned(U v) { return static_cast<I>(v); }
+  static F ToFloat(I v) { return static_cast<F>(v); }
+  static I Truncate(F v) { return static_cast<I>(v); }
+  static F Abs(F v) {
+    return std::bit_cast<F>(std::bit_cast<U>(v) & 0x7fffffffu);
+  }
+  static F Max(F a, F b) { return a > b ? a : b; }
+};
+
+} // namespace
+} // namespace terrain_noise
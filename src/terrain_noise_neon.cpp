@@ -0,0 +1,83 @@
+#include "terrain_noise_kernel.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+
+namespace terrain_noise {
+namespace {
+
+struct NeonLanes {
+  struct F {
+    F(float32x4_t value) : v(value) {}
+    F(float value) : v(vdupq_n_f32(value)) {}
+    float32x4_t v;
+  };
+  struct I {
+    I(int32x4_t value) : v(value) {}
+    I(int32_t value) : v(vdupq_n_s32(value)) {}
+    int32x4_t v;
+  };
+  struct U {
+    U(uint32x4_t value) : v(value) {}
+    U(uint32_t value) : v(vdupq_n_u32(value)) {}
+    uint32x4_t v;
+  };
+
+  static U AsUnsigned(I a) { return vreinterpretq_u32_s32(a.v); }
+  static I AsSigned(U a) { return vreinterpretq_s32_u32(a.v); }
+  static F ToFloat(I a) { return vcvtq_f32_s32(a.v); }
+  static I Truncate(F a) { return vcvtq_s32_f32(a.v); }
+  static F Abs(F a) { return vabsq_f32(a.v); }
+  static F Max(F a, F b) { return vbslq_f32(vcgtq_f32(a.v, b.v), a.v, b.v); }
+};
+
+using F = NeonLanes::F;
+using I = NeonLanes::I;
+using U = NeonLanes::U;
+
+F operator+(F a, F b) { return vaddq_f32(a.v, b.v); }
+F operator-(F a, F b) { return vsubq_f32(a.v, b.v); }
+F operator*(F a, F b) { return vmulq_f32(a.v, b.v); }
+
+I operator+(I a, I b) { return vaddq_s32(a.v, b.v); }
+I operator&(I a, I b) { return vandq_s32(a.v, b.v); }
+// Shifting left by a negative count is an arithmetic right shift.
+I operator>>(I a, int32_t shift) { return vshlq_s32(a.v, vdupq_n_s32(-shift)); }
+
+U operator*(U a, U b) { return vmulq_u32(a.v, b.v); }
+U operator^(U a, U b) { return veorq_u32(a.v, b.v); }
+U operator>>(U a, int32_t shift) {
+  return vshlq_u32(a.v, vdupq_n_s32(-shift));
+}
+
+} // namespace
+
+const bool kNeonCompiled = true;
+
+size_t HeightsNeon(const Params &params, const int32_t *points, float *heights,
+                   size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    // De-interleaves the xyz triples.
+    int32x4x3_t xyz = vld3q_s32(points + 3 * i);
+    F height = Height<NeonLanes>(params, xyz.val[0], xyz.val[1], xyz.val[2]);
+    vst1q_f32(heights + i, height.v);
+  }
+  return i;
+}
+
+} // namespace terrain_noise
+
+#else
+
+namespace terrain_noise {
+
+const bool kNeonCompiled = false;
+
+size_t HeightsNeon(const Params &, const int32_t *, float *, size_t) {
+  return 0;
+}
+
+} // namespace terrain_noise
+
+#endif
@@ -0,0 +1,512 @@
+#include "terrain_query.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <glm/gtc/constants.hpp>
+#include <mutex>
+#include <spdlog/spdlog.h>
+#include <utility>
+
+namespace {
+
+// A ray steps by this fraction of its height above the ground, at least half
+// a grid cell. Safe on slopes below about 60 degrees.
+constexpr double kStepFraction = 0.5;
+// Steps after which a ray that has not hit anything counts as a miss.
+constexpr uint32_t kMaxRaySteps = 4096;
+// Hits are refined by bisection to this many metres.
+constexpr double kHitTolerance = 0.01;
+
+} // namespace
+
+bool TerrainQuery::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  if (!create_info_.noise) {
+    spdlog::error("Terrain queries need a heightfield.");
+    return false;
+  }
+  TerrainLattice::CreateInfo lattice_info{};
+  lattice_info.radius = create_info_.radius;
+  lattice_info.grid_size = create_info_.grid_size;
+  lattice_info.max_level = create_info_.level;
+  if (!lattice_.Init(lattice_info)) {
+    return false;
+  }
+  create_info_.level = lattice_.MaxLevel();
+
+  min_height_ = create_info_.noise->MinHeight();
+  max_height_ = create_info_.noise->MaxHeight();
+  if (create_info_.height_tiles) {
+    const TileFile::Header &header = create_info_.height_tiles->GetHeader();
+    if (header.format != TileFormat::kHeightFloat32 ||
+        header.tile_size != create_info_.grid_size + 2) {
+      spdlog::error("Height tiles have to be {}x{} floats, ignoring them.",
+                    create_info_.grid_size + 2, create_info_.grid_size + 2);
+      create_info_.height_tiles = nullptr;
+    } else if (header.tile_count > 0) {
+      min_height_ = std::min<double>(min_height_, header.min_value);
+      max_height_ = std::max<double>(max_height_, header.max_value);
+    }
+  }
+
+  const uint32_t cells = create_info_.grid_size - 1;
+  vertex_spacing_ = create_info_.radius * glm::half_pi<double>() /
+                    (static_cast<double>(1u << create_info_.level) * cells);
+  tile_bytes_ = sizeof(Tile) + sizeof(float) * create_info_.grid_size *
+                                   create_info_.grid_size;
+  return true;
+}
+
+void TerrainQuery::Destroy() {
+  std::unique_lock lock(mutex_);
+  tiles_.clear();
+  resident_bytes_ = 0;
+}
+
+float TerrainQuery::Height(const glm::dvec3 &direction) const {
+  float height = 0.0f;
+  Heights(&direction, &height, 1);
+  return height;
+}
+
+void TerrainQuery::Heights(const glm::dvec3 *directions, float *heights,
+                           size_t count) const {
+  if (count == 0) {
+    return;
+  }
+  std::vector<Sample> samples(count);
+  for (size_t k = 0; k < count; ++k) {
+    samples[k] = Locate(directions[k]);
+  }
+  std::vector<std::shared_ptr<const Tile>> tiles;
+  Resolve(samples, tiles);
+  for (size_t k = 0; k < count; ++k) {
+    heights[k] = Interpolate(samples[k], *tiles[k]);
+  }
+  queries_.fetch_add(count, std::memory_order_relaxed);
+}
+
+float TerrainQuery::HeightAt(double latitude, double longitude) const {
+  return Height(Direction(latitude, longitude));
+}
+
+void TerrainQuery::HeightsAt(const glm::dvec2 *lat_lons, float *heights,
+                             size_t count) const {
+  std::vector<glm::dvec3> directions(count);
+  for (size_t k = 0; k < count; ++k) {
+    directions[k] = Direction(lat_lons[k].x, lat_lons[k].y);
+  }
+  Heights(directions.data(), heights, count);
+}
+
+TerrainQuery::Hit TerrainQuery::Raycast(const Ray &ray) const {
+  Hit hit;
+  Raycasts(&ray, &hit, 1);
+  return hit;
+}
+
+void TerrainQuery::Raycasts(const Ray *rays, Hit *hits, size_t count) const {
+  // Only the shell between the lowest and the highest terrain can be hit.
+  const double top = create_info_.radius + max_height_;
+  const double min_step = 0.5 * vertex_spacing_;
+  std::vector<Ray> normalized(rays, rays + count);
+  std::vector<const Ray *> active;
+  std::vector<size_t> indices;
+  std::vector<double> distances;
+  std::vector<double> ends;
+  for (size_t k = 0; k < count; ++k) {
+    hits[k] = Hit{};
+    Ray &ray = normalized[k];
+    ray.direction = glm::normalize(ray.direction);
+    double b = glm::dot(ray.origin, ray.direction);
+    double c = glm::dot(ray.origin, ray.origin) - top * top;
+    double discriminant = b * b - c;
+    if (discriminant < 0.0) {
+      continue;
+    }
+    double root = glm::sqrt(discriminant);
+    double start = std::max(-b - root, 0.0);
+    double end = std::min(-b + root, ray.max_distance);
+    if (start > end) {
+      continue;
+    }
+    active.push_back(&ray);
+    indices.push_back(k);
+    distances.push_back(start);
+    ends.push_back(end);
+  }
+
+  std::vector<double> clearances;
+  Clearances(active, distances, clearances);
+  // Rays that went below the ground between `low` and `high`.
+  std::vector<const Ray *> crossing;
+  std::vector<size_t> crossing_indices;
+  std::vector<double> lows;
+  std::vector<double> highs;
+  auto keep_if_above = [&](std::vector<double> &next,
+                           const std::vector<double> &next_clearances) {
+    size_t kept = 0;
+    for (size_t a = 0; a < active.size(); ++a) {
+      if (next_clearances[a] <= 0.0) {
+        crossing.push_back(active[a]);
+        crossing_indices.push_back(indices[a]);
+        lows.push_back(distances[a]);
+        highs.push_back(next[a]);
+      } else if (next[a] < ends[a]) {
+        active[kept] = active[a];
+        indices[kept] = indices[a];
+        distances[kept] = next[a];
+        ends[kept] = ends[a];
+        clearances[kept] = next_clearances[a];
+        ++kept;
+      }
+    }
+    active.resize(kept);
+    indices.resize(kept);
+    distances.resize(kept);
+    ends.resize(kept);
+    clearances.resize(kept);
+  };
+  // A ray already below the ground where it starts hits right there.
+  keep_if_above(distances, clearances);
+
+  std::vector<double> next;
+  std::vector<double> next_clearances;
+  for (uint32_t step = 0; step < kMaxRaySteps && !active.empty(); ++step) {
+    next.resize(active.size());
+    for (size_t a = 0; a < active.size(); ++a) {
+      next[a] = std::min(
+          distances[a] + std::max(clearances[a] * kStepFraction, min_step),
+          ends[a]);
+    }
+    Clearances(active, next, next_clearances);
+    keep_if_above(next, next_clearances);
+  }
+
+  std::vector<double> middles(crossing.size());
+  std::vector<double> middle_clearances;
+  for (;;) {
+    double widest = 0.0;
+    for (size_t a = 0; a < crossing.size(); ++a) {
+      middles[a] = 0.5 * (lows[a] + highs[a]);
+      widest = std::max(widest, highs[a] - lows[a]);
+    }
+    if (widest <= kHitTolerance) {
+      break;
+    }
+    Clearances(crossing, middles, middle_clearances);
+    for (size_t a = 0; a < crossing.size(); ++a) {
+      (middle_clearances[a] <= 0.0 ? highs[a] : lows[a]) = middles[a];
+    }
+  }
+  for (size_t a = 0; a < crossing.size(); ++a) {
+    Hit &hit = hits[crossing_indices[a]];
+    hit.hit = true;
+    hit.distance = highs[a];
+    hit.position = crossing[a]->origin + crossing[a]->direction * highs[a];
+  }
+}
+
+glm::dvec3 TerrainQuery::Direction(double latitude, double longitude) {
+  double cos_latitude = std::cos(latitude);
+  return {cos_latitude * std::sin(longitude), std::sin(latitude),
+          cos_latitude * std::cos(longitude)};
+}
+
+TerrainQuery::Stats TerrainQuery::GetStats() const {
+  Stats stats;
+  stats.queries = queries_.load(std::memory_order_relaxed);
+  stats.cache_hits = cache_hits_.load(std::memory_order_relaxed);
+  stats.cache_misses = cache_misses_.load(std::memory_order_relaxed);
+  stats.evicted_tiles = evicted_tiles_.load(std::memory_order_relaxed);
+  std::shared_lock lock(mutex_);
+  stats.resident_tiles = static_cast<uint32_t>(tiles_.size());
+  stats.resident_bytes = resident_bytes_;
+  return stats;
+}
+
+TerrainQuery::Sample TerrainQuery::Locate(const glm::dvec3 &direction) const {
+  Sample sample;
+  glm::dvec2 uv = TerrainLattice::SphereToFace(direction, sample.key.face);
+  const uint32_t level = create_info_.level;
+  const uint32_t last_node = (1u << level) - 1;
+  const uint32_t last_cell = create_info_.grid_size - 2;
+  glm::dvec2 node = (uv + 1.0) * 0.5 * static_cast<double>(1u << level);
+  sample.key.level = level;
+  sample.key.x = std::min(static_cast<uint32_t>(std::max(node.x, 0.0)),
+                          last_node);
+  sample.key.y = std::min(static_cast<uint32_t>(std::max(node.y, 0.0)),
+                          last_node);
+  glm::dvec2 cell =
+      (node - glm::dvec2(sample.key.x, sample.key.y)) * (last_cell + 1.0);
+  sample.i = std::min(static_cast<uint32_t>(std::max(cell.x, 0.0)), last_cell);
+  sample.j = std::min(static_cast<uint32_t>(std::max(cell.y, 0.0)), last_cell);
+  sample.fu = static_cast<float>(std::clamp(cell.x - sample.i, 0.0, 1.0));
+  sample.fv = static_cast<float>(std::clamp(cell.y - sample.j, 0.0, 1.0));
+  return sample;
+}
+
+void TerrainQuery::Resolve(
+    const std::vector<Sample> &samples,
+    std::vector<std::shared_ptr<const Tile>> &tiles) const {
+  tiles.assign(samples.size(), nullptr);
+  std::vector<size_t> missing;
+  {
+    std::shared_lock lock(mutex_);
+    const uint64_t now = clock_.fetch_add(1, std::memory_order_relaxed) + 1;
+    for (size_t k = 0; k < samples.size(); ++k) {
+      auto it = tiles_.find(samples[k].key.Pack());
+      if (it == tiles_.end()) {
+        missing.push_back(k);
+        continue;
+      }
+      tiles[k] = it->second;
+      it->second->last_used.store(now, std::memory_order_relaxed);
+    }
+  }
+  cache_hits_.fetch_add(samples.size() - missing.size(),
+                        std::memory_order_relaxed);
+  if (missing.empty()) {
+    return;
+  }
+
+  // Every missing grid once, the ones the tile file does not have generated
+  // together.
+  std::unordered_map<uint64_t, size_t> pending;
+  std::vector<TileKey> keys;
+  for (size_t k : missing) {
+    if (pending.emplace(samples[k].key.Pack(), keys.size()).second) {
+      keys.push_back(samples[k].key);
+    }
+  }
+  cache_misses_.fetch_add(keys.size(), std::memory_order_relaxed);
+
+  const int32_t grid_size = static_cast<int32_t>(create_info_.grid_size);
+  const int32_t half_grid = grid_size / 2;
+  const size_t grid_vertices = static_cast<size_t>(grid_size) * grid_size;
+  std::vector<std::vector<float>> grids(keys.size());
+  std::vector<size_t> generated;
+  std::vector<glm::ivec3> points;
+  for (size_t m = 0; m < keys.size(); ++m) {
+    grids[m] = ReadTile(keys[m]);
+    if (!grids[m].empty()) {
+      continue;
+    }
+    ChunkLattice lattice = lattice_.LatticeOf(keys[m]);
+    for (int32_t j = 0; j < grid_size; ++j) {
+      for (int32_t i = 0; i < grid_size; ++i) {
+        points.push_back(lattice.center + lattice.step_u * (i - half_grid) +
+                         lattice.step_v * (j - half_grid));
+      }
+    }
+    generated.push_back(m);
+  }
+  if (!points.empty()) {
+    std::vector<float> heights(points.size());
+    create_info_.noise->Heights(points.data(), heights.data(), points.size());
+    for (size_t g = 0; g < generated.size(); ++g) {
+      auto first = heights.begin() + g * grid_vertices;
+      grids[generated[g]].assign(first, first + grid_vertices);
+    }
+  }
+
+  std::vector<std::shared_ptr<const Tile>> inserted(keys.size());
+  {
+    std::unique_lock lock(mutex_);
+    for (size_t m = 0; m < keys.size(); ++m) {
+      inserted[m] = Insert(keys[m].Pack(), std::move(grids[m]));
+    }
+    Evict();
+  }
+  for (size_t k : missing) {
+    tiles[k] = inserted[pending[samples[k].key.Pack()]];
+  }
+}
+
+std::vector<float> TerrainQuery::ReadTile(const TileKey &key) const {
+  const TileFile *file = create_info_.height_tiles;
+  std::vector<uint8_t> samples;
+  if (!file || !file->Find(key) || !file->Read(key, samples)) {
+    return {};
+  }
+  // Without the border.
+  const uint32_t grid_size = create_info_.grid_size;
+  const uint32_t bordered_size = grid_size + 2;
+  std::vector<float> heights(grid_size * grid_size);
+  for (uint32_t j = 0; j < grid_size; ++j) {
+    std::memcpy(&heights[j * grid_size],
+                &samples[sizeof(float) * ((j + 1) * bordered_size + 1)],
+                sizeof(float) * grid_size);
+  }
+  return heights;
+}
+
+std::shared_ptr<const TerrainQuery::Tile> TerrainQuery::Insert(
+    uint64_t key, std::vector<float> &&heights) const {
+  auto [it, added] = tiles_.try_emplace(key);
+  if (!added) {
+    // Another thread generated it in the meantime.
+    return it->second;
+  }
+  auto tile = std::make_shared<Tile>();
+  tile->heights = std::move(heights);
+  tile->last_used.store(clock_.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+  it->second = tile;
+  resident_bytes_ += tile_bytes_;
+  return tile;
+}
+
+void TerrainQuery::Evict() const {
+  if (resident_bytes_ <= create_info_.byte_budget) {
+    return;
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> ages;
+  ages.reserve(tiles_.size());
+  for (const auto &[key, tile] : tiles_) {
+    ages.emplace_back(tile->last_used.load(std::memory_order_relaxed), key);
+  }
+  std::sort(ages.begin(), ages.end());
+  const size_t target = create_info_.byte_budget / 8 * 7;
+  uint64_t evicted = 0;
+  for (const auto &age : ages) {
+    if (resident_bytes_ <= target) {
+      break;
+    }
+    tiles_.erase(age.second);
+    resident_bytes_ -= tile_bytes_;
+    ++evicted;
+  }
+  evicted_tiles_.fetch_add(evicted, std::memory_order_relaxed);
+}
+
+float TerrainQuery::Interpolate(const Sample &sample, const Tile &tile) const {
+  // On the triangles of the chunks' index buffer, split from (i, j) to
+  // (i + 1, j + 1).
+  const uint32_t grid_size = create_info_.grid_size;
+  const float *row = &tile.heights[sample.j * grid_size + sample.i];
+  float h00 = row[0];
+  float h10 = row[1];
+  float h01 = row[grid_size];
+  float h11 = row[grid_size + 1];
+  if (sample.fu >= sample.fv) {
+    return h00 + sample.fu * (h10 - h00) + sample.fv * (h11 - h10);
+  }
+  return h00 + sample.fv * (h01 - h00) + sample.fu * (h11 - h01);
+}
+
+void TerrainQuery::Clearances(const std::vector<const Ray *> &rays,
+                              const std::vector<double> &distances,
+                              std::vector<double> &clearances) const {
+  std::vector<glm::dvec3> positions(rays.size());
+  for (size_t a = 0; a < rays.size(); ++a) {
+    positions[a] = rays[a]->origin + rays[a]->direction * distances[a];
+  }
+  std::vector<float> heights(rays.size());
+  Heights(positions.data(), heights.data(), positions.size());
+  clearances.resize(rays.size());
+  for (size_t a = 0; a < rays.size(); ++a) {
+    clearances[a] =
+        glm::length(positions[a]) - (create_info_.radius + heights[a]);
+  }
+}
+
+TerrainQuery::QueryBenchmark
+TerrainQuery::BenchmarkQueries(const glm::dvec3 &center, uint32_t query_count,
+                               JobSystem &job_system) const {
+  QueryBenchmark result;
+  result.queries = query_count;
+  result.simd_path = create_info_.noise->SimdPath();
+  {
+    std::unique_lock lock(mutex_);
+    tiles_.clear();
+    resident_bytes_ = 0;
+  }
+
+  // A fixed, evenly spread set of points (the R2 sequence), so runs are
+  // comparable.
+  glm::dvec3 up = glm::normalize(center);
+  glm::dvec3 east = glm::normalize(glm::cross(
+      std::abs(up.y) < 0.99 ? glm::dvec3(0.0, 1.0, 0.0)
+                            : glm::dvec3(1.0, 0.0, 0.0),
+      up));
+  glm::dvec3 north = glm::cross(up, east);
+  constexpr double kHalfSize = 10000.0;
+  auto point = [&](uint32_t k) {
+    double x = std::fmod(0.5 + k * 0.7548776662466927, 1.0) * 2.0 - 1.0;
+    double y = std::fmod(0.5 + k * 0.5698402909980532, 1.0) * 2.0 - 1.0;
+    return up * create_info_.radius + (east * x + north * y) * kHalfSize;
+  };
+  std::vector<glm::dvec3> directions(query_count);
+  for (uint32_t k = 0; k < query_count; ++k) {
+    directions[k] = point(k);
+  }
+  std::vector<float> heights(query_count);
+  auto time = [](auto &&run) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  const uint64_t misses = cache_misses_.load(std::memory_order_relaxed);
+  result.cold_ms =
+      time([&] { Heights(directions.data(), heights.data(), query_count); });
+  result.generated_tiles = static_cast<uint32_t>(
+      cache_misses_.load(std::memory_order_relaxed) - misses);
+  result.warm_ms =
+      time([&] { Heights(directions.data(), heights.data(), query_count); });
+  result.single_ms = time([&] {
+    for (uint32_t k = 0; k < query_count; ++k) {
+      heights[k] = Height(directions[k]);
+    }
+  });
+  result.threads = job_system.ThreadCount();
+  result.parallel_ms = time([&] {
+    job_system.ParallelFor(result.threads, [&](uint32_t, uint32_t) {
+      std::vector<float> thread_heights(query_count);
+      Heights(directions.data(), thread_heights.data(), query_count);
+    });
+  });
+
+  // From 2 km up, 30 degrees below the horizon towards the east.
+  result.rays = std::max(query_count / 16, 1u);
+  std::vector<Ray> rays(result.rays);
+  for (uint32_t k = 0; k < result.rays; ++k) {
+    glm::dvec3 ground = point(k);
+    glm::dvec3 local_up = glm::normalize(ground);
+    rays[k].origin = local_up * (create_info_.radius + max_height_ + 2000.0);
+    rays[k].direction = east * std::cos(glm::radians(30.0)) -
+                        local_up * std::sin(glm::radians(30.0));
+    rays[k].max_distance = 100000.0;
+  }
+  std::vector<Hit> hits(result.rays);
+  result.ray_ms =
+      time([&] { Raycasts(rays.data(), hits.data(), result.rays); });
+  for (const Hit &hit : hits) {
+    result.ray_hits += hit.hit;
+  }
+
+  // Heights at the vertices of the grids the batch used.
+  const int32_t grid_size = static_cast<int32_t>(create_info_.grid_size);
+  const int32_t half_grid = grid_size / 2;
+  for (uint32_t k = 0; k < std::min(query_count, 256u); ++k) {
+    Sample sample = Locate(directions[k]);
+    ChunkLattice lattice = lattice_.LatticeOf(sample.key);
+    std::vector<float> tile = ReadTile(sample.key);
+    const int32_t i = static_cast<int32_t>(sample.i);
+    const int32_t j = static_cast<int32_t>(sample.j);
+    glm::ivec3 vertex = lattice.center + lattice.step_u * (i - half_grid) +
+                        lattice.step_v * (j - half_grid);
+    float expected = tile.empty()
+                         ? create_info_.noise->Height(vertex)
+                         : tile[j * grid_size + i];
+    float height = Height(TerrainLattice::LatticeToSphere(vertex));
+    result.max_vertex_error = std::max(
+        result.max_vertex_error, std::abs(static_cast<double>(height) -
+                                          static_cast<double>(expected)));
+  }
+  return result;
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "job_system.h"
+#include "terrain_lattice.h"
+#include "terrain_noise.h"
+#include "tile_file.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// Height and ray queries against the terrain on the CPU, for simulation code
+// that must not wait for GPU readbacks.
+//
+// The surface is the one the chunks of one quadtree level draw,
+// CreateInfo::level. Each node at that level owns a grid of heights with the
+// chunks' lattice and layout. The grid comes from the height tile file if it
+// has the node, otherwise from the TerrainNoise the chunks are generated
+// with. Heights between grid vertices are interpolated on the chunks'
+// triangles, so a query returns the surface the renderer draws at that
+// level.
+//
+// The grids are cached under a byte budget. Lookups take a shared lock, so
+// any number of threads can query concurrently. A miss generates the grid on
+// the querying thread and only takes the exclusive lock to insert it. When
+// over budget, the least recently used grids are evicted; a thread still
+// reading one keeps it alive until it is done.
+//
+// The batched calls find every grid the batch needs first. All grids that
+// are missing are then generated with a single TerrainNoise::Heights() call,
+// which evaluates with AVX2 or NEON where the CPU has them.
+//
+// Everything but Init() and Destroy() may be called from any thread.
+class TerrainQuery {
+public:
+  struct CreateInfo {
+    // Has to outlive the queries.
+    const TerrainNoise *noise = nullptr;
+    // The height tile file the terrain streams from, optional. Has to stay
+    // open while the queries exist, only its tiles at `level` are read.
+    const TileFile *height_tiles = nullptr;
+    double radius = 6371000.0;
+    // Same as Terrain::CreateInfo::grid_size.
+    uint32_t grid_size = 33;
+    // Clamped like Terrain::CreateInfo::max_level. Grid vertices are
+    // radius * pi / 2 / 2^level / (grid_size - 1) apart, about 5 m at the
+    // default level on an Earth sized planet.
+    uint32_t level = 16;
+    size_t byte_budget = 64ull * 1024ull * 1024ull;
+  };
+
+  struct Ray {
+    // World space, metres from the planet's centre.
+    glm::dvec3 origin{0.0};
+    // Does not have to be normalized.
+    glm::dvec3 direction{0.0, 0.0, -1.0};
+    double max_distance = 1.0e7;
+  };
+
+  struct Hit {
+    bool hit = false;
+    // Along the normalized ray direction, within a centimetre.
+    double distance = 0.0;
+    glm::dvec3 position{0.0};
+  };
+
+  // Result of BenchmarkQueries(), times in milliseconds.
+  struct QueryBenchmark {
+    uint32_t queries = 0;
+    const char *simd_path = "scalar";
+    // The batch on an empty cache, which generates every grid it needs, and
+    // once more on the warm cache.
+    double cold_ms = 0.0;
+    double warm_ms = 0.0;
+    uint32_t generated_tiles = 0;
+    // The same queries one Height() call each.
+    double single_ms = 0.0;
+    // Every job system thread runs the whole batch at the same time.
+    uint32_t threads = 0;
+    double parallel_ms = 0.0;
+    uint32_t rays = 0;
+    uint32_t ray_hits = 0;
+    double ray_ms = 0.0;
+    // Largest difference in metres between a query at a grid vertex and the
+    // vertex's height, should be about 0.
+    double max_vertex_error = 0.0;
+  };
+
+  struct Stats {
+    uint64_t queries = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t evicted_tiles = 0;
+    uint32_t resident_tiles = 0;
+    size_t resident_bytes = 0;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  void Destroy();
+
+  // Height in metres above the sphere of `radius` below a direction from the
+  // planet's centre, which does not have to be normalized.
+  float Height(const glm::dvec3 &direction) const;
+  // Height() of `count` directions.
+  void Heights(const glm::dvec3 *directions, float *heights,
+               size_t count) const;
+  // Latitude and longitude in radians, see Direction().
+  float HeightAt(double latitude, double longitude) const;
+  // HeightAt() of `count` (latitude, longitude) pairs.
+  void HeightsAt(const glm::dvec2 *lat_lons, float *heights,
+                 size_t count) const;
+
+  // First intersection of a ray with the surface. A ray starting below the
+  // surface hits at distance 0. The ray marches with steps bounded by its
+  // height above the ground. Features narrower than a grid cell can be
+  // stepped over by very flat rays.
+  Hit Raycast(const Ray &ray) const;
+  // Raycast() of `count` rays. All rays advance together, so each step is a
+  // single batched height query.
+  void Raycasts(const Ray *rays, Hit *hits, size_t count) const;
+
+  // Unit direction of a latitude and longitude in radians. The north pole is
+  // +y, longitude 0 points to +z and longitude pi / 2 to +x, which is east.
+  static glm::dvec3 Direction(double latitude, double longitude);
+
+  // Bounds of every height a query can return.
+  double MinHeight() const { return min_height_; }
+  double MaxHeight() const { return max_height_; }
+  uint32_t Level() const { return create_info_.level; }
+  // Metres between grid vertices, roughly.
+  double VertexSpacing() const { return vertex_spacing_; }
+  Stats GetStats() const;
+
+  // Times `query_count` queries spread over a square of 20 km around
+  // `center`, empties the cache first. Meant for benchmark runs only, no
+  // other thread may query meanwhile.
+  QueryBenchmark BenchmarkQueries(const glm::dvec3 &center,
+                                  uint32_t query_count,
+                                  JobSystem &job_system) const;
+
+private:
+  struct Tile {
+    // grid_size^2 heights, rows along the face's v axis.
+    std::vector<float> heights;
+    // Value of clock_ at the last lookup.
+    mutable std::atomic<uint64_t> last_used{0};
+  };
+
+  // Where a query falls: the grid of a node, its triangle pair and the
+  // position inside it.
+  struct Sample {
+    TileKey key;
+    uint32_t i = 0;
+    uint32_t j = 0;
+    float fu = 0.0f;
+    float fv = 0.0f;
+  };
+
+  Sample Locate(const glm::dvec3 &direction) const;
+  // Looks up the grid of every sample, generating the missing ones.
+  void Resolve(const std::vector<Sample> &samples,
+               std::vector<std::shared_ptr<const Tile>> &tiles) const;
+  // The node's heights from the tile file, or empty if it has no tile.
+  std::vector<float> ReadTile(const TileKey &key) const;
+  std::shared_ptr<const Tile> Insert(uint64_t key,
+                                     std::vector<float> &&heights) const;
+  // Drops least recently used grids down to 7/8 of the budget. Exclusive
+  // lock held.
+  void Evict() const;
+  float Interpolate(const Sample &sample, const Tile &tile) const;
+  // Heights of the points `distances` along the rays, above the surface.
+  void Clearances(const std::vector<const Ray *> &rays,
+                  const std::vector<double> &distances,
+                  std::vector<double> &clearances) const;
+
+  CreateInfo create_info_;
+  // The chunks' lattice at max_level `level`.
+  TerrainLattice lattice_;
+  double min_height_ = 0.0;
+  double max_height_ = 0.0;
+  double vertex_spacing_ = 0.0;
+  size_t tile_bytes_ = 0;
+
+  mutable std::shared_mutex mutex_;
+  // Key is TileKey::Pack() of the node.
+  mutable std::unordered_map<uint64_t, std::shared_ptr<const Tile>> tiles_;
+  mutable size_t resident_bytes_ = 0;
+
+  mutable std::atomic<uint64_t> clock_{0};
+  mutable std::atomic<uint64_t> queries_{0};
+  mutable std::atomic<uint64_t> cache_hits_{0};
+  mutable std::atomic<uint64_t> cache_misses_{0};
+  mutable std::atomic<uint64_t> evicted_tiles_{0};
+};
@@ -0,0 +1,160 @@
+#include "tile_cache.h"
+#include <spdlog/spdlog.h>
+
+bool TileCache::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  if (!create_info_.file || !create_info_.file->IsOpen()) {
+    spdlog::error("Tile cache needs an open tile file.");
+    return false;
+  }
+  stop_ = false;
+  loader_ = std::thread(&TileCache::LoaderLoop, this);
+  return true;
+}
+
+void TileCache::Destroy() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  if (loader_.joinable()) {
+    loader_.join();
+  }
+  queue_ = {};
+  loads_.clear();
+  loaded_.clear();
+  tiles_.clear();
+  lru_.clear();
+  resident_bytes_ = 0;
+}
+
+void TileCache::BeginFrame() {
+  std::vector<std::pair<uint64_t, std::vector<uint8_t>>> loaded;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    loaded.swap(loaded_);
+    std::erase_if(loads_, [](const auto &load) {
+      return load.second == LoadState::kQueued ||
+             load.second == LoadState::kLoaded;
+    });
+    queue_ = {};
+  }
+  for (auto &[packed, samples] : loaded) {
+    Insert(packed, std::move(samples));
+  }
+
+  // Tiles of the frame that just ended are never evicted, the view may need
+  // all of them again right away.
+  while (resident_bytes_ > create_info_.byte_budget && !lru_.empty()) {
+    auto tile = tiles_.find(lru_.back());
+    if (tile->second.last_used_frame >= frame_) {
+      break;
+    }
+    resident_bytes_ -= tile->second.samples.size();
+    tiles_.erase(tile);
+    lru_.pop_back();
+    ++evicted_tiles_;
+  }
+  ++frame_;
+}
+
+const std::vector<uint8_t> *TileCache::Find(const TileKey &key) {
+  auto tile = tiles_.find(key.Pack());
+  if (tile == tiles_.end()) {
+    return nullptr;
+  }
+  tile->second.last_used_frame = frame_;
+  lru_.splice(lru_.begin(), lru_, tile->second.lru);
+  return &tile->second.samples;
+}
+
+void TileCache::Request(const TileKey &key, float priority) {
+  uint64_t packed = key.Pack();
+  if (tiles_.contains(packed) || !create_info_.file->Find(key)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto [load, inserted] = loads_.try_emplace(packed, LoadState::kQueued);
+    if (!inserted && load->second != LoadState::kQueued) {
+      return;
+    }
+    // A second request of a queued tile only adds an entry with the new
+    // priority, the loader skips whichever comes out later.
+    queue_.push({priority, key});
+  }
+  wake_.notify_one();
+}
+
+const std::vector<uint8_t> *TileCache::Load(const TileKey &key) {
+  if (const std::vector<uint8_t> *samples = Find(key)) {
+    return samples;
+  }
+  std::vector<uint8_t> samples;
+  if (!create_info_.file->Read(key, samples)) {
+    return nullptr;
+  }
+  return Insert(key.Pack(), std::move(samples));
+}
+
+TileCache::Stats TileCache::GetStats() const {
+  Stats stats;
+  stats.resident_tiles = static_cast<uint32_t>(tiles_.size());
+  stats.resident_bytes = resident_bytes_;
+  stats.evicted_tiles = evicted_tiles_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats.queued_requests = static_cast<uint32_t>(queue_.size());
+  stats.loaded_tiles = loaded_tiles_;
+  return stats;
+}
+
+void TileCache::LoaderLoop() {
+  std::vector<uint8_t> samples;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (stop_) {
+      return;
+    }
+    QueuedRequest request = queue_.top();
+    queue_.pop();
+    uint64_t packed = request.key.Pack();
+    auto load = loads_.find(packed);
+    if (load == loads_.end() || load->second != LoadState::kQueued) {
+      continue;
+    }
+    load->second = LoadState::kLoading;
+
+    // Page faults and decoding happen without the lock, the render thread
+    // keeps queueing requests meanwhile.
+    lock.unlock();
+    bool read = create_info_.file->Read(request.key, samples);
+    lock.lock();
+
+    load = loads_.find(packed);
+    if (read) {
+      load->second = LoadState::kLoaded;
+      loaded_.emplace_back(packed, std::move(samples));
+      samples = {};
+      ++loaded_tiles_;
+    } else {
+      // Corrupt, stays in loads_ so it is not requested again.
+      load->second = LoadState::kFailed;
+    }
+  }
+}
+
+const std::vector<uint8_t> *
+TileCache::Insert(uint64_t packed, std::vector<uint8_t> &&samples) {
+  auto [tile, inserted] = tiles_.try_emplace(packed);
+  if (!inserted) {
+    return &tile->second.samples;
+  }
+  resident_bytes_ += samples.size();
+  tile->second.samples = std::move(samples);
+  tile->second.last_used_frame = frame_;
+  lru_.push_front(packed);
+  tile->second.lru = lru_.begin();
+  return &tile->second.samples;
+}
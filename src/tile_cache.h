@@ -0,0 +1,103 @@
+#pragma once
+
+#include "tile_file.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Streams tiles of a TileFile into memory on a background thread, under a
+// byte budget with least recently used eviction.
+//
+// Requests only live for the frame they were made in: BeginFrame() drops the
+// ones that are still queued, so every frame re-requests what it still wants
+// and the loader always works on the most important tiles of the current view
+// first. Nothing on the render thread ever waits for the disk, a tile that is
+// not resident yet is simply not there.
+//
+// Everything but the loader thread belongs to the render thread.
+class TileCache {
+public:
+  struct CreateInfo {
+    // Has to stay open while the cache exists.
+    const TileFile *file = nullptr;
+    size_t byte_budget = 256ull * 1024ull * 1024ull;
+  };
+
+  struct Stats {
+    uint32_t resident_tiles = 0;
+    size_t resident_bytes = 0;
+    uint32_t queued_requests = 0;
+    uint64_t loaded_tiles = 0;
+    uint64_t evicted_tiles = 0;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  void Destroy();
+
+  // Takes in the tiles loaded since the last call, evicts the least recently
+  // used ones not touched in the previous frame while over budget, and drops
+  // the previous frame's queued requests.
+  void BeginFrame();
+
+  // Decoded samples of a resident tile, see TileFile::Read(), or nullptr.
+  // Marks the tile as used. Valid until the next BeginFrame().
+  const std::vector<uint8_t> *Find(const TileKey &key);
+  // Queues a load of a tile that is not resident, larger priorities are
+  // loaded first. Tiles missing from the file are ignored.
+  void Request(const TileKey &key, float priority);
+  // Reads a tile on the calling thread and makes it resident. For startup.
+  const std::vector<uint8_t> *Load(const TileKey &key);
+
+  const TileFile &File() const { return *create_info_.file; }
+  Stats GetStats() const;
+
+private:
+  struct Tile {
+    std::vector<uint8_t> samples;
+    uint64_t last_used_frame = 0;
+    // Position in lru_.
+    std::list<uint64_t>::iterator lru;
+  };
+
+  struct QueuedRequest {
+    float priority;
+    TileKey key;
+    bool operator<(const QueuedRequest &other) const {
+      return priority < other.priority;
+    }
+  };
+
+  enum class LoadState { kQueued, kLoading, kLoaded, kFailed };
+
+  void LoaderLoop();
+  const std::vector<uint8_t> *Insert(uint64_t packed,
+                                     std::vector<uint8_t> &&samples);
+
+  CreateInfo create_info_;
+
+  // Render thread only.
+  std::unordered_map<uint64_t, Tile> tiles_;
+  // Most recently used first.
+  std::list<uint64_t> lru_;
+  size_t resident_bytes_ = 0;
+  uint64_t frame_ = 0;
+  uint64_t evicted_tiles_ = 0;
+
+  // Shared with the loader thread.
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  std::priority_queue<QueuedRequest> queue_;
+  // Every tile on its way in, until BeginFrame() takes it in, and the ones
+  // that failed to load.
+  std::unordered_map<uint64_t, LoadState> loads_;
+  std::vector<std::pair<uint64_t, std::vector<uint8_t>>> loaded_;
+  uint64_t loaded_tiles_ = 0;
+  bool stop_ = false;
+  std::thread loader_;
+};
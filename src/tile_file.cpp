@@ -0,0 +1,268 @@
+#include "tile_file.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// Channels of a sample and the bytes of each channel.
+struct SampleLayout {
+  uint32_t channels;
+  uint32_t channel_bytes;
+};
+
+SampleLayout LayoutOf(TileFormat format) {
+  return format == TileFormat::kRgba8 ? SampleLayout{4, 1}
+                                      : SampleLayout{1, 4};
+}
+
+uint32_t LoadChannel(const uint8_t *p, uint32_t bytes) {
+  uint32_t value = 0;
+  std::memcpy(&value, p, bytes);
+  return value;
+}
+
+void StoreChannel(uint8_t *p, uint32_t bytes, uint32_t value) {
+  std::memcpy(p, &value, bytes);
+}
+
+// Offset of the sample a sample is predicted from, none for the first one.
+size_t PredictorOffset(size_t sample, uint32_t tile_size, size_t stride) {
+  if (sample % tile_size != 0) {
+    return stride;
+  }
+  return sample == 0 ? 0 : stride * tile_size;
+}
+
+void Encode(TileFormat format, uint32_t tile_size, const uint8_t *samples,
+            std::vector<uint8_t> &out) {
+  const SampleLayout layout = LayoutOf(format);
+  const uint32_t bits = layout.channel_bytes * 8;
+  const uint32_t mask = bits == 32 ? 0xffffffffu : (1u << bits) - 1;
+  const size_t stride = layout.channels * layout.channel_bytes;
+  const size_t count = static_cast<size_t>(tile_size) * tile_size;
+
+  out.clear();
+  for (size_t sample = 0; sample < count; ++sample) {
+    const uint8_t *current = samples + sample * stride;
+    size_t predictor = PredictorOffset(sample, tile_size, stride);
+    for (uint32_t c = 0; c < layout.channels; ++c) {
+      const uint8_t *channel = current + c * layout.channel_bytes;
+      uint32_t predicted =
+          predictor ? LoadChannel(channel - predictor, layout.channel_bytes)
+                    : 0;
+      uint32_t residual =
+          (LoadChannel(channel, layout.channel_bytes) - predicted) & mask;
+      // Zigzag within the channel's width: small negative residuals become
+      // small codes.
+      uint32_t sign = (residual >> (bits - 1)) & 1;
+      uint32_t code = ((residual << 1) ^ (0u - sign)) & mask;
+      do {
+        uint8_t byte = code & 0x7f;
+        code >>= 7;
+        out.push_back(code ? byte | 0x80 : byte);
+      } while (code);
+    }
+  }
+}
+
+bool Decode(TileFormat format, uint32_t tile_size, const uint8_t *data,
+            size_t size, uint8_t *samples) {
+  const SampleLayout layout = LayoutOf(format);
+  const uint32_t bits = layout.channel_bytes * 8;
+  const uint32_t mask = bits == 32 ? 0xffffffffu : (1u << bits) - 1;
+  const size_t stride = layout.channels * layout.channel_bytes;
+  const size_t count = static_cast<size_t>(tile_size) * tile_size;
+
+  const uint8_t *end = data + size;
+  for (size_t sample = 0; sample < count; ++sample) {
+    uint8_t *current = samples + sample * stride;
+    size_t predictor = PredictorOffset(sample, tile_size, stride);
+    for (uint32_t c = 0; c < layout.channels; ++c) {
+      uint32_t code = 0;
+      for (uint32_t shift = 0;; shift += 7) {
+        if (data == end || shift >= 35) {
+          return false;
+        }
+        uint8_t byte = *data++;
+        code |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+          break;
+        }
+      }
+      uint32_t residual = ((code >> 1) ^ (0u - (code & 1))) & mask;
+      uint8_t *channel = current + c * layout.channel_bytes;
+      uint32_t predicted =
+          predictor ? LoadChannel(channel - predictor, layout.channel_bytes)
+                    : 0;
+      StoreChannel(channel, layout.channel_bytes,
+                   (predicted + residual) & mask);
+    }
+  }
+  return data == end;
+}
+
+} // namespace
+
+bool TileFile::Open(const std::string &path) {
+  Close();
+  if (!file_.Open(path)) {
+    return false;
+  }
+
+  bool valid = file_.Size() >= sizeof(Header);
+  if (valid) {
+    std::memcpy(&header_, file_.Data(), sizeof(Header));
+    valid = std::memcmp(header_.magic, Header{}.magic, 4) == 0 &&
+            header_.version == kVersion && header_.tile_size > 0 &&
+            header_.max_level < 25 &&
+            (header_.format == TileFormat::kHeightFloat32 ||
+             header_.format == TileFormat::kRgba8) &&
+            header_.index_offset % alignof(IndexEntry) == 0 &&
+            header_.index_offset <= file_.Size() &&
+            header_.tile_count <=
+                (file_.Size() - header_.index_offset) / sizeof(IndexEntry);
+  }
+  if (!valid) {
+    spdlog::error("{} is not a version {} tile file.", path, kVersion);
+    Close();
+    return false;
+  }
+  index_ = reinterpret_cast<const IndexEntry *>(file_.Data() +
+                                                header_.index_offset);
+  spdlog::info("Opened tile file {}: {} tiles of {}x{}, levels 0-{}.", path,
+               header_.tile_count, header_.tile_size, header_.tile_size,
+               header_.max_level);
+  return true;
+}
+
+void TileFile::Close() {
+  file_.Close();
+  header_ = Header{};
+  index_ = nullptr;
+}
+
+size_t TileFile::SampleBytes() const {
+  SampleLayout layout = LayoutOf(header_.format);
+  return layout.channels * layout.channel_bytes;
+}
+
+const TileFile::IndexEntry *TileFile::Find(const TileKey &key) const {
+  if (!index_ || key.level > header_.max_level) {
+    return nullptr;
+  }
+  const uint64_t packed = key.Pack();
+  const IndexEntry *end = index_ + header_.tile_count;
+  const IndexEntry *entry = std::lower_bound(
+      index_, end, packed,
+      [](const IndexEntry &e, uint64_t k) { return e.key < k; });
+  return entry != end && entry->key == packed ? entry : nullptr;
+}
+
+bool TileFile::Read(const TileKey &key, std::vector<uint8_t> &samples) const {
+  const IndexEntry *entry = Find(key);
+  if (!entry) {
+    return false;
+  }
+  if (entry->offset > header_.index_offset ||
+      entry->size > header_.index_offset - entry->offset) {
+    spdlog::error("Tile {}/{}/{}/{} lies outside the tile data.", key.face,
+                  key.level, key.x, key.y);
+    return false;
+  }
+  samples.resize(TileBytes());
+  if (!Decode(header_.format, header_.tile_size, file_.Data() + entry->offset,
+              entry->size, samples.data())) {
+    spdlog::error("Tile {}/{}/{}/{} is corrupt.", key.face, key.level, key.x,
+                  key.y);
+    return false;
+  }
+  return true;
+}
+
+bool TileFileWriter::Open(const std::string &path, TileFormat format,
+                          uint32_t tile_size) {
+  path_ = path;
+  header_ = TileFile::Header{};
+  header_.format = format;
+  header_.tile_size = tile_size;
+  header_.min_value = std::numeric_limits<float>::max();
+  header_.max_value = std::numeric_limits<float>::lowest();
+  index_.clear();
+
+  file_.open(path, std::ios::binary | std::ios::trunc);
+  // Rewritten by Finish() once the index offset is known.
+  if (!file_.is_open() ||
+      !file_.write(reinterpret_cast<const char *>(&header_), sizeof(header_))) {
+    spdlog::error("Failed to create tile file {}.", path);
+    return false;
+  }
+  return true;
+}
+
+bool TileFileWriter::Add(const TileKey &key, const void *samples) {
+  const auto *bytes = static_cast<const uint8_t *>(samples);
+  Encode(header_.format, header_.tile_size, bytes, encoded_);
+
+  TileFile::IndexEntry entry;
+  entry.key = key.Pack();
+  entry.offset = static_cast<uint64_t>(file_.tellp());
+  entry.size = static_cast<uint32_t>(encoded_.size());
+  if (header_.format == TileFormat::kHeightFloat32) {
+    const size_t count =
+        static_cast<size_t>(header_.tile_size) * header_.tile_size;
+    entry.min_value = std::numeric_limits<float>::max();
+    entry.max_value = std::numeric_limits<float>::lowest();
+    for (size_t i = 0; i < count; ++i) {
+      float value;
+      std::memcpy(&value, bytes + i * sizeof(float), sizeof(float));
+      entry.min_value = std::min(entry.min_value, value);
+      entry.max_value = std::max(entry.max_value, value);
+    }
+    header_.min_value = std::min(header_.min_value, entry.min_value);
+    header_.max_value = std::max(header_.max_value, entry.max_value);
+  }
+  index_.push_back(entry);
+  header_.max_level = std::max(header_.max_level, key.level);
+
+  if (!file_.write(reinterpret_cast<const char *>(encoded_.data()),
+                   static_cast<std::streamsize>(encoded_.size()))) {
+    spdlog::error("Failed to write tile file {}.", path_);
+    return false;
+  }
+  return true;
+}
+
+bool TileFileWriter::Finish() {
+  std::sort(index_.begin(), index_.end(),
+            [](const TileFile::IndexEntry &a, const TileFile::IndexEntry &b) {
+              return a.key < b.key;
+            });
+  if (header_.format != TileFormat::kHeightFloat32 || index_.empty()) {
+    header_.min_value = 0.0f;
+    header_.max_value = 0.0f;
+  }
+
+  uint64_t end = static_cast<uint64_t>(file_.tellp());
+  const char padding[alignof(TileFile::IndexEntry)] = {};
+  uint64_t padding_size = (alignof(TileFile::IndexEntry) -
+                           end % alignof(TileFile::IndexEntry)) %
+                          alignof(TileFile::IndexEntry);
+  header_.index_offset = end + padding_size;
+  header_.tile_count = index_.size();
+
+  file_.write(padding, static_cast<std::streamsize>(padding_size));
+  file_.write(reinterpret_cast<const char *>(index_.data()),
+              static_cast<std::streamsize>(sizeof(TileFile::IndexEntry) *
+                                           index_.size()));
+  file_.seekp(0);
+  file_.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+  file_.close();
+  if (!file_) {
+    spdlog::error("Failed to write tile file {}.", path_);
+    return false;
+  }
+  spdlog::info("Wrote {} tiles to {}.", index_.size(), path_);
+  return true;
+}
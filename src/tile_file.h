@@ -0,0 +1,119 @@
+#pragma once
+
+#include "mapped_file.h"
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Address of a tile: a node of the quadtree of one cube face, the same
+// addressing Terrain uses for its chunks. Level l is the l-th mip of the face.
+struct TileKey {
+  uint32_t face = 0;
+  uint32_t level = 0;
+  uint32_t x = 0;
+  uint32_t y = 0;
+
+  // 3 bits face, 5 bits level, 25 bits each for x and y, ordered by level
+  // first so every mip of the file is contiguous.
+  uint64_t Pack() const {
+    return static_cast<uint64_t>(level) << 53 |
+           static_cast<uint64_t>(face) << 50 |
+           static_cast<uint64_t>(y) << 25 | static_cast<uint64_t>(x);
+  }
+  bool operator==(const TileKey &other) const = default;
+};
+
+enum class TileFormat : uint32_t {
+  // One float per sample, heights in metres.
+  kHeightFloat32 = 0,
+  // Four bytes per sample.
+  kRgba8 = 1,
+};
+
+// Tiled container for per-face quadtree datasets (heightmaps, imagery) that
+// can be much larger than RAM. Little-endian, laid out as
+//
+//   Header
+//   tile data, each tile compressed on its own, coarse levels first
+//   IndexEntry[tile_count], sorted by TileKey::Pack()
+//
+// The file is memory mapped, finding a tile is a binary search over the index
+// and reading one only touches the pages of that tile. Samples are predicted
+// from their left neighbour (the one above at the start of a row) and the
+// zigzagged residuals of every channel are stored as LEB128 varints, which is
+// lossless for floats as well and cheap to decode.
+//
+// Opened files are read-only and may be read from any thread.
+class TileFile {
+public:
+  static constexpr uint32_t kVersion = 1;
+
+  struct Header {
+    char magic[4] = {'P', 'T', 'I', 'L'};
+    uint32_t version = kVersion;
+    TileFormat format = TileFormat::kHeightFloat32;
+    // Samples along one edge of a tile.
+    uint32_t tile_size = 0;
+    // Deepest level with tiles, not every node has to be present.
+    uint32_t max_level = 0;
+    // Range of the samples of kHeightFloat32 files.
+    float min_value = 0.0f;
+    float max_value = 0.0f;
+    uint32_t padding = 0;
+    uint64_t tile_count = 0;
+    uint64_t index_offset = 0;
+  };
+  static_assert(sizeof(Header) == 48);
+
+  struct IndexEntry {
+    uint64_t key = 0;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    // Range of the tile's samples, lets users bound a tile without reading
+    // it. 0 for kRgba8.
+    float min_value = 0.0f;
+    float max_value = 0.0f;
+    uint32_t padding = 0;
+  };
+  static_assert(sizeof(IndexEntry) == 32);
+
+  bool Open(const std::string &path);
+  void Close();
+  bool IsOpen() const { return file_.IsOpen(); }
+
+  const Header &GetHeader() const { return header_; }
+  size_t SampleBytes() const;
+  size_t TileBytes() const {
+    return SampleBytes() * header_.tile_size * header_.tile_size;
+  }
+
+  // nullptr if the file has no such tile.
+  const IndexEntry *Find(const TileKey &key) const;
+  // Decodes the tile into `samples`, TileBytes() bytes, rows top to bottom.
+  // False if the tile is missing or corrupt.
+  bool Read(const TileKey &key, std::vector<uint8_t> &samples) const;
+
+private:
+  MappedFile file_;
+  Header header_;
+  const IndexEntry *index_ = nullptr;
+};
+
+// Writes a TileFile. Tiles may be added in any order, the index is sorted on
+// Finish().
+class TileFileWriter {
+public:
+  bool Open(const std::string &path, TileFormat format, uint32_t tile_size);
+  // `samples` holds tile_size^2 samples of the file's format.
+  bool Add(const TileKey &key, const void *samples);
+  bool Finish();
+
+private:
+  std::ofstream file_;
+  std::string path_;
+  TileFile::Header header_;
+  std::vector<TileFile::IndexEntry> index_;
+  std::vector<uint8_t> encoded_;
+};
@@ -0,0 +1,211 @@
+#include "tlsf_allocator.h"
+#include <algorithm>
+#include <bit>
+
+TlsfAllocator::TlsfAllocator(uint64_t size) : size_(size) {
+  for (auto &heads : free_heads_) {
+    heads.fill(kNull);
+  }
+  uint32_t index = NewRange();
+  ranges_[index].offset = 0;
+  ranges_[index].size = size;
+  InsertFree(index);
+}
+
+uint64_t TlsfAllocator::Allocate(uint64_t size, uint64_t alignment) {
+  size = std::max<uint64_t>(size, 1);
+  alignment = std::max<uint64_t>(alignment, 1);
+
+  // Searching for the worst case padding guarantees that the first range of
+  // the found bucket fits, which keeps the lookup O(1).
+  uint32_t fl, sl;
+  MappingSearch(size + alignment - 1, fl, sl);
+  if (fl >= kFlCount) {
+    return kInvalidOffset;
+  }
+  uint32_t index = FindFree(fl, sl);
+  if (index == kNull) {
+    return kInvalidOffset;
+  }
+  RemoveFree(index);
+
+  uint64_t offset = ranges_[index].offset;
+  uint64_t aligned_offset = (offset + alignment - 1) & ~(alignment - 1);
+  uint64_t padding = aligned_offset - offset;
+  if (padding > 0) {
+    // The front padding goes back to the free lists as its own range. Its
+    // previous neighbour can't be free because free ranges are always merged.
+    uint32_t front = NewRange();
+    Range &range = ranges_[index];
+    ranges_[front].offset = offset;
+    ranges_[front].size = padding;
+    ranges_[front].prev_physical = range.prev_physical;
+    ranges_[front].next_physical = index;
+    if (range.prev_physical != kNull) {
+      ranges_[range.prev_physical].next_physical = front;
+    }
+    range.prev_physical = front;
+    range.offset = aligned_offset;
+    range.size -= padding;
+    InsertFree(front);
+  }
+  SplitTail(index, size);
+
+  used_bytes_ += ranges_[index].size;
+  allocated_[aligned_offset] = index;
+  return aligned_offset;
+}
+
+void TlsfAllocator::Free(uint64_t offset) {
+  auto it = allocated_.find(offset);
+  if (it == allocated_.end()) {
+    return;
+  }
+  uint32_t index = it->second;
+  allocated_.erase(it);
+  used_bytes_ -= ranges_[index].size;
+
+  uint32_t next = ranges_[index].next_physical;
+  if (next != kNull && ranges_[next].free) {
+    RemoveFree(next);
+    MergeWithNext(index);
+  }
+  uint32_t prev = ranges_[index].prev_physical;
+  if (prev != kNull && ranges_[prev].free) {
+    RemoveFree(prev);
+    MergeWithNext(prev);
+    index = prev;
+  }
+  InsertFree(index);
+}
+
+uint64_t TlsfAllocator::LargestFreeRange() const {
+  if (fl_bitmap_ == 0) {
+    return 0;
+  }
+  uint32_t fl = 63 - std::countl_zero(fl_bitmap_);
+  uint32_t sl = 31 - std::countl_zero(sl_bitmap_[fl]);
+  uint64_t largest = 0;
+  for (uint32_t index = free_heads_[fl][sl]; index != kNull;
+       index = ranges_[index].next_free) {
+    largest = std::max(largest, ranges_[index].size);
+  }
+  return largest;
+}
+
+void TlsfAllocator::MappingInsert(uint64_t size, uint32_t &fl, uint32_t &sl) {
+  if (size < kSlCount) {
+    fl = 0;
+    sl = static_cast<uint32_t>(size);
+    return;
+  }
+  uint32_t log2 = static_cast<uint32_t>(std::bit_width(size)) - 1;
+  sl = static_cast<uint32_t>(size >> (log2 - kSlBits)) - kSlCount;
+  fl = log2 - kSlBits + 1;
+}
+
+void TlsfAllocator::MappingSearch(uint64_t size, uint32_t &fl, uint32_t &sl) {
+  if (size >= kSlCount) {
+    uint32_t log2 = static_cast<uint32_t>(std::bit_width(size)) - 1;
+    size += (1ull << (log2 - kSlBits)) - 1;
+  }
+  MappingInsert(size, fl, sl);
+}
+
+uint32_t TlsfAllocator::NewRange() {
+  if (!unused_ranges_.empty()) {
+    uint32_t index = unused_ranges_.back();
+    unused_ranges_.pop_back();
+    ranges_[index] = Range{};
+    return index;
+  }
+  ranges_.emplace_back();
+  return static_cast<uint32_t>(ranges_.size() - 1);
+}
+
+void TlsfAllocator::ReleaseRange(uint32_t index) {
+  unused_ranges_.push_back(index);
+}
+
+void TlsfAllocator::InsertFree(uint32_t index) {
+  uint32_t fl, sl;
+  MappingInsert(ranges_[index].size, fl, sl);
+  uint32_t head = free_heads_[fl][sl];
+  Range &range = ranges_[index];
+  range.free = true;
+  range.prev_free = kNull;
+  range.next_free = head;
+  if (head != kNull) {
+    ranges_[head].prev_free = index;
+  }
+  free_heads_[fl][sl] = index;
+  fl_bitmap_ |= 1ull << fl;
+  sl_bitmap_[fl] |= 1u << sl;
+}
+
+void TlsfAllocator::RemoveFree(uint32_t index) {
+  uint32_t fl, sl;
+  MappingInsert(ranges_[index].size, fl, sl);
+  Range &range = ranges_[index];
+  if (range.prev_free != kNull) {
+    ranges_[range.prev_free].next_free = range.next_free;
+  }
+  if (range.next_free != kNull) {
+    ranges_[range.next_free].prev_free = range.prev_free;
+  }
+  if (free_heads_[fl][sl] == index) {
+    free_heads_[fl][sl] = range.next_free;
+    if (range.next_free == kNull) {
+      sl_bitmap_[fl] &= ~(1u << sl);
+      if (sl_bitmap_[fl] == 0) {
+        fl_bitmap_ &= ~(1ull << fl);
+      }
+    }
+  }
+  range.free = false;
+  range.prev_free = kNull;
+  range.next_free = kNull;
+}
+
+uint32_t TlsfAllocator::FindFree(uint32_t fl, uint32_t sl) const {
+  uint32_t sl_map = sl_bitmap_[fl] & (~0u << sl);
+  if (sl_map == 0) {
+    uint64_t fl_map = fl + 1 < 64 ? fl_bitmap_ & (~0ull << (fl + 1)) : 0;
+    if (fl_map == 0) {
+      return kNull;
+    }
+    fl = static_cast<uint32_t>(std::countr_zero(fl_map));
+    sl_map = sl_bitmap_[fl];
+  }
+  sl = static_cast<uint32_t>(std::countr_zero(sl_map));
+  return free_heads_[fl][sl];
+}
+
+void TlsfAllocator::SplitTail(uint32_t index, uint64_t size) {
+  uint64_t remainder = ranges_[index].size - size;
+  if (remainder == 0) {
+    return;
+  }
+  uint32_t tail = NewRange();
+  Range &range = ranges_[index];
+  ranges_[tail].offset = range.offset + size;
+  ranges_[tail].size = remainder;
+  ranges_[tail].prev_physical = index;
+  ranges_[tail].next_physical = range.next_physical;
+  if (range.next_physical != kNull) {
+    ranges_[range.next_physical].prev_physical = tail;
+  }
+  range.next_physical = tail;
+  range.size = size;
+  InsertFree(tail);
+}
+
+void TlsfAllocator::MergeWithNext(uint32_t index) {
+  uint32_t next = ranges_[index].next_physical;
+  ranges_[index].size += ranges_[next].size;
+  ranges_[index].next_physical = ranges_[next].next_physical;
+  if (ranges_[next].next_physical != kNull) {
+    ranges_[ranges_[next].next_physical].prev_physical = index;
+  }
+  ReleaseRange(next);
+}
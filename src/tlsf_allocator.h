@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Two-level segregated fit (TLSF) allocator over an abstract [0, size) range.
+// It only hands out offsets, the owner maps them onto real memory. Allocation
+// and free are O(1): free ranges are bucketed by size class and looked up
+// through two levels of bitmaps, and neighbouring free ranges are merged as
+// soon as a range is released.
+class TlsfAllocator {
+public:
+  static constexpr uint64_t kInvalidOffset = ~0ull;
+
+  explicit TlsfAllocator(uint64_t size);
+
+  // Returns kInvalidOffset if no free range can hold size bytes at the
+  // requested (power of two) alignment.
+  uint64_t Allocate(uint64_t size, uint64_t alignment);
+  void Free(uint64_t offset);
+
+  uint64_t Size() const { return size_; }
+  uint64_t UsedBytes() const { return used_bytes_; }
+  uint64_t FreeBytes() const { return size_ - used_bytes_; }
+  uint32_t AllocationCount() const {
+    return static_cast<uint32_t>(allocated_.size());
+  }
+  bool Empty() const { return allocated_.empty(); }
+  uint64_t LargestFreeRange() const;
+
+private:
+  // Second level subdivides each power of two size class into 2^kSlBits
+  // linear buckets.
+  static constexpr uint32_t kSlBits = 5;
+  static constexpr uint32_t kSlCount = 1u << kSlBits;
+  static constexpr uint32_t kFlCount = 64 - kSlBits + 1;
+  static constexpr uint32_t kNull = ~0u;
+
+  struct Range {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    // Neighbours in address order.
+    uint32_t prev_physical = kNull;
+    uint32_t next_physical = kNull;
+    // Neighbours in the free list of the range's bucket.
+    uint32_t prev_free = kNull;
+    uint32_t next_free = kNull;
+    bool free = false;
+  };
+
+  static void MappingInsert(uint64_t size, uint32_t &fl, uint32_t &sl);
+  static void MappingSearch(uint64_t size, uint32_t &fl, uint32_t &sl);
+
+  uint32_t NewRange();
+  void ReleaseRange(uint32_t index);
+  void InsertFree(uint32_t index);
+  void RemoveFree(uint32_t index);
+  uint32_t FindFree(uint32_t fl, uint32_t sl) const;
+  // Splits `index` so that it is exactly `size` bytes long and returns the
+  // remainder to the free lists.
+  void SplitTail(uint32_t index, uint64_t size);
+  // Merges `index` with `next`, which must directly follow it and be free.
+  void MergeWithNext(uint32_t index);
+
+  uint64_t size_;
+  uint64_t used_bytes_ = 0;
+  std::vector<Range> ranges_;
+  std::vector<uint32_t> unused_ranges_;
+  uint64_t fl_bitmap_ = 0;
+  std::array<uint32_t, kFlCount> sl_bitmap_{};
+  std::array<std::array<uint32_t, kSlCount>, kFlCount> free_heads_;
+  // Offset of every live allocation to its range.
+  std::unordered_map<uint64_t, uint32_t> allocated_;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Lock-free handoff of the newest value from one producer thread to one
+// consumer thread. The producer writes Back() and publishes it, the consumer
+// picks up the newest published value with Update() and reads Front(). Values
+// published in between are skipped, neither side ever waits for the other.
+//
+// The three slots are swapped through an atomic index: the producer owns one,
+// the consumer owns one and the third is the last published value, with a
+// flag telling whether the consumer has taken it yet.
+template <typename T> class TripleBuffer {
+public:
+  // Sets every slot to `value`. Not while either thread uses the buffer.
+  void Reset(const T &value) {
+    for (Slot &slot : slots_) {
+      slot.value = value;
+    }
+    back_ = 0;
+    middle_.store(1, std::memory_order_relaxed);
+    front_ = 2;
+  }
+
+  // Producer only. Keeps whatever it held when it was last handed back,
+  // which is not the value published last.
+  T &Back() { return slots_[back_].value; }
+  // Producer only. Makes Back() the newest value.
+  void Publish() {
+    uint32_t previous = middle_.exchange(back_ | kFresh,
+                                         std::memory_order_acq_rel);
+    back_ = previous & kIndexMask;
+  }
+
+  // Consumer only. Moves the newest published value to Front(), returns
+  // false if nothing was published since the last call.
+  bool Update() {
+    if ((middle_.load(std::memory_order_relaxed) & kFresh) == 0) {
+      return false;
+    }
+    uint32_t previous = middle_.exchange(front_, std::memory_order_acq_rel);
+    front_ = previous & kIndexMask;
+    return true;
+  }
+  // Consumer only.
+  const T &Front() const { return slots_[front_].value; }
+
+private:
+  static constexpr uint32_t kIndexMask = 3;
+  static constexpr uint32_t kFresh = 4;
+
+  // A cache line each, so the threads do not invalidate each other's slot.
+  struct alignas(64) Slot {
+    T value{};
+  };
+
+  std::array<Slot, 3> slots_{};
+  // Producer only.
+  uint32_t back_ = 0;
+  // Index of the published slot, kFresh while the consumer has not taken it.
+  alignas(64) std::atomic<uint32_t> middle_{1};
+  // Consumer only.
+  alignas(64) uint32_t front_ = 2;
+};
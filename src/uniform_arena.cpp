@@ -0,0 +1,61 @@
+#include "uniform_arena.h"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+bool UniformArena::Init(const CreateInfo &create_info) {
+  device_ = create_info.device;
+  allocator_ = create_info.allocator;
+  alignment_ = std::max<VkDeviceSize>(create_info.alignment, 16);
+  // Every region starts aligned as well.
+  frame_size_ =
+      (create_info.frame_size + alignment_ - 1) / alignment_ * alignment_;
+
+  VkBufferCreateInfo buffer_info{};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = frame_size_ * create_info.frames_in_flight;
+  buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  if (vkCreateBuffer(device_, &buffer_info, nullptr, &buffer_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create uniform arena.");
+    return false;
+  }
+  std::optional<GpuAllocation> allocation = allocator_->AllocateForBuffer(
+      buffer_, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  if (!allocation || !allocation->mapped) {
+    spdlog::error("Failed to allocate uniform arena memory.");
+    vkDestroyBuffer(device_, buffer_, nullptr);
+    buffer_ = VK_NULL_HANDLE;
+    return false;
+  }
+  allocation_ = *allocation;
+  return true;
+}
+
+void UniformArena::Destroy() {
+  if (buffer_ == VK_NULL_HANDLE) {
+    return;
+  }
+  vkDestroyBuffer(device_, buffer_, nullptr);
+  allocator_->Free(allocation_);
+  buffer_ = VK_NULL_HANDLE;
+}
+
+void UniformArena::BeginFrame(uint32_t frame) {
+  frame_begin_ = frame_size_ * frame;
+  cursor_ = frame_begin_;
+}
+
+std::optional<UniformArena::Allocation>
+UniformArena::Allocate(VkDeviceSize size) {
+  if (cursor_ + size > frame_begin_ + frame_size_) {
+    spdlog::error("Uniform arena frame of {} bytes is full.", frame_size_);
+    return std::nullopt;
+  }
+  Allocation allocation;
+  allocation.offset = static_cast<uint32_t>(cursor_);
+  allocation.data = static_cast<uint8_t *>(allocation_.mapped) + cursor_;
+  cursor_ = (cursor_ + size + alignment_ - 1) / alignment_ * alignment_;
+  return allocation;
+}
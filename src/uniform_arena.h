@@ -0,0 +1,66 @@
+#pragma once
+
+#include "gpu_allocator.h"
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <vulkan/vulkan.h>
+
+// Linear allocator for per-frame shader constants. One persistently mapped
+// buffer is split into a region per frame in flight, a frame bump-allocates
+// from its region while it is prepared and everything is bound through
+// VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC offsets, so a single descriptor
+// set serves every frame and every allocation in it.
+//
+// Render thread only.
+class UniformArena {
+public:
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    GpuAllocator *allocator = nullptr;
+    uint32_t frames_in_flight = 2;
+    // Bytes per frame.
+    VkDeviceSize frame_size = 64ull * 1024ull;
+    // VkPhysicalDeviceLimits::minUniformBufferOffsetAlignment.
+    VkDeviceSize alignment = 256;
+  };
+
+  struct Allocation {
+    // Dynamic offset the allocation is bound with.
+    uint32_t offset = 0;
+    void *data = nullptr;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  void Destroy();
+
+  // Starts allocating from the region of `frame`, which the GPU has to be
+  // done reading.
+  void BeginFrame(uint32_t frame);
+  // std::nullopt if the frame's region is full.
+  std::optional<Allocation> Allocate(VkDeviceSize size);
+  // Allocates and copies `value`, returns its dynamic offset.
+  template <typename T> std::optional<uint32_t> Push(const T &value) {
+    std::optional<Allocation> allocation = Allocate(sizeof(T));
+    if (!allocation) {
+      return std::nullopt;
+    }
+    std::memcpy(allocation->data, &value, sizeof(T));
+    return allocation->offset;
+  }
+
+  VkBuffer Buffer() const { return buffer_; }
+  // Bytes allocated by the current frame.
+  VkDeviceSize Used() const { return cursor_ - frame_begin_; }
+
+private:
+  VkDevice device_ = VK_NULL_HANDLE;
+  GpuAllocator *allocator_ = nullptr;
+  VkDeviceSize frame_size_ = 0;
+  VkDeviceSize alignment_ = 0;
+
+  VkBuffer buffer_ = VK_NULL_HANDLE;
+  GpuAllocation allocation_;
+  VkDeviceSize frame_begin_ = 0;
+  VkDeviceSize cursor_ = 0;
+};
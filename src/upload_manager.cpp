@@ -0,0 +1,303 @@
+#include "upload_manager.h"
+#include <algorithm>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+bool UploadManager::Init(const CreateInfo &create_info) {
+  device_ = create_info.device;
+  allocator_ = create_info.allocator;
+  transfer_queue_ = create_info.transfer_queue;
+  transfer_family_ = create_info.transfer_family;
+  graphics_family_ = create_info.graphics_family;
+  ring_size_ = create_info.ring_size;
+  copy_alignment_ = std::max<VkDeviceSize>(create_info.copy_alignment, 4);
+
+  VkCommandPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                    VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = transfer_family_;
+  if (vkCreateCommandPool(device_, &pool_info, nullptr, &command_pool_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create upload command pool.");
+    return false;
+  }
+
+  VkSemaphoreTypeCreateInfo type_info{};
+  type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  type_info.initialValue = 0;
+  VkSemaphoreCreateInfo semaphore_info{};
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphore_info.pNext = &type_info;
+  if (vkCreateSemaphore(device_, &semaphore_info, nullptr,
+                        &timeline_semaphore_) != VK_SUCCESS) {
+    spdlog::error("Failed to create upload timeline semaphore.");
+    return false;
+  }
+
+  VkBufferCreateInfo buffer_info{};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = ring_size_;
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  if (vkCreateBuffer(device_, &buffer_info, nullptr, &ring_buffer_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create upload staging ring.");
+    return false;
+  }
+  std::optional<GpuAllocation> allocation = allocator_->AllocateForBuffer(
+      ring_buffer_, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  if (!allocation || !allocation->mapped) {
+    spdlog::error("Failed to allocate upload staging ring memory.");
+    return false;
+  }
+  ring_allocation_ = *allocation;
+
+  spdlog::info("Upload ring: {} MiB, transfer family {}{}",
+               ring_size_ / (1024 * 1024), transfer_family_,
+               NeedsOwnershipTransfer() ? " (dedicated)" : "");
+  return true;
+}
+
+void UploadManager::Destroy() {
+  WaitIdle();
+  vkDestroyCommandPool(device_, command_pool_, nullptr);
+  vkDestroySemaphore(device_, timeline_semaphore_, nullptr);
+  vkDestroyBuffer(device_, ring_buffer_, nullptr);
+  allocator_->Free(ring_allocation_);
+  free_command_buffers_.clear();
+  submitted_batches_.clear();
+}
+
+std::optional<uint64_t>
+UploadManager::UploadBuffer(VkBuffer dst, VkDeviceSize dst_offset,
+                            const void *data, VkDeviceSize size,
+                            VkPipelineStageFlags dst_stage,
+                            VkAccessFlags dst_access) {
+  // Zero sized copies are invalid, and there is nothing to wait for.
+  if (size == 0) {
+    return 0;
+  }
+  if (size > ring_size_) {
+    spdlog::error("Upload of {} bytes does not fit into the staging ring.",
+                  size);
+    return std::nullopt;
+  }
+
+  std::lock_guard lock(mutex_);
+  Reclaim();
+
+  // Allocations never wrap around the end of the ring, the remainder of the
+  // ring is skipped instead.
+  uint64_t position =
+      (ring_head_ + copy_alignment_ - 1) & ~(copy_alignment_ - 1);
+  VkDeviceSize ring_offset = position % ring_size_;
+  if (ring_offset + size > ring_size_) {
+    position += ring_size_ - ring_offset;
+    ring_offset = 0;
+  }
+  if (position + size - ring_tail_ > ring_size_) {
+    return std::nullopt;
+  }
+  ring_head_ = position + size;
+
+  memcpy(static_cast<char *>(ring_allocation_.mapped) + ring_offset, data,
+         static_cast<size_t>(size));
+
+  if (open_batch_.command_buffer == VK_NULL_HANDLE) {
+    open_batch_.command_buffer = AcquireCommandBuffer();
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(open_batch_.command_buffer, &begin_info);
+  }
+
+  VkBufferCopy copy_region{};
+  copy_region.srcOffset = ring_offset;
+  copy_region.dstOffset = dst_offset;
+  copy_region.size = size;
+  vkCmdCopyBuffer(open_batch_.command_buffer, ring_buffer_, dst, 1,
+                  &copy_region);
+
+  open_batch_.regions.push_back({dst, dst_offset, size, dst_stage, dst_access});
+  open_batch_.ring_end = ring_head_;
+  return next_ticket_;
+}
+
+void UploadManager::Flush() {
+  std::lock_guard lock(mutex_);
+  if (open_batch_.command_buffer == VK_NULL_HANDLE) {
+    return;
+  }
+
+  if (NeedsOwnershipTransfer()) {
+    std::vector<VkBufferMemoryBarrier> barriers;
+    barriers.reserve(open_batch_.regions.size());
+    for (const Region &region : open_batch_.regions) {
+      VkBufferMemoryBarrier barrier{};
+      barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask = 0;
+      barrier.srcQueueFamilyIndex = transfer_family_;
+      barrier.dstQueueFamilyIndex = graphics_family_;
+      barrier.buffer = region.buffer;
+      barrier.offset = region.offset;
+      barrier.size = region.size;
+      barriers.push_back(barrier);
+    }
+    vkCmdPipelineBarrier(open_batch_.command_buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+                         static_cast<uint32_t>(barriers.size()),
+                         barriers.data(), 0, nullptr);
+  }
+  vkEndCommandBuffer(open_batch_.command_buffer);
+
+  open_batch_.ticket = next_ticket_++;
+
+  VkTimelineSemaphoreSubmitInfo timeline_info{};
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &open_batch_.ticket;
+
+  VkSubmitInfo submit_info{};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.pNext = &timeline_info;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &open_batch_.command_buffer;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = &timeline_semaphore_;
+
+  if (vkQueueSubmit(transfer_queue_, 1, &submit_info, VK_NULL_HANDLE) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to submit upload batch.");
+  }
+
+  submitted_batches_.push_back(std::move(open_batch_));
+  open_batch_ = Batch{};
+}
+
+uint64_t UploadManager::RecordAcquireBarriers(VkCommandBuffer command_buffer) {
+  std::lock_guard lock(mutex_);
+  uint64_t completed = CompletedTicket();
+  uint64_t wait_value = 0;
+  VkPipelineStageFlags dst_stages = 0;
+  std::vector<VkBufferMemoryBarrier> barriers;
+
+  // Only batches that already finished are acquired, so the graphics queue
+  // never waits on an in-progress transfer.
+  for (Batch &batch : submitted_batches_) {
+    if (batch.ticket > completed) {
+      break;
+    }
+    if (batch.acquired) {
+      continue;
+    }
+    if (NeedsOwnershipTransfer()) {
+      for (const Region &region : batch.regions) {
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = region.dst_access;
+        barrier.srcQueueFamilyIndex = transfer_family_;
+        barrier.dstQueueFamilyIndex = graphics_family_;
+        barrier.buffer = region.buffer;
+        barrier.offset = region.offset;
+        barrier.size = region.size;
+        barriers.push_back(barrier);
+        dst_stages |= region.dst_stage;
+      }
+    }
+    batch.acquired = true;
+    wait_value = batch.ticket;
+    acquired_ticket_ = batch.ticket;
+  }
+
+  if (!barriers.empty()) {
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         dst_stages, 0, 0, nullptr,
+                         static_cast<uint32_t>(barriers.size()),
+                         barriers.data(), 0, nullptr);
+  }
+
+  Reclaim();
+  return wait_value;
+}
+
+bool UploadManager::IsComplete(uint64_t ticket) const {
+  return ticket <= CompletedTicket();
+}
+
+void UploadManager::WaitIdle() {
+  uint64_t last_ticket;
+  {
+    std::lock_guard lock(mutex_);
+    last_ticket = next_ticket_ - 1;
+  }
+  if (last_ticket == 0) {
+    return;
+  }
+  VkSemaphoreWaitInfo wait_info{};
+  wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &timeline_semaphore_;
+  wait_info.pValues = &last_ticket;
+  vkWaitSemaphores(device_, &wait_info, UINT64_MAX);
+}
+
+VkDeviceSize UploadManager::PendingBytes() const {
+  std::lock_guard lock(mutex_);
+  return ring_head_ - ring_tail_;
+}
+
+uint64_t UploadManager::CompletedTicket() const {
+  uint64_t value = 0;
+  vkGetSemaphoreCounterValue(device_, timeline_semaphore_, &value);
+  return value;
+}
+
+void UploadManager::Reclaim() {
+  uint64_t completed = CompletedTicket();
+  for (Batch &batch : submitted_batches_) {
+    if (batch.ticket > completed) {
+      break;
+    }
+    ring_tail_ = std::max(ring_tail_, batch.ring_end);
+    if (batch.command_buffer != VK_NULL_HANDLE) {
+      vkResetCommandBuffer(batch.command_buffer, 0);
+      free_command_buffers_.push_back(batch.command_buffer);
+      batch.command_buffer = VK_NULL_HANDLE;
+    }
+  }
+  while (!submitted_batches_.empty() && submitted_batches_.front().acquired &&
+         submitted_batches_.front().command_buffer == VK_NULL_HANDLE) {
+    submitted_batches_.pop_front();
+  }
+  if (submitted_batches_.empty() &&
+      open_batch_.command_buffer == VK_NULL_HANDLE) {
+    // Nothing in flight, start over at the beginning of the ring.
+    ring_head_ = ring_tail_ = 0;
+  }
+}
+
+VkCommandBuffer UploadManager::AcquireCommandBuffer() {
+  if (!free_command_buffers_.empty()) {
+    VkCommandBuffer command_buffer = free_command_buffers_.back();
+    free_command_buffers_.pop_back();
+    return command_buffer;
+  }
+
+  VkCommandBufferAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = command_pool_;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  if (vkAllocateCommandBuffers(device_, &allocate_info, &command_buffer) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to allocate upload command buffer.");
+  }
+  return command_buffer;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "gpu_allocator.h"
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Streams data from the CPU into device-local buffers without stalling the
+// render thread. Data is copied into a persistently mapped staging ring, the
+// copies of many uploads are batched into one submit on the transfer queue and
+// each batch signals a value on a timeline semaphore. When the transfer queue
+// belongs to a different family than graphics, the queue family ownership
+// release is recorded with the copies and the matching acquire is recorded by
+// the render thread with RecordAcquireBarriers().
+//
+// Uploads may be queued from any thread, Flush() and RecordAcquireBarriers()
+// belong to the render thread.
+class UploadManager {
+public:
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    GpuAllocator *allocator = nullptr;
+    VkQueue transfer_queue = VK_NULL_HANDLE;
+    uint32_t transfer_family = 0;
+    uint32_t graphics_family = 0;
+    VkDeviceSize ring_size = 64ull * 1024ull * 1024ull;
+    VkDeviceSize copy_alignment = 16;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  void Destroy();
+
+  // Copies `size` bytes from `data` into the staging ring and queues a copy to
+  // `dst` at `dst_offset`. `dst_stage`/`dst_access` describe the first use of
+  // the data on the graphics queue. Returns the ticket at which the data is on
+  // the GPU, or std::nullopt if the ring is currently full (retry later).
+  // Nothing is queued for 0 bytes, their ticket 0 is complete right away.
+  std::optional<uint64_t>
+  UploadBuffer(VkBuffer dst, VkDeviceSize dst_offset, const void *data,
+               VkDeviceSize size,
+               VkPipelineStageFlags dst_stage =
+                   VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+               VkAccessFlags dst_access = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                                          VK_ACCESS_INDEX_READ_BIT);
+
+  // Submits every queued copy in one batch on the transfer queue.
+  void Flush();
+
+  // Records the ownership acquire barriers of all batches that have finished
+  // on the transfer queue. Returns the timeline value the graphics submission
+  // has to wait on (0 if there is nothing to wait for). Only data with a
+  // ticket <= AcquiredTicket() may be used by commands recorded after this.
+  uint64_t RecordAcquireBarriers(VkCommandBuffer command_buffer);
+  uint64_t AcquiredTicket() const { return acquired_ticket_; }
+
+  bool IsComplete(uint64_t ticket) const;
+  // Blocks until every submitted batch is done. Meant for startup only.
+  void WaitIdle();
+
+  VkSemaphore GetTimelineSemaphore() const { return timeline_semaphore_; }
+  VkDeviceSize RingSize() const { return ring_size_; }
+  VkDeviceSize PendingBytes() const;
+
+private:
+  struct Region {
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    VkPipelineStageFlags dst_stage;
+    VkAccessFlags dst_access;
+  };
+
+  struct Batch {
+    VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+    std::vector<Region> regions;
+    // Ring positions are monotonic, the physical offset is position %
+    // ring_size_.
+    uint64_t ring_end = 0;
+    uint64_t ticket = 0;
+    bool acquired = false;
+  };
+
+  bool NeedsOwnershipTransfer() const {
+    return transfer_family_ != graphics_family_;
+  }
+  uint64_t CompletedTicket() const;
+  // Releases the ring space and command buffers of retired batches.
+  void Reclaim();
+  VkCommandBuffer AcquireCommandBuffer();
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  GpuAllocator *allocator_ = nullptr;
+  VkQueue transfer_queue_ = VK_NULL_HANDLE;
+  uint32_t transfer_family_ = 0;
+  uint32_t graphics_family_ = 0;
+  VkDeviceSize copy_alignment_ = 16;
+
+  VkCommandPool command_pool_ = VK_NULL_HANDLE;
+  std::vector<VkCommandBuffer> free_command_buffers_;
+  VkSemaphore timeline_semaphore_ = VK_NULL_HANDLE;
+
+  VkBuffer ring_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation ring_allocation_;
+  VkDeviceSize ring_size_ = 0;
+  uint64_t ring_head_ = 0;
+  uint64_t ring_tail_ = 0;
+
+  mutable std::mutex mutex_;
+  // Batch currently collecting copies, not yet submitted.
+  Batch open_batch_;
+  // Submitted batches in ticket order, dropped once retired and acquired.
+  std::deque<Batch> submitted_batches_;
+  uint64_t next_ticket_ = 1;
+  uint64_t acquired_ticket_ = 0;
+};
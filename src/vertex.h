@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+// Terrain vertex, 4 bytes. Positions are not stored: shaders/shader.vert
+// rebuilds them from the vertex's place in the chunk grid and the chunk's
+// ChunkGpuData, so a vertex only carries what the lattice does not know.
+// shaders/terrain.mesh decodes the same layout from a storage buffer.
+struct Vertex {
+  // Height within the chunk's height range, see ChunkGpuData.
+  uint16_t height;
+  // Octahedral encoded unit normal, xy of the octahedron.
+  int8_t normal[2];
+
+  // Same encoding as shaders/heightfield.comp.
+  static Vertex Pack(float height, float height_min, float height_range,
+                     const glm::vec3 &normal) {
+    float t = height_range > 0.0f ? (height - height_min) / height_range : 0.0f;
+    Vertex vertex;
+    vertex.height = static_cast<uint16_t>(
+        std::clamp(t, 0.0f, 1.0f) * 65535.0f + 0.5f);
+
+    glm::vec3 n =
+        normal / (std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z));
+    glm::vec2 octahedron(n.x, n.y);
+    if (n.z < 0.0f) {
+      // Folds the lower half over the diagonals.
+      octahedron = {(1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+                    (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f)};
+    }
+    for (int i = 0; i < 2; ++i) {
+      vertex.normal[i] = static_cast<int8_t>(
+          std::lround(std::clamp(octahedron[i], -1.0f, 1.0f) * 127.0f));
+    }
+    return vertex;
+  }
+
+  static VkVertexInputBindingDescription GetBindingDescription() {
+    VkVertexInputBindingDescription binding_description{};
+    binding_description.binding = 0;
+    binding_description.stride = sizeof(Vertex);
+    binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    return binding_description;
+  }
+
+  static std::array<VkVertexInputAttributeDescription, 2>
+  GetAttributeDescriptions() {
+    std::array<VkVertexInputAttributeDescription, 2> attribute_descriptions{};
+    attribute_descriptions[0].binding = 0;
+    attribute_descriptions[0].location = 0;
+    attribute_descriptions[0].format = VK_FORMAT_R16_UNORM;
+    attribute_descriptions[0].offset = offsetof(Vertex, height);
+    attribute_descriptions[1].binding = 0;
+    attribute_descriptions[1].location = 1;
+    attribute_descriptions[1].format = VK_FORMAT_R8G8_SNORM;
+    attribute_descriptions[1].offset = offsetof(Vertex, normal);
+    return attribute_descriptions;
+  }
+};
+static_assert(sizeof(Vertex) == 4);
@@ -0,0 +1,785 @@
+#include "virtual_texture.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// Imagery is colour, filtered in linear space.
+constexpr VkFormat kCacheFormat = VK_FORMAT_R8G8B8A8_SRGB;
+constexpr VkFormat kPageTableFormat = VK_FORMAT_R32G32B32A32_UINT;
+constexpr VkImageUsageFlags kCacheUsage =
+    VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+// Levels a TileKey can address.
+constexpr uint32_t kMaxLevel = 24;
+
+VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+bool VirtualTexture::Init(const CreateInfo &create_info) {
+  create_info_ = create_info;
+  if (create_info_.tiles) {
+    const TileFile::Header &header = create_info_.tiles->File().GetHeader();
+    if (header.format != TileFormat::kRgba8 || header.tile_size < 3) {
+      spdlog::error("Imagery tiles have to be kRgba8 with a border.");
+      return false;
+    }
+    max_level_ = std::min(header.max_level, kMaxLevel);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(create_info_.physical_device, &properties);
+    uint32_t max_pages =
+        properties.limits.maxImageDimension2D / header.tile_size;
+    create_info_.pages_per_axis =
+        std::clamp(create_info_.pages_per_axis, 3u, max_pages);
+    // The roots are all uploaded by the first frame.
+    create_info_.max_uploads_per_frame =
+        std::max(create_info_.max_uploads_per_frame, kPinnedPages);
+  } else {
+    create_info_.pages_per_axis = 1;
+    create_info_.max_uploads_per_frame = 0;
+    create_info_.feedback_capacity = 0;
+  }
+  pages_.resize(create_info_.pages_per_axis * create_info_.pages_per_axis);
+  stats_.page_count = static_cast<uint32_t>(pages_.size());
+
+  VkSamplerCreateInfo sampler_info{};
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  if (vkCreateSampler(create_info_.device, &sampler_info, nullptr,
+                      &sampler_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture sampler.");
+    return false;
+  }
+  if (!CreateCache() || !CreatePageTable() || !CreateBuffers() ||
+      !CreateDescriptorSet()) {
+    return false;
+  }
+  if (!IsEnabled()) {
+    return true;
+  }
+
+  // The roots stay in the pages of their faces for good.
+  for (uint32_t page = static_cast<uint32_t>(pages_.size()) - 1;
+       page >= kPinnedPages; --page) {
+    free_pages_.push_back(page);
+  }
+  // The first Update() stages into frame 0's region before these are
+  // recorded.
+  staging_frame_ = create_info_.frames_in_flight - 1;
+  staging_cursor_ = 0;
+  for (uint32_t face = 0; face < kPinnedPages; ++face) {
+    TileKey key{face, 0, 0, 0};
+    const std::vector<uint8_t> *samples = create_info_.tiles->Load(key);
+    if (!samples || samples->size() != TileBytes()) {
+      spdlog::error("Imagery has no root tile for face {}.", face);
+      return false;
+    }
+    Page &page = pages_[face];
+    page.key = key.Pack();
+    page.used = true;
+    resident_[page.key] = face;
+    if (sparse_ && !BindPageMemory(face)) {
+      return false;
+    }
+    VkDeviceSize offset =
+        staging_frame_size_ * staging_frame_ + staging_cursor_;
+    std::memcpy(static_cast<uint8_t *>(staging_allocation_.mapped) + offset,
+                samples->data(), TileBytes());
+    uploads_.push_back({face, offset});
+    staging_cursor_ += TileBytes();
+  }
+  stats_.resident_pages = kPinnedPages;
+  return CommitBinds();
+}
+
+void VirtualTexture::Destroy() {
+  VkDevice device = create_info_.device;
+  if (device == VK_NULL_HANDLE) {
+    return;
+  }
+  vkDestroyDescriptorPool(device, pool_, nullptr);
+  vkDestroyDescriptorSetLayout(device, set_layout_, nullptr);
+  vkDestroyBuffer(device, staging_buffer_, nullptr);
+  vkDestroyBuffer(device, feedback_buffer_, nullptr);
+  vkDestroyImageView(device, page_table_view_, nullptr);
+  vkDestroyImage(device, page_table_image_, nullptr);
+  vkDestroyImageView(device, cache_view_, nullptr);
+  vkDestroyImage(device, cache_image_, nullptr);
+  vkDestroySemaphore(device, bind_semaphore_, nullptr);
+  vkDestroySampler(device, sampler_, nullptr);
+  GpuAllocator &allocator = *create_info_.allocator;
+  for (const GpuAllocation *allocation :
+       {&staging_allocation_, &feedback_allocation_, &page_table_allocation_,
+        &cache_allocation_}) {
+    if (allocation->memory != VK_NULL_HANDLE) {
+      allocator.Free(*allocation);
+    }
+  }
+  for (const GpuAllocation &block : sparse_blocks_) {
+    if (block.memory != VK_NULL_HANDLE) {
+      allocator.Free(block);
+    }
+  }
+  *this = VirtualTexture();
+}
+
+void VirtualTexture::Update(uint32_t frame) {
+  if (!feedback_allocation_.mapped) {
+    return;
+  }
+  auto *feedback = reinterpret_cast<uint32_t *>(
+      static_cast<uint8_t *>(feedback_allocation_.mapped) +
+      FeedbackOffset(frame));
+  auto *header = reinterpret_cast<FeedbackHeader *>(feedback);
+  if (!IsEnabled()) {
+    *header = {0, 0, 0, 0};
+    return;
+  }
+  ++frame_counter_;
+
+  // Every frame reads the entries one frame in flight wrote. Repeats count
+  // the pixels that wanted a tile.
+  uint32_t count = std::min(header->count, create_info_.feedback_capacity);
+  const uint32_t *entries = feedback + sizeof(FeedbackHeader) / 4;
+  wanted_.clear();
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t x = entries[2 * i];
+    uint32_t y = entries[2 * i + 1];
+    TileKey key{x >> 25, std::min(y >> 25, max_level_), x & 0x1ffffffu,
+                y & 0x1ffffffu};
+    if (key.face < kPinnedPages) {
+      ++wanted_[key.Pack()];
+    }
+  }
+  stats_.feedback_entries = count;
+  stats_.wanted_tiles = static_cast<uint32_t>(wanted_.size());
+
+  // An odd stride visits every pixel of the block once per period.
+  uint32_t pixel = static_cast<uint32_t>(frame_counter_ * 29 %
+                                         kFeedbackPeriod);
+  *header = {0, create_info_.feedback_capacity, pixel, max_level_};
+
+  // Uploads of the last frame recorded from this region have retired too.
+  staging_frame_ = frame;
+  staging_cursor_ = 0;
+  for (const auto &[packed, hits] : wanted_) {
+    TileKey key;
+    key.face = static_cast<uint32_t>(packed >> 50) & 0x7u;
+    key.level = static_cast<uint32_t>(packed >> 53);
+    key.y = static_cast<uint32_t>(packed >> 25) & 0x1ffffffu;
+    key.x = static_cast<uint32_t>(packed) & 0x1ffffffu;
+    Want(key, hits);
+  }
+  CommitBinds();
+}
+
+void VirtualTexture::Want(const TileKey &key, uint32_t hits) {
+  uint32_t page = key.face;
+  pages_[page].last_wanted_frame = frame_counter_;
+  for (uint32_t level = 1; level <= key.level; ++level) {
+    uint32_t shift = key.level - level;
+    TileKey child{key.face, level, key.x >> shift, key.y >> shift};
+    uint32_t quadrant = (child.x & 1u) | (child.y & 1u) << 1;
+    uint32_t child_page = pages_[page].children[quadrant];
+    if (child_page == kNoPage) {
+      // Coarse tiles first, they cover the most, then by how often they are
+      // wanted.
+      float priority = static_cast<float>(kMaxLevel - level) +
+                       static_cast<float>(std::min(hits, 1000u)) / 1000.0f;
+      if (!UploadTile(child, page, quadrant)) {
+        create_info_.tiles->Request(child, priority);
+      }
+      return;
+    }
+    page = child_page;
+    pages_[page].last_wanted_frame = frame_counter_;
+  }
+}
+
+bool VirtualTexture::UploadTile(const TileKey &key, uint32_t parent,
+                                uint32_t quadrant) {
+  if (uploads_.size() >= create_info_.max_uploads_per_frame) {
+    return false;
+  }
+  const std::vector<uint8_t> *samples = create_info_.tiles->Find(key);
+  if (!samples || samples->size() != TileBytes()) {
+    return false;
+  }
+  uint32_t page = AllocatePage();
+  if (page == kNoPage) {
+    return false;
+  }
+  if (sparse_ && !BindPageMemory(page)) {
+    FreePage(page);
+    return false;
+  }
+
+  Page &entry = pages_[page];
+  entry.key = key.Pack();
+  entry.used = true;
+  entry.parent = parent;
+  entry.last_wanted_frame = frame_counter_;
+  resident_[entry.key] = page;
+  pages_[parent].children[quadrant] = page;
+  WritePageTableEntry(parent);
+  WritePageTableEntry(page);
+
+  VkDeviceSize offset = staging_frame_size_ * staging_frame_ + staging_cursor_;
+  std::memcpy(static_cast<uint8_t *>(staging_allocation_.mapped) + offset,
+              samples->data(), TileBytes());
+  uploads_.push_back({page, offset});
+  staging_cursor_ += TileBytes();
+  ++stats_.uploaded_pages;
+  ++stats_.resident_pages;
+  return true;
+}
+
+uint32_t VirtualTexture::AllocatePage() {
+  if (!free_pages_.empty()) {
+    uint32_t page = free_pages_.back();
+    free_pages_.pop_back();
+    return page;
+  }
+  // A sparse pixel of the feedback can go a whole period without seeing a
+  // tile that is still on screen.
+  uint32_t victim = kNoPage;
+  for (uint32_t page = kPinnedPages; page < pages_.size(); ++page) {
+    const Page &candidate = pages_[page];
+    bool leaf = std::all_of(std::begin(candidate.children),
+                            std::end(candidate.children),
+                            [](uint32_t child) { return child == kNoPage; });
+    if (!candidate.used || !leaf ||
+        candidate.last_wanted_frame + 2 * kFeedbackPeriod > frame_counter_) {
+      continue;
+    }
+    if (victim == kNoPage ||
+        candidate.last_wanted_frame < pages_[victim].last_wanted_frame) {
+      victim = page;
+    }
+  }
+  if (victim == kNoPage) {
+    return kNoPage;
+  }
+  Page &page = pages_[victim];
+  Page &parent = pages_[page.parent];
+  for (uint32_t &child : parent.children) {
+    if (child == victim) {
+      child = kNoPage;
+    }
+  }
+  WritePageTableEntry(page.parent);
+  resident_.erase(page.key);
+  page = Page();
+  ++stats_.evicted_pages;
+  --stats_.resident_pages;
+  return victim;
+}
+
+void VirtualTexture::FreePage(uint32_t page) {
+  pages_[page] = Page();
+  free_pages_.push_back(page);
+}
+
+void VirtualTexture::WritePageTableEntry(uint32_t page) {
+  // Written once per frame from the page's state at Record().
+  if (std::find(dirty_pages_.begin(), dirty_pages_.end(), page) ==
+      dirty_pages_.end()) {
+    dirty_pages_.push_back(page);
+  }
+}
+
+void VirtualTexture::Record(VkCommandBuffer command_buffer) {
+  if (laid_out_ && uploads_.empty() && dirty_pages_.empty()) {
+    return;
+  }
+
+  std::array<VkImageMemoryBarrier, 2> barriers{};
+  for (VkImageMemoryBarrier &barrier : barriers) {
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout =
+        laid_out_ ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  }
+  barriers[0].image = cache_image_;
+  barriers[1].image = page_table_image_;
+  // Waits for the previous frames' reads of the pages that are rewritten.
+  vkCmdPipelineBarrier(command_buffer,
+                       laid_out_ ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+                                 : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                       nullptr, static_cast<uint32_t>(barriers.size()),
+                       barriers.data());
+
+  if (!laid_out_) {
+    // Every child starts out missing. The sparse cache has nothing to clear
+    // before its blocks are bound, and pages are written before they are
+    // read anyway.
+    VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    VkClearColorValue no_page{};
+    std::fill(std::begin(no_page.uint32), std::end(no_page.uint32), kNoPage);
+    vkCmdClearColorImage(command_buffer, page_table_image_,
+                         VK_IMAGE_LAYOUT_GENERAL, &no_page, 1, &range);
+    if (!IsEnabled()) {
+      VkClearColorValue black{};
+      vkCmdClearColorImage(command_buffer, cache_image_,
+                           VK_IMAGE_LAYOUT_GENERAL, &black, 1, &range);
+    }
+    VkMemoryBarrier clear_barrier{};
+    clear_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    clear_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    clear_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &clear_barrier,
+                         0, nullptr, 0, nullptr);
+    laid_out_ = true;
+  }
+
+  const uint32_t tile_size = TileSize();
+  const uint32_t pages_per_axis = create_info_.pages_per_axis;
+  std::vector<VkBufferImageCopy> copies;
+  copies.reserve(uploads_.size());
+  for (const Upload &upload : uploads_) {
+    VkBufferImageCopy copy{};
+    copy.bufferOffset = upload.staging_offset;
+    copy.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    copy.imageOffset = {
+        static_cast<int32_t>(upload.page % pages_per_axis * tile_size),
+        static_cast<int32_t>(upload.page / pages_per_axis * tile_size), 0};
+    copy.imageExtent = {tile_size, tile_size, 1};
+    copies.push_back(copy);
+  }
+  if (!copies.empty()) {
+    vkCmdCopyBufferToImage(command_buffer, staging_buffer_, cache_image_,
+                           VK_IMAGE_LAYOUT_GENERAL,
+                           static_cast<uint32_t>(copies.size()),
+                           copies.data());
+  }
+
+  // After this frame's tiles in the staging region, one uvec4 per page.
+  copies.clear();
+  VkDeviceSize offset = staging_frame_size_ * staging_frame_ +
+                        AlignUp(staging_cursor_, sizeof(uint32_t) * 4);
+  for (uint32_t page : dirty_pages_) {
+    std::memcpy(static_cast<uint8_t *>(staging_allocation_.mapped) + offset,
+                pages_[page].children, sizeof(uint32_t) * 4);
+    VkBufferImageCopy copy{};
+    copy.bufferOffset = offset;
+    copy.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    copy.imageOffset = {static_cast<int32_t>(page % pages_per_axis),
+                        static_cast<int32_t>(page / pages_per_axis), 0};
+    copy.imageExtent = {1, 1, 1};
+    copies.push_back(copy);
+    offset += sizeof(uint32_t) * 4;
+  }
+  if (!copies.empty()) {
+    vkCmdCopyBufferToImage(command_buffer, staging_buffer_, page_table_image_,
+                           VK_IMAGE_LAYOUT_GENERAL,
+                           static_cast<uint32_t>(copies.size()),
+                           copies.data());
+  }
+  uploads_.clear();
+  dirty_pages_.clear();
+
+  for (VkImageMemoryBarrier &barrier : barriers) {
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0,
+                       nullptr, static_cast<uint32_t>(barriers.size()),
+                       barriers.data());
+}
+
+void VirtualTexture::RecordFeedbackBarrier(VkCommandBuffer command_buffer,
+                                           uint32_t frame) const {
+  VkBufferMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = feedback_buffer_;
+  barrier.offset = FeedbackOffset(frame);
+  barrier.size = feedback_frame_size_;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &barrier,
+                       0, nullptr);
+}
+
+uint32_t VirtualTexture::TileSize() const {
+  return IsEnabled() ? create_info_.tiles->File().GetHeader().tile_size : 1;
+}
+
+bool VirtualTexture::CreateCache() {
+  const uint32_t size = create_info_.pages_per_axis * TileSize();
+  sparse_ = IsEnabled() && create_info_.sparse_queue != VK_NULL_HANDLE &&
+            ChooseSparse();
+
+  VkImageCreateInfo image_info{};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.flags = sparse_ ? VK_IMAGE_CREATE_SPARSE_BINDING_BIT |
+                                   VK_IMAGE_CREATE_SPARSE_RESIDENCY_BIT
+                             : 0;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = kCacheFormat;
+  image_info.extent = {size, size, 1};
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = kCacheUsage;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  if (vkCreateImage(create_info_.device, &image_info, nullptr,
+                    &cache_image_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture cache.");
+    return false;
+  }
+
+  if (sparse_) {
+    // A single level larger than a block has no mip tail to bind up front.
+    uint32_t requirement_count = 0;
+    vkGetImageSparseMemoryRequirements(create_info_.device, cache_image_,
+                                       &requirement_count, nullptr);
+    std::vector<VkSparseImageMemoryRequirements> requirements(
+        requirement_count);
+    vkGetImageSparseMemoryRequirements(create_info_.device, cache_image_,
+                                       &requirement_count,
+                                       requirements.data());
+    vkGetImageMemoryRequirements(create_info_.device, cache_image_,
+                                 &sparse_requirements_);
+    bool has_color = false;
+    for (const VkSparseImageMemoryRequirements &requirement : requirements) {
+      if (requirement.formatProperties.aspectMask &
+          VK_IMAGE_ASPECT_COLOR_BIT) {
+        has_color = requirement.imageMipTailFirstLod > 0;
+        sparse_block_ = requirement.formatProperties.imageGranularity;
+      }
+    }
+    if (!has_color) {
+      // The same image without the flags.
+      spdlog::warn("Sparse imagery cache is not usable, making it resident.");
+      vkDestroyImage(create_info_.device, cache_image_, nullptr);
+      cache_image_ = VK_NULL_HANDLE;
+      create_info_.sparse_queue = VK_NULL_HANDLE;
+      return CreateCache();
+    }
+    uint32_t rows = (size + sparse_block_.height - 1) / sparse_block_.height;
+    sparse_blocks_per_row_ =
+        (size + sparse_block_.width - 1) / sparse_block_.width;
+    sparse_blocks_.resize(sparse_blocks_per_row_ * rows);
+
+    VkSemaphoreTypeCreateInfo type_info{};
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    VkSemaphoreCreateInfo semaphore_info{};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &type_info;
+    if (vkCreateSemaphore(create_info_.device, &semaphore_info, nullptr,
+                          &bind_semaphore_) != VK_SUCCESS) {
+      spdlog::error("Failed to create sparse bind semaphore.");
+      return false;
+    }
+  } else {
+    std::optional<GpuAllocation> allocation =
+        create_info_.allocator->AllocateForImage(
+            cache_image_, VK_IMAGE_TILING_OPTIMAL,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+    if (!allocation) {
+      spdlog::error("Failed to allocate virtual texture cache memory.");
+      return false;
+    }
+    cache_allocation_ = *allocation;
+    stats_.cache_bytes = cache_allocation_.size;
+  }
+  stats_.sparse = sparse_;
+
+  VkImageViewCreateInfo view_info{};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = cache_image_;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = kCacheFormat;
+  view_info.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  if (vkCreateImageView(create_info_.device, &view_info, nullptr,
+                        &cache_view_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture cache view.");
+    return false;
+  }
+  return true;
+}
+
+bool VirtualTexture::ChooseSparse() {
+  uint32_t property_count = 0;
+  vkGetPhysicalDeviceSparseImageFormatProperties(
+      create_info_.physical_device, kCacheFormat, VK_IMAGE_TYPE_2D,
+      VK_SAMPLE_COUNT_1_BIT, kCacheUsage, VK_IMAGE_TILING_OPTIMAL,
+      &property_count, nullptr);
+  return property_count > 0;
+}
+
+bool VirtualTexture::BindPageMemory(uint32_t page) {
+  const uint32_t tile_size = TileSize();
+  const uint32_t size = create_info_.pages_per_axis * tile_size;
+  const uint32_t x0 = page % create_info_.pages_per_axis * tile_size;
+  const uint32_t y0 = page / create_info_.pages_per_axis * tile_size;
+  for (uint32_t by = y0 / sparse_block_.height;
+       by <= (y0 + tile_size - 1) / sparse_block_.height; ++by) {
+    for (uint32_t bx = x0 / sparse_block_.width;
+         bx <= (x0 + tile_size - 1) / sparse_block_.width; ++bx) {
+      GpuAllocation &block = sparse_blocks_[by * sparse_blocks_per_row_ + bx];
+      if (block.memory != VK_NULL_HANDLE) {
+        continue;
+      }
+      VkMemoryRequirements requirements = sparse_requirements_;
+      requirements.size = sparse_requirements_.alignment;
+      std::optional<GpuAllocation> allocation =
+          create_info_.allocator->AllocateForSparseImage(
+              requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      if (!allocation) {
+        spdlog::error("Failed to allocate a sparse imagery block.");
+        return false;
+      }
+      block = *allocation;
+      stats_.cache_bytes += block.size;
+
+      // Blocks along the right and bottom edges may be cut off.
+      VkSparseImageMemoryBind bind{};
+      bind.subresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0};
+      bind.offset = {static_cast<int32_t>(bx * sparse_block_.width),
+                     static_cast<int32_t>(by * sparse_block_.height), 0};
+      bind.extent = {
+          std::min(sparse_block_.width, size - bx * sparse_block_.width),
+          std::min(sparse_block_.height, size - by * sparse_block_.height),
+          1};
+      bind.memory = block.memory;
+      bind.memoryOffset = block.offset;
+      pending_binds_.push_back(bind);
+    }
+  }
+  return true;
+}
+
+bool VirtualTexture::CommitBinds() {
+  if (pending_binds_.empty()) {
+    bind_wait_value_ = 0;
+    return true;
+  }
+  VkSparseImageMemoryBindInfo image_bind{};
+  image_bind.image = cache_image_;
+  image_bind.bindCount = static_cast<uint32_t>(pending_binds_.size());
+  image_bind.pBinds = pending_binds_.data();
+
+  uint64_t signal_value = bind_value_ + 1;
+  VkTimelineSemaphoreSubmitInfo timeline_info{};
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &signal_value;
+  VkBindSparseInfo bind_info{};
+  bind_info.sType = VK_STRUCTURE_TYPE_BIND_SPARSE_INFO;
+  bind_info.pNext = &timeline_info;
+  bind_info.imageBindCount = 1;
+  bind_info.pImageBinds = &image_bind;
+  bind_info.signalSemaphoreCount = 1;
+  bind_info.pSignalSemaphores = &bind_semaphore_;
+  pending_binds_.clear();
+  if (vkQueueBindSparse(create_info_.sparse_queue, 1, &bind_info,
+                        VK_NULL_HANDLE) != VK_SUCCESS) {
+    spdlog::error("Failed to bind sparse imagery memory.");
+    bind_wait_value_ = 0;
+    return false;
+  }
+  bind_value_ = signal_value;
+  bind_wait_value_ = signal_value;
+  return true;
+}
+
+bool VirtualTexture::CreatePageTable() {
+  VkImageCreateInfo image_info{};
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = kPageTableFormat;
+  image_info.extent = {create_info_.pages_per_axis,
+                       create_info_.pages_per_axis, 1};
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage =
+      VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  if (vkCreateImage(create_info_.device, &image_info, nullptr,
+                    &page_table_image_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture page table.");
+    return false;
+  }
+  std::optional<GpuAllocation> allocation =
+      create_info_.allocator->AllocateForImage(
+          page_table_image_, VK_IMAGE_TILING_OPTIMAL,
+          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  if (!allocation) {
+    spdlog::error("Failed to allocate virtual texture page table memory.");
+    return false;
+  }
+  page_table_allocation_ = *allocation;
+
+  VkImageViewCreateInfo view_info{};
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = page_table_image_;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = kPageTableFormat;
+  view_info.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  if (vkCreateImageView(create_info_.device, &view_info, nullptr,
+                        &page_table_view_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture page table view.");
+    return false;
+  }
+  return true;
+}
+
+bool VirtualTexture::CreateBuffers() {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(create_info_.physical_device, &properties);
+  const uint32_t frames = create_info_.frames_in_flight;
+
+  // Read back by the CPU, so host visible. The GPU only writes a few bytes
+  // per frame.
+  feedback_frame_size_ =
+      AlignUp(sizeof(FeedbackHeader) +
+                  sizeof(uint32_t) * 2 * create_info_.feedback_capacity,
+              properties.limits.minStorageBufferOffsetAlignment);
+  VkBufferCreateInfo buffer_info{};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = feedback_frame_size_ * frames;
+  buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  if (vkCreateBuffer(create_info_.device, &buffer_info, nullptr,
+                     &feedback_buffer_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture feedback buffer.");
+    return false;
+  }
+  std::optional<GpuAllocation> allocation =
+      create_info_.allocator->AllocateForBuffer(
+          feedback_buffer_, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+                                VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+  if (!allocation) {
+    allocation = create_info_.allocator->AllocateForBuffer(
+        feedback_buffer_, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  }
+  if (!allocation || !allocation->mapped) {
+    spdlog::error("Failed to allocate virtual texture feedback memory.");
+    return false;
+  }
+  feedback_allocation_ = *allocation;
+  std::memset(feedback_allocation_.mapped, 0, buffer_info.size);
+
+  // The tiles of a frame, then its page table entries.
+  staging_frame_size_ =
+      AlignUp(TileBytes() * create_info_.max_uploads_per_frame,
+              sizeof(uint32_t) * 4) +
+      sizeof(uint32_t) * 4 * pages_.size();
+  buffer_info.size = staging_frame_size_ * frames;
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  if (vkCreateBuffer(create_info_.device, &buffer_info, nullptr,
+                     &staging_buffer_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture staging buffer.");
+    return false;
+  }
+  allocation = create_info_.allocator->AllocateForBuffer(
+      staging_buffer_, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  if (!allocation || !allocation->mapped) {
+    spdlog::error("Failed to allocate virtual texture staging memory.");
+    return false;
+  }
+  staging_allocation_ = *allocation;
+  return true;
+}
+
+bool VirtualTexture::CreateDescriptorSet() {
+  std::array<VkDescriptorSetLayoutBinding, 3> bindings{};
+  for (uint32_t i = 0; i < bindings.size(); ++i) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  }
+  bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+  layout_info.pBindings = bindings.data();
+  if (vkCreateDescriptorSetLayout(create_info_.device, &layout_info, nullptr,
+                                  &set_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture set layout.");
+    return false;
+  }
+
+  std::array<VkDescriptorPoolSize, 2> pool_sizes = {{
+      {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2},
+      {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 1},
+  }};
+  VkDescriptorPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = 1;
+  pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+  pool_info.pPoolSizes = pool_sizes.data();
+  if (vkCreateDescriptorPool(create_info_.device, &pool_info, nullptr,
+                             &pool_) != VK_SUCCESS) {
+    spdlog::error("Failed to create virtual texture descriptor pool.");
+    return false;
+  }
+  VkDescriptorSetAllocateInfo allocate_info{};
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.descriptorPool = pool_;
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &set_layout_;
+  if (vkAllocateDescriptorSets(create_info_.device, &allocate_info, &set_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to allocate virtual texture descriptor set.");
+    return false;
+  }
+
+  // The page table is only read with texelFetch(), the filter goes unused.
+  std::array<VkDescriptorImageInfo, 2> image_infos = {{
+      {sampler_, page_table_view_, VK_IMAGE_LAYOUT_GENERAL},
+      {sampler_, cache_view_, VK_IMAGE_LAYOUT_GENERAL},
+  }};
+  VkDescriptorBufferInfo buffer_info{feedback_buffer_, 0,
+                                     feedback_frame_size_};
+  std::array<VkWriteDescriptorSet, 3> writes{};
+  for (uint32_t i = 0; i < writes.size(); ++i) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = set_;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = bindings[i].descriptorType;
+    if (i < image_infos.size()) {
+      writes[i].pImageInfo = &image_infos[i];
+    } else {
+      writes[i].pBufferInfo = &buffer_info;
+    }
+  }
+  vkUpdateDescriptorSets(create_info_.device,
+                         static_cast<uint32_t>(writes.size()), writes.data(),
+                         0, nullptr);
+  return true;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "gpu_allocator.h"
+#include "tile_cache.h"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Planet-wide imagery from a kRgba8 TileFile as a virtual texture: the tiles
+// of every face's quadtree are the pages, the few the view samples are kept
+// in a fixed physical cache, so GPU memory stays the same however large the
+// dataset is.
+//
+// Tiles have a border of one sample, the inner ones sit on the corners of the
+// node like the heights of a height tile, see Terrain::BakeImageryTiles().
+// Every physical page holds one tile, and the texel of the page table at the
+// page's position in the cache holds the pages of the tile's four children,
+// or kNoPage. The roots of the six faces are pinned to pages 0 to 5, so the
+// terrain's fragment shader finds the deepest resident tile by walking down
+// from its face's root, and the coarser levels always cover what is missing.
+//
+// The fragment shader writes the tile it wanted to a feedback buffer, from
+// one pixel in every 8 x 8 block, another one each frame. Update() reads the
+// buffer once the frame that wrote it has retired, requests the missing
+// tiles, shallowest first, from the TileCache and queues the loaded ones for
+// Record() to copy into the cache, evicting the least recently wanted tiles
+// whose children are not resident. A tile is only uploaded once its parent
+// is resident.
+//
+// With a sparse binding queue the cache is a sparse image whose memory is
+// bound block by block as pages are first used, so it only takes what the
+// views so far needed, up to the cache's size. Otherwise it is fully
+// resident.
+//
+// Without a tile file the images are 1x1 placeholders, the descriptor set
+// still has to be bound.
+//
+// Render thread only.
+class VirtualTexture {
+public:
+  static constexpr uint32_t kNoPage = 0xffffffffu;
+  // Roots of the six faces.
+  static constexpr uint32_t kPinnedPages = 6;
+  // The feedback pattern repeats every kFeedbackPeriod frames.
+  static constexpr uint32_t kFeedbackPeriod = 64;
+
+  struct CreateInfo {
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+    GpuAllocator *allocator = nullptr;
+    // Of a kRgba8 tile file with every face's root tile. A placeholder if
+    // not set. Has to outlive the virtual texture.
+    TileCache *tiles = nullptr;
+    uint32_t frames_in_flight = 2;
+    // Physical pages along each axis of the cache.
+    uint32_t pages_per_axis = 32;
+    // Tiles copied into the cache per frame.
+    uint32_t max_uploads_per_frame = 16;
+    // Feedback entries per frame, the rest of a frame's are dropped.
+    uint32_t feedback_capacity = 32768;
+    // A queue with VK_QUEUE_SPARSE_BINDING_BIT on a device with sparseBinding
+    // and sparseResidencyImage2D enabled. Only used if the format and page
+    // size allow it.
+    VkQueue sparse_queue = VK_NULL_HANDLE;
+  };
+
+  struct Stats {
+    uint32_t resident_pages = 0;
+    uint32_t page_count = 0;
+    uint32_t wanted_tiles = 0;
+    uint32_t feedback_entries = 0;
+    uint64_t uploaded_pages = 0;
+    uint64_t evicted_pages = 0;
+    // Memory bound to the cache, the whole cache unless sparse.
+    VkDeviceSize cache_bytes = 0;
+    bool sparse = false;
+  };
+
+  bool Init(const CreateInfo &create_info);
+  // The device has to be idle.
+  void Destroy();
+
+  bool IsEnabled() const { return create_info_.tiles != nullptr; }
+
+  // Reads the feedback the frame last written to `frame`'s buffer left in
+  // it, which has to have retired, and queues the uploads and sparse binds
+  // that follow. Resets the buffer for the frame recorded next.
+  void Update(uint32_t frame);
+  // Copies the queued tiles into the cache and updates the page table,
+  // outside a render pass. Leaves both readable by fragment shaders.
+  void Record(VkCommandBuffer command_buffer);
+  // Makes the fragment shader's feedback for `frame` visible to Update(),
+  // after the last draw of the frame.
+  void RecordFeedbackBarrier(VkCommandBuffer command_buffer,
+                             uint32_t frame) const;
+  // Timeline semaphore and value the frame's submission has to wait on
+  // before the copies of Record(), 0 when nothing was bound.
+  VkSemaphore BindSemaphore() const { return bind_semaphore_; }
+  uint64_t BindWaitValue() const { return bind_wait_value_; }
+
+  // Set for the terrain's fragment shader: binding 0 the page table as a
+  // usampler2D, binding 1 the cache as a sampler2D and binding 2 the
+  // feedback buffer at FeedbackOffset().
+  VkDescriptorSetLayout SetLayout() const { return set_layout_; }
+  VkDescriptorSet Set() const { return set_; }
+  uint32_t FeedbackOffset(uint32_t frame) const {
+    return static_cast<uint32_t>(feedback_frame_size_ * frame);
+  }
+
+  const Stats &GetStats() const { return stats_; }
+
+private:
+  // Header of the feedback buffer, std430, followed by one uvec2 per entry:
+  // x the tile's x | face << 25, y its y | level << 25.
+  struct FeedbackHeader {
+    uint32_t count;
+    uint32_t capacity;
+    // Pixel of the 8 x 8 blocks that writes, x | y << 3.
+    uint32_t pixel;
+    uint32_t max_level;
+  };
+
+  struct Page {
+    // Packed TileKey of the tile, 0 and unused when free.
+    uint64_t key = 0;
+    bool used = false;
+    uint32_t parent = kNoPage;
+    uint32_t children[4] = {kNoPage, kNoPage, kNoPage, kNoPage};
+    uint64_t last_wanted_frame = 0;
+  };
+
+  struct Upload {
+    uint32_t page = 0;
+    VkDeviceSize staging_offset = 0;
+  };
+
+  bool CreateCache();
+  bool CreatePageTable();
+  bool CreateBuffers();
+  bool CreateDescriptorSet();
+  bool ChooseSparse();
+  // Binds the memory of the sparse blocks `page` touches that are not bound
+  // yet.
+  bool BindPageMemory(uint32_t page);
+  bool CommitBinds();
+
+  // Walks from the face's root to `key`, marking every resident tile on the
+  // way as wanted. The first missing one is requested or, if loaded,
+  // uploaded.
+  void Want(const TileKey &key, uint32_t hits);
+  bool UploadTile(const TileKey &key, uint32_t parent, uint32_t quadrant);
+  // A free page, or the least recently wanted leaf that was not wanted
+  // within a feedback period. kNoPage if there is none.
+  uint32_t AllocatePage();
+  void FreePage(uint32_t page);
+  void WritePageTableEntry(uint32_t page);
+  uint32_t TileSize() const;
+  VkDeviceSize TileBytes() const { return TileSize() * TileSize() * 4ull; }
+
+  CreateInfo create_info_;
+  uint32_t max_level_ = 0;
+
+  VkSampler sampler_ = VK_NULL_HANDLE;
+  VkImage cache_image_ = VK_NULL_HANDLE;
+  GpuAllocation cache_allocation_;
+  VkImageView cache_view_ = VK_NULL_HANDLE;
+  VkImage page_table_image_ = VK_NULL_HANDLE;
+  GpuAllocation page_table_allocation_;
+  VkImageView page_table_view_ = VK_NULL_HANDLE;
+  bool laid_out_ = false;
+
+  // One region per frame in flight each.
+  VkBuffer feedback_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation feedback_allocation_;
+  VkDeviceSize feedback_frame_size_ = 0;
+  VkBuffer staging_buffer_ = VK_NULL_HANDLE;
+  GpuAllocation staging_allocation_;
+  VkDeviceSize staging_frame_size_ = 0;
+  uint32_t staging_frame_ = 0;
+  VkDeviceSize staging_cursor_ = 0;
+
+  VkDescriptorSetLayout set_layout_ = VK_NULL_HANDLE;
+  VkDescriptorPool pool_ = VK_NULL_HANDLE;
+  VkDescriptorSet set_ = VK_NULL_HANDLE;
+
+  // Sparse cache: granularity of its blocks in texels, and their memory.
+  bool sparse_ = false;
+  VkExtent3D sparse_block_{};
+  VkMemoryRequirements sparse_requirements_{};
+  uint32_t sparse_blocks_per_row_ = 0;
+  std::vector<GpuAllocation> sparse_blocks_;
+  std::vector<VkSparseImageMemoryBind> pending_binds_;
+  VkSemaphore bind_semaphore_ = VK_NULL_HANDLE;
+  uint64_t bind_value_ = 0;
+  uint64_t bind_wait_value_ = 0;
+
+  std::vector<Page> pages_;
+  std::vector<uint32_t> free_pages_;
+  // Packed TileKey to page.
+  std::unordered_map<uint64_t, uint32_t> resident_;
+  // Feedback of the frame being read, packed TileKey to pixels.
+  std::unordered_map<uint64_t, uint32_t> wanted_;
+  std::vector<Upload> uploads_;
+  // Pages whose page table entry changed since the last Record().
+  std::vector<uint32_t> dirty_pages_;
+  uint64_t frame_counter_ = 0;
+  Stats stats_;
+};
@@ -1,4 +1,7 @@
 #include "vulkan_engine.h"
+#include "detail_texture.h"
+#include "init_graph.h"
+#include "vertex.h"
 #include "SDL3/SDL_oldnames.h"
 #include "glm/ext/matrix_transform.hpp"
 #include "spdlog/fmt/bundled/base.h"
@@ -8,19 +11,24 @@
 #include <SDL3/SDL_vulkan.h>
 #include <algorithm>
 #include <array>
+#include <cctype>
 #include <chrono>
+#include <cmath>
 #include <complex>
+#include <cstdlib>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <fcntl.h>
+#include <filesystem>
 #include <fstream>
-#define GLM_FORCE_RADIANS
-#define GLM_FORCE_DEPTH_ZERO_TO_ONE // Vulkan operates on [0, 1] range
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <limits>
 #include <optional>
 #include <set>
+#include <string_view>
+#include <utility>
 #include <spdlog/spdlog.h>
 #include <vulkan/vulkan_core.h>
 
@@ -30,59 +38,70 @@
 
 namespace {
 
-struct Vertex {
-  glm::vec3 position;
-  glm::vec3 color;
-
-  static VkVertexInputBindingDescription GetBindingDescription() {
-    VkVertexInputBindingDescription binding_description{};
-    binding_description.binding = 0;
-    binding_description.stride = sizeof(Vertex);
-    binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-    return binding_description;
-  }
-
-  static std::array<VkVertexInputAttributeDescription, 2>
-  GetAttributeDescriptions() {
-    std::array<VkVertexInputAttributeDescription, 2> attribute_descriptions{};
-    attribute_descriptions[0].binding = 0;
-    attribute_descriptions[0].location = 0;
-    attribute_descriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-    attribute_descriptions[0].offset = offsetof(Vertex, position);
-    attribute_descriptions[1].binding = 0;
-    attribute_descriptions[1].location = 1;
-    attribute_descriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-    attribute_descriptions[1].offset = offsetof(Vertex, color);
-    return attribute_descriptions;
-  }
-};
-
+// The model transform is per chunk, see ChunkGpuData.
 struct UniformBufferObject {
-  glm::mat4 model;
   glm::mat4 view;
   glm::mat4 projection;
 };
 
-const std::vector<Vertex> vertices = {
-    {{-0.5f, -0.5f, 0.0f}, {1.0f, 0.0f, 0.0f}},
-    {{0.5f, -0.5f, 0.0f}, {0.0f, 1.0f, 0.0f}},
-    {{0.5f, 0.5f, 0.0f}, {0.0f, 0.0f, 1.0f}},
-    {{-0.5f, 0.5f, 0.0f}, {1.0f, 1.0f, 1.0f}},
-
-    {{-0.5f, -0.5f, -0.5f}, {1.0f, 0.0f, 0.0f}},
-    {{0.5f, -0.5f, -0.5f}, {0.0f, 1.0f, 0.0f}},
-    {{0.5f, 0.5f, -0.5f}, {0.0f, 0.0f, 1.0f}},
-    {{-0.5f, 0.5f, -0.5f}, {1.0f, 1.0f, 1.0f}}};
+// Every push of UpdateUniformBuffer() padded to 256 bytes, the largest
+// minUniformBufferOffsetAlignment Vulkan allows. Their dynamic offsets would
+// fall back to 0 and read the wrong struct if the frame's region ran out.
+constexpr VkDeviceSize AlignedUniformSize(VkDeviceSize size) {
+  return (size + 255) / 256 * 256;
+}
+constexpr VkDeviceSize kFrameUniformBytes =
+    AlignedUniformSize(sizeof(UniformBufferObject)) +
+    AlignedUniformSize(sizeof(CullOcclusionData)) +
+    AlignedUniformSize(sizeof(AtmosphereGpuData)) +
+    AlignedUniformSize(sizeof(ShadowGpuData));
+static_assert(kFrameUniformBytes <= UniformArena::CreateInfo{}.frame_size,
+              "The frame's uniforms have to fit into its arena region");
+
+const double kPlanetRadius = 6371000.0;
+// Vertices along a terrain chunk's edge, shared by the terrain, the generator
+// and the vertex shader.
+const uint32_t kTerrainGridSize = 33;
+const float kReversedZNearPlane = 0.1f;
+// Of the terrain's detail textures, see DetailTexture.
+const uint32_t kDetailTextureSize = 256;
+const float kMaxAnisotropy = 8.0f;
+const double kScriptedFlightDuration = 120.0;
+// Frames at the start of a benchmark that are left out of the statistics.
+const uint32_t kBenchmarkWarmupFrames = 10;
+// GLSL the shader library compiles on changes, set by the build.
+#ifdef PLANET_SHADER_SOURCE_DIR
+const char *const kShaderSourceDir = PLANET_SHADER_SOURCE_DIR;
+#else
+const char *const kShaderSourceDir = "";
+#endif
 
-const std::vector<uint32_t> indices = {0, 1, 2, 2, 3, 0, 4, 5, 6, 6, 7, 4};
+// The present modes the Display window offers, if the surface supports them.
+const std::array<VkPresentModeKHR, 4> kPresentModes = {
+    VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+    VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR};
+
+const char *PresentModeName(VkPresentModeKHR present_mode) {
+  switch (present_mode) {
+  case VK_PRESENT_MODE_FIFO_KHR:
+    return "FIFO";
+  case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+    return "FIFO relaxed";
+  case VK_PRESENT_MODE_MAILBOX_KHR:
+    return "Mailbox";
+  case VK_PRESENT_MODE_IMMEDIATE_KHR:
+    return "Immediate";
+  default:
+    return "Other";
+  }
+}
 
 const std::vector<const char *> kValidationLayers = {
     "VK_LAYER_KHRONOS_validation"};
 
 const std::vector<const char *> kDeviceExtensions = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME};
-
-const int kMaxFramesInFlight = 2;
+const std::vector<const char *> kHeadlessDeviceExtensions = {};
 
 // TODO: Enable validation layers only on debug builds
 const bool kEnableValidationLayers = true;
@@ -101,18 +120,77 @@ DebugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT message_severity,
   return VK_FALSE;
 }
 
-std::vector<char> ReadFile(const std::string &filename) {
-  std::ifstream file(filename, std::ios::ate | std::ios::binary);
-  if (!file.is_open()) {
-    spdlog::error("Failed to read file: {}", filename);
-    return {};
+// Nearest-rank percentile of unsorted samples, p in [0, 1].
+float Percentile(std::vector<float> samples, double p) {
+  if (samples.empty()) {
+    return 0.0f;
+  }
+  size_t rank = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  return samples[rank];
+}
+
+std::string TimingJson(const std::vector<float> &samples) {
+  double sum = 0.0;
+  for (float sample : samples) {
+    sum += sample;
+  }
+  float max = samples.empty()
+                  ? 0.0f
+                  : *std::max_element(samples.begin(), samples.end());
+  return fmt::format(
+      "{{\"mean\": {:.4f}, \"p50\": {:.4f}, \"p95\": {:.4f}, "
+      "\"p99\": {:.4f}, \"max\": {:.4f}}}",
+      samples.empty() ? 0.0 : sum / samples.size(), Percentile(samples, 0.5),
+      Percentile(samples, 0.95), Percentile(samples, 0.99), max);
+}
+
+// Lower case hex, in the usual 8-4-4-4-12 groups.
+std::string FormatUuid(const uint8_t (&uuid)[VK_UUID_SIZE]) {
+  std::string text;
+  for (uint32_t i = 0; i < VK_UUID_SIZE; ++i) {
+    if (i == 4 || i == 6 || i == 8 || i == 10) {
+      text += '-';
+    }
+    text += fmt::format("{:02x}", uuid[i]);
+  }
+  return text;
+}
+
+const char *DeviceTypeName(VkPhysicalDeviceType type) {
+  switch (type) {
+  case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+    return "discrete";
+  case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+    return "integrated";
+  case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+    return "virtual";
+  case VK_PHYSICAL_DEVICE_TYPE_CPU:
+    return "CPU";
+  default:
+    return "other";
+  }
+}
+
+// `request` is a part of the name, in any case, or the UUID, with or without
+// the dashes.
+bool MatchesGpu(std::string_view request, std::string_view name,
+                std::string_view uuid) {
+  auto normalize = [](std::string_view text, bool drop_dashes) {
+    std::string result;
+    for (char c : text) {
+      if (!(drop_dashes && c == '-')) {
+        result += static_cast<char>(
+            std::tolower(static_cast<unsigned char>(c)));
+      }
+    }
+    return result;
+  };
+  if (normalize(request, true) == normalize(uuid, true)) {
+    return true;
   }
-  size_t file_size = (size_t)file.tellg();
-  std::vector<char> buffer(file_size);
-  file.seekg(0);
-  file.read(buffer.data(), file_size);
-  file.close();
-  return buffer;
+  return normalize(name, false).find(normalize(request, false)) !=
+         std::string::npos;
 }
 
 static void check_vk_result(VkResult err) {
@@ -126,36 +204,171 @@ static void check_vk_result(VkResult err) {
 
 } // namespace
 
-void VulkanEngine::Init() {
+void VulkanEngine::Init(const EngineConfig &config) {
   // TODO: Check if everything initialized correctly (everywhere in this class).
   // Make sure destruction is done correctly.
-  InitSDL();
-  InitVulkanInstance();
-  SetupDebugMessenger();
-  CreateSurface();
-  PickPhysicalDevice();
-  CreateLogicalDevice();
-  CreateSwapChain();
-  CreateImageViews();
-  CreateRenderPass();
-  CreateDescriptorSetLayout();
-  CreateGraphicsPipeline();
-  CreateCommandPool();
-  CreateDepthResources();
-  CreateColorResources();
-  CreateFramebuffers();
-  CreateVertexBuffer();
-  CreateIndexBuffer();
-  CreateUniformBuffers();
-  CreateDescriptorPool();
-  CreateDescriptorSets();
-  CreateCommandBuffer();
-  CreateSyncObjects();
-  InitImGui();
+  auto init_start = std::chrono::steady_clock::now();
+  config_ = config;
+  config_.frames_in_flight = std::max(config_.frames_in_flight, 1u);
+  // present_input_times_ has to reach back past the queued presents.
+  config_.max_queued_presents = std::min(config_.max_queued_presents, 8u);
+  spdlog::info("Frames in flight: {}", config_.frames_in_flight);
+  job_system_.Init(config_.worker_threads);
+  spdlog::info("Job system threads: {}", job_system_.ThreadCount());
+
+  // Over the highest mountains, the skim would cut through them otherwise.
+  camera_path_ = CameraPath::Scripted(
+      kPlanetRadius + terrain_noise_.MaxHeight(), kScriptedFlightDuration);
+  if (!config_.camera_path.empty()) {
+    if (std::optional<CameraPath> path = CameraPath::Load(config_.camera_path)) {
+      camera_path_ = std::move(*path);
+    } else {
+      spdlog::warn("Falling back to the scripted camera flight.");
+    }
+  }
+
+  // Shader reads and pipeline creation overlap with the rest of the device
+  // setup, ImGui is only set up after the first frame, see Run().
+  constexpr auto kAnyThread = InitGraph::Affinity::kAnyThread;
+  constexpr auto kMainThread = InitGraph::Affinity::kMainThread;
+  InitGraph graph;
+  graph.Add("Window", {}, kMainThread, [this] {
+    if (!config_.headless) {
+      InitSDL();
+    }
+  });
+  graph.Add("Shader library", {"Window"}, kAnyThread,
+            [this] { InitShaderLibrary(); });
+  graph.Add("Instance", {"Window"}, kMainThread, [this] {
+    InitVulkanInstance();
+    SetupDebugMessenger();
+    if (!config_.headless) {
+      CreateSurface();
+    }
+  });
+  // Settles the config for everything after it.
+  graph.Add("Device", {"Instance"}, kAnyThread, [this] {
+    PickPhysicalDevice();
+    CreateLogicalDevice();
+    allocator_.Init(physical_device_, device_);
+  });
+  graph.Add("Upload manager", {"Device"}, kAnyThread,
+            [this] { InitUploadManager(); });
+  graph.Add("Profiler", {"Device"}, kAnyThread, [this] { InitProfiler(); });
+  graph.Add("Swap chain", {"Device"}, kMainThread, [this] {
+    if (config_.headless) {
+      CreateOffscreenTargets();
+    } else {
+      CreateSwapChain();
+    }
+    CreateImageViews();
+  });
+  graph.Add("Quality governor", {"Swap chain"}, kAnyThread,
+            [this] { InitQualityGovernor(); });
+  graph.Add("Render pass", {"Quality governor"}, kAnyThread, [this] {
+    if (!config_.dynamic_rendering) {
+      CreateRenderPass();
+    }
+  });
+  graph.Add("Descriptor set layouts", {"Device"}, kAnyThread,
+            [this] { CreateDescriptorSetLayout(); });
+  graph.Add("Bindless textures", {"Device"}, kAnyThread,
+            [this] { InitBindlessTextures(); });
+  graph.Add("Pipeline cache", {"Device"}, kAnyThread,
+            [this] { LoadPipelineCache(); });
+  graph.Add("Uniform arena", {"Device"}, kAnyThread,
+            [this] { InitUniformArena(); });
+  graph.Add("Atmosphere", {"Shader library", "Pipeline cache", "Uniform arena"},
+            kAnyThread, [this] { InitAtmosphere(); });
+  // Loads the root tiles and binds sparse memory on the graphics queue.
+  graph.Add("Virtual texture", {"Device"}, kMainThread,
+            [this] { InitVirtualTexture(); });
+  // Decides on occlusion culling, which the depth buffer depends on.
+  graph.Add("Hi-Z pyramid", {"Shader library", "Pipeline cache"}, kAnyThread,
+            [this] { InitHiZPyramid(); });
+  // The mesh shader pipeline layout has the Hi-Z pyramid's set.
+  graph.Add("Graphics pipeline",
+            {"Shader library", "Pipeline cache", "Descriptor set layouts",
+             "Bindless textures", "Atmosphere", "Virtual texture",
+             "Render pass", "Hi-Z pyramid"},
+            kAnyThread, [this] { CreateGraphicsPipeline(); });
+  graph.Add("Sky pipeline",
+            {"Shader library", "Pipeline cache", "Atmosphere", "Render pass"},
+            kAnyThread, [this] { CreateSkyPipeline(); });
+  graph.Add("Cull pipeline",
+            {"Shader library", "Pipeline cache", "Descriptor set layouts",
+             "Hi-Z pyramid"},
+            kAnyThread, [this] { CreateCullPipeline(); });
+  graph.Add("Terrain generator", {"Shader library", "Pipeline cache"},
+            kAnyThread, [this] {
+              if (config_.gpu_terrain_generation) {
+                InitTerrainGenerator();
+              }
+            });
+  // Everything from here on records from the command pool or submits.
+  graph.Add("Command pool", {"Device"}, kMainThread,
+            [this] { CreateCommandPool(); });
+  graph.Add("Detail textures", {"Command pool", "Bindless textures"},
+            kMainThread, [this] { CreateDetailTextures(); });
+  graph.Add("Render targets",
+            {"Command pool", "Render pass", "Hi-Z pyramid"}, kMainThread,
+            [this] {
+              CreateDepthResources();
+              CreateColorResources();
+              CreateSceneResources();
+              if (!config_.dynamic_rendering) {
+                CreateFramebuffers();
+              }
+            });
+  graph.Add("Terrain",
+            {"Upload manager", "Terrain generator", "Detail textures"},
+            kMainThread, [this] {
+              InitTerrain();
+              // The terrain root chunks have to be resident before the first
+              // frame records its draws, this is the only place that waits
+              // on the upload and compute queues.
+              upload_manager_.Flush();
+              upload_manager_.WaitIdle();
+              terrain_generator_.Flush();
+              terrain_generator_.WaitIdle();
+            });
+  graph.Add("Terrain query", {"Terrain"}, kAnyThread,
+            [this] { InitTerrainQuery(); });
+  graph.Add("Simulation", {"Atmosphere"}, kAnyThread,
+            [this] { InitSimulation(); });
+  graph.Add("Shadow maps",
+            {"Shader library", "Pipeline cache", "Uniform arena", "Terrain"},
+            kAnyThread, [this] { InitShadowMaps(); });
+  graph.Add("Descriptor sets",
+            {"Terrain", "Uniform arena", "Cull pipeline", "Render targets",
+             "Shadow maps"},
+            kMainThread, [this] {
+              CreateDescriptorPool();
+              CreateDescriptorSets();
+            });
+  graph.Add("Frame resources", {"Render targets", "Detail textures"},
+            kMainThread, [this] {
+              CreateCommandBuffer();
+              CreateThreadCommandPools();
+              CreateSyncObjects();
+            });
+  // The graph is fixed, an unknown step is a bug and nothing would be set up.
+  if (!graph.Run(job_system_)) {
+    spdlog::critical("The init graph is invalid.");
+    std::abort();
+  }
+  spdlog::info("Initialized in {:.1f} ms.",
+               std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - init_start)
+                   .count());
 }
 
 void VulkanEngine::Run() {
+  simulation_.Start();
   while (running_) {
+    // Before the events are read, so the frame works with the newest input.
+    WaitForQueuedPresents();
+
     SDL_Event event;
     while (SDL_PollEvent(&event) != 0) {
       switch (event.type) {
@@ -172,68 +385,271 @@ void VulkanEngine::Run() {
         freeze_rendering_ = false;
         break;
       }
-      ImGui_ImplSDL3_ProcessEvent(&event);
+      if (imgui_initialized_) {
+        ImGui_ImplSDL3_ProcessEvent(&event);
+      }
     }
+    input_time_ = std::chrono::steady_clock::now();
+    // Before the UI, which shows and edits the sun of this frame.
+    ApplySimulationState(simulation_.Sample(input_time_));
 
     if (freeze_rendering_) {
       std::this_thread::sleep_for(std::chrono::milliseconds(100));
       continue;
     }
 
-    if (resize_requested_) {
-      RecreateSwapChain();
+    if (resize_requested_ && !RecreateSwapChain()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
     }
 
-    ImGui_ImplVulkan_NewFrame();
-    ImGui_ImplSDL3_NewFrame();
-    ImGui::NewFrame();
-    ImGui::ShowDemoWindow();
+    if (imgui_initialized_) {
+      ImGui_ImplVulkan_NewFrame();
+      ImGui_ImplSDL3_NewFrame();
+      ImGui::NewFrame();
+      profiler_.DrawImGui();
+      DrawDisplayImGui();
+    }
 
-    DrawFrame();
+    {
+      Profiler::CpuScope scope(profiler_, "DrawFrame");
+      DrawFrame();
+    }
+    // Not needed for the first frame, which is on its way already.
+    if (!imgui_initialized_) {
+      auto imgui_start = std::chrono::steady_clock::now();
+      InitImGui();
+      spdlog::info("Initialized ImGui in {:.1f} ms.",
+                   std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - imgui_start)
+                       .count());
+    }
+  }
+}
 
-    // NOTE:
-    // This should not be called once every frame according to:
-    // https://vulkan-tutorial.com/Drawing_a_triangle/Drawing/Rendering_and_presentation
+bool VulkanEngine::RunBenchmark(uint32_t frame_count,
+                                const std::string &output_path) {
+  // A fixed time step makes every run see the same camera positions,
+  // independent of how fast the frames are rendered.
+  double time_step = camera_path_.Duration() / std::max(frame_count, 1u);
+  // GPU times are the tail of the profiler's history, one per measured
+  // frame.
+  auto fly = [&](std::vector<float> &frame_times,
+                 std::vector<float> &gpu_times) {
+    frame_times.clear();
+    frame_times.reserve(frame_count);
+    auto last_frame_end = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < frame_count; ++i) {
+      camera_path_.Apply(i * time_step, camera_);
+      {
+        Profiler::CpuScope scope(profiler_, "DrawFrame");
+        DrawFrame();
+      }
+      // Includes the fence waits, so once the pipeline is full this is the
+      // frame rate the GPU sustains.
+      auto frame_end = std::chrono::steady_clock::now();
+      if (i >= kBenchmarkWarmupFrames) {
+        frame_times.push_back(std::chrono::duration<float, std::milli>(
+                                  frame_end - last_frame_end)
+                                  .count());
+      }
+      last_frame_end = frame_end;
+    }
     vkDeviceWaitIdle(device_);
+    profiler_.CollectAll();
+
+    gpu_times = profiler_.ScopeSamples("Frame", true);
+    gpu_times.erase(gpu_times.begin(),
+                    gpu_times.end() - std::min(frame_times.size(),
+                                               gpu_times.size()));
+  };
+
+  // The vertex shader path first, its results stay at the top level. The
+  // mesh shader path flies the same path again if the device has it.
+  bool mesh_shaders = config_.mesh_shaders;
+  SetMeshShaders(false);
+  std::vector<float> frame_times;
+  std::vector<float> gpu_times;
+  fly(frame_times, gpu_times);
+  std::string mesh_shader_json = "null";
+  if (mesh_shaders_supported_) {
+    SetMeshShaders(true);
+    std::vector<float> mesh_frame_times;
+    std::vector<float> mesh_gpu_times;
+    fly(mesh_frame_times, mesh_gpu_times);
+    mesh_shader_json =
+        fmt::format("{{\"frame_time_ms\": {}, \"gpu_time_ms\": {}}}",
+                    TimingJson(mesh_frame_times), TimingJson(mesh_gpu_times));
+  }
+  SetMeshShaders(mesh_shaders);
+
+  GpuAllocatorStats memory = allocator_.GetStats();
+  const Terrain::Stats &terrain = terrain_.GetStats();
+
+  std::string json = fmt::format(
+      "{{\"frames\": {}, \"warmup_frames\": {}, \"width\": {}, "
+      "\"height\": {}, \"frame_time_ms\": {}, \"gpu_time_ms\": {}, "
+      "\"memory\": {{\"block_bytes\": {}, \"used_bytes\": {}, "
+      "\"dedicated_bytes\": {}}}, \"terrain\": {{\"resident_chunks\": {}, "
+      "\"selected_chunks\": {}}}, \"mesh_shaders\": {}}}",
+      frame_count, kBenchmarkWarmupFrames, swap_chain_extent_.width,
+      swap_chain_extent_.height, TimingJson(frame_times),
+      TimingJson(gpu_times), memory.block_bytes, memory.used_bytes,
+      memory.dedicated_bytes, terrain.resident_chunks,
+      terrain.selected_chunks, mesh_shader_json);
+  fmt::print("{}\n", json);
+
+  if (!output_path.empty()) {
+    std::ofstream file(output_path, std::ios::trunc);
+    if (!file.is_open() || !(file << json << "\n")) {
+      spdlog::error("Failed to write benchmark results to {}.", output_path);
+      return false;
+    }
   }
+  return true;
 }
 
-void VulkanEngine::Destroy() {
-  ImGui_ImplVulkan_Shutdown();
-  ImGui_ImplSDL3_Shutdown();
-  ImGui::DestroyContext();
-  vkDestroyDescriptorPool(device_, imgui_descriptor_pool_, nullptr);
+bool VulkanEngine::RunHeightfieldBenchmark(uint32_t chunk_count,
+                                           const std::string &output_path) {
+  Terrain::GenerationBenchmark result =
+      terrain_.BenchmarkGeneration(chunk_count);
+  std::string json = fmt::format(
+      "{{\"chunks\": {}, \"simd_path\": \"{}\", "
+      "\"scalar_ms\": {:.3f}, \"simd_ms\": {:.3f}, \"gpu_chunks\": {}, "
+      "\"gpu_ms\": {:.3f}, \"simd_mismatches\": {}, "
+      "\"gpu_mismatches\": {}}}",
+      result.chunks, result.simd_path,
+      result.scalar_ms, result.simd_ms, result.gpu_chunks, result.gpu_ms,
+      result.simd_mismatches, result.gpu_mismatches);
+  fmt::print("{}\n", json);
+
+  if (!output_path.empty()) {
+    std::ofstream file(output_path, std::ios::trunc);
+    if (!file.is_open() || !(file << json << "\n")) {
+      spdlog::error("Failed to write benchmark results to {}.", output_path);
+      return false;
+    }
+  }
+  if (result.simd_mismatches > 0 || result.gpu_mismatches > 0) {
+    spdlog::error("Generated heights differ from the scalar reference.");
+    return false;
+  }
+  return true;
+}
+
+bool VulkanEngine::RunQueryBenchmark(uint32_t query_count,
+                                     const std::string &output_path) {
+  // Where the camera path starts, which is where a simulation would look.
+  camera_path_.Apply(0.0, camera_);
+  TerrainQuery::QueryBenchmark result = terrain_query_.BenchmarkQueries(
+      camera_.position, query_count, job_system_);
+  auto per_second = [](uint64_t count, double ms) {
+    return ms > 0.0 ? count / (ms * 1e-3) : 0.0;
+  };
+  std::string json = fmt::format(
+      "{{\"queries\": {}, \"simd_path\": \"{}\", \"level\": {}, "
+      "\"cold_ms\": {:.3f}, \"warm_ms\": {:.3f}, "
+      "\"generated_tiles\": {}, \"single_ms\": {:.3f}, "
+      "\"threads\": {}, \"parallel_ms\": {:.3f}, "
+      "\"warm_queries_per_s\": {:.0f}, "
+      "\"parallel_queries_per_s\": {:.0f}, \"rays\": {}, "
+      "\"ray_hits\": {}, \"ray_ms\": {:.3f}, "
+      "\"max_vertex_error_m\": {:.6f}}}",
+      result.queries, result.simd_path, terrain_query_.Level(),
+      result.cold_ms, result.warm_ms, result.generated_tiles,
+      result.single_ms, result.threads, result.parallel_ms,
+      per_second(result.queries, result.warm_ms),
+      per_second(static_cast<uint64_t>(result.queries) * result.threads,
+                 result.parallel_ms),
+      result.rays, result.ray_hits, result.ray_ms, result.max_vertex_error);
+  fmt::print("{}\n", json);
+
+  if (!output_path.empty()) {
+    std::ofstream file(output_path, std::ios::trunc);
+    if (!file.is_open() || !(file << json << "\n")) {
+      spdlog::error("Failed to write benchmark results to {}.", output_path);
+      return false;
+    }
+  }
+  // Float heights of up to a few kilometres, interpolated right next to a
+  // vertex.
+  if (result.max_vertex_error > 0.01) {
+    spdlog::error("Terrain queries differ from the grid heights.");
+    return false;
+  }
+  return true;
+}
 
-  CleanupSwapChain();
+void VulkanEngine::Destroy() {
+  simulation_.Destroy();
+  // Frames are pipelined, so the GPU may still be working on the last
+  // frames_in_flight submissions.
+  vkDeviceWaitIdle(device_);
 
-  for (size_t i = 0; i < kMaxFramesInFlight; ++i) {
-    vkDestroyBuffer(device_, uniform_buffers_[i], nullptr);
-    vkFreeMemory(device_, uniform_buffers_memory_[i], nullptr);
+  if (imgui_initialized_) {
+    ImGui_ImplVulkan_Shutdown();
+    ImGui_ImplSDL3_Shutdown();
+    ImGui::DestroyContext();
+    vkDestroyDescriptorPool(device_, imgui_descriptor_pool_, nullptr);
   }
 
-  vkDestroyDescriptorPool(device_, descriptor_pool_, nullptr);
+  RetireSwapChain();
+  deletion_queue_.FlushAll();
 
-  vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_, nullptr);
+  uniform_arena_.Destroy();
 
-  vkDestroyBuffer(device_, vertex_buffer_, nullptr);
-  vkFreeMemory(device_, vertex_buffer_memory_, nullptr);
+  vkDestroyDescriptorPool(device_, descriptor_pool_, nullptr);
 
-  vkDestroyBuffer(device_, index_buffer_, nullptr);
-  vkFreeMemory(device_, index_buffer_memory_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_, nullptr);
+  vkDestroyDescriptorSetLayout(device_, cull_descriptor_set_layout_, nullptr);
+
+  shadow_maps_.Destroy();
+  terrain_.Destroy();
+  terrain_generator_.Destroy();
+  hiz_.Destroy();
+  atmosphere_.Destroy();
+  virtual_texture_.Destroy();
+  imagery_tile_cache_.Destroy();
+  imagery_tile_file_.Close();
+  for (BindlessImage &texture : detail_textures_) {
+    vkDestroyImageView(device_, texture.view, nullptr);
+    vkDestroyImage(device_, texture.image, nullptr);
+    allocator_.Free(texture.allocation);
+  }
+  detail_textures_.clear();
+  bindless_textures_.Destroy();
+  terrain_query_.Destroy();
+  height_tile_cache_.Destroy();
+  height_tile_file_.Close();
 
   vkDestroyPipeline(device_, graphics_pipeline_, nullptr);
   vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr);
+  vkDestroyPipelineLayout(device_, mesh_pipeline_layout_, nullptr);
+  vkDestroyPipeline(device_, cull_pipeline_, nullptr);
+  vkDestroyPipelineLayout(device_, cull_pipeline_layout_, nullptr);
+  vkDestroyPipeline(device_, sky_pipeline_, nullptr);
+  vkDestroyPipelineLayout(device_, sky_pipeline_layout_, nullptr);
 
   vkDestroyRenderPass(device_, render_pass_, nullptr);
 
-  for (size_t i = 0; i < kMaxFramesInFlight; ++i) {
+  SavePipelineCache();
+  vkDestroyPipelineCache(device_, pipeline_cache_, nullptr);
+  shader_library_.Destroy();
+
+  for (size_t i = 0; i < config_.frames_in_flight; ++i) {
     vkDestroySemaphore(device_, image_available_semaphores_[i], nullptr);
     vkDestroySemaphore(device_, render_finished_semaphores_[i], nullptr);
     vkDestroyFence(device_, in_flight_fences_[i], nullptr);
   }
 
+  DestroyThreadCommandPools();
   vkDestroyCommandPool(device_, command_pool_, nullptr);
+  job_system_.Destroy();
 
+  profiler_.Destroy();
+  upload_manager_.Destroy();
+  allocator_.LogStats();
+  allocator_.Destroy();
   vkDestroyDevice(device_, nullptr);
 
   if (kEnableValidationLayers) {
@@ -247,7 +663,9 @@ void VulkanEngine::Destroy() {
   vkDestroySurfaceKHR(instance_, surface_, nullptr);
   vkDestroyInstance(instance_, nullptr);
 
-  SDL_DestroyWindow(window_);
+  if (window_) {
+    SDL_DestroyWindow(window_);
+  }
   SDL_Quit();
 }
 
@@ -300,9 +718,12 @@ void VulkanEngine::InitVulkanInstance() {
   create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
   create_info.pApplicationInfo = &app_info;
 
+  // Headless runs need no surface extensions.
   uint32_t sdl_extension_count = 0;
-  const char *const *sdl_extensions;
-  sdl_extensions = SDL_Vulkan_GetInstanceExtensions(&sdl_extension_count);
+  const char *const *sdl_extensions = nullptr;
+  if (!config_.headless) {
+    sdl_extensions = SDL_Vulkan_GetInstanceExtensions(&sdl_extension_count);
+  }
   std::vector<const char *> extensions(sdl_extensions,
                                        sdl_extensions + sdl_extension_count);
   if (kEnableValidationLayers) {
@@ -390,12 +811,55 @@ void VulkanEngine::InitImGui() {
   init_info.DescriptorPool = imgui_descriptor_pool_;
   init_info.RenderPass = render_pass_;
   init_info.Subpass = 0;
+  init_info.UseDynamicRendering = config_.dynamic_rendering;
+  init_info.PipelineRenderingCreateInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+  init_info.PipelineRenderingCreateInfo.colorAttachmentCount = 1;
+  init_info.PipelineRenderingCreateInfo.pColorAttachmentFormats =
+      &swap_chain_image_format_;
   init_info.MinImageCount = 2;
-  init_info.ImageCount = 2;
-  init_info.MSAASamples = msaa_samples_;
+  init_info.ImageCount = static_cast<uint32_t>(swap_chain_images_.size());
+  // With dynamic rendering ImGui is drawn single sampled after the scene,
+  // which keeps its pipeline valid whatever quality level is used.
+  init_info.MSAASamples =
+      config_.dynamic_rendering ? VK_SAMPLE_COUNT_1_BIT : msaa_samples_;
   init_info.Allocator = nullptr;
+  init_info.PipelineCache = pipeline_cache_;
   init_info.CheckVkResultFn = check_vk_result;
   ImGui_ImplVulkan_Init(&init_info);
+  imgui_initialized_ = true;
+}
+
+void VulkanEngine::InitProfiler() {
+  QueueFamilyIndices indices = FindQueueFamilies(physical_device_);
+  Profiler::CreateInfo create_info{};
+  create_info.physical_device = physical_device_;
+  create_info.device = device_;
+  create_info.queue_family = indices.graphics_family.value();
+  create_info.frames_in_flight = config_.frames_in_flight;
+  create_info.pipeline_statistics = config_.pipeline_statistics;
+  if (!profiler_.Init(create_info)) {
+    spdlog::error("Failed to initialize profiler.");
+  }
+}
+
+void VulkanEngine::InitUploadManager() {
+  QueueFamilyIndices indices = FindQueueFamilies(physical_device_);
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+
+  UploadManager::CreateInfo create_info{};
+  create_info.device = device_;
+  create_info.allocator = &allocator_;
+  create_info.transfer_queue = transfer_queue_;
+  create_info.transfer_family = indices.transfer_family.value();
+  create_info.graphics_family = indices.graphics_family.value();
+  create_info.copy_alignment =
+      properties.limits.optimalBufferCopyOffsetAlignment;
+  if (!upload_manager_.Init(create_info)) {
+    spdlog::error("Failed to initialize upload manager.");
+    return;
+  }
 }
 
 bool VulkanEngine::CheckValidationLayerSupport() {
@@ -460,28 +924,178 @@ void VulkanEngine::PickPhysicalDevice() {
   std::vector<VkPhysicalDevice> devices(device_count);
   vkEnumeratePhysicalDevices(instance_, &device_count, devices.data());
 
+  // Hybrid laptops and multi-GPU machines list the integrated GPU first more
+  // often than not, so every device is scored.
+  VkPhysicalDevice best_device = VK_NULL_HANDLE;
+  uint64_t best_score = 0;
+  VkPhysicalDevice requested_device = VK_NULL_HANDLE;
   for (const auto &device : devices) {
-    VkPhysicalDeviceProperties properties;
-    vkGetPhysicalDeviceProperties(device, &properties);
-
-    if (IsDeviceSuitable(device)) {
-      physical_device_ = device;
-      msaa_samples_ = GetMaxUsableSampleCount();
-      break;
+    VkPhysicalDeviceIDProperties id_properties{};
+    id_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties{};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &id_properties;
+    vkGetPhysicalDeviceProperties2(device, &properties);
+    const char *name = properties.properties.deviceName;
+    std::string uuid = FormatUuid(id_properties.deviceUUID);
+
+    if (!IsDeviceSuitable(device)) {
+      spdlog::info("GPU {} ({}): not suitable.", name, uuid);
+      continue;
+    }
+    uint64_t score = ScorePhysicalDevice(device);
+    spdlog::info("GPU {} ({}, {}): score {:#x}.", name,
+                 DeviceTypeName(properties.properties.deviceType), uuid,
+                 score);
+    if (best_device == VK_NULL_HANDLE || score > best_score) {
+      best_device = device;
+      best_score = score;
     }
+    if (requested_device == VK_NULL_HANDLE && !config_.gpu.empty() &&
+        MatchesGpu(config_.gpu, name, uuid)) {
+      requested_device = device;
+    }
+  }
+  if (!config_.gpu.empty() && requested_device == VK_NULL_HANDLE) {
+    spdlog::warn("No suitable GPU matches \"{}\", picking by score.",
+                 config_.gpu);
   }
+  physical_device_ =
+      requested_device != VK_NULL_HANDLE ? requested_device : best_device;
 
   if (physical_device_ == VK_NULL_HANDLE) {
     spdlog::error("Failed to find suitable GPU.");
     return;
   }
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+  spdlog::info("Using GPU {}.", properties.deviceName);
+  msaa_samples_ = GetMaxUsableSampleCount();
+  depth_format_ = FindDepthFormat().value_or(VK_FORMAT_UNDEFINED);
+}
+
+uint64_t VulkanEngine::ScorePhysicalDevice(VkPhysicalDevice device) {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device, &properties);
+  uint64_t type_rank = 0;
+  switch (properties.deviceType) {
+  case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+    type_rank = 4;
+    break;
+  case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+    type_rank = 3;
+    break;
+  case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+    type_rank = 2;
+    break;
+  case VK_PHYSICAL_DEVICE_TYPE_CPU:
+    type_rank = 1;
+    break;
+  default:
+    break;
+  }
+
+  // In whole GiB, devices of the same class with about the same memory tie
+  // and the fast paths decide.
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  vkGetPhysicalDeviceMemoryProperties(device, &memory_properties);
+  VkDeviceSize device_local = 0;
+  for (uint32_t i = 0; i < memory_properties.memoryHeapCount; ++i) {
+    const VkMemoryHeap &heap = memory_properties.memoryHeaps[i];
+    if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+      device_local = std::max(device_local, heap.size);
+    }
+  }
+  uint64_t memory_gib = std::min<uint64_t>(device_local >> 30, 0xffffffffu);
+
+  // Timeline semaphores, descriptor indexing and draw indirect count are
+  // required, see IsDeviceSuitable(). These are the paths with a fallback.
+  uint64_t fast_paths = 0;
+  VkPhysicalDeviceVulkan13Features features13{};
+  features13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+  VkPhysicalDeviceFeatures2 features{};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  if (properties.apiVersion >= VK_API_VERSION_1_3) {
+    features.pNext = &features13;
+  }
+  vkGetPhysicalDeviceFeatures2(device, &features);
+  if (features13.dynamicRendering && features13.synchronization2) {
+    // Render scaling, occlusion culling and the separate UI pass.
+    fast_paths += 16;
+  }
+  QueueFamilyIndices indices = FindQueueFamilies(device);
+  if (indices.transfer_family != indices.graphics_family) {
+    fast_paths += 8;
+  }
+  if (indices.compute_family != indices.graphics_family) {
+    fast_paths += 8;
+  }
+  if (IsDeviceExtensionSupported(device, VK_EXT_MESH_SHADER_EXTENSION_NAME)) {
+    fast_paths += 4;
+  }
+  if (!config_.headless &&
+      IsDeviceExtensionSupported(device, VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+      IsDeviceExtensionSupported(device, VK_KHR_PRESENT_WAIT_EXTENSION_NAME)) {
+    fast_paths += 2;
+  }
+  if (features.features.sparseBinding &&
+      features.features.sparseResidencyImage2D) {
+    fast_paths += 1;
+  }
+  return type_rank << 56 | memory_gib << 24 | fast_paths;
+}
+
+void VulkanEngine::LogDeviceCapabilities() {
+  QueueFamilyIndices indices = FindQueueFamilies(physical_device_);
+  spdlog::info("Queue families: graphics {}, present {}, transfer {}{}, "
+               "compute {}{}.",
+               indices.graphics_family.value(),
+               indices.presentation_family.value(),
+               indices.transfer_family.value(),
+               indices.transfer_family != indices.graphics_family
+                   ? " (dedicated)"
+                   : "",
+               indices.compute_family.value(),
+               indices.compute_family != indices.graphics_family
+                   ? " (async)"
+                   : "");
+  auto on_off = [](bool enabled) { return enabled ? "on" : "off"; };
+  spdlog::info("Dynamic rendering: {}, present wait: {}, pipeline "
+               "statistics: {}, sparse imagery: {}, mesh shaders: {}, max "
+               "MSAA: {}x.",
+               on_off(config_.dynamic_rendering),
+               on_off(config_.present_wait),
+               on_off(config_.pipeline_statistics),
+               on_off(config_.sparse_imagery), on_off(config_.mesh_shaders),
+               static_cast<uint32_t>(msaa_samples_));
 }
 
 bool VulkanEngine::IsDeviceSuitable(VkPhysicalDevice device) {
+  // Timeline semaphores are core since Vulkan 1.2, the upload path depends on
+  // them. The terrain is drawn with vkCmdDrawIndexedIndirectCount and passes
+  // the chunk index through firstInstance. BindlessTextures needs descriptor
+  // indexing, also core since 1.2.
+  VkPhysicalDeviceVulkan12Features features12{};
+  features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  VkPhysicalDeviceFeatures2 features{};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &features12;
+  vkGetPhysicalDeviceFeatures2(device, &features);
+  if (!features12.timelineSemaphore || !features12.drawIndirectCount ||
+      !features.features.multiDrawIndirect ||
+      !features.features.drawIndirectFirstInstance ||
+      !features12.runtimeDescriptorArray ||
+      !features12.descriptorBindingPartiallyBound ||
+      !features12.descriptorBindingSampledImageUpdateAfterBind ||
+      !features12.descriptorBindingUpdateUnusedWhilePending ||
+      !features12.shaderSampledImageArrayNonUniformIndexing) {
+    return false;
+  }
+
   QueueFamilyIndices indices = FindQueueFamilies(device);
   bool extensions_supported = CheckDeviceExtensionSupport(device);
-  bool swap_chain_adequate = false;
-  if (extensions_supported) {
+  bool swap_chain_adequate = config_.headless;
+  if (extensions_supported && !config_.headless) {
     SwapChainSupportDetails swap_chain_support = QuerySwapChainSupport(device);
     swap_chain_adequate = !swap_chain_support.formats.empty() &&
                           !swap_chain_support.present_modes.empty();
@@ -497,8 +1111,10 @@ bool VulkanEngine::CheckDeviceExtensionSupport(VkPhysicalDevice device) {
   std::vector<VkExtensionProperties> available_extensions(extension_count);
   vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
                                        available_extensions.data());
-  std::set<std::string> required_extensions(kDeviceExtensions.begin(),
-                                            kDeviceExtensions.end());
+  const std::vector<const char *> &device_extensions =
+      RequiredDeviceExtensions();
+  std::set<std::string> required_extensions(device_extensions.begin(),
+                                            device_extensions.end());
   for (const auto &extension : available_extensions) {
     required_extensions.erase(extension.extensionName);
   }
@@ -506,34 +1122,223 @@ bool VulkanEngine::CheckDeviceExtensionSupport(VkPhysicalDevice device) {
   return required_extensions.empty();
 }
 
+bool VulkanEngine::IsDeviceExtensionSupported(VkPhysicalDevice device,
+                                              const char *extension) {
+  uint32_t extension_count;
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
+                                       nullptr);
+  std::vector<VkExtensionProperties> available_extensions(extension_count);
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
+                                       available_extensions.data());
+  return std::any_of(available_extensions.begin(), available_extensions.end(),
+                     [extension](const VkExtensionProperties &properties) {
+                       return std::strcmp(properties.extensionName,
+                                          extension) == 0;
+                     });
+}
+
+const std::vector<const char *> &
+VulkanEngine::RequiredDeviceExtensions() const {
+  return config_.headless ? kHeadlessDeviceExtensions : kDeviceExtensions;
+}
+
 void VulkanEngine::CreateLogicalDevice() {
   QueueFamilyIndices indices = FindQueueFamilies(physical_device_);
   std::vector<VkDeviceQueueCreateInfo> queue_create_infos;
   std::set<uint32_t> unique_queue_families = {
-      indices.graphics_family.value(), indices.presentation_family.value()};
+      indices.graphics_family.value(), indices.presentation_family.value(),
+      indices.transfer_family.value(), indices.compute_family.value()};
 
   float queue_priority = 1.0f;
 
   for (uint32_t queue_family : unique_queue_families) {
     VkDeviceQueueCreateInfo queue_create_info{};
     queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_info.queueFamilyIndex = indices.graphics_family.value();
+    queue_create_info.queueFamilyIndex = queue_family;
     queue_create_info.queueCount = 1;
     queue_create_info.pQueuePriorities = &queue_priority;
     queue_create_infos.push_back(queue_create_info);
   }
-  VkPhysicalDeviceFeatures device_features{};
+
+  VkPhysicalDeviceVulkan12Features features12{};
+  features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  features12.timelineSemaphore = VK_TRUE;
+  features12.drawIndirectCount = VK_TRUE;
+  features12.runtimeDescriptorArray = VK_TRUE;
+  features12.descriptorBindingPartiallyBound = VK_TRUE;
+  features12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+  features12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+  features12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+
+  // Both or neither, the dynamic rendering path transitions its attachments
+  // with synchronization2 barriers. Only 1.3 devices know the structure.
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+  bool vulkan13 = properties.apiVersion >= VK_API_VERSION_1_3;
+  VkPhysicalDeviceVulkan13Features supported_features13{};
+  supported_features13.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+  if (vulkan13) {
+    VkPhysicalDeviceFeatures2 supported_features2{};
+    supported_features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported_features2.pNext = &supported_features13;
+    vkGetPhysicalDeviceFeatures2(physical_device_, &supported_features2);
+  }
+  if (config_.dynamic_rendering && (!supported_features13.dynamicRendering ||
+                                    !supported_features13.synchronization2)) {
+    spdlog::warn("Dynamic rendering is not supported, using a render pass.");
+    config_.dynamic_rendering = false;
+  }
+  VkPhysicalDeviceVulkan13Features features13{};
+  features13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+  features13.dynamicRendering = config_.dynamic_rendering ? VK_TRUE : VK_FALSE;
+  features13.synchronization2 = config_.dynamic_rendering ? VK_TRUE : VK_FALSE;
+  if (vulkan13) {
+    features12.pNext = &features13;
+  }
+
+  // Present pacing needs both extensions, ids to name the presents and the
+  // wait on them.
+  VkPhysicalDevicePresentIdFeaturesKHR present_id_features{};
+  present_id_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+  VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features{};
+  present_wait_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+  bool present_wait_requested = config_.present_wait;
+  if (config_.present_wait &&
+      (config_.headless ||
+       !IsDeviceExtensionSupported(physical_device_,
+                                   VK_KHR_PRESENT_ID_EXTENSION_NAME) ||
+       !IsDeviceExtensionSupported(physical_device_,
+                                   VK_KHR_PRESENT_WAIT_EXTENSION_NAME))) {
+    config_.present_wait = false;
+  }
+  if (config_.present_wait) {
+    present_id_features.pNext = &present_wait_features;
+    VkPhysicalDeviceFeatures2 supported_features2{};
+    supported_features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported_features2.pNext = &present_id_features;
+    vkGetPhysicalDeviceFeatures2(physical_device_, &supported_features2);
+    config_.present_wait =
+        present_id_features.presentId && present_wait_features.presentWait;
+  }
+  if (present_wait_requested && !config_.headless && !config_.present_wait) {
+    spdlog::warn("Present wait is not supported, frames are not paced.");
+  }
+
+  VkPhysicalDeviceFeatures supported_features;
+  vkGetPhysicalDeviceFeatures(physical_device_, &supported_features);
+  if (config_.pipeline_statistics &&
+      !supported_features.pipelineStatisticsQuery) {
+    spdlog::warn("Pipeline statistics queries are not supported.");
+    config_.pipeline_statistics = false;
+  }
+  // The statistics query spans the main pass, whose secondaries can only run
+  // inside it if they inherit it.
+  inline_main_pass_ =
+      config_.pipeline_statistics && !supported_features.inheritedQueries;
+  if (inline_main_pass_) {
+    spdlog::warn("Inherited queries are not supported, the main pass is "
+                 "recorded on one thread while pipeline statistics are on.");
+  }
+  // The terrain's fragment shader writes the imagery feedback.
+  if (!config_.imagery_tile_file.empty() &&
+      !supported_features.fragmentStoresAndAtomics) {
+    spdlog::warn("Fragment stores are not supported, continuing without "
+                 "imagery.");
+    config_.imagery_tile_file.clear();
+  }
+  // The sparse binds go through the graphics queue.
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &family_count,
+                                           nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &family_count,
+                                           families.data());
+  if (config_.imagery_tile_file.empty() ||
+      !supported_features.sparseBinding ||
+      !supported_features.sparseResidencyImage2D ||
+      !(families[indices.graphics_family.value()].queueFlags &
+        VK_QUEUE_SPARSE_BINDING_BIT)) {
+    config_.sparse_imagery = false;
+  }
+  // The terrain's task and mesh shaders, see Terrain::DrawMeshTasks(). Their
+  // pipeline layout has the Hi-Z pyramid's set on top of the other four.
+  VkPhysicalDeviceMeshShaderFeaturesEXT mesh_shader_features{};
+  mesh_shader_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT;
+  if (config_.mesh_shaders &&
+      IsDeviceExtensionSupported(physical_device_,
+                                 VK_EXT_MESH_SHADER_EXTENSION_NAME) &&
+      properties.limits.maxBoundDescriptorSets >= 5) {
+    VkPhysicalDeviceFeatures2 supported_features2{};
+    supported_features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported_features2.pNext = &mesh_shader_features;
+    vkGetPhysicalDeviceFeatures2(physical_device_, &supported_features2);
+    mesh_shaders_supported_ =
+        mesh_shader_features.taskShader && mesh_shader_features.meshShader;
+  }
+  if (config_.mesh_shaders && !mesh_shaders_supported_) {
+    spdlog::warn("Mesh shaders are not supported, drawing the terrain with "
+                 "vertex shaders.");
+  }
+  config_.mesh_shaders = mesh_shaders_supported_;
+  // Only the two, the others need features this device does not enable.
+  VkPhysicalDeviceMeshShaderFeaturesEXT mesh_shader_enabled{};
+  mesh_shader_enabled.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT;
+  mesh_shader_enabled.taskShader = VK_TRUE;
+  mesh_shader_enabled.meshShader = VK_TRUE;
+
+  VkPhysicalDeviceFeatures2 device_features{};
+  device_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  device_features.pNext = &features12;
+  if (config_.present_wait) {
+    // The query left both features set.
+    present_wait_features.pNext = device_features.pNext;
+    device_features.pNext = &present_id_features;
+  }
+  if (mesh_shaders_supported_) {
+    mesh_shader_enabled.pNext = device_features.pNext;
+    device_features.pNext = &mesh_shader_enabled;
+  }
+  device_features.features.multiDrawIndirect = VK_TRUE;
+  device_features.features.drawIndirectFirstInstance = VK_TRUE;
+  device_features.features.pipelineStatisticsQuery =
+      config_.pipeline_statistics ? VK_TRUE : VK_FALSE;
+  device_features.features.inheritedQueries =
+      config_.pipeline_statistics && !inline_main_pass_ ? VK_TRUE : VK_FALSE;
+  device_features.features.samplerAnisotropy =
+      supported_features.samplerAnisotropy;
+  // The fragment shader has the stores either way, behind a specialization
+  // constant.
+  device_features.features.fragmentStoresAndAtomics =
+      supported_features.fragmentStoresAndAtomics;
+  device_features.features.sparseBinding =
+      config_.sparse_imagery ? VK_TRUE : VK_FALSE;
+  device_features.features.sparseResidencyImage2D =
+      config_.sparse_imagery ? VK_TRUE : VK_FALSE;
 
   VkDeviceCreateInfo create_info{};
   create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  create_info.pNext = &device_features;
   create_info.queueCreateInfoCount =
       static_cast<uint32_t>(queue_create_infos.size());
   create_info.pQueueCreateInfos = queue_create_infos.data();
-  create_info.pEnabledFeatures = &device_features;
+  create_info.pEnabledFeatures = nullptr;
 
+  std::vector<const char *> device_extensions = RequiredDeviceExtensions();
+  if (config_.present_wait) {
+    device_extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+    device_extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+  }
+  if (mesh_shaders_supported_) {
+    device_extensions.push_back(VK_EXT_MESH_SHADER_EXTENSION_NAME);
+  }
   create_info.enabledExtensionCount =
-      static_cast<uint32_t>(kDeviceExtensions.size());
-  create_info.ppEnabledExtensionNames = kDeviceExtensions.data();
+      static_cast<uint32_t>(device_extensions.size());
+  create_info.ppEnabledExtensionNames = device_extensions.data();
 
   if (kEnableValidationLayers) {
     create_info.enabledLayerCount =
@@ -553,6 +1358,24 @@ void VulkanEngine::CreateLogicalDevice() {
                    &graphics_queue_);
   vkGetDeviceQueue(device_, indices.presentation_family.value(), 0,
                    &presentation_queue_);
+  vkGetDeviceQueue(device_, indices.transfer_family.value(), 0,
+                   &transfer_queue_);
+  vkGetDeviceQueue(device_, indices.compute_family.value(), 0,
+                   &compute_queue_);
+
+  if (config_.present_wait) {
+    wait_for_present_ = reinterpret_cast<PFN_vkWaitForPresentKHR>(
+        vkGetDeviceProcAddr(device_, "vkWaitForPresentKHR"));
+    config_.present_wait = wait_for_present_ != nullptr;
+  }
+  if (mesh_shaders_supported_) {
+    draw_mesh_tasks_ =
+        reinterpret_cast<PFN_vkCmdDrawMeshTasksIndirectCountEXT>(
+            vkGetDeviceProcAddr(device_, "vkCmdDrawMeshTasksIndirectCountEXT"));
+    mesh_shaders_supported_ = draw_mesh_tasks_ != nullptr;
+    config_.mesh_shaders = mesh_shaders_supported_;
+  }
+  LogDeviceCapabilities();
 }
 
 VulkanEngine::QueueFamilyIndices
@@ -564,22 +1387,46 @@ VulkanEngine::FindQueueFamilies(VkPhysicalDevice device) {
   std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
   vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count,
                                            queue_families.data());
-  int i = 0;
+  // All families are visited so that dedicated transfer and compute families
+  // further down the list are still found.
+  uint32_t i = 0;
   for (const auto &queue_family : queue_families) {
-    if (queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+    if (!indices.graphics_family &&
+        queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
       indices.graphics_family = i;
     }
-    VkBool32 presentation_support = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface_,
-                                         &presentation_support);
-    if (presentation_support) {
+    // Without a surface (headless) nothing is presented, the graphics family
+    // stands in.
+    VkBool32 presentation_support = surface_ == VK_NULL_HANDLE &&
+                                    (queue_family.queueFlags &
+                                     VK_QUEUE_GRAPHICS_BIT);
+    if (surface_ != VK_NULL_HANDLE) {
+      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface_,
+                                           &presentation_support);
+    }
+    if (!indices.presentation_family && presentation_support) {
       indices.presentation_family = i;
     }
-    if (indices.IsComplete()) {
-      break;
+    bool transfer_only =
+        (queue_family.queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+        !(queue_family.queueFlags &
+          (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT));
+    if (!indices.transfer_family && transfer_only) {
+      indices.transfer_family = i;
+    }
+    bool async_compute = (queue_family.queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+                         !(queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT);
+    if (!indices.compute_family && async_compute) {
+      indices.compute_family = i;
     }
     ++i;
   }
+  if (!indices.transfer_family) {
+    indices.transfer_family = indices.graphics_family;
+  }
+  if (!indices.compute_family) {
+    indices.compute_family = indices.graphics_family;
+  }
   return indices;
 }
 
@@ -593,10 +1440,16 @@ void VulkanEngine::CreateSwapChain() {
       ChooseSwapPresentMode(swap_chain_support.present_modes);
   VkExtent2D extent = ChooseSwapExtent(swap_chain_support.capabilities);
 
-  uint32_t image_count = swap_chain_support.capabilities.minImageCount + 1;
-  if (swap_chain_support.capabilities.maxImageCount > 0 &&
-      image_count > swap_chain_support.capabilities.maxImageCount) {
-    image_count = swap_chain_support.capabilities.maxImageCount;
+  // More images let MAILBOX and IMMEDIATE run further ahead of the display,
+  // fewer bound the latency under FIFO.
+  const VkSurfaceCapabilitiesKHR &capabilities =
+      swap_chain_support.capabilities;
+  uint32_t image_count = config_.swap_chain_image_count > 0
+                             ? config_.swap_chain_image_count
+                             : capabilities.minImageCount + 1;
+  image_count = std::max(image_count, capabilities.minImageCount);
+  if (capabilities.maxImageCount > 0) {
+    image_count = std::min(image_count, capabilities.maxImageCount);
   }
 
   VkSwapchainCreateInfoKHR create_info{};
@@ -608,6 +1461,10 @@ void VulkanEngine::CreateSwapChain() {
   create_info.imageExtent = extent;
   create_info.imageArrayLayers = 1;
   create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  // A lowered render resolution is blitted in.
+  if (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT) {
+    create_info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  }
 
   QueueFamilyIndices indices = FindQueueFamilies(physical_device_);
   uint32_t queue_family_indices[] = {indices.graphics_family.value(),
@@ -625,13 +1482,17 @@ void VulkanEngine::CreateSwapChain() {
   create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
   create_info.presentMode = present_mode;
   create_info.clipped = VK_TRUE;
-  create_info.oldSwapchain = VK_NULL_HANDLE;
+  // Passing the previous swap chain lets the driver hand over its images
+  // while frames presented from it are still in flight.
+  create_info.oldSwapchain = swap_chain_;
 
-  if (vkCreateSwapchainKHR(device_, &create_info, nullptr, &swap_chain_) !=
+  VkSwapchainKHR swap_chain;
+  if (vkCreateSwapchainKHR(device_, &create_info, nullptr, &swap_chain) !=
       VK_SUCCESS) {
     spdlog::error("Failed to create swap chain.");
     return;
   }
+  swap_chain_ = swap_chain;
 
   vkGetSwapchainImagesKHR(device_, swap_chain_, &image_count, nullptr);
   swap_chain_images_.resize(image_count);
@@ -640,6 +1501,33 @@ void VulkanEngine::CreateSwapChain() {
 
   swap_chain_image_format_ = surface_format.format;
   swap_chain_extent_ = extent;
+  present_modes_ = swap_chain_support.present_modes;
+  present_mode_ = present_mode;
+  surface_capabilities_ = capabilities;
+  // Presents to the old swap chain complete without the new one knowing.
+  first_present_id_ = present_id_ + 1;
+  spdlog::info("Created swap chain with {} images of {}x{}, present mode {}.",
+               image_count, extent.width, extent.height,
+               PresentModeName(present_mode));
+}
+
+void VulkanEngine::CreateOffscreenTargets() {
+  swap_chain_image_format_ = VK_FORMAT_B8G8R8A8_SRGB;
+  swap_chain_extent_ = {config_.headless_width, config_.headless_height};
+  // One target per frame in flight, the images are never presented so none
+  // of them is held by a presentation engine.
+  swap_chain_images_.resize(config_.frames_in_flight);
+  swap_chain_image_allocations_.resize(config_.frames_in_flight);
+  for (uint32_t i = 0; i < config_.frames_in_flight; ++i) {
+    CreateImage(swap_chain_extent_.width, swap_chain_extent_.height,
+                VK_SAMPLE_COUNT_1_BIT, swap_chain_image_format_,
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swap_chain_images_[i],
+                swap_chain_image_allocations_[i]);
+  }
 }
 
 VkSurfaceFormatKHR VulkanEngine::ChooseSwapSurfaceFormat(
@@ -656,10 +1544,11 @@ VkSurfaceFormatKHR VulkanEngine::ChooseSwapSurfaceFormat(
 VkPresentModeKHR VulkanEngine::ChooseSwapPresentMode(
     const std::vector<VkPresentModeKHR> &available_present_modes) {
   for (const auto &available_present_mode : available_present_modes) {
-    if (available_present_mode == VK_PRESENT_MODE_MAILBOX_KHR) {
+    if (available_present_mode == config_.present_mode) {
       return available_present_mode;
     }
   }
+  // The only mode every surface supports.
   return VK_PRESENT_MODE_FIFO_KHR;
 }
 
@@ -704,47 +1593,103 @@ VulkanEngine::QuerySwapChainSupport(VkPhysicalDevice device) {
   if (present_mode_count != 0) {
     details.present_modes.resize(present_mode_count);
     vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface_,
-                                              &present_mode_count, nullptr);
+                                              &present_mode_count,
+                                              details.present_modes.data());
   }
 
   return details;
 }
 
-void VulkanEngine::CleanupSwapChain() {
-  vkDestroyImageView(device_, color_image_view_, nullptr);
-  vkDestroyImage(device_, color_image_, nullptr);
-  vkFreeMemory(device_, color_image_memory_, nullptr);
-  vkDestroyImageView(device_, depth_image_view_, nullptr);
-  vkDestroyImage(device_, depth_image_, nullptr);
-  vkFreeMemory(device_, depth_image_memory_, nullptr);
-  for (size_t i = 0; i < swap_chain_framebuffers_.size(); ++i) {
-    vkDestroyFramebuffer(device_, swap_chain_framebuffers_[i], nullptr);
-  }
-  for (size_t i = 0; i < swap_chain_image_views_.size(); ++i) {
-    vkDestroyImageView(device_, swap_chain_image_views_[i], nullptr);
-  }
-  vkDestroySwapchainKHR(device_, swap_chain_, nullptr);
+void VulkanEngine::RetireSwapChain() {
+  // Copies of the handles are captured so that the members can be recreated
+  // right away while the old objects wait for the GPU to finish with them.
+  RetireRenderTargets();
+  DeferDestroy([this, device = device_, swap_chain = swap_chain_,
+                framebuffers = std::move(swap_chain_framebuffers_),
+                image_views = std::move(swap_chain_image_views_),
+                images = swap_chain_images_,
+                image_allocations =
+                    std::move(swap_chain_image_allocations_)]() {
+    for (VkFramebuffer framebuffer : framebuffers) {
+      vkDestroyFramebuffer(device, framebuffer, nullptr);
+    }
+    for (VkImageView image_view : image_views) {
+      vkDestroyImageView(device, image_view, nullptr);
+    }
+    vkDestroySwapchainKHR(device, swap_chain, nullptr);
+    // Only offscreen targets own their images.
+    for (size_t i = 0; i < image_allocations.size(); ++i) {
+      vkDestroyImage(device, images[i], nullptr);
+      allocator_.Free(image_allocations[i]);
+    }
+  });
+  swap_chain_framebuffers_.clear();
+  swap_chain_image_views_.clear();
+  swap_chain_image_allocations_.clear();
 }
 
-void VulkanEngine::RecreateSwapChain() {
+void VulkanEngine::RetireRenderTargets() {
+  DeferDestroy([this, device = device_, color_image = color_image_,
+                color_image_view = color_image_view_,
+                color_image_allocation = color_image_allocation_,
+                depth_image = depth_image_, depth_image_view = depth_image_view_,
+                depth_image_allocation = depth_image_allocation_,
+                depth_resolve_image = depth_resolve_image_,
+                depth_resolve_image_view = depth_resolve_image_view_,
+                depth_resolve_image_allocation =
+                    depth_resolve_image_allocation_,
+                scene_image = scene_image_,
+                scene_image_view = scene_image_view_,
+                scene_image_allocation = scene_image_allocation_]() {
+    vkDestroyImageView(device, color_image_view, nullptr);
+    vkDestroyImage(device, color_image, nullptr);
+    allocator_.Free(color_image_allocation);
+    vkDestroyImageView(device, depth_image_view, nullptr);
+    vkDestroyImage(device, depth_image, nullptr);
+    allocator_.Free(depth_image_allocation);
+    if (depth_resolve_image != VK_NULL_HANDLE) {
+      vkDestroyImageView(device, depth_resolve_image_view, nullptr);
+      vkDestroyImage(device, depth_resolve_image, nullptr);
+      allocator_.Free(depth_resolve_image_allocation);
+    }
+    if (scene_image != VK_NULL_HANDLE) {
+      vkDestroyImageView(device, scene_image_view, nullptr);
+      vkDestroyImage(device, scene_image, nullptr);
+      allocator_.Free(scene_image_allocation);
+    }
+  });
+  scene_image_ = VK_NULL_HANDLE;
+  scene_image_view_ = VK_NULL_HANDLE;
+}
+
+bool VulkanEngine::RecreateSwapChain() {
+  // A minimized window has no area to create images for. Nothing waits here,
+  // Run() keeps handling events and retries.
   int width = 0;
   int height = 0;
-
-  // Handle minimization by pausing until the window is in the foreground again
-  while (width == 0 || height == 0) {
-    SDL_GetWindowSize(window_, &width, &height);
-    SDL_WaitEvent(nullptr);
+  SDL_GetWindowSizeInPixels(window_, &width, &height);
+  if (width == 0 || height == 0) {
+    return false;
   }
-  vkDeviceWaitIdle(device_);
 
-  CleanupSwapChain();
+  // The old swap chain stays alive (retired) until the frames that used it
+  // are done, so the device does not need to idle here. CreateSwapChain()
+  // passes it as oldSwapchain before it gets destroyed.
+  RetireSwapChain();
 
   CreateSwapChain();
   CreateImageViews();
+  UpdateRenderExtent();
   CreateColorResources();
   CreateDepthResources();
-  CreateFramebuffers();
+  CreateSceneResources();
+  // Dynamic rendering names the views when the pass begins, there is nothing
+  // else to rebuild.
+  if (!config_.dynamic_rendering) {
+    CreateFramebuffers();
+  }
   resize_requested_ = false;
+  return true;
 }
 
 void VulkanEngine::CreateImageViews() {
@@ -761,6 +1706,9 @@ void VulkanEngine::CreateImageViews() {
 }
 
 void VulkanEngine::CreateRenderPass() {
+  // Without MSAA the subpass draws into the swap chain image itself and has
+  // no resolve attachment, attachment 0 then takes the resolve's place.
+  bool multisampled = msaa_samples_ != VK_SAMPLE_COUNT_1_BIT;
   VkAttachmentDescription color_attachment{};
   color_attachment.format = swap_chain_image_format_;
   color_attachment.samples = msaa_samples_;
@@ -795,7 +1743,13 @@ void VulkanEngine::CreateRenderPass() {
   color_attachment_resolve.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   color_attachment_resolve.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   color_attachment_resolve.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  color_attachment_resolve.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  // Offscreen targets are left ready to be copied out.
+  color_attachment_resolve.finalLayout =
+      config_.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                       : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  if (!multisampled) {
+    color_attachment.finalLayout = color_attachment_resolve.finalLayout;
+  }
 
   VkAttachmentReference color_attachment_ref{};
   color_attachment_ref.attachment = 0;
@@ -816,7 +1770,8 @@ void VulkanEngine::CreateRenderPass() {
   subpass.colorAttachmentCount = 1;
   subpass.pColorAttachments = &color_attachment_ref;
   subpass.pDepthStencilAttachment = &depth_attachment_ref;
-  subpass.pResolveAttachments = &color_attachment_resolve_ref;
+  subpass.pResolveAttachments =
+      multisampled ? &color_attachment_resolve_ref : nullptr;
 
   VkSubpassDependency dependency{};
   dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
@@ -833,7 +1788,8 @@ void VulkanEngine::CreateRenderPass() {
       color_attachment, depth_attachment, color_attachment_resolve};
   VkRenderPassCreateInfo render_pass_info{};
   render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-  render_pass_info.attachmentCount = static_cast<uint32_t>(attachments.size());
+  render_pass_info.attachmentCount =
+      multisampled ? static_cast<uint32_t>(attachments.size()) : 2;
   render_pass_info.pAttachments = attachments.data();
   render_pass_info.subpassCount = 1;
   render_pass_info.pSubpasses = &subpass;
@@ -849,6 +1805,9 @@ void VulkanEngine::CreateRenderPass() {
 
 std::optional<VkShaderModule>
 VulkanEngine::CreateShaderModule(const std::vector<char> &code) {
+  if (code.empty()) {
+    return std::nullopt;
+  }
   VkShaderModuleCreateInfo create_info{};
   create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
   create_info.codeSize = code.size();
@@ -864,17 +1823,57 @@ VulkanEngine::CreateShaderModule(const std::vector<char> &code) {
 }
 
 void VulkanEngine::CreateDescriptorSetLayout() {
+  // The task and mesh shaders read the same set, when the device has them.
+  VkShaderStageFlags stages = VK_SHADER_STAGE_VERTEX_BIT;
+  if (mesh_shaders_supported_) {
+    stages |= VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+  }
+
   VkDescriptorSetLayoutBinding ubo_layout_binding{};
   ubo_layout_binding.binding = 0;
-  ubo_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  ubo_layout_binding.descriptorType =
+      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   ubo_layout_binding.descriptorCount = 1;
-  ubo_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  ubo_layout_binding.stageFlags = stages;
   ubo_layout_binding.pImmutableSamplers = nullptr;
 
+  VkDescriptorSetLayoutBinding chunk_layout_binding{};
+  chunk_layout_binding.binding = 1;
+  chunk_layout_binding.descriptorType =
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  chunk_layout_binding.descriptorCount = 1;
+  chunk_layout_binding.stageFlags = stages;
+
+  // Only for shaders/terrain.task and terrain.mesh: the frame's
+  // CullOcclusionData, the whole draw buffer and the vertex slots.
+  VkDescriptorSetLayoutBinding occlusion_layout_binding = ubo_layout_binding;
+  occlusion_layout_binding.binding = 2;
+  VkDescriptorSetLayoutBinding draw_layout_binding = chunk_layout_binding;
+  draw_layout_binding.binding = 3;
+  draw_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  VkDescriptorSetLayoutBinding vertex_layout_binding = draw_layout_binding;
+  vertex_layout_binding.binding = 4;
+
+  // Only for shaders/shader.frag: the frame's ShadowGpuData and the shadow
+  // maps, see ShadowMaps.
+  VkDescriptorSetLayoutBinding shadow_layout_binding = ubo_layout_binding;
+  shadow_layout_binding.binding = 5;
+  shadow_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  VkDescriptorSetLayoutBinding shadow_map_layout_binding =
+      shadow_layout_binding;
+  shadow_map_layout_binding.binding = 6;
+  shadow_map_layout_binding.descriptorType =
+      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+
+  std::array<VkDescriptorSetLayoutBinding, 7> bindings = {
+      ubo_layout_binding,       chunk_layout_binding,
+      occlusion_layout_binding, draw_layout_binding,
+      vertex_layout_binding,    shadow_layout_binding,
+      shadow_map_layout_binding};
   VkDescriptorSetLayoutCreateInfo layout_info{};
   layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  layout_info.bindingCount = 1;
-  layout_info.pBindings = &ubo_layout_binding;
+  layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+  layout_info.pBindings = bindings.data();
 
   if (vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
                                   &descriptor_set_layout_) != VK_SUCCESS) {
@@ -883,32 +1882,191 @@ void VulkanEngine::CreateDescriptorSetLayout() {
   }
 }
 
-void VulkanEngine::CreateGraphicsPipeline() {
-  auto vert_shader_code = ReadFile("shaders/shader.vert.spv");
-  auto frag_shader_code = ReadFile("shaders/shader.frag.spv");
+std::string VulkanEngine::PipelineCachePath() const {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+  std::string directory;
+  if (char *pref_path = SDL_GetPrefPath("mmalesadev", "planet-renderer")) {
+    directory = pref_path;
+    SDL_free(pref_path);
+  }
+  return fmt::format("{}pipeline_cache_{:04x}_{:04x}.bin", directory,
+                     properties.vendorID, properties.deviceID);
+}
+
+void VulkanEngine::LoadPipelineCache() {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+
+  std::string path = PipelineCachePath();
+  std::vector<char> data;
+  std::ifstream file(path, std::ios::ate | std::ios::binary);
+  if (file.is_open()) {
+    data.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(data.data(), data.size());
+  }
 
-  auto vert_shader_module = CreateShaderModule(vert_shader_code);
-  auto frag_shader_module = CreateShaderModule(frag_shader_code);
-  if (!vert_shader_module || !frag_shader_module) {
+  // Drivers are supposed to reject foreign data themselves, but not all of
+  // them do so gracefully.
+  bool valid = false;
+  VkPipelineCacheHeaderVersionOne header{};
+  if (data.size() >= sizeof(header)) {
+    memcpy(&header, data.data(), sizeof(header));
+    valid = header.headerSize >= sizeof(header) &&
+            header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+            header.vendorID == properties.vendorID &&
+            header.deviceID == properties.deviceID &&
+            memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID,
+                   VK_UUID_SIZE) == 0;
+  }
+  if (!data.empty() && !valid) {
+    spdlog::info("Ignoring pipeline cache {}, it belongs to another driver.",
+                 path);
+  }
+
+  VkPipelineCacheCreateInfo create_info{};
+  create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  create_info.initialDataSize = valid ? data.size() : 0;
+  create_info.pInitialData = valid ? data.data() : nullptr;
+  if (vkCreatePipelineCache(device_, &create_info, nullptr,
+                            &pipeline_cache_) != VK_SUCCESS) {
+    spdlog::error("Failed to create pipeline cache.");
+    pipeline_cache_ = VK_NULL_HANDLE;
     return;
   }
+  if (valid) {
+    spdlog::info("Loaded pipeline cache {} ({} bytes).", path, data.size());
+  }
+}
 
-  VkPipelineShaderStageCreateInfo vert_shader_stage_info{};
-  vert_shader_stage_info.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  vert_shader_stage_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-  vert_shader_stage_info.module = *vert_shader_module;
-  vert_shader_stage_info.pName = "main";
+void VulkanEngine::SavePipelineCache() {
+  if (pipeline_cache_ == VK_NULL_HANDLE) {
+    return;
+  }
+  size_t size = 0;
+  if (vkGetPipelineCacheData(device_, pipeline_cache_, &size, nullptr) !=
+      VK_SUCCESS) {
+    return;
+  }
+  std::vector<char> data(size);
+  if (vkGetPipelineCacheData(device_, pipeline_cache_, &size, data.data()) !=
+      VK_SUCCESS) {
+    return;
+  }
 
-  VkPipelineShaderStageCreateInfo frag_shader_stage_info{};
-  frag_shader_stage_info.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  frag_shader_stage_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  frag_shader_stage_info.module = *frag_shader_module;
-  frag_shader_stage_info.pName = "main";
+  // Written next to the cache and renamed over it, a crash half way never
+  // leaves a truncated cache behind.
+  std::string path = PipelineCachePath();
+  std::string temporary_path = path + ".tmp";
+  {
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open() || !file.write(data.data(), size)) {
+      spdlog::warn("Failed to write pipeline cache {}.", temporary_path);
+      return;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(temporary_path, path, error);
+  if (error) {
+    spdlog::warn("Failed to write pipeline cache {}: {}", path,
+                 error.message());
+  }
+}
+
+void VulkanEngine::InitShaderLibrary() {
+  ShaderLibrary::CreateInfo create_info{};
+  create_info.source_dir = kShaderSourceDir;
+  if (char *pref_path = SDL_GetPrefPath("mmalesadev", "planet-renderer")) {
+    create_info.cache_dir = fmt::format("{}shader_cache", pref_path);
+    SDL_free(pref_path);
+  }
+  create_info.hot_reload = config_.shader_hot_reload;
+  if (!shader_library_.Init(create_info)) {
+    // The build's SPIR-V is still used.
+    spdlog::warn("Continuing without shader hot reload.");
+  }
+}
+
+void VulkanEngine::ReloadChangedShaders() {
+  std::vector<std::string> changed = shader_library_.TakeChanged();
+  auto has_changed = [&changed](std::string_view name) {
+    return std::find(changed.begin(), changed.end(), name) != changed.end();
+  };
+  // The frames in flight finish with the old pipelines, which go to the
+  // deletion queue like any other retired resource.
+  if (has_changed("shader.frag") ||
+      (config_.mesh_shaders
+           ? has_changed("terrain.task") || has_changed("terrain.mesh")
+           : has_changed("shader.vert"))) {
+    RebuildGraphicsPipeline();
+  }
+  if (has_changed("cull.comp")) {
+    RebuildCullPipeline();
+  }
+  if (has_changed("hiz.comp")) {
+    hiz_.ReloadShader(shader_library_.Get("hiz.comp"));
+  }
+  if (has_changed("atmosphere.comp")) {
+    atmosphere_.ReloadShader(shader_library_.Get("atmosphere.comp"));
+  }
+  if (has_changed("sky.vert") || has_changed("sky.frag")) {
+    RebuildSkyPipeline();
+  }
+  if (has_changed("shadow.vert") || has_changed("shadow_cull.comp")) {
+    shadow_maps_.ReloadShaders(shader_library_.Get("shadow.vert"),
+                               shader_library_.Get("shadow_cull.comp"));
+  }
+  if (has_changed("heightfield.comp") && config_.gpu_terrain_generation) {
+    terrain_generator_.ReloadShader(shader_library_.Get("heightfield.comp"));
+  }
+}
+
+bool VulkanEngine::CreateGraphicsPipeline() {
+  // With mesh shaders the task and mesh shaders take the vertex shader's
+  // place, see Terrain::DrawMeshTasks().
+  std::vector<std::pair<VkShaderStageFlagBits, const char *>> stage_shaders;
+  if (config_.mesh_shaders) {
+    stage_shaders = {{VK_SHADER_STAGE_TASK_BIT_EXT, "terrain.task"},
+                     {VK_SHADER_STAGE_MESH_BIT_EXT, "terrain.mesh"}};
+  } else {
+    stage_shaders = {{VK_SHADER_STAGE_VERTEX_BIT, "shader.vert"}};
+  }
+  stage_shaders.push_back({VK_SHADER_STAGE_FRAGMENT_BIT, "shader.frag"});
+  std::vector<VkShaderModule> shader_modules;
+  auto destroy_shader_modules = [this, &shader_modules]() {
+    for (VkShaderModule shader_module : shader_modules) {
+      vkDestroyShaderModule(device_, shader_module, nullptr);
+    }
+  };
+  for (const auto &[stage, name] : stage_shaders) {
+    auto shader_module = CreateShaderModule(shader_library_.Get(name));
+    if (!shader_module) {
+      destroy_shader_modules();
+      return false;
+    }
+    shader_modules.push_back(*shader_module);
+  }
 
-  VkPipelineShaderStageCreateInfo shader_stages[] = {vert_shader_stage_info,
-                                                     frag_shader_stage_info};
+  // The vertex and mesh shaders place vertices by their index in the chunk
+  // grid, the debug view is a permutation of the same shaders. Only the
+  // shaded view gets the aerial perspective and the tone mapping in the
+  // fragment shader, and the imagery if there is any. The task shader's
+  // occlusion test needs the depth direction.
+  SpecializationConstants vert_specialization{
+      kTerrainGridSize, static_cast<uint32_t>(terrain_debug_view_),
+      virtual_texture_.IsEnabled() ? 1u : 0u, config_.reversed_z ? 1u : 0u};
+  std::vector<VkPipelineShaderStageCreateInfo> shader_stages;
+  for (size_t i = 0; i < stage_shaders.size(); ++i) {
+    VkPipelineShaderStageCreateInfo shader_stage_info{};
+    shader_stage_info.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shader_stage_info.stage = stage_shaders[i].first;
+    shader_stage_info.module = shader_modules[i];
+    shader_stage_info.pName = "main";
+    shader_stage_info.pSpecializationInfo = vert_specialization.Info();
+    shader_stages.push_back(shader_stage_info);
+  }
 
   std::vector<VkDynamicState> dynamic_states = {VK_DYNAMIC_STATE_VIEWPORT,
                                                 VK_DYNAMIC_STATE_SCISSOR};
@@ -964,7 +2122,9 @@ void VulkanEngine::CreateGraphicsPipeline() {
       VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
   depth_stencil.depthTestEnable = VK_TRUE;
   depth_stencil.depthWriteEnable = VK_TRUE;
-  depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+  depth_stencil.depthCompareOp = config_.reversed_z
+                                     ? VK_COMPARE_OP_GREATER_OR_EQUAL
+                                     : VK_COMPARE_OP_LESS;
   depth_stencil.depthBoundsTestEnable = VK_FALSE;
   depth_stencil.minDepthBounds = 0.0f;
   depth_stencil.maxDepthBounds = 1.0f;
@@ -987,61 +2147,505 @@ void VulkanEngine::CreateGraphicsPipeline() {
 
   VkPipelineLayoutCreateInfo pipeline_layout_info{};
   pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipeline_layout_info.setLayoutCount = 1;
-  pipeline_layout_info.pSetLayouts = &descriptor_set_layout_;
-
-  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+  // Set 1 is the same for every draw, see BindlessTextures. Set 2 is the
+  // atmosphere's, for the sunlight and the aerial perspective, set 3 the
+  // imagery's virtual texture.
+  std::array<VkDescriptorSetLayout, 4> set_layouts = {
+      descriptor_set_layout_, bindless_textures_.Layout(),
+      atmosphere_.RenderSetLayout(), virtual_texture_.SetLayout()};
+  pipeline_layout_info.setLayoutCount =
+      static_cast<uint32_t>(set_layouts.size());
+  pipeline_layout_info.pSetLayouts = set_layouts.data();
+
+  // Kept when the pipeline is rebuilt for another sample count.
+  if (pipeline_layout_ == VK_NULL_HANDLE &&
+      vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
                              &pipeline_layout_) != VK_SUCCESS) {
     spdlog::error("Failed to create pipeline layout!");
-    return;
+    destroy_shader_modules();
+    return false;
+  }
+  // The task shader tests meshlets against the Hi-Z pyramid in set 4 and
+  // learns where its draws are from the push constants.
+  std::array<VkDescriptorSetLayout, 5> mesh_set_layouts = {
+      set_layouts[0], set_layouts[1], set_layouts[2], set_layouts[3],
+      hiz_.CullSetLayout()};
+  VkPushConstantRange mesh_push_constant_range{};
+  mesh_push_constant_range.stageFlags = VK_SHADER_STAGE_TASK_BIT_EXT;
+  mesh_push_constant_range.offset = 0;
+  mesh_push_constant_range.size = sizeof(MeshTaskPushConstants);
+  pipeline_layout_info.setLayoutCount =
+      static_cast<uint32_t>(mesh_set_layouts.size());
+  pipeline_layout_info.pSetLayouts = mesh_set_layouts.data();
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &mesh_push_constant_range;
+  if (mesh_shaders_supported_ && mesh_pipeline_layout_ == VK_NULL_HANDLE &&
+      vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &mesh_pipeline_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create mesh shader pipeline layout.");
+    destroy_shader_modules();
+    return false;
   }
 
+  // Mesh pipelines have no vertex input and input assembly.
   VkGraphicsPipelineCreateInfo pipeline_info{};
   pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-  pipeline_info.stageCount = 2;
-  pipeline_info.pStages = shader_stages;
-  pipeline_info.pVertexInputState = &vertex_input_info;
-  pipeline_info.pInputAssemblyState = &input_assembly;
+  pipeline_info.stageCount = static_cast<uint32_t>(shader_stages.size());
+  pipeline_info.pStages = shader_stages.data();
+  if (!config_.mesh_shaders) {
+    pipeline_info.pVertexInputState = &vertex_input_info;
+    pipeline_info.pInputAssemblyState = &input_assembly;
+  }
   pipeline_info.pViewportState = &viewport_state;
   pipeline_info.pRasterizationState = &rasterizer;
   pipeline_info.pMultisampleState = &multisampling;
   pipeline_info.pDepthStencilState = &depth_stencil;
   pipeline_info.pColorBlendState = &color_blending;
   pipeline_info.pDynamicState = &dynamic_state;
-  pipeline_info.layout = pipeline_layout_;
+  pipeline_info.layout =
+      config_.mesh_shaders ? mesh_pipeline_layout_ : pipeline_layout_;
   pipeline_info.renderPass = render_pass_;
   pipeline_info.subpass = 0;
+  // Without a render pass the pipeline only needs the attachment formats.
+  VkPipelineRenderingCreateInfo rendering_info{};
+  rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+  rendering_info.colorAttachmentCount = 1;
+  rendering_info.pColorAttachmentFormats = &swap_chain_image_format_;
+  rendering_info.depthAttachmentFormat = depth_format_;
+  if (config_.dynamic_rendering) {
+    pipeline_info.pNext = &rendering_info;
+  }
   pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
 
-  if (vkCreateGraphicsPipelines(device_, VK_NULL_HANDLE, 1, &pipeline_info,
-                                nullptr, &graphics_pipeline_) != VK_SUCCESS) {
+  // Only replaced on success, a failed rebuild keeps drawing with the old
+  // pipeline.
+  VkPipeline pipeline;
+  VkResult result = vkCreateGraphicsPipelines(
+      device_, pipeline_cache_, 1, &pipeline_info, nullptr, &pipeline);
+  destroy_shader_modules();
+  if (result != VK_SUCCESS) {
     spdlog::error("Failed to create graphics pipeline.");
-    return;
+    return false;
   }
-
-  vkDestroyShaderModule(device_, *vert_shader_module, nullptr);
-  vkDestroyShaderModule(device_, *frag_shader_module, nullptr);
+  graphics_pipeline_ = pipeline;
+  return true;
 }
 
-void VulkanEngine::CreateFramebuffers() {
-  swap_chain_framebuffers_.resize(swap_chain_image_views_.size());
-  for (size_t i = 0; i < swap_chain_image_views_.size(); ++i) {
-    std::array<VkImageView, 3> attachments = {
-        color_image_view_,
-        depth_image_view_,
-        swap_chain_image_views_[i],
-    };
-    VkFramebufferCreateInfo framebuffer_info{};
-    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-    framebuffer_info.renderPass = render_pass_;
-    framebuffer_info.attachmentCount =
-        static_cast<uint32_t>(attachments.size());
-    framebuffer_info.pAttachments = attachments.data();
-    framebuffer_info.width = swap_chain_extent_.width;
-    framebuffer_info.height = swap_chain_extent_.height;
-    framebuffer_info.layers = 1;
+bool VulkanEngine::RebuildGraphicsPipeline() {
+  VkPipeline old_pipeline = graphics_pipeline_;
+  if (!CreateGraphicsPipeline()) {
+    return false;
+  }
+  DeferDestroy([device = device_, old_pipeline]() {
+    vkDestroyPipeline(device, old_pipeline, nullptr);
+  });
+  return true;
+}
 
-    if (vkCreateFramebuffer(device_, &framebuffer_info, nullptr,
+bool VulkanEngine::CreateSkyPipeline() {
+  auto vert_shader_module = CreateShaderModule(shader_library_.Get("sky.vert"));
+  auto frag_shader_module = CreateShaderModule(shader_library_.Get("sky.frag"));
+  if (!vert_shader_module || !frag_shader_module) {
+    if (vert_shader_module) {
+      vkDestroyShaderModule(device_, *vert_shader_module, nullptr);
+    }
+    if (frag_shader_module) {
+      vkDestroyShaderModule(device_, *frag_shader_module, nullptr);
+    }
+    return false;
+  }
+
+  std::array<VkPipelineShaderStageCreateInfo, 2> shader_stages{};
+  shader_stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  shader_stages[0].module = *vert_shader_module;
+  shader_stages[0].pName = "main";
+  // The triangle lies on the far plane.
+  SpecializationConstants vert_specialization{config_.reversed_z ? 1u : 0u};
+  shader_stages[0].pSpecializationInfo = vert_specialization.Info();
+  shader_stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  shader_stages[1].module = *frag_shader_module;
+  shader_stages[1].pName = "main";
+
+  std::array<VkDynamicState, 2> dynamic_states = {VK_DYNAMIC_STATE_VIEWPORT,
+                                                  VK_DYNAMIC_STATE_SCISSOR};
+  VkPipelineDynamicStateCreateInfo dynamic_state{};
+  dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamic_state.dynamicStateCount =
+      static_cast<uint32_t>(dynamic_states.size());
+  dynamic_state.pDynamicStates = dynamic_states.data();
+
+  // The vertices come from gl_VertexIndex.
+  VkPipelineVertexInputStateCreateInfo vertex_input_info{};
+  vertex_input_info.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+  VkPipelineInputAssemblyStateCreateInfo input_assembly{};
+  input_assembly.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+  VkPipelineViewportStateCreateInfo viewport_state{};
+  viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewport_state.viewportCount = 1;
+  viewport_state.scissorCount = 1;
+
+  VkPipelineRasterizationStateCreateInfo rasterizer{};
+  rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+  rasterizer.lineWidth = 1.0f;
+  rasterizer.cullMode = VK_CULL_MODE_NONE;
+  rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+  VkPipelineMultisampleStateCreateInfo multisampling{};
+  multisampling.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampling.rasterizationSamples = msaa_samples_;
+
+  // Passes only where the depth is still the clear value, and leaves it so.
+  VkPipelineDepthStencilStateCreateInfo depth_stencil{};
+  depth_stencil.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  depth_stencil.depthTestEnable = VK_TRUE;
+  depth_stencil.depthWriteEnable = VK_FALSE;
+  depth_stencil.depthCompareOp = config_.reversed_z
+                                     ? VK_COMPARE_OP_GREATER_OR_EQUAL
+                                     : VK_COMPARE_OP_LESS_OR_EQUAL;
+  depth_stencil.maxDepthBounds = 1.0f;
+
+  VkPipelineColorBlendAttachmentState color_blend_attachment{};
+  color_blend_attachment.colorWriteMask =
+      VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+  VkPipelineColorBlendStateCreateInfo color_blending{};
+  color_blending.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  color_blending.attachmentCount = 1;
+  color_blending.pAttachments = &color_blend_attachment;
+
+  VkDescriptorSetLayout set_layout = atmosphere_.RenderSetLayout();
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &set_layout;
+  if (sky_pipeline_layout_ == VK_NULL_HANDLE &&
+      vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &sky_pipeline_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create sky pipeline layout.");
+    vkDestroyShaderModule(device_, *vert_shader_module, nullptr);
+    vkDestroyShaderModule(device_, *frag_shader_module, nullptr);
+    return false;
+  }
+
+  VkGraphicsPipelineCreateInfo pipeline_info{};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipeline_info.stageCount = static_cast<uint32_t>(shader_stages.size());
+  pipeline_info.pStages = shader_stages.data();
+  pipeline_info.pVertexInputState = &vertex_input_info;
+  pipeline_info.pInputAssemblyState = &input_assembly;
+  pipeline_info.pViewportState = &viewport_state;
+  pipeline_info.pRasterizationState = &rasterizer;
+  pipeline_info.pMultisampleState = &multisampling;
+  pipeline_info.pDepthStencilState = &depth_stencil;
+  pipeline_info.pColorBlendState = &color_blending;
+  pipeline_info.pDynamicState = &dynamic_state;
+  pipeline_info.layout = sky_pipeline_layout_;
+  pipeline_info.renderPass = render_pass_;
+  pipeline_info.subpass = 0;
+  // The same attachments as the terrain's.
+  VkPipelineRenderingCreateInfo rendering_info{};
+  rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+  rendering_info.colorAttachmentCount = 1;
+  rendering_info.pColorAttachmentFormats = &swap_chain_image_format_;
+  rendering_info.depthAttachmentFormat = depth_format_;
+  if (config_.dynamic_rendering) {
+    pipeline_info.pNext = &rendering_info;
+  }
+
+  VkPipeline pipeline;
+  VkResult result = vkCreateGraphicsPipelines(
+      device_, pipeline_cache_, 1, &pipeline_info, nullptr, &pipeline);
+  vkDestroyShaderModule(device_, *vert_shader_module, nullptr);
+  vkDestroyShaderModule(device_, *frag_shader_module, nullptr);
+  if (result != VK_SUCCESS) {
+    spdlog::error("Failed to create sky pipeline.");
+    return false;
+  }
+  sky_pipeline_ = pipeline;
+  return true;
+}
+
+bool VulkanEngine::RebuildSkyPipeline() {
+  VkPipeline old_pipeline = sky_pipeline_;
+  if (!CreateSkyPipeline()) {
+    return false;
+  }
+  DeferDestroy([device = device_, old_pipeline]() {
+    vkDestroyPipeline(device, old_pipeline, nullptr);
+  });
+  return true;
+}
+
+bool VulkanEngine::CreateCullPipeline() {
+  // The layouts are kept when the pipeline is rebuilt for a new shader.
+  if (cull_pipeline_layout_ == VK_NULL_HANDLE && !CreateCullPipelineLayout()) {
+    return false;
+  }
+  auto comp_shader_module =
+      CreateShaderModule(shader_library_.Get("cull.comp"));
+  if (!comp_shader_module) {
+    return false;
+  }
+
+  VkComputePipelineCreateInfo pipeline_info{};
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = *comp_shader_module;
+  pipeline_info.stage.pName = "main";
+  // The mesh shader path gets one task workgroup per visible chunk instead
+  // of its indexed draw.
+  SpecializationConstants specialization{config_.reversed_z ? 1u : 0u,
+                                         config_.mesh_shaders ? 1u : 0u};
+  pipeline_info.stage.pSpecializationInfo = specialization.Info();
+  pipeline_info.layout = cull_pipeline_layout_;
+  VkPipeline pipeline;
+  VkResult result = vkCreateComputePipelines(
+      device_, pipeline_cache_, 1, &pipeline_info, nullptr, &pipeline);
+  vkDestroyShaderModule(device_, *comp_shader_module, nullptr);
+  if (result != VK_SUCCESS) {
+    spdlog::error("Failed to create cull pipeline.");
+    return false;
+  }
+  cull_pipeline_ = pipeline;
+  return true;
+}
+
+bool VulkanEngine::RebuildCullPipeline() {
+  VkPipeline old_pipeline = cull_pipeline_;
+  if (!CreateCullPipeline()) {
+    return false;
+  }
+  DeferDestroy([device = device_, old_pipeline]() {
+    vkDestroyPipeline(device, old_pipeline, nullptr);
+  });
+  return true;
+}
+
+void VulkanEngine::SetMeshShaders(bool enabled) {
+  enabled = enabled && mesh_shaders_supported_;
+  if (enabled == config_.mesh_shaders) {
+    return;
+  }
+  // Both or neither, the culling pass writes the draws of one path.
+  config_.mesh_shaders = enabled;
+  if (!RebuildGraphicsPipeline() || !RebuildCullPipeline()) {
+    spdlog::error("Failed to switch the terrain's shaders.");
+    config_.mesh_shaders = !enabled;
+    RebuildGraphicsPipeline();
+    RebuildCullPipeline();
+  }
+}
+
+bool VulkanEngine::CreateCullPipelineLayout() {
+  // Binding 0: chunks of the frame, binding 1: draw commands, binding 2: draw
+  // counts of the groups, binding 3: visibility of the mesh slots, binding 4:
+  // the frame's CullOcclusionData. All but the visibility at the frame's
+  // dynamic offsets. Set 1 is the Hi-Z pyramid's.
+  std::array<VkDescriptorSetLayoutBinding, 5> bindings{};
+  for (uint32_t i = 0; i < bindings.size(); ++i) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+  bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[4].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  VkDescriptorSetLayoutCreateInfo layout_info{};
+  layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+  layout_info.pBindings = bindings.data();
+  if (vkCreateDescriptorSetLayout(device_, &layout_info, nullptr,
+                                  &cull_descriptor_set_layout_) !=
+      VK_SUCCESS) {
+    spdlog::error("Failed to create cull descriptor set layout.");
+    return false;
+  }
+
+  VkPushConstantRange push_constant_range{};
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = sizeof(CullPushConstants);
+
+  std::array<VkDescriptorSetLayout, 2> set_layouts = {
+      cull_descriptor_set_layout_, hiz_.CullSetLayout()};
+  VkPipelineLayoutCreateInfo pipeline_layout_info{};
+  pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipeline_layout_info.setLayoutCount =
+      static_cast<uint32_t>(set_layouts.size());
+  pipeline_layout_info.pSetLayouts = set_layouts.data();
+  pipeline_layout_info.pushConstantRangeCount = 1;
+  pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+  if (vkCreatePipelineLayout(device_, &pipeline_layout_info, nullptr,
+                             &cull_pipeline_layout_) != VK_SUCCESS) {
+    spdlog::error("Failed to create cull pipeline layout.");
+    return false;
+  }
+  return true;
+}
+
+void VulkanEngine::InitHiZPyramid() {
+  // The pyramid is built between the two parts of the main pass, which the
+  // render pass fallback has no room for, from a sampled depth buffer.
+  VkFormatProperties format_properties{};
+  vkGetPhysicalDeviceFormatProperties(physical_device_, depth_format_,
+                                      &format_properties);
+  if (config_.occlusion_culling &&
+      (!config_.dynamic_rendering ||
+       !(format_properties.optimalTilingFeatures &
+         VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT))) {
+    spdlog::warn("Occlusion culling is not supported, continuing without.");
+    config_.occlusion_culling = false;
+  }
+
+  // The farthest sample keeps the resolved depth conservative, sample 0 can
+  // be nearer than the rest along the edges of the terrain.
+  VkPhysicalDeviceVulkan12Properties properties12{};
+  properties12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+  VkPhysicalDeviceProperties2 properties{};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  properties.pNext = &properties12;
+  vkGetPhysicalDeviceProperties2(physical_device_, &properties);
+  VkResolveModeFlagBits farthest = config_.reversed_z
+                                       ? VK_RESOLVE_MODE_MIN_BIT
+                                       : VK_RESOLVE_MODE_MAX_BIT;
+  depth_resolve_mode_ =
+      (properties12.supportedDepthResolveModes & farthest) != 0
+          ? farthest
+          : VK_RESOLVE_MODE_SAMPLE_ZERO_BIT;
+
+  HiZPyramid::CreateInfo create_info{};
+  create_info.device = device_;
+  create_info.allocator = &allocator_;
+  create_info.pipeline_cache = pipeline_cache_;
+  create_info.shader_code = shader_library_.Get("hiz.comp");
+  create_info.reversed_z = config_.reversed_z;
+  create_info.task_shaders = mesh_shaders_supported_;
+  create_info.defer_destroy = [this](std::function<void()> &&deleter) {
+    DeferDestroy(std::move(deleter));
+  };
+  if (!hiz_.Init(create_info)) {
+    spdlog::error("Failed to initialize Hi-Z pyramid.");
+    return;
+  }
+}
+
+void VulkanEngine::InitAtmosphere() {
+  Atmosphere::CreateInfo create_info{};
+  create_info.device = device_;
+  create_info.allocator = &allocator_;
+  create_info.pipeline_cache = pipeline_cache_;
+  create_info.shader_code = shader_library_.Get("atmosphere.comp");
+  create_info.uniform_buffer = uniform_arena_.Buffer();
+  create_info.reversed_z = config_.reversed_z;
+  create_info.mesh_shaders = mesh_shaders_supported_;
+  create_info.defer_destroy = [this](std::function<void()> &&deleter) {
+    DeferDestroy(std::move(deleter));
+  };
+  if (!atmosphere_.Init(create_info)) {
+    spdlog::error("Failed to initialize atmosphere.");
+    return;
+  }
+}
+
+void VulkanEngine::InitVirtualTexture() {
+  VirtualTexture::CreateInfo create_info{};
+  create_info.device = device_;
+  create_info.physical_device = physical_device_;
+  create_info.allocator = &allocator_;
+  create_info.frames_in_flight = config_.frames_in_flight;
+  if (!config_.imagery_tile_file.empty()) {
+    // The tile cache holds what the loader read, the virtual texture's cache
+    // what the GPU samples.
+    if (imagery_tile_file_.Open(config_.imagery_tile_file) &&
+        imagery_tile_cache_.Init({&imagery_tile_file_,
+                                  config_.tile_cache_budget})) {
+      create_info.tiles = &imagery_tile_cache_;
+      if (config_.sparse_imagery) {
+        create_info.sparse_queue = graphics_queue_;
+      }
+    } else {
+      spdlog::warn("Continuing without imagery.");
+    }
+  }
+  if (virtual_texture_.Init(create_info)) {
+    return;
+  }
+  if (create_info.tiles) {
+    // Falls back to the flat colour, the pipeline layout still needs the set.
+    spdlog::warn("Continuing without imagery.");
+    virtual_texture_.Destroy();
+    imagery_tile_cache_.Destroy();
+    imagery_tile_file_.Close();
+    create_info.tiles = nullptr;
+    create_info.sparse_queue = VK_NULL_HANDLE;
+    if (virtual_texture_.Init(create_info)) {
+      return;
+    }
+  }
+  spdlog::error("Failed to initialize virtual texture.");
+}
+
+void VulkanEngine::InitShadowMaps() {
+  ShadowMaps::CreateInfo create_info{};
+  create_info.device = device_;
+  create_info.physical_device = physical_device_;
+  create_info.allocator = &allocator_;
+  create_info.pipeline_cache = pipeline_cache_;
+  create_info.vertex_shader_code = shader_library_.Get("shadow.vert");
+  create_info.cull_shader_code = shader_library_.Get("shadow_cull.comp");
+  create_info.terrain = &terrain_;
+  create_info.grid_size = kTerrainGridSize;
+  create_info.uniform_buffer = uniform_arena_.Buffer();
+  create_info.frames_in_flight = config_.frames_in_flight;
+  create_info.cascade_count = config_.shadow_cascades;
+  create_info.resolution = config_.shadow_resolution;
+  create_info.dynamic_cascades = config_.shadow_dynamic_cascades;
+  create_info.max_distance = config_.shadow_distance;
+  create_info.dynamic_rendering = config_.dynamic_rendering;
+  create_info.defer_destroy = [this](std::function<void()> &&deleter) {
+    DeferDestroy(std::move(deleter));
+  };
+  if (!shadow_maps_.Init(create_info)) {
+    spdlog::error("Failed to initialize shadow maps.");
+    return;
+  }
+}
+
+void VulkanEngine::CreateFramebuffers() {
+  swap_chain_framebuffers_.resize(swap_chain_image_views_.size());
+  for (size_t i = 0; i < swap_chain_image_views_.size(); ++i) {
+    // See CreateRenderPass(), without MSAA the swap chain image is drawn
+    // into directly.
+    bool multisampled = msaa_samples_ != VK_SAMPLE_COUNT_1_BIT;
+    std::array<VkImageView, 3> attachments = {
+        multisampled ? color_image_view_ : swap_chain_image_views_[i],
+        depth_image_view_,
+        swap_chain_image_views_[i],
+    };
+    VkFramebufferCreateInfo framebuffer_info{};
+    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_info.renderPass = render_pass_;
+    framebuffer_info.attachmentCount =
+        multisampled ? static_cast<uint32_t>(attachments.size()) : 2;
+    framebuffer_info.pAttachments = attachments.data();
+    framebuffer_info.width = swap_chain_extent_.width;
+    framebuffer_info.height = swap_chain_extent_.height;
+    framebuffer_info.layers = 1;
+
+    if (vkCreateFramebuffer(device_, &framebuffer_info, nullptr,
                             &swap_chain_framebuffers_[i]) != VK_SUCCESS) {
       spdlog::error("Failed to create framebuffer.");
       return;
@@ -1052,7 +2656,7 @@ void VulkanEngine::CreateFramebuffers() {
 void VulkanEngine::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
                                 VkMemoryPropertyFlags properties,
                                 VkBuffer &buffer,
-                                VkDeviceMemory &buffer_memory) {
+                                GpuAllocation &buffer_allocation) {
   VkBufferCreateInfo buffer_info{};
   buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
   buffer_info.size = size;
@@ -1064,162 +2668,309 @@ void VulkanEngine::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
     return;
   }
 
-  VkMemoryRequirements memory_requirements;
-  vkGetBufferMemoryRequirements(device_, buffer, &memory_requirements);
-
-  VkMemoryAllocateInfo allocate_info{};
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex =
-      FindMemoryType(memory_requirements.memoryTypeBits, properties);
-
-  // NOTE: Real world application should NOT call vkAllocateMemory for every
-  // individual buffer. The right way is to create a custom allocator that
-  // splits up single allocation among many objects using offset param.
-  // This can be either implemented or VulkanMemoryAllocator can be used.
-  // (https://github.com/GPUOpen-LibrariesAndSDKs/VulkanMemoryAllocator)
-  if (vkAllocateMemory(device_, &allocate_info, nullptr, &buffer_memory) !=
-      VK_SUCCESS) {
+  // Memory is sub-allocated from large blocks, see GpuAllocator.
+  std::optional<GpuAllocation> allocation =
+      allocator_.AllocateForBuffer(buffer, properties);
+  if (!allocation) {
     spdlog::error("Failed to allocate buffer memory.");
     return;
   }
-
-  vkBindBufferMemory(device_, buffer, buffer_memory, 0);
-}
-
-void VulkanEngine::CopyBuffer(VkBuffer src_buffer, VkBuffer dst_buffer,
-                              VkDeviceSize size) {
-  VkCommandBuffer command_buffer = BeginSingleTimeCommands();
-
-  VkBufferCopy copy_region{};
-  copy_region.srcOffset = 0;
-  copy_region.dstOffset = 0;
-  copy_region.size = size;
-  vkCmdCopyBuffer(command_buffer, src_buffer, dst_buffer, 1, &copy_region);
-
-  EndSingleTimeCommands(command_buffer);
+  buffer_allocation = *allocation;
 }
 
-void VulkanEngine::CreateVertexBuffer() {
-  VkDeviceSize buffer_size = sizeof(vertices[0]) * vertices.size();
-
-  VkBuffer staging_buffer;
-  VkDeviceMemory staging_buffer_memory;
-  CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               staging_buffer, staging_buffer_memory);
-  void *data;
-  vkMapMemory(device_, staging_buffer_memory, 0, buffer_size, 0, &data);
-  memcpy(data, vertices.data(), (size_t)buffer_size);
-  vkUnmapMemory(device_, staging_buffer_memory);
-
-  CreateBuffer(buffer_size,
-               VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertex_buffer_,
-               vertex_buffer_memory_);
-
-  CopyBuffer(staging_buffer, vertex_buffer_, buffer_size);
+void VulkanEngine::InitTerrainGenerator() {
+  QueueFamilyIndices indices = FindQueueFamilies(physical_device_);
 
-  vkDestroyBuffer(device_, staging_buffer, nullptr);
-  vkFreeMemory(device_, staging_buffer_memory, nullptr);
+  TerrainGenerator::CreateInfo create_info{};
+  create_info.device = device_;
+  create_info.compute_queue = compute_queue_;
+  create_info.compute_family = indices.compute_family.value();
+  create_info.graphics_family = indices.graphics_family.value();
+  create_info.pipeline_cache = pipeline_cache_;
+  create_info.shader_code = shader_library_.Get("heightfield.comp");
+  create_info.grid_size = kTerrainGridSize;
+  create_info.mesh_shaders = mesh_shaders_supported_;
+  if (!terrain_generator_.Init(create_info)) {
+    spdlog::warn("Failed to initialize terrain generator, generating terrain "
+                 "on the CPU.");
+    terrain_generator_.Destroy();
+    config_.gpu_terrain_generation = false;
+  }
 }
 
-uint32_t VulkanEngine::FindMemoryType(uint32_t type_filter,
-                                      VkMemoryPropertyFlags properties) {
-  VkPhysicalDeviceMemoryProperties memory_properties;
-  vkGetPhysicalDeviceMemoryProperties(physical_device_, &memory_properties);
-
-  for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
-    if ((type_filter & (1 << i)) &&
-        (memory_properties.memoryTypes[i].propertyFlags & properties) ==
-            properties) {
-      return i;
+void VulkanEngine::InitTerrain() {
+  Terrain::CreateInfo create_info{};
+  create_info.device = device_;
+  create_info.allocator = &allocator_;
+  create_info.upload_manager = &upload_manager_;
+  create_info.noise = &terrain_noise_;
+  if (config_.gpu_terrain_generation) {
+    create_info.generator = &terrain_generator_;
+  }
+  if (!config_.height_tile_file.empty()) {
+    // Without the file the terrain is still complete, only procedural.
+    if (height_tile_file_.Open(config_.height_tile_file) &&
+        height_tile_cache_.Init({&height_tile_file_,
+                                 config_.tile_cache_budget})) {
+      create_info.height_tiles = &height_tile_cache_;
+    } else {
+      spdlog::warn("Continuing without height tiles.");
     }
   }
-
-  spdlog::error("Failed to find suitable memory type.");
-  return 0;
+  create_info.radius = kPlanetRadius;
+  create_info.grid_size = kTerrainGridSize;
+  create_info.defer_destroy = [this](std::function<void()> &&deleter) {
+    DeferDestroy(std::move(deleter));
+  };
+  create_info.vertex_budget = config_.terrain_vertex_budget;
+  create_info.frames_in_flight = config_.frames_in_flight;
+  create_info.draw_groups = config_.terrain_draw_groups;
+  create_info.job_system = &job_system_;
+  create_info.build_budget_ms = config_.terrain_build_budget_ms;
+  create_info.draw_mesh_tasks = draw_mesh_tasks_;
+  if (detail_textures_.size() == 2) {
+    create_info.detail_textures =
+        detail_textures_[0].index | detail_textures_[1].index << 16;
+  }
+  if (!terrain_.Init(create_info)) {
+    spdlog::error("Failed to initialize terrain.");
+    return;
+  }
 }
 
-void VulkanEngine::CreateIndexBuffer() {
-  VkDeviceSize buffer_size = sizeof(indices[0]) * indices.size();
-
-  VkBuffer staging_buffer;
-  VkDeviceMemory staging_buffer_memory;
-  CreateBuffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               staging_buffer, staging_buffer_memory);
-  void *data;
-  vkMapMemory(device_, staging_buffer_memory, 0, buffer_size, 0, &data);
-  memcpy(data, indices.data(), (size_t)buffer_size);
-  vkUnmapMemory(device_, staging_buffer_memory);
-
-  CreateBuffer(
-      buffer_size,
-      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, index_buffer_, index_buffer_memory_);
-
-  CopyBuffer(staging_buffer, index_buffer_, buffer_size);
+void VulkanEngine::InitTerrainQuery() {
+  TerrainQuery::CreateInfo create_info{};
+  create_info.noise = &terrain_noise_;
+  if (height_tile_file_.IsOpen()) {
+    create_info.height_tiles = &height_tile_file_;
+  }
+  create_info.radius = kPlanetRadius;
+  create_info.grid_size = kTerrainGridSize;
+  create_info.level = config_.terrain_query_level;
+  create_info.byte_budget = config_.terrain_query_budget;
+  if (!terrain_query_.Init(create_info)) {
+    spdlog::error("Failed to initialize terrain queries.");
+    return;
+  }
+}
 
-  vkDestroyBuffer(device_, staging_buffer, nullptr);
-  vkFreeMemory(device_, staging_buffer_memory, nullptr);
+void VulkanEngine::InitSimulation() {
+  Simulation::CreateInfo create_info{};
+  create_info.camera_path = &camera_path_;
+  create_info.tick_rate = config_.simulation_rate;
+  create_info.sun_direction = atmosphere_.Sun().direction;
+  if (!simulation_.Init(create_info)) {
+    spdlog::error("Failed to initialize the simulation.");
+    return;
+  }
 }
 
-void VulkanEngine::CreateUniformBuffers() {
-  VkDeviceSize buffer_size = sizeof(UniformBufferObject);
+void VulkanEngine::ApplySimulationState(const SimulationState &state) {
+  camera_ = state.camera;
+  AtmosphereSun sun = atmosphere_.Sun();
+  sun.direction = state.sun_direction;
+  atmosphere_.SetSun(sun);
+}
 
-  uniform_buffers_.resize(kMaxFramesInFlight);
-  uniform_buffers_memory_.resize(kMaxFramesInFlight);
-  uniform_buffers_mapped_.resize(kMaxFramesInFlight);
+void VulkanEngine::InitBindlessTextures() {
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(physical_device_, &features);
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+
+  BindlessTextures::CreateInfo create_info{};
+  create_info.device = device_;
+  if (features.samplerAnisotropy) {
+    create_info.max_anisotropy =
+        std::min(kMaxAnisotropy, properties.limits.maxSamplerAnisotropy);
+  }
+  if (!bindless_textures_.Init(create_info, physical_device_)) {
+    spdlog::error("Failed to initialize bindless textures.");
+    return;
+  }
+}
 
-  for (size_t i = 0; i < kMaxFramesInFlight; ++i) {
-    CreateBuffer(buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+void VulkanEngine::CreateDetailTextures() {
+  // Rock breaks up more strongly than the ground around it.
+  const DetailTexture textures[] = {
+      DetailTexture::Generate(kDetailTextureSize, 1, 6, 0.55f, 0.35f),
+      DetailTexture::Generate(kDetailTextureSize, 2, 6, 0.65f, 0.7f)};
+  for (const DetailTexture &texture : textures) {
+    VkBuffer staging_buffer = VK_NULL_HANDLE;
+    GpuAllocation staging_allocation;
+    CreateBuffer(texture.texels.size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 uniform_buffers_[i], uniform_buffers_memory_[i]);
-    vkMapMemory(device_, uniform_buffers_memory_[i], 0, buffer_size, 0,
-                &uniform_buffers_mapped_[i]);
+                 staging_buffer, staging_allocation);
+    if (staging_allocation.mapped == nullptr) {
+      spdlog::error("Failed to create detail texture staging buffer.");
+      vkDestroyBuffer(device_, staging_buffer, nullptr);
+      return;
+    }
+    std::memcpy(staging_allocation.mapped, texture.texels.data(),
+                texture.texels.size());
+
+    BindlessImage image;
+    CreateImage(texture.size, texture.size, VK_SAMPLE_COUNT_1_BIT,
+                VK_FORMAT_R8_UNORM, VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image.image,
+                image.allocation, texture.LevelCount());
+
+    // TransitionImageLayout() only knows single level images.
+    VkImageMemoryBarrier2 barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image.image;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0,
+                                texture.LevelCount(), 0, 1};
+    std::vector<VkBufferImageCopy> regions(texture.LevelCount());
+    for (uint32_t level = 0; level < texture.LevelCount(); ++level) {
+      uint32_t level_size = texture.size >> level;
+      regions[level].bufferOffset = texture.level_offsets[level];
+      regions[level].imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, 0,
+                                         1};
+      regions[level].imageExtent = {level_size, level_size, 1};
+    }
+    VkCommandBuffer command_buffer = BeginSingleTimeCommands();
+    RecordImageBarrier(command_buffer, barrier);
+    vkCmdCopyBufferToImage(command_buffer, staging_buffer, image.image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           static_cast<uint32_t>(regions.size()),
+                           regions.data());
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    RecordImageBarrier(command_buffer, barrier);
+    EndSingleTimeCommands(command_buffer);
+    vkDestroyBuffer(device_, staging_buffer, nullptr);
+    allocator_.Free(staging_allocation);
+
+    std::optional<VkImageView> view =
+        CreateImageView(image.image, VK_FORMAT_R8_UNORM,
+                        VK_IMAGE_ASPECT_COLOR_BIT, texture.LevelCount());
+    std::optional<uint32_t> index =
+        view ? bindless_textures_.Add(*view) : std::nullopt;
+    if (!index) {
+      spdlog::error("Failed to create detail texture.");
+      if (view) {
+        vkDestroyImageView(device_, *view, nullptr);
+      }
+      vkDestroyImage(device_, image.image, nullptr);
+      allocator_.Free(image.allocation);
+      return;
+    }
+    image.view = *view;
+    image.index = *index;
+    detail_textures_.push_back(image);
   }
 }
 
-void VulkanEngine::UpdateUniformBuffer(uint32_t current_image) {
-  static auto start_time = std::chrono::high_resolution_clock::now();
+void VulkanEngine::InitUniformArena() {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device_, &properties);
+
+  UniformArena::CreateInfo create_info{};
+  create_info.device = device_;
+  create_info.allocator = &allocator_;
+  create_info.frames_in_flight = config_.frames_in_flight;
+  create_info.alignment = properties.limits.minUniformBufferOffsetAlignment;
+  if (!uniform_arena_.Init(create_info)) {
+    spdlog::error("Failed to initialize uniform arena.");
+    return;
+  }
+}
 
-  auto current_time = std::chrono::high_resolution_clock::now();
-  float time = std::chrono::duration<float, std::chrono::seconds::period>(
-                   current_time - start_time)
-                   .count();
+void VulkanEngine::UpdateUniformBuffer(uint32_t current_image) {
+  double altitude = glm::length(camera_.position) - kPlanetRadius;
 
+  float aspect = swap_chain_extent_.width / (float)swap_chain_extent_.height;
   UniformBufferObject ubo{};
-  ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f),
-                          glm::vec3(0.0f, 0.0f, 1.0f));
-  ubo.view =
-      glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f),
-                  glm::vec3(0.0f, 0.0f, 1.0f));
-  ubo.projection = glm::perspective(
-      glm::radians(45.0f),
-      swap_chain_extent_.width / (float)swap_chain_extent_.height, 0.1f, 10.0f);
-  ubo.projection[1][1] *= -1; // Invert Y (because GLM was designed for OpenGL)
+  ubo.view = camera_.ViewMatrix();
+  float near_plane = kReversedZNearPlane;
+  if (config_.reversed_z) {
+    ubo.projection =
+        camera_.InfiniteReversedProjectionMatrix(aspect, kReversedZNearPlane);
+  } else {
+    // Everything from the camera to the far side of the planet is in range,
+    // the near plane has to move out with the altitude to keep precision.
+    near_plane = static_cast<float>(std::max(altitude * 0.1, 1.0));
+    float far_plane =
+        static_cast<float>(glm::length(camera_.position) + kPlanetRadius);
+    ubo.projection = camera_.ProjectionMatrix(aspect, near_plane, far_plane);
+  }
 
-  // NOTE: A more efficient way to pass a small buffer of data to shaders are
-  // push costants.
-  memcpy(uniform_buffers_mapped_[current_image], &ubo, sizeof(ubo));
+  if (height_tile_file_.IsOpen()) {
+    height_tile_cache_.BeginFrame();
+  }
+  if (imagery_tile_file_.IsOpen()) {
+    imagery_tile_cache_.BeginFrame();
+  }
+  // The fence wait of this frame slot retired the feedback it reads.
+  virtual_texture_.Update(current_image);
+  terrain_.Update(current_image, camera_.position, ubo.projection * ubo.view,
+                  camera_.ProjectionScale(
+                      static_cast<float>(swap_chain_extent_.height)));
+
+  // The fence wait of this frame slot retired the region's previous
+  // contents.
+  uniform_arena_.BeginFrame(current_image);
+  // Every push here has to be counted in kFrameUniformBytes.
+  uniform_offset_ = uniform_arena_.Push(ubo).value_or(0);
+  CullOcclusionData occlusion = terrain_.OcclusionData(current_image);
+  occlusion.depth_size = glm::vec2(hiz_.DepthExtent().width,
+                                   hiz_.DepthExtent().height);
+  occlusion.hiz_levels = hiz_.LevelCount();
+  occlusion_offset_ = uniform_arena_.Push(occlusion).value_or(0);
+  Atmosphere::View atmosphere_view{};
+  atmosphere_view.camera_position = camera_.position;
+  atmosphere_view.view_projection = ubo.projection * ubo.view;
+  atmosphere_view.render_extent = render_extent_;
+  atmosphere_offset_ =
+      uniform_arena_.Push(atmosphere_.Update(atmosphere_view)).value_or(0);
+  // After the terrain's update, the casters are the chunks it selected.
+  ShadowMaps::View shadow_view{};
+  shadow_view.camera_position = camera_.position;
+  shadow_view.camera_forward = camera_.forward;
+  shadow_view.fov_y = camera_.fov_y;
+  shadow_view.aspect = aspect;
+  shadow_view.near_plane = near_plane;
+  shadow_view.sun_direction = atmosphere_.Sun().direction;
+  shadow_view.planet_radius = kPlanetRadius;
+  shadow_offset_ =
+      uniform_arena_.Push(shadow_maps_.Update(shadow_view)).value_or(0);
 }
 
 void VulkanEngine::CreateDescriptorPool() {
   //
-  VkDescriptorPoolSize pool_size{};
-  pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  pool_size.descriptorCount = static_cast<uint32_t>(kMaxFramesInFlight);
+  // The graphics set (UBO + chunks + occlusion data + draws + vertices +
+  // shadow data + shadow maps) and the cull set (chunks + draws + draw counts
+  // + visibility + occlusion data), shared by all frames.
+  std::array<VkDescriptorPoolSize, 4> pool_sizes{};
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  pool_sizes[0].descriptorCount = 4;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  pool_sizes[1].descriptorCount = 4;
+  pool_sizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  pool_sizes[2].descriptorCount = 3;
+  pool_sizes[3].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pool_sizes[3].descriptorCount = 1;
 
   VkDescriptorPoolCreateInfo pool_info{};
   pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  pool_info.poolSizeCount = 1;
-  pool_info.pPoolSizes = &pool_size;
-  pool_info.maxSets = static_cast<uint32_t>(kMaxFramesInFlight);
+  pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+  pool_info.pPoolSizes = pool_sizes.data();
+  pool_info.maxSets = 2;
 
   if (vkCreateDescriptorPool(device_, &pool_info, nullptr, &descriptor_pool_) !=
       VK_SUCCESS) {
@@ -1229,40 +2980,141 @@ void VulkanEngine::CreateDescriptorPool() {
 }
 
 void VulkanEngine::CreateDescriptorSets() {
-  std::vector<VkDescriptorSetLayout> layouts(kMaxFramesInFlight,
-                                             descriptor_set_layout_);
+  std::array<VkDescriptorSetLayout, 2> layouts = {descriptor_set_layout_,
+                                                  cull_descriptor_set_layout_};
+  std::array<VkDescriptorSet, 2> sets{};
   VkDescriptorSetAllocateInfo allocate_info{};
   allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
   allocate_info.descriptorPool = descriptor_pool_;
-  allocate_info.descriptorSetCount = static_cast<uint32_t>(kMaxFramesInFlight);
+  allocate_info.descriptorSetCount = static_cast<uint32_t>(layouts.size());
   allocate_info.pSetLayouts = layouts.data();
-
-  descriptor_sets_.resize(kMaxFramesInFlight);
-  if (vkAllocateDescriptorSets(device_, &allocate_info,
-                               descriptor_sets_.data()) != VK_SUCCESS) {
+  if (vkAllocateDescriptorSets(device_, &allocate_info, sets.data()) !=
+      VK_SUCCESS) {
     spdlog::error("Failed to allocate descriptor sets.");
     return;
   }
-
-  for (size_t i = 0; i < kMaxFramesInFlight; ++i) {
-    VkDescriptorBufferInfo buffer_info{};
-    buffer_info.buffer = uniform_buffers_[i];
-    buffer_info.offset = 0;
-    buffer_info.range = sizeof(UniformBufferObject);
-
-    VkWriteDescriptorSet descriptor_write{};
-    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_write.dstSet = descriptor_sets_[i];
-    descriptor_write.dstBinding = 0;
-    descriptor_write.dstArrayElement = 0;
-    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptor_write.descriptorCount = 1;
-    descriptor_write.pBufferInfo = &buffer_info;
-    descriptor_write.pImageInfo = nullptr;
-    descriptor_write.pTexelBufferView = nullptr;
-
-    vkUpdateDescriptorSets(device_, 1, &descriptor_write, 0, nullptr);
-  }
+  descriptor_set_ = sets[0];
+  cull_descriptor_set_ = sets[1];
+
+  // Ranges are one frame's worth, the dynamic offsets pick the frame.
+  VkDescriptorBufferInfo buffer_info{};
+  buffer_info.buffer = uniform_arena_.Buffer();
+  buffer_info.offset = 0;
+  buffer_info.range = sizeof(UniformBufferObject);
+
+  VkDescriptorBufferInfo chunk_buffer_info{};
+  chunk_buffer_info.buffer = terrain_.ChunkBuffer();
+  chunk_buffer_info.offset = 0;
+  chunk_buffer_info.range = terrain_.ChunkBufferSize();
+
+  VkDescriptorBufferInfo draw_buffer_info{};
+  draw_buffer_info.buffer = terrain_.DrawBuffer();
+  draw_buffer_info.offset = 0;
+  draw_buffer_info.range = terrain_.DrawBufferSize();
+
+  VkDescriptorBufferInfo count_buffer_info{};
+  count_buffer_info.buffer = terrain_.CountBuffer();
+  count_buffer_info.offset = 0;
+  count_buffer_info.range = terrain_.CountBufferSize();
+
+  VkDescriptorBufferInfo visibility_buffer_info{};
+  visibility_buffer_info.buffer = terrain_.VisibilityBuffer();
+  visibility_buffer_info.offset = 0;
+  visibility_buffer_info.range = terrain_.VisibilityBufferSize();
+
+  VkDescriptorBufferInfo occlusion_buffer_info{};
+  occlusion_buffer_info.buffer = uniform_arena_.Buffer();
+  occlusion_buffer_info.offset = 0;
+  occlusion_buffer_info.range = sizeof(CullOcclusionData);
+
+  // The mesh shader path reads the draws of every frame and phase, and all
+  // vertex slots.
+  VkDescriptorBufferInfo all_draws_buffer_info{};
+  all_draws_buffer_info.buffer = terrain_.DrawBuffer();
+  all_draws_buffer_info.offset = 0;
+  all_draws_buffer_info.range = VK_WHOLE_SIZE;
+
+  VkDescriptorBufferInfo vertex_buffer_info{};
+  vertex_buffer_info.buffer = terrain_.MeshBuffer();
+  vertex_buffer_info.offset = terrain_.VertexDataOffset();
+  vertex_buffer_info.range = VK_WHOLE_SIZE;
+
+  VkDescriptorBufferInfo shadow_buffer_info{};
+  shadow_buffer_info.buffer = uniform_arena_.Buffer();
+  shadow_buffer_info.offset = 0;
+  shadow_buffer_info.range = sizeof(ShadowGpuData);
+
+  VkDescriptorImageInfo shadow_map_info{};
+  shadow_map_info.sampler = shadow_maps_.Sampler();
+  shadow_map_info.imageView = shadow_maps_.View();
+  shadow_map_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  std::array<VkWriteDescriptorSet, 12> descriptor_writes{};
+  descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptor_writes[0].dstSet = descriptor_set_;
+  descriptor_writes[0].dstBinding = 0;
+  descriptor_writes[0].dstArrayElement = 0;
+  descriptor_writes[0].descriptorType =
+      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  descriptor_writes[0].descriptorCount = 1;
+  descriptor_writes[0].pBufferInfo = &buffer_info;
+
+  descriptor_writes[1] = descriptor_writes[0];
+  descriptor_writes[1].dstBinding = 1;
+  descriptor_writes[1].descriptorType =
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  descriptor_writes[1].pBufferInfo = &chunk_buffer_info;
+
+  descriptor_writes[2] = descriptor_writes[1];
+  descriptor_writes[2].dstSet = cull_descriptor_set_;
+  descriptor_writes[2].dstBinding = 0;
+
+  descriptor_writes[3] = descriptor_writes[2];
+  descriptor_writes[3].dstBinding = 1;
+  descriptor_writes[3].pBufferInfo = &draw_buffer_info;
+
+  descriptor_writes[4] = descriptor_writes[3];
+  descriptor_writes[4].dstBinding = 2;
+  descriptor_writes[4].pBufferInfo = &count_buffer_info;
+
+  descriptor_writes[5] = descriptor_writes[4];
+  descriptor_writes[5].dstBinding = 3;
+  descriptor_writes[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  descriptor_writes[5].pBufferInfo = &visibility_buffer_info;
+
+  descriptor_writes[6] = descriptor_writes[4];
+  descriptor_writes[6].dstBinding = 4;
+  descriptor_writes[6].descriptorType =
+      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  descriptor_writes[6].pBufferInfo = &occlusion_buffer_info;
+
+  descriptor_writes[7] = descriptor_writes[6];
+  descriptor_writes[7].dstSet = descriptor_set_;
+  descriptor_writes[7].dstBinding = 2;
+
+  descriptor_writes[8] = descriptor_writes[5];
+  descriptor_writes[8].dstSet = descriptor_set_;
+  descriptor_writes[8].dstBinding = 3;
+  descriptor_writes[8].pBufferInfo = &all_draws_buffer_info;
+
+  descriptor_writes[9] = descriptor_writes[8];
+  descriptor_writes[9].dstBinding = 4;
+  descriptor_writes[9].pBufferInfo = &vertex_buffer_info;
+
+  descriptor_writes[10] = descriptor_writes[0];
+  descriptor_writes[10].dstBinding = 5;
+  descriptor_writes[10].pBufferInfo = &shadow_buffer_info;
+
+  descriptor_writes[11] = descriptor_writes[0];
+  descriptor_writes[11].dstBinding = 6;
+  descriptor_writes[11].descriptorType =
+      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  descriptor_writes[11].pBufferInfo = nullptr;
+  descriptor_writes[11].pImageInfo = &shadow_map_info;
+
+  vkUpdateDescriptorSets(device_,
+                         static_cast<uint32_t>(descriptor_writes.size()),
+                         descriptor_writes.data(), 0, nullptr);
 }
 
 bool HasStencilComponent(VkFormat format) {
@@ -1277,11 +3129,17 @@ void VulkanEngine::CreateDepthResources() {
     return;
   }
 
-  CreateImage(swap_chain_extent_.width, swap_chain_extent_.height,
-              msaa_samples_, *depth_format, VK_IMAGE_TILING_OPTIMAL,
-              VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+  // The Hi-Z pyramid samples the depth buffer, or its single sampled
+  // resolve with MSAA.
+  bool multisampled = msaa_samples_ != VK_SAMPLE_COUNT_1_BIT;
+  VkImageUsageFlags usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  if (config_.occlusion_culling && !multisampled) {
+    usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+  }
+  CreateImage(render_extent_.width, render_extent_.height, msaa_samples_,
+              *depth_format, VK_IMAGE_TILING_OPTIMAL, usage,
               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_image_,
-              depth_image_memory_);
+              depth_image_allocation_);
   std::optional<VkImageView> image_view =
       CreateImageView(depth_image_, *depth_format, VK_IMAGE_ASPECT_DEPTH_BIT);
   if (!image_view) {
@@ -1290,8 +3148,33 @@ void VulkanEngine::CreateDepthResources() {
   }
   depth_image_view_ = *image_view;
 
-  TransitionImageLayout(depth_image_, *depth_format, VK_IMAGE_LAYOUT_UNDEFINED,
-                        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+  depth_resolve_image_ = VK_NULL_HANDLE;
+  depth_resolve_image_view_ = VK_NULL_HANDLE;
+  if (!config_.occlusion_culling) {
+    hiz_.Resize(render_extent_, VK_NULL_HANDLE);
+  } else if (!multisampled) {
+    hiz_.Resize(render_extent_, depth_image_view_);
+  } else {
+    CreateImage(render_extent_.width, render_extent_.height,
+                VK_SAMPLE_COUNT_1_BIT, *depth_format, VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_resolve_image_,
+                depth_resolve_image_allocation_);
+    image_view = CreateImageView(depth_resolve_image_, *depth_format,
+                                 VK_IMAGE_ASPECT_DEPTH_BIT);
+    if (!image_view) {
+      spdlog::error("Cannot create image view for depth resolve.");
+      return;
+    }
+    depth_resolve_image_view_ = *image_view;
+    hiz_.Resize(render_extent_, depth_resolve_image_view_);
+  }
+
+  // NOTE: No explicit layout transition is recorded here. The main pass
+  // transitions the attachment from VK_IMAGE_LAYOUT_UNDEFINED every frame
+  // itself, and a one-time submit would stall the graphics queue on every
+  // resize.
 }
 
 std::optional<VkFormat>
@@ -1316,6 +3199,7 @@ VulkanEngine::FindSupportedFormat(const std::vector<VkFormat> &candidates,
 }
 
 std::optional<VkFormat> VulkanEngine::FindDepthFormat() {
+  // Float formats first, reversed-Z loses most of its precision in UNORM.
   return FindSupportedFormat(
       {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT,
        VK_FORMAT_D24_UNORM_S8_UINT},
@@ -1324,7 +3208,8 @@ std::optional<VkFormat> VulkanEngine::FindDepthFormat() {
 
 std::optional<VkImageView>
 VulkanEngine::CreateImageView(VkImage image, VkFormat format,
-                              VkImageAspectFlags aspect_flags) {
+                              VkImageAspectFlags aspect_flags,
+                              uint32_t mip_levels) {
   VkImageViewCreateInfo view_info{};
   view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   view_info.image = image;
@@ -1332,7 +3217,7 @@ VulkanEngine::CreateImageView(VkImage image, VkFormat format,
   view_info.format = format;
   view_info.subresourceRange.aspectMask = aspect_flags;
   view_info.subresourceRange.baseMipLevel = 0;
-  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.levelCount = mip_levels;
   view_info.subresourceRange.baseArrayLayer = 0;
   view_info.subresourceRange.layerCount = 1;
 
@@ -1351,14 +3236,15 @@ void VulkanEngine::CreateImage(uint32_t width, uint32_t height,
                                VkFormat format, VkImageTiling tiling,
                                VkImageUsageFlags usage,
                                VkMemoryPropertyFlags properties, VkImage &image,
-                               VkDeviceMemory &image_memory) {
+                               GpuAllocation &image_allocation,
+                               uint32_t mip_levels) {
   VkImageCreateInfo image_info{};
   image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
   image_info.imageType = VK_IMAGE_TYPE_2D;
   image_info.extent.width = width;
   image_info.extent.height = height;
   image_info.extent.depth = 1;
-  image_info.mipLevels = 1;
+  image_info.mipLevels = mip_levels;
   image_info.arrayLayers = 1;
   image_info.format = format;
   image_info.tiling = tiling;
@@ -1372,31 +3258,25 @@ void VulkanEngine::CreateImage(uint32_t width, uint32_t height,
     return;
   }
 
-  VkMemoryRequirements memory_requirements;
-  vkGetImageMemoryRequirements(device_, image, &memory_requirements);
-
-  VkMemoryAllocateInfo allocate_info{};
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex =
-      FindMemoryType(memory_requirements.memoryTypeBits, properties);
-
-  if (vkAllocateMemory(device_, &allocate_info, nullptr, &image_memory) !=
-      VK_SUCCESS) {
+  // Render targets are large and get recreated on every resize, so they get
+  // their own allocation instead of fragmenting the shared blocks.
+  bool is_attachment =
+      usage & (VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+               VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+  std::optional<GpuAllocation> allocation =
+      allocator_.AllocateForImage(image, tiling, properties, is_attachment);
+  if (!allocation) {
     spdlog::error("Failed to allocate image memory!");
     return;
   }
-
-  vkBindImageMemory(device_, image, image_memory, 0);
+  image_allocation = *allocation;
 }
 
 void VulkanEngine::TransitionImageLayout(VkImage image, VkFormat format,
                                          VkImageLayout old_layout,
                                          VkImageLayout new_layout) {
-  VkCommandBuffer command_buffer = BeginSingleTimeCommands();
-
-  VkImageMemoryBarrier barrier{};
-  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  VkImageMemoryBarrier2 barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
   barrier.oldLayout = old_layout;
   barrier.newLayout = new_layout;
   barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -1416,42 +3296,85 @@ void VulkanEngine::TransitionImageLayout(VkImage image, VkFormat format,
   barrier.subresourceRange.baseArrayLayer = 0;
   barrier.subresourceRange.layerCount = 1;
 
-  VkPipelineStageFlags source_stage;
-  VkPipelineStageFlags destination_stage;
-
+  // Only the stages that actually touch the image on either side, so the
+  // transition does not drain the whole pipeline.
   if (old_layout == VK_IMAGE_LAYOUT_UNDEFINED &&
       new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-    source_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-    destination_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
   } else if (old_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
              new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-    source_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    destination_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
   } else if (old_layout == VK_IMAGE_LAYOUT_UNDEFINED &&
              new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
-                            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-
-    source_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-    destination_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                            VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
   } else {
     spdlog::error("Unsupported layout transtition.");
     return;
   }
 
-  vkCmdPipelineBarrier(command_buffer, source_stage, destination_stage, 0, 0,
-                       nullptr, 0, nullptr, 1, &barrier);
-
+  VkCommandBuffer command_buffer = BeginSingleTimeCommands();
+  RecordImageBarrier(command_buffer, barrier);
   EndSingleTimeCommands(command_buffer);
 }
 
+void VulkanEngine::RecordImageBarrier(VkCommandBuffer command_buffer,
+                                      const VkImageMemoryBarrier2 &barrier) {
+  if (config_.dynamic_rendering) {
+    VkDependencyInfo dependency_info{};
+    dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency_info.imageMemoryBarrierCount = 1;
+    dependency_info.pImageMemoryBarriers = &barrier;
+    vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+    return;
+  }
+
+  // The synchronization1 flags are the low bits of their synchronization2
+  // counterparts. The 2-only copy and sampled read bits map to the transfer
+  // and shader read bits they split up, NONE to the top or bottom of the
+  // pipe.
+  auto stages = [](VkPipelineStageFlags2 stages, VkPipelineStageFlags none) {
+    if (stages & VK_PIPELINE_STAGE_2_COPY_BIT) {
+      stages = (stages & ~VK_PIPELINE_STAGE_2_COPY_BIT) |
+               VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+    }
+    return stages == VK_PIPELINE_STAGE_2_NONE
+               ? none
+               : static_cast<VkPipelineStageFlags>(stages);
+  };
+  auto accesses = [](VkAccessFlags2 accesses) {
+    if (accesses & VK_ACCESS_2_SHADER_SAMPLED_READ_BIT) {
+      accesses = (accesses & ~VK_ACCESS_2_SHADER_SAMPLED_READ_BIT) |
+                 VK_ACCESS_2_SHADER_READ_BIT;
+    }
+    return static_cast<VkAccessFlags>(accesses);
+  };
+  VkImageMemoryBarrier legacy_barrier{};
+  legacy_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  legacy_barrier.srcAccessMask = accesses(barrier.srcAccessMask);
+  legacy_barrier.dstAccessMask = accesses(barrier.dstAccessMask);
+  legacy_barrier.oldLayout = barrier.oldLayout;
+  legacy_barrier.newLayout = barrier.newLayout;
+  legacy_barrier.srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+  legacy_barrier.dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+  legacy_barrier.image = barrier.image;
+  legacy_barrier.subresourceRange = barrier.subresourceRange;
+  vkCmdPipelineBarrier(
+      command_buffer,
+      stages(barrier.srcStageMask, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT),
+      stages(barrier.dstStageMask, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT), 0, 0,
+      nullptr, 0, nullptr, 1, &legacy_barrier);
+}
+
 void VulkanEngine::CreateCommandPool() {
   QueueFamilyIndices queue_family_indices = FindQueueFamilies(physical_device_);
 
@@ -1468,7 +3391,7 @@ void VulkanEngine::CreateCommandPool() {
 }
 
 void VulkanEngine::CreateCommandBuffer() {
-  command_buffers_.resize(kMaxFramesInFlight);
+  command_buffers_.resize(config_.frames_in_flight);
   VkCommandBufferAllocateInfo allocate_info{};
   allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocate_info.commandPool = command_pool_;
@@ -1482,64 +3405,359 @@ void VulkanEngine::CreateCommandBuffer() {
   }
 }
 
-void VulkanEngine::RecordCommandBuffer(VkCommandBuffer command_buffer,
-                                       uint32_t image_index) {
+void VulkanEngine::CreateThreadCommandPools() {
+  QueueFamilyIndices queue_family_indices = FindQueueFamilies(physical_device_);
+
+  VkCommandPoolCreateInfo pool_info{};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  pool_info.queueFamilyIndex = queue_family_indices.graphics_family.value();
+
+  thread_command_pools_.resize(config_.frames_in_flight);
+  for (std::vector<ThreadCommandPool> &frame_pools : thread_command_pools_) {
+    frame_pools.resize(job_system_.ThreadCount());
+    for (ThreadCommandPool &thread_pool : frame_pools) {
+      if (vkCreateCommandPool(device_, &pool_info, nullptr,
+                              &thread_pool.pool) != VK_SUCCESS) {
+        spdlog::error("Failed to create thread command pool.");
+        return;
+      }
+    }
+  }
+}
+
+void VulkanEngine::DestroyThreadCommandPools() {
+  // Destroying a pool frees its command buffers.
+  for (std::vector<ThreadCommandPool> &frame_pools : thread_command_pools_) {
+    for (ThreadCommandPool &thread_pool : frame_pools) {
+      vkDestroyCommandPool(device_, thread_pool.pool, nullptr);
+    }
+  }
+  thread_command_pools_.clear();
+}
+
+VkCommandBuffer VulkanEngine::BeginSecondaryCommandBuffer(
+    uint32_t thread, uint32_t image_index) {
+  ThreadCommandPool &thread_pool = thread_command_pools_[current_frame_][thread];
+  if (thread_pool.used == thread_pool.secondary_buffers.size()) {
+    VkCommandBufferAllocateInfo allocate_info{};
+    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocate_info.commandPool = thread_pool.pool;
+    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    allocate_info.commandBufferCount = 1;
+
+    VkCommandBuffer command_buffer;
+    if (vkAllocateCommandBuffers(device_, &allocate_info, &command_buffer) !=
+        VK_SUCCESS) {
+      spdlog::error("Failed to allocate secondary command buffer.");
+      return VK_NULL_HANDLE;
+    }
+    thread_pool.secondary_buffers.push_back(command_buffer);
+  }
+  VkCommandBuffer command_buffer =
+      thread_pool.secondary_buffers[thread_pool.used++];
+
+  VkCommandBufferInheritanceInfo inheritance_info{};
+  inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritance_info.renderPass = render_pass_;
+  inheritance_info.subpass = 0;
+  // Executed inside the profiler's statistics query, which counts their
+  // draws too.
+  if (config_.pipeline_statistics) {
+    inheritance_info.pipelineStatistics = Profiler::kStatisticsFlags;
+  }
+  // Dynamic rendering has no framebuffer to inherit, the secondary only
+  // learns the attachment formats the pass begins with.
+  VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info{};
+  inheritance_rendering_info.sType =
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+  if (config_.dynamic_rendering) {
+    inheritance_rendering_info.colorAttachmentCount = 1;
+    inheritance_rendering_info.pColorAttachmentFormats =
+        &swap_chain_image_format_;
+    inheritance_rendering_info.depthAttachmentFormat = depth_format_;
+    inheritance_rendering_info.rasterizationSamples = msaa_samples_;
+    inheritance_info.pNext = &inheritance_rendering_info;
+  } else {
+    inheritance_info.framebuffer = swap_chain_framebuffers_[image_index];
+  }
+
   VkCommandBufferBeginInfo begin_info{};
   begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                     VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  begin_info.pInheritanceInfo = &inheritance_info;
+  if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS) {
+    spdlog::error("Failed to begin recording secondary command buffer.");
+    return VK_NULL_HANDLE;
+  }
+  return command_buffer;
+}
 
-  if (vkBeginCommandBuffer(command_buffer, &begin_info)) {
-    spdlog::error("Failed to begin recording command buffer.");
-    return;
+VkCommandBuffer VulkanEngine::RecordTerrainGroup(uint32_t group,
+                                                 uint32_t thread,
+                                                 uint32_t image_index) {
+  VkCommandBuffer command_buffer =
+      BeginSecondaryCommandBuffer(thread, image_index);
+  if (command_buffer == VK_NULL_HANDLE) {
+    return VK_NULL_HANDLE;
   }
 
-  VkRenderPassBeginInfo render_pass_info{};
-  render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  render_pass_info.renderPass = render_pass_;
-  render_pass_info.framebuffer = swap_chain_framebuffers_[image_index];
-  render_pass_info.renderArea.offset = {0, 0};
-  render_pass_info.renderArea.extent = swap_chain_extent_;
+  // Secondaries inherit no state from the render pass, every group binds
+  // everything it draws with.
+  BindTerrainState(command_buffer);
+  DrawTerrain(command_buffer, group,
+              config_.occlusion_culling ? CullPhase::kLastVisible
+                                        : CullPhase::kAll);
 
-  std::array<VkClearValue, 2> clear_values{};
-  clear_values[0].color = {{0.0f, 0.0f, 0.0f}};
-  clear_values[1].depthStencil = {1.0f, 0};
+  if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+    spdlog::error("Failed to record terrain command buffer.");
+    return VK_NULL_HANDLE;
+  }
+  return command_buffer;
+}
 
-  render_pass_info.clearValueCount = static_cast<uint32_t>(clear_values.size());
-  render_pass_info.pClearValues = clear_values.data();
+void VulkanEngine::DrawTerrain(VkCommandBuffer command_buffer, uint32_t group,
+                               CullPhase phase) {
+  if (config_.mesh_shaders) {
+    terrain_.DrawMeshTasks(command_buffer, current_frame_, group, phase,
+                           mesh_pipeline_layout_);
+  } else {
+    terrain_.Draw(command_buffer, current_frame_, group, phase);
+  }
+}
 
-  vkCmdBeginRenderPass(command_buffer, &render_pass_info,
-                       VK_SUBPASS_CONTENTS_INLINE);
+void VulkanEngine::BindTerrainState(VkCommandBuffer command_buffer) {
   vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                     graphics_pipeline_);
 
-  VkBuffer vertex_buffers[] = {vertex_buffer_};
-  VkDeviceSize offsets[] = {0};
-  vkCmdBindVertexBuffers(command_buffer, 0, 1, vertex_buffers, offsets);
-
-  vkCmdBindIndexBuffer(command_buffer, index_buffer_, 0, VK_INDEX_TYPE_UINT32);
-
   VkViewport viewport{};
   viewport.x = 0.0f;
   viewport.y = 0.0f;
-  viewport.width = static_cast<float>(swap_chain_extent_.width);
-  viewport.height = static_cast<float>(swap_chain_extent_.height);
+  viewport.width = static_cast<float>(render_extent_.width);
+  viewport.height = static_cast<float>(render_extent_.height);
   viewport.minDepth = 0.0f;
   viewport.maxDepth = 1.0f;
   vkCmdSetViewport(command_buffer, 0, 1, &viewport);
 
   VkRect2D scissor{};
   scissor.offset = {0, 0};
-  scissor.extent = swap_chain_extent_;
+  scissor.extent = render_extent_;
+  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+  // In binding order: the frame's UniformBufferObject, chunk buffer,
+  // CullOcclusionData, ShadowGpuData, AtmosphereGpuData and imagery
+  // feedback. The bindless set has no dynamic descriptors, nor has the Hi-Z
+  // pyramid's, which only the task shader reads.
+  std::array<VkDescriptorSet, 5> descriptor_sets = {
+      descriptor_set_, bindless_textures_.Set(), atmosphere_.RenderSet(),
+      virtual_texture_.Set(), hiz_.CullSet()};
+  std::array<uint32_t, 6> dynamic_offsets = {
+      uniform_offset_, terrain_.ChunkBufferOffset(current_frame_),
+      occlusion_offset_, shadow_offset_, atmosphere_offset_,
+      virtual_texture_.FeedbackOffset(current_frame_)};
+  vkCmdBindDescriptorSets(
+      command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+      config_.mesh_shaders ? mesh_pipeline_layout_ : pipeline_layout_, 0,
+      config_.mesh_shaders ? 5 : 4, descriptor_sets.data(),
+      static_cast<uint32_t>(dynamic_offsets.size()), dynamic_offsets.data());
+}
+
+void VulkanEngine::RecordSky(VkCommandBuffer command_buffer) {
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    sky_pipeline_);
+
+  VkViewport viewport{};
+  viewport.width = static_cast<float>(render_extent_.width);
+  viewport.height = static_cast<float>(render_extent_.height);
+  viewport.maxDepth = 1.0f;
+  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+  VkRect2D scissor{};
+  scissor.extent = render_extent_;
   vkCmdSetScissor(command_buffer, 0, 1, &scissor);
 
+  VkDescriptorSet descriptor_set = atmosphere_.RenderSet();
   vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          pipeline_layout_, 0, 1,
-                          &descriptor_sets_[current_frame_], 0, nullptr);
-  vkCmdDrawIndexed(command_buffer, static_cast<uint32_t>(indices.size()), 1, 0,
-                   0, 0);
+                          sky_pipeline_layout_, 0, 1, &descriptor_set, 1,
+                          &atmosphere_offset_);
+  vkCmdDraw(command_buffer, 3, 1, 0, 0);
+}
 
-  ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), command_buffer);
+void VulkanEngine::RecordMainPassInline(VkCommandBuffer command_buffer) {
+  BindTerrainState(command_buffer);
+  for (uint32_t group = 0; group < terrain_.DrawGroupCount(); ++group) {
+    DrawTerrain(command_buffer, group,
+                config_.occlusion_culling ? CullPhase::kLastVisible
+                                          : CullPhase::kAll);
+  }
+  if (!config_.occlusion_culling) {
+    RecordSky(command_buffer);
+  }
+  if (imgui_initialized_ && !config_.dynamic_rendering) {
+    ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), command_buffer);
+  }
+}
 
-  vkCmdEndRenderPass(command_buffer);
+void VulkanEngine::RecordCommandBuffer(VkCommandBuffer command_buffer,
+                                       uint32_t image_index) {
+  // The fence of this frame slot has been waited on, nothing recorded from
+  // these pools is pending anymore.
+  for (ThreadCommandPool &thread_pool : thread_command_pools_[current_frame_]) {
+    vkResetCommandPool(device_, thread_pool.pool, 0);
+    thread_pool.used = 0;
+  }
+
+  // Groups land at their own index whichever thread recorded them, so the
+  // execution order is the same on every run.
+  uint32_t group_count = terrain_.DrawGroupCount();
+  secondary_command_buffers_.assign(inline_main_pass_ ? 0 : group_count,
+                                    VK_NULL_HANDLE);
+  job_system_.ParallelFor(
+      static_cast<uint32_t>(secondary_command_buffers_.size()),
+      [&](uint32_t group, uint32_t thread) {
+        secondary_command_buffers_[group] =
+            RecordTerrainGroup(group, thread, image_index);
+      });
+  // After all the terrain, with occlusion culling in the second part of the
+  // main pass. After ParallelFor() returned, so thread 0's pool is free again.
+  if (!inline_main_pass_ && !config_.occlusion_culling) {
+    VkCommandBuffer sky_command_buffer =
+        BeginSecondaryCommandBuffer(0, image_index);
+    if (sky_command_buffer != VK_NULL_HANDLE) {
+      RecordSky(sky_command_buffer);
+      if (vkEndCommandBuffer(sky_command_buffer) == VK_SUCCESS) {
+        secondary_command_buffers_.push_back(sky_command_buffer);
+      }
+    }
+  }
+  // With dynamic rendering ImGui gets its own pass, see RecordOutputPass().
+  if (!inline_main_pass_ && imgui_initialized_ &&
+      !config_.dynamic_rendering) {
+    VkCommandBuffer imgui_command_buffer =
+        BeginSecondaryCommandBuffer(0, image_index);
+    if (imgui_command_buffer != VK_NULL_HANDLE) {
+      ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(),
+                                      imgui_command_buffer);
+      if (vkEndCommandBuffer(imgui_command_buffer) == VK_SUCCESS) {
+        secondary_command_buffers_.push_back(imgui_command_buffer);
+      }
+    }
+  }
+  std::erase_if(secondary_command_buffers_, [](VkCommandBuffer buffer) {
+    return buffer == VK_NULL_HANDLE;
+  });
+
+  VkCommandBufferBeginInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+  if (vkBeginCommandBuffer(command_buffer, &begin_info)) {
+    spdlog::error("Failed to begin recording command buffer.");
+    return;
+  }
+
+  // Take ownership of everything the transfer queue finished since the last
+  // frame before any of it is read.
+  upload_wait_value_ = upload_manager_.RecordAcquireBarriers(command_buffer);
+  generator_wait_value_ =
+      terrain_generator_.RecordAcquireBarriers(command_buffer);
+
+  profiler_.BeginCommandBuffer(command_buffer);
+  profiler_.BeginGpuScope(command_buffer, "Frame");
+
+  // Before anything draws with the LUTs, the cost is the same at every
+  // resolution.
+  profiler_.BeginGpuScope(command_buffer, "Atmosphere");
+  atmosphere_.Record(command_buffer, atmosphere_offset_);
+  profiler_.EndGpuScope(command_buffer);
+
+  profiler_.BeginGpuScope(command_buffer, "Virtual texture");
+  virtual_texture_.Record(command_buffer);
+  profiler_.EndGpuScope(command_buffer);
+
+  profiler_.BeginGpuScope(command_buffer, "Culling");
+  if (!config_.occlusion_culling) {
+    // Only lays out the placeholder the cull set points to.
+    hiz_.Record(command_buffer);
+  }
+  RecordCulling(command_buffer, config_.occlusion_culling
+                                    ? CullPhase::kLastVisible
+                                    : CullPhase::kAll);
+  profiler_.EndGpuScope(command_buffer);
+
+  // Outside the main pass, which samples the maps.
+  profiler_.BeginGpuScope(command_buffer, "Shadows");
+  shadow_maps_.Record(command_buffer, current_frame_, shadow_offset_);
+  profiler_.EndGpuScope(command_buffer);
+
+  // A pass with secondary contents allows no other commands, timestamps
+  // included, so the scope covers the whole pass. The inline fallback keeps
+  // the same scope, so the timings compare across devices.
+  profiler_.BeginGpuScope(command_buffer, "Main pass");
+  MainPass first_pass =
+      config_.occlusion_culling ? MainPass::kFirst : MainPass::kWhole;
+  if (config_.dynamic_rendering) {
+    BeginMainRendering(command_buffer, image_index, first_pass);
+  } else {
+    VkRenderPassBeginInfo render_pass_info{};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderPass = render_pass_;
+    render_pass_info.framebuffer = swap_chain_framebuffers_[image_index];
+    render_pass_info.renderArea.offset = {0, 0};
+    render_pass_info.renderArea.extent = swap_chain_extent_;
+
+    std::array<VkClearValue, 2> clear_values{};
+    clear_values[0].color = {{0.0f, 0.0f, 0.0f}};
+    clear_values[1].depthStencil = {config_.reversed_z ? 0.0f : 1.0f, 0};
+
+    render_pass_info.clearValueCount =
+        static_cast<uint32_t>(clear_values.size());
+    render_pass_info.pClearValues = clear_values.data();
+    vkCmdBeginRenderPass(command_buffer, &render_pass_info,
+                         inline_main_pass_
+                             ? VK_SUBPASS_CONTENTS_INLINE
+                             : VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  }
+  if (inline_main_pass_) {
+    RecordMainPassInline(command_buffer);
+  } else if (!secondary_command_buffers_.empty()) {
+    vkCmdExecuteCommands(
+        command_buffer,
+        static_cast<uint32_t>(secondary_command_buffers_.size()),
+        secondary_command_buffers_.data());
+  }
+  if (config_.dynamic_rendering) {
+    EndMainRendering(command_buffer, image_index, first_pass);
+  } else {
+    vkCmdEndRenderPass(command_buffer);
+  }
+  if (config_.occlusion_culling) {
+    // What the first part drew hides the chunks behind it, the rest is
+    // tested against it and drawn in the second part, inline: it is few
+    // draws, most of the terrain was visible last frame too.
+    profiler_.BeginGpuScope(command_buffer, "Occlusion culling");
+    hiz_.Record(command_buffer);
+    RecordCulling(command_buffer, CullPhase::kNewlyVisible);
+    profiler_.EndGpuScope(command_buffer);
+
+    BeginMainRendering(command_buffer, image_index, MainPass::kSecond);
+    BindTerrainState(command_buffer);
+    for (uint32_t group = 0; group < group_count; ++group) {
+      DrawTerrain(command_buffer, group, CullPhase::kNewlyVisible);
+    }
+    RecordSky(command_buffer);
+    EndMainRendering(command_buffer, image_index, MainPass::kSecond);
+  }
+  profiler_.EndGpuScope(command_buffer);
+  virtual_texture_.RecordFeedbackBarrier(command_buffer, current_frame_);
+
+  if (config_.dynamic_rendering) {
+    profiler_.BeginGpuScope(command_buffer, "Output pass");
+    RecordOutputPass(command_buffer, image_index);
+    profiler_.EndGpuScope(command_buffer);
+  }
+
+  profiler_.EndGpuScope(command_buffer);
+  profiler_.EndCommandBuffer(command_buffer);
 
   if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
     spdlog::error("Failed to record command buffer.");
@@ -1547,6 +3765,326 @@ void VulkanEngine::RecordCommandBuffer(VkCommandBuffer command_buffer,
   }
 }
 
+void VulkanEngine::RecordCulling(VkCommandBuffer command_buffer,
+                                 CullPhase phase) {
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    cull_pipeline_);
+  // In binding order: chunks, draws, counts and occlusion data.
+  std::array<uint32_t, 4> cull_offsets = {
+      terrain_.ChunkBufferOffset(current_frame_),
+      terrain_.DrawBufferOffset(current_frame_, phase),
+      terrain_.CountBufferOffset(current_frame_, phase), occlusion_offset_};
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          cull_pipeline_layout_, 0, 1, &cull_descriptor_set_,
+                          static_cast<uint32_t>(cull_offsets.size()),
+                          cull_offsets.data());
+  // Replaced with the pyramid on every resize.
+  VkDescriptorSet hiz_set = hiz_.CullSet();
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          cull_pipeline_layout_, 1, 1, &hiz_set, 0, nullptr);
+  terrain_.RecordCulling(command_buffer, current_frame_, phase,
+                         cull_pipeline_layout_);
+}
+
+void VulkanEngine::BeginMainRendering(VkCommandBuffer command_buffer,
+                                      uint32_t image_index, MainPass pass) {
+  // What the render pass' attachment descriptions and subpass dependency do
+  // implicitly. The previous contents of all three images are discarded, the
+  // barriers only order this frame's writes after the previous frame's.
+  VkImageMemoryBarrier2 color_barrier{};
+  color_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+  color_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+  color_barrier.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+  color_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+  color_barrier.dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+  color_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  color_barrier.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  color_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  color_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  color_barrier.image = color_image_;
+  color_barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+
+  // The resolve target. The acquire semaphore is waited on at the color
+  // attachment output stage, which is enough for a presentable image. The
+  // scene image was last read by the previous frame's blit.
+  VkImageMemoryBarrier2 resolve_barrier = color_barrier;
+  resolve_barrier.srcAccessMask = VK_ACCESS_2_NONE;
+  if (scene_image_ != VK_NULL_HANDLE) {
+    resolve_barrier.srcStageMask |= VK_PIPELINE_STAGE_2_BLIT_BIT;
+    resolve_barrier.image = scene_image_;
+  } else {
+    resolve_barrier.image = swap_chain_images_[image_index];
+  }
+
+  VkImageMemoryBarrier2 depth_barrier = color_barrier;
+  depth_barrier.srcStageMask = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT |
+                               VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+  depth_barrier.srcAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  depth_barrier.dstStageMask = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT |
+                               VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+  depth_barrier.dstAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  depth_barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  depth_barrier.image = depth_image_;
+  depth_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  if (HasStencilComponent(depth_format_)) {
+    depth_barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+  }
+
+  // Without MSAA the pass draws into the resolve target itself.
+  bool multisampled = msaa_samples_ != VK_SAMPLE_COUNT_1_BIT;
+  std::array<VkImageMemoryBarrier2, 4> barriers = {
+      color_barrier, resolve_barrier, depth_barrier};
+  uint32_t barrier_count = 3;
+  if (!multisampled) {
+    color_barrier.srcStageMask = resolve_barrier.srcStageMask;
+    color_barrier.image = resolve_barrier.image;
+    barriers = {color_barrier, depth_barrier};
+    barrier_count = 2;
+  }
+  bool resolve_depth =
+      pass == MainPass::kFirst && depth_resolve_image_ != VK_NULL_HANDLE;
+  if (resolve_depth) {
+    // Last read by the previous frame's Hi-Z pyramid. Depth resolves write
+    // at the color attachment output stage, newer revisions of the spec say
+    // the late fragment tests, so both are waited for.
+    VkImageMemoryBarrier2 &barrier = barriers[barrier_count++];
+    barrier = depth_barrier;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT |
+                           VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT |
+                            VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    barrier.image = depth_resolve_image_;
+  }
+  if (pass == MainPass::kSecond) {
+    // Continues where the first part left off: only the resolve target has
+    // not been written yet and keeps its layout.
+    barrier_count = 2;
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    barriers[0].dstAccessMask |= VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT;
+    barriers[1] = depth_barrier;
+    if (depth_resolve_image_ != VK_NULL_HANDLE) {
+      barriers[1].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    } else {
+      // Back from the Hi-Z pyramid's build.
+      barriers[1].srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+      barriers[1].srcAccessMask = VK_ACCESS_2_NONE;
+      barriers[1].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    }
+  }
+  VkDependencyInfo dependency_info{};
+  dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+  dependency_info.imageMemoryBarrierCount = barrier_count;
+  dependency_info.pImageMemoryBarriers = barriers.data();
+  vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+
+  // The multisampled image is only needed until it is resolved, so it is
+  // never stored, unless the second part of the pass continues it.
+  VkRenderingAttachmentInfo color_attachment{};
+  color_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+  color_attachment.imageView = color_image_view_;
+  color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  color_attachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+  color_attachment.resolveImageView =
+      scene_image_ != VK_NULL_HANDLE ? scene_image_view_
+                                     : swap_chain_image_views_[image_index];
+  color_attachment.resolveImageLayout =
+      VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  color_attachment.clearValue.color = {{0.0f, 0.0f, 0.0f, 0.0f}};
+  if (!multisampled) {
+    color_attachment.imageView = color_attachment.resolveImageView;
+    color_attachment.resolveMode = VK_RESOLVE_MODE_NONE;
+    color_attachment.resolveImageView = VK_NULL_HANDLE;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  }
+
+  VkRenderingAttachmentInfo depth_attachment{};
+  depth_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+  depth_attachment.imageView = depth_image_view_;
+  depth_attachment.imageLayout =
+      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  depth_attachment.clearValue.depthStencil = {
+      config_.reversed_z ? 0.0f : 1.0f, 0};
+
+  if (pass == MainPass::kFirst) {
+    color_attachment.resolveMode = VK_RESOLVE_MODE_NONE;
+    color_attachment.resolveImageView = VK_NULL_HANDLE;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    if (resolve_depth) {
+      depth_attachment.resolveMode = depth_resolve_mode_;
+      depth_attachment.resolveImageView = depth_resolve_image_view_;
+      depth_attachment.resolveImageLayout =
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    }
+  } else if (pass == MainPass::kSecond) {
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+  }
+
+  VkRenderingInfo rendering_info{};
+  rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+  if (pass != MainPass::kSecond && !inline_main_pass_) {
+    rendering_info.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT;
+  }
+  rendering_info.renderArea.offset = {0, 0};
+  rendering_info.renderArea.extent = render_extent_;
+  rendering_info.layerCount = 1;
+  rendering_info.colorAttachmentCount = 1;
+  rendering_info.pColorAttachments = &color_attachment;
+  rendering_info.pDepthAttachment = &depth_attachment;
+  vkCmdBeginRendering(command_buffer, &rendering_info);
+}
+
+void VulkanEngine::EndMainRendering(VkCommandBuffer command_buffer,
+                                    uint32_t image_index, MainPass pass) {
+  vkCmdEndRendering(command_buffer);
+  if (pass == MainPass::kFirst) {
+    // The depth the Hi-Z pyramid is built from: the resolve, see
+    // BeginMainRendering() for its stages, or the depth buffer itself.
+    VkImageMemoryBarrier2 barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    barrier.image = depth_image_;
+    if (depth_resolve_image_ != VK_NULL_HANDLE) {
+      barrier.srcStageMask |= VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+      barrier.srcAccessMask |= VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+      barrier.image = depth_resolve_image_;
+    }
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+    if (HasStencilComponent(depth_format_)) {
+      barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+    }
+    RecordImageBarrier(command_buffer, barrier);
+    return;
+  }
+  if (scene_image_ == VK_NULL_HANDLE) {
+    return;
+  }
+
+  // Scales the resolved scene up into the output image, which ends up where
+  // an unscaled resolve would have left it.
+  VkImageMemoryBarrier2 scene_barrier{};
+  scene_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+  scene_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+  scene_barrier.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+  scene_barrier.dstStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+  scene_barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+  scene_barrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  scene_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  scene_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  scene_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  scene_barrier.image = scene_image_;
+  scene_barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+
+  // Behind the acquire semaphore like the unscaled resolve.
+  VkImageMemoryBarrier2 output_barrier = scene_barrier;
+  output_barrier.srcAccessMask = VK_ACCESS_2_NONE;
+  output_barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  output_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  output_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  output_barrier.image = swap_chain_images_[image_index];
+
+  std::array<VkImageMemoryBarrier2, 2> barriers = {scene_barrier,
+                                                   output_barrier};
+  VkDependencyInfo dependency_info{};
+  dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+  dependency_info.imageMemoryBarrierCount =
+      static_cast<uint32_t>(barriers.size());
+  dependency_info.pImageMemoryBarriers = barriers.data();
+  vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+
+  VkImageBlit2 region{};
+  region.sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2;
+  region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  region.srcOffsets[1] = {static_cast<int32_t>(render_extent_.width),
+                          static_cast<int32_t>(render_extent_.height), 1};
+  region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  region.dstOffsets[1] = {static_cast<int32_t>(swap_chain_extent_.width),
+                          static_cast<int32_t>(swap_chain_extent_.height), 1};
+  VkBlitImageInfo2 blit_info{};
+  blit_info.sType = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2;
+  blit_info.srcImage = scene_image_;
+  blit_info.srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  blit_info.dstImage = swap_chain_images_[image_index];
+  blit_info.dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  blit_info.regionCount = 1;
+  blit_info.pRegions = &region;
+  blit_info.filter = VK_FILTER_LINEAR;
+  vkCmdBlitImage2(command_buffer, &blit_info);
+
+  VkImageMemoryBarrier2 barrier = output_barrier;
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT |
+                          VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  RecordImageBarrier(command_buffer, barrier);
+}
+
+void VulkanEngine::RecordOutputPass(VkCommandBuffer command_buffer,
+                                    uint32_t image_index) {
+  if (imgui_initialized_) {
+    // Single sampled at the swap chain's resolution whatever the scene is
+    // rendered at, so the UI stays sharp. Loaded, the scene is below it.
+    VkRenderingAttachmentInfo color_attachment{};
+    color_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+    color_attachment.imageView = swap_chain_image_views_[image_index];
+    color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+
+    VkRenderingInfo rendering_info{};
+    rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+    rendering_info.renderArea.offset = {0, 0};
+    rendering_info.renderArea.extent = swap_chain_extent_;
+    rendering_info.layerCount = 1;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachments = &color_attachment;
+    vkCmdBeginRendering(command_buffer, &rendering_info);
+    ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), command_buffer);
+    vkCmdEndRendering(command_buffer);
+  }
+
+  // Presentation waits on the render finished semaphore, which covers all
+  // commands, so nothing is waited on for it. Offscreen targets are left
+  // ready to be copied out.
+  VkImageMemoryBarrier2 barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  if (config_.headless) {
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  } else {
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+    barrier.dstAccessMask = VK_ACCESS_2_NONE;
+    barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  }
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = swap_chain_images_[image_index];
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  RecordImageBarrier(command_buffer, barrier);
+}
+
 VkCommandBuffer VulkanEngine::BeginSingleTimeCommands() {
   VkCommandBufferAllocateInfo allocate_info{};
   allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -1589,6 +4127,10 @@ VkSampleCountFlagBits VulkanEngine::GetMaxUsableSampleCount() const {
   VkSampleCountFlags counts =
       physical_device_properties.limits.framebufferColorSampleCounts &
       physical_device_properties.limits.framebufferDepthSampleCounts;
+  for (VkSampleCountFlags count = VK_SAMPLE_COUNT_64_BIT;
+       count > config_.max_msaa_samples; count >>= 1) {
+    counts &= ~count;
+  }
   if (counts & VK_SAMPLE_COUNT_64_BIT) {
     return VK_SAMPLE_COUNT_64_BIT;
   }
@@ -1611,14 +4153,25 @@ VkSampleCountFlagBits VulkanEngine::GetMaxUsableSampleCount() const {
 }
 
 void VulkanEngine::CreateColorResources() {
+  // Without MSAA the main pass draws into the scene or output image directly.
+  color_image_ = VK_NULL_HANDLE;
+  color_image_allocation_ = {};
+  color_image_view_ = VK_NULL_HANDLE;
+  if (msaa_samples_ == VK_SAMPLE_COUNT_1_BIT) {
+    return;
+  }
   VkFormat color_format = swap_chain_image_format_;
 
-  CreateImage(swap_chain_extent_.width, swap_chain_extent_.height,
-              msaa_samples_, color_format, VK_IMAGE_TILING_OPTIMAL,
-              VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
-                  VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+  // Stored between the two parts of the main pass with occlusion culling,
+  // transient otherwise.
+  VkImageUsageFlags usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  if (!config_.occlusion_culling) {
+    usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+  }
+  CreateImage(render_extent_.width, render_extent_.height, msaa_samples_,
+              color_format, VK_IMAGE_TILING_OPTIMAL, usage,
               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, color_image_,
-              color_image_memory_);
+              color_image_allocation_);
   std::optional<VkImageView> color_image_view =
       CreateImageView(color_image_, color_format, VK_IMAGE_ASPECT_COLOR_BIT);
   if (!color_image_view) {
@@ -1628,10 +4181,103 @@ void VulkanEngine::CreateColorResources() {
   color_image_view_ = *color_image_view;
 }
 
+void VulkanEngine::CreateSceneResources() {
+  if (render_extent_.width == swap_chain_extent_.width &&
+      render_extent_.height == swap_chain_extent_.height) {
+    return;
+  }
+  CreateImage(render_extent_.width, render_extent_.height,
+              VK_SAMPLE_COUNT_1_BIT, swap_chain_image_format_,
+              VK_IMAGE_TILING_OPTIMAL,
+              VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                  VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scene_image_,
+              scene_image_allocation_);
+  std::optional<VkImageView> scene_image_view = CreateImageView(
+      scene_image_, swap_chain_image_format_, VK_IMAGE_ASPECT_COLOR_BIT);
+  if (!scene_image_view) {
+    spdlog::error("Cannot create scene image view.");
+    return;
+  }
+  scene_image_view_ = *scene_image_view;
+}
+
+void VulkanEngine::InitQualityGovernor() {
+  // The scaled image is blitted into the output, which the render pass
+  // fallback has no room for.
+  VkFormatProperties format_properties;
+  vkGetPhysicalDeviceFormatProperties(physical_device_,
+                                      swap_chain_image_format_,
+                                      &format_properties);
+  VkFormatFeatureFlags blit_features =
+      VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+  bool render_scaling =
+      config_.dynamic_rendering &&
+      (format_properties.optimalTilingFeatures & blit_features) ==
+          blit_features &&
+      (config_.headless || (surface_capabilities_.supportedUsageFlags &
+                            VK_IMAGE_USAGE_TRANSFER_DST_BIT));
+  if (!config_.dynamic_rendering) {
+    config_.adaptive_quality = false;
+  }
+
+  QualityGovernor::CreateInfo create_info{};
+  create_info.max_samples = msaa_samples_;
+  create_info.min_render_scale = config_.min_render_scale;
+  create_info.render_scaling = render_scaling;
+  create_info.target_ms = config_.target_gpu_time_ms;
+  quality_governor_.Init(create_info);
+  msaa_samples_ = quality_governor_.Current().samples;
+  UpdateRenderExtent();
+}
+
+void VulkanEngine::UpdateQuality() {
+  std::optional<Profiler::Sample> sample =
+      profiler_.LatestSample("Frame", true);
+  if (!config_.adaptive_quality || !sample ||
+      sample->frame_number <= governed_frame_number_) {
+    return;
+  }
+  governed_frame_number_ = sample->frame_number;
+  if (quality_governor_.AddSample(sample->milliseconds)) {
+    ApplyQualityLevel();
+  }
+}
+
+void VulkanEngine::ApplyQualityLevel() {
+  const QualityGovernor::Level &level = quality_governor_.Current();
+  spdlog::info("Quality level {}: {}x MSAA at {:.0f}% resolution.",
+               quality_governor_.CurrentLevel(),
+               static_cast<uint32_t>(level.samples),
+               level.render_scale * 100.0f);
+  bool samples_changed = level.samples != msaa_samples_;
+  msaa_samples_ = level.samples;
+
+  // Like a resize, the frames in flight keep the old targets until they
+  // retire.
+  RetireRenderTargets();
+  UpdateRenderExtent();
+  CreateColorResources();
+  CreateDepthResources();
+  CreateSceneResources();
+  if (samples_changed) {
+    RebuildGraphicsPipeline();
+    RebuildSkyPipeline();
+  }
+}
+
+void VulkanEngine::UpdateRenderExtent() {
+  float scale = quality_governor_.Current().render_scale;
+  render_extent_.width = std::max(
+      static_cast<uint32_t>(swap_chain_extent_.width * scale + 0.5f), 1u);
+  render_extent_.height = std::max(
+      static_cast<uint32_t>(swap_chain_extent_.height * scale + 0.5f), 1u);
+}
+
 void VulkanEngine::CreateSyncObjects() {
-  image_available_semaphores_.resize(kMaxFramesInFlight);
-  render_finished_semaphores_.resize(kMaxFramesInFlight);
-  in_flight_fences_.resize(kMaxFramesInFlight);
+  image_available_semaphores_.resize(config_.frames_in_flight);
+  render_finished_semaphores_.resize(config_.frames_in_flight);
+  in_flight_fences_.resize(config_.frames_in_flight);
 
   VkSemaphoreCreateInfo semaphore_info{};
   semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -1640,7 +4286,7 @@ void VulkanEngine::CreateSyncObjects() {
   fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
   fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-  for (size_t i = 0; i < kMaxFramesInFlight; ++i) {
+  for (size_t i = 0; i < config_.frames_in_flight; ++i) {
     if (vkCreateSemaphore(device_, &semaphore_info, nullptr,
                           &image_available_semaphores_[i]) != VK_SUCCESS ||
         vkCreateSemaphore(device_, &semaphore_info, nullptr,
@@ -1654,45 +4300,101 @@ void VulkanEngine::CreateSyncObjects() {
 }
 
 void VulkanEngine::DrawFrame() {
+  // Waiting on this slot's fence means frame (frame_number_ -
+  // frames_in_flight) and everything submitted before it has finished, so
+  // resources retired up to that frame can be released.
   vkWaitForFences(device_, 1, &in_flight_fences_[current_frame_], VK_TRUE,
                   UINT64_MAX);
+  if (frame_number_ >= config_.frames_in_flight) {
+    deletion_queue_.Flush(frame_number_ - config_.frames_in_flight);
+  }
+  profiler_.BeginFrame(current_frame_, frame_number_);
+  // Before anything of this frame uses the render targets or pipelines.
+  UpdateQuality();
+  ReloadChangedShaders();
+
+  // Offscreen targets are per frame in flight, the fence wait above already
+  // made this one available.
+  uint32_t image_index = current_frame_;
+  if (!config_.headless) {
+    VkResult result =
+        vkAcquireNextImageKHR(device_, swap_chain_, UINT64_MAX,
+                              image_available_semaphores_[current_frame_],
+                              VK_NULL_HANDLE, &image_index);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+      resize_requested_ = true;
+      return;
+    } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+      spdlog::error("Failed to acquire swap chain image.");
+      return;
+    }
+  }
 
-  uint32_t image_index;
-  VkResult result =
-      vkAcquireNextImageKHR(device_, swap_chain_, UINT64_MAX,
-                            image_available_semaphores_[current_frame_],
-                            VK_NULL_HANDLE, &image_index);
-
-  if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-    resize_requested_ = true;
-    return;
-  } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-    spdlog::error("Failed to acquire swap chain image.");
-    return;
+  {
+    Profiler::CpuScope scope(profiler_, "UpdateUniformBuffer");
+    UpdateUniformBuffer(current_frame_);
   }
-  UpdateUniformBuffer(current_frame_);
 
   vkResetFences(device_, 1, &in_flight_fences_[current_frame_]);
   vkResetCommandBuffer(command_buffers_[current_frame_], 0);
 
-  ImGui::Render();
-  RecordCommandBuffer(command_buffers_[current_frame_], image_index);
+  if (imgui_initialized_) {
+    ImGui::Render();
+  }
+  // Uploads and chunk generation queued while preparing this frame go out in
+  // a single batch each.
+  upload_manager_.Flush();
+  terrain_generator_.Flush();
+  {
+    Profiler::CpuScope scope(profiler_, "RecordCommandBuffer");
+    RecordCommandBuffer(command_buffers_[current_frame_], image_index);
+  }
 
   VkSubmitInfo submit_info{};
   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-  VkSemaphore wait_semaphores[] = {image_available_semaphores_[current_frame_]};
-  VkPipelineStageFlags wait_stages[] = {
-      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-  submit_info.waitSemaphoreCount = 1;
-  submit_info.pWaitSemaphores = wait_semaphores;
-  submit_info.pWaitDstStageMask = wait_stages;
+  // The upload and generator timeline values have already been reached on the
+  // CPU side, the waits only order the ownership acquires after the releases.
+  // The sparse binds of the imagery cache are still queued ahead of the
+  // frame.
+  std::array<VkSemaphore, 4> wait_semaphores{};
+  std::array<VkPipelineStageFlags, 4> wait_stages{};
+  std::array<uint64_t, 4> wait_values{};
+  uint32_t wait_count = 0;
+  if (!config_.headless) {
+    wait_semaphores[wait_count] = image_available_semaphores_[current_frame_];
+    wait_stages[wait_count] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    wait_values[wait_count++] = 0;
+  }
+  if (upload_wait_value_ > 0) {
+    wait_semaphores[wait_count] = upload_manager_.GetTimelineSemaphore();
+    wait_stages[wait_count] = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    wait_values[wait_count++] = upload_wait_value_;
+  }
+  if (generator_wait_value_ > 0) {
+    wait_semaphores[wait_count] = terrain_generator_.GetTimelineSemaphore();
+    wait_stages[wait_count] = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    wait_values[wait_count++] = generator_wait_value_;
+  }
+  if (virtual_texture_.BindWaitValue() > 0) {
+    wait_semaphores[wait_count] = virtual_texture_.BindSemaphore();
+    wait_stages[wait_count] = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    wait_values[wait_count++] = virtual_texture_.BindWaitValue();
+  }
+  VkTimelineSemaphoreSubmitInfo timeline_info{};
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  submit_info.pNext = &timeline_info;
+  submit_info.waitSemaphoreCount = wait_count;
+  timeline_info.waitSemaphoreValueCount = wait_count;
+  timeline_info.pWaitSemaphoreValues = wait_values.data();
+  submit_info.pWaitSemaphores = wait_semaphores.data();
+  submit_info.pWaitDstStageMask = wait_stages.data();
   submit_info.commandBufferCount = 1;
   submit_info.pCommandBuffers = &command_buffers_[current_frame_];
 
   VkSemaphore signal_semaphores[] = {
       render_finished_semaphores_[current_frame_]};
-  submit_info.signalSemaphoreCount = 1;
+  submit_info.signalSemaphoreCount = config_.headless ? 0 : 1;
   submit_info.pSignalSemaphores = signal_semaphores;
 
   if (vkQueueSubmit(graphics_queue_, 1, &submit_info,
@@ -1701,24 +4403,266 @@ void VulkanEngine::DrawFrame() {
     return;
   }
 
-  VkPresentInfoKHR present_info{};
-  present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-  present_info.waitSemaphoreCount = 1;
-  present_info.pWaitSemaphores = signal_semaphores;
+  if (!config_.headless) {
+    VkPresentInfoKHR present_info{};
+    present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    present_info.waitSemaphoreCount = 1;
+    present_info.pWaitSemaphores = signal_semaphores;
+
+    VkSwapchainKHR swap_chains[] = {swap_chain_};
+    present_info.swapchainCount = 1;
+    present_info.pSwapchains = swap_chains;
+    present_info.pImageIndices = &image_index;
+
+    // Ids have to increase strictly, a failed present uses one up as well.
+    uint64_t present_id = ++present_id_;
+    present_input_times_[present_id % present_input_times_.size()] =
+        input_time_;
+    VkPresentIdKHR present_id_info{};
+    present_id_info.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+    present_id_info.swapchainCount = 1;
+    present_id_info.pPresentIds = &present_id;
+    if (wait_for_present_) {
+      present_info.pNext = &present_id_info;
+    }
 
-  VkSwapchainKHR swap_chains[] = {swap_chain_};
-  present_info.swapchainCount = 1;
-  present_info.pSwapchains = swap_chains;
-  present_info.pImageIndices = &image_index;
+    VkResult result = vkQueuePresentKHR(presentation_queue_, &present_info);
 
-  result = vkQueuePresentKHR(presentation_queue_, &present_info);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+      resize_requested_ = true;
+    } else if (result != VK_SUCCESS) {
+      spdlog::error("Failed to present swap chain image.");
+      return;
+    }
+  }
 
-  if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
-    resize_requested_ = true;
-  } else if (result != VK_SUCCESS) {
-    spdlog::error("Failed to present swap chain image.");
+  current_frame_ = (current_frame_ + 1) % config_.frames_in_flight;
+  ++frame_number_;
+}
+
+void VulkanEngine::WaitForQueuedPresents() {
+  if (!config_.present_wait ||
+      present_id_ <= config_.max_queued_presents) {
+    return;
+  }
+  uint64_t present_id = present_id_ - config_.max_queued_presents;
+  if (present_id <= completed_present_id_ || present_id < first_present_id_) {
     return;
   }
+  // Bounded, some compositors never complete presents of hidden windows.
+  const uint64_t kTimeoutNs = 100'000'000;
+  VkResult result =
+      wait_for_present_(device_, swap_chain_, present_id, kTimeoutNs);
+  if (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR) {
+    // The wait returns once the image is on screen, plus the wakeup.
+    completed_present_id_ = present_id;
+    input_to_photon_ms_ =
+        std::chrono::duration<float, std::milli>(
+            std::chrono::steady_clock::now() -
+            present_input_times_[present_id % present_input_times_.size()])
+            .count();
+    profiler_.AddCpuSample("Input to photon", input_to_photon_ms_);
+  } else if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+    resize_requested_ = true;
+  }
+}
+
+void VulkanEngine::DrawDisplayImGui() {
+  ImGui::Begin("Display");
+  // Changes take effect with the next swap chain, which is created without
+  // waiting for the current one.
+  if (ImGui::BeginCombo("Present mode", PresentModeName(present_mode_))) {
+    for (VkPresentModeKHR present_mode : kPresentModes) {
+      if (std::find(present_modes_.begin(), present_modes_.end(),
+                    present_mode) == present_modes_.end()) {
+        continue;
+      }
+      if (ImGui::Selectable(PresentModeName(present_mode),
+                            present_mode == present_mode_)) {
+        config_.present_mode = present_mode;
+        resize_requested_ |= present_mode != present_mode_;
+      }
+    }
+    ImGui::EndCombo();
+  }
+
+  int image_count = config_.swap_chain_image_count > 0
+                        ? static_cast<int>(config_.swap_chain_image_count)
+                        : static_cast<int>(swap_chain_images_.size());
+  if (ImGui::InputInt("Swap chain images", &image_count)) {
+    int max_image_count = surface_capabilities_.maxImageCount > 0
+                              ? surface_capabilities_.maxImageCount
+                              : 8;
+    image_count =
+        std::clamp(image_count,
+                   static_cast<int>(surface_capabilities_.minImageCount),
+                   max_image_count);
+    config_.swap_chain_image_count = static_cast<uint32_t>(image_count);
+    resize_requested_ |=
+        static_cast<size_t>(image_count) != swap_chain_images_.size();
+  }
+  ImGui::Text("Created with %zu images.", swap_chain_images_.size());
+
+  if (wait_for_present_) {
+    ImGui::Checkbox("Pace frames", &config_.present_wait);
+    int max_queued_presents = static_cast<int>(config_.max_queued_presents);
+    if (ImGui::InputInt("Max queued presents", &max_queued_presents)) {
+      config_.max_queued_presents =
+          static_cast<uint32_t>(std::clamp(max_queued_presents, 0, 8));
+    }
+    ImGui::Text("Input to photon: %.1f ms", input_to_photon_ms_);
+  } else {
+    ImGui::TextUnformatted("Present wait is not enabled.");
+  }
+
+  // The render pass fallback is built for one sample count.
+  if (config_.dynamic_rendering) {
+    ImGui::SeparatorText("Quality");
+    ImGui::Checkbox("Adaptive", &config_.adaptive_quality);
+    float target_ms = quality_governor_.TargetMs();
+    if (ImGui::InputFloat("Target GPU time (ms)", &target_ms, 0.5f)) {
+      quality_governor_.SetTargetMs(std::max(target_ms, 1.0f));
+    }
+    auto level_name = [](const QualityGovernor::Level &level) {
+      return fmt::format("{}x MSAA, {:.0f}%",
+                         static_cast<uint32_t>(level.samples),
+                         level.render_scale * 100.0f);
+    };
+    // Picking a level by hand turns the governor off.
+    const std::vector<QualityGovernor::Level> &levels =
+        quality_governor_.Levels();
+    std::string current_name = level_name(quality_governor_.Current());
+    if (ImGui::BeginCombo("Level", current_name.c_str())) {
+      for (uint32_t i = 0; i < levels.size(); ++i) {
+        std::string name = level_name(levels[i]);
+        bool selected = i == quality_governor_.CurrentLevel();
+        if (ImGui::Selectable(name.c_str(), selected) && !selected) {
+          config_.adaptive_quality = false;
+          quality_governor_.SetLevel(i);
+          ApplyQualityLevel();
+        }
+      }
+      ImGui::EndCombo();
+    }
+    ImGui::Text("Smoothed GPU time: %.2f ms", quality_governor_.SmoothedMs());
+  }
+
+  ImGui::SeparatorText("Atmosphere");
+  // The sun's direction above the camera's horizon, north towards the
+  // planet's +y.
+  AtmosphereSun sun = atmosphere_.Sun();
+  glm::vec3 up = glm::normalize(glm::vec3(camera_.position));
+  glm::vec3 east = glm::normalize(glm::cross(
+      std::abs(up.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f)
+                             : glm::vec3(1.0f, 0.0f, 0.0f),
+      up));
+  glm::vec3 north = glm::cross(up, east);
+  float elevation = glm::degrees(
+      std::asin(std::clamp(glm::dot(sun.direction, up), -1.0f, 1.0f)));
+  float azimuth = glm::degrees(std::atan2(glm::dot(sun.direction, east),
+                                          glm::dot(sun.direction, north)));
+  bool sun_turned = ImGui::SliderFloat("Sun elevation", &elevation, -10.0f,
+                                       90.0f, "%.1f deg");
+  sun_turned |= ImGui::SliderFloat("Sun azimuth", &azimuth, -180.0f, 180.0f,
+                                   "%.0f deg");
+  if (ImGui::SliderFloat("Exposure", &sun.exposure, 0.5f, 50.0f, "%.1f",
+                         ImGuiSliderFlags_Logarithmic)) {
+    atmosphere_.SetSun(sun);
+  }
+  // The simulation owns the sun's direction, it turns with its next tick.
+  if (sun_turned) {
+    float elevation_radians = glm::radians(elevation);
+    float azimuth_radians = glm::radians(azimuth);
+    simulation_.RequestSun(up * std::sin(elevation_radians) +
+                           (north * std::cos(azimuth_radians) +
+                            east * std::sin(azimuth_radians)) *
+                               std::cos(elevation_radians));
+  }
+  const Atmosphere::Stats &atmosphere = atmosphere_.GetStats();
+  ImGui::Text("LUT builds: %u, sky view %u, aerial perspective %u",
+              atmosphere.lut_builds, atmosphere.sky_view_builds,
+              atmosphere.aerial_perspective_builds);
+
+  if (virtual_texture_.IsEnabled()) {
+    ImGui::SeparatorText("Imagery");
+    const VirtualTexture::Stats &imagery = virtual_texture_.GetStats();
+    ImGui::Text("Pages: %u / %u resident, %u wanted from %u samples",
+                imagery.resident_pages, imagery.page_count,
+                imagery.wanted_tiles, imagery.feedback_entries);
+    ImGui::Text("Uploaded %llu, evicted %llu",
+                static_cast<unsigned long long>(imagery.uploaded_pages),
+                static_cast<unsigned long long>(imagery.evicted_pages));
+    ImGui::Text("Cache: %.1f MB%s",
+                static_cast<double>(imagery.cache_bytes) / (1024.0 * 1024.0),
+                imagery.sparse ? ", sparse" : "");
+  }
+
+  ImGui::SeparatorText("Simulation");
+  Simulation::Stats simulation = simulation_.GetStats();
+  ImGui::Text("%.0f Hz, tick %.3f ms, %llu ticks, %llu skipped",
+              simulation_.TickRate(), simulation.tick_ms,
+              static_cast<unsigned long long>(simulation.ticks),
+              static_cast<unsigned long long>(simulation.skipped_ticks));
+
+  ImGui::SeparatorText("Terrain queries");
+  // Cached after the first frame, the same lookup simulation code would do.
+  float ground = terrain_query_.Height(camera_.position);
+  ImGui::Text("Ground %.1f m, camera %.1f m above it", ground,
+              glm::length(camera_.position) - kPlanetRadius - ground);
+  TerrainQuery::Stats queries = terrain_query_.GetStats();
+  ImGui::Text("Grids: %u, %.1f MB, %llu hits, %llu misses",
+              queries.resident_tiles,
+              static_cast<double>(queries.resident_bytes) /
+                  (1024.0 * 1024.0),
+              static_cast<unsigned long long>(queries.cache_hits),
+              static_cast<unsigned long long>(queries.cache_misses));
+
+  ImGui::SeparatorText("Shaders");
+  const char *debug_views[] = {"Shaded", "Normals", "Chunk size"};
+  if (ImGui::Combo("Terrain view", &terrain_debug_view_, debug_views,
+                   IM_ARRAYSIZE(debug_views))) {
+    RebuildGraphicsPipeline();
+  }
+  if (mesh_shaders_supported_) {
+    bool mesh_shaders = config_.mesh_shaders;
+    if (ImGui::Checkbox("Mesh shaders", &mesh_shaders)) {
+      SetMeshShaders(mesh_shaders);
+    }
+  }
+  if (config_.shader_hot_reload) {
+    ImGui::TextUnformatted(ShaderLibrary::CanCompile()
+                               ? "Recompiling src/shaders on save."
+                               : "Reloading when compile_shaders runs.");
+    std::string errors = shader_library_.Errors();
+    if (!errors.empty()) {
+      ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s", errors.c_str());
+    }
+  }
+  const Terrain::Stats &terrain = terrain_.GetStats();
+  ImGui::Text("Terrain builds: %u, %u in flight, %.2f ms",
+              terrain.chunks_built, terrain.chunks_in_flight,
+              terrain.build_ms);
+  ImGui::Text("Bindless textures: %u / %u", bindless_textures_.Count(),
+              bindless_textures_.Capacity());
+  if (config_.occlusion_culling) {
+    ImGui::Text("Hi-Z pyramid: %u levels of %u x %u depth",
+                hiz_.LevelCount(), hiz_.DepthExtent().width,
+                hiz_.DepthExtent().height);
+  } else {
+    ImGui::TextUnformatted("Occlusion culling is off.");
+  }
+  if (shadow_maps_.CascadeCount() > 0) {
+    const ShadowMaps::Stats &shadows = shadow_maps_.GetStats();
+    ImGui::Text("Shadows: %u cascades of %u, to %.0f m, mask %x, %llu cached",
+                shadow_maps_.CascadeCount(), shadow_maps_.Resolution(),
+                shadows.distance, shadows.rendered_mask,
+                static_cast<unsigned long long>(shadows.cached_renders));
+  } else {
+    ImGui::TextUnformatted("Shadows are off.");
+  }
+  ImGui::End();
+}
 
-  current_frame_ = (current_frame_ + 1) % kMaxFramesInFlight;
+void VulkanEngine::DeferDestroy(std::function<void()> &&deleter) {
+  deletion_queue_.Push(frame_number_, std::move(deleter));
 }
@@ -1,19 +1,191 @@
+#pragma once
+
+#include "atmosphere.h"
+#include "bindless_textures.h"
+#include "camera.h"
+#include "camera_path.h"
+#include "deletion_queue.h"
+#include "gpu_allocator.h"
+#include "hiz_pyramid.h"
+#include "job_system.h"
+#include "profiler.h"
+#include "quality_governor.h"
+#include "shader_library.h"
+#include "shadow_maps.h"
+#include "simulation.h"
+#include "terrain.h"
+#include "terrain_generator.h"
+#include "terrain_noise.h"
+#include "terrain_query.h"
+#include "tile_cache.h"
+#include "tile_file.h"
+#include "uniform_arena.h"
+#include "upload_manager.h"
+#include "virtual_texture.h"
 #include <SDL3/SDL.h>
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <optional>
+#include <string>
 #include <vector>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
+struct EngineConfig {
+  // Number of frames the CPU may record ahead of the GPU. Each frame in flight
+  // owns its own command buffer, uniform buffer and synchronization objects.
+  uint32_t frames_in_flight = 2;
+  // Upper bound for the number of terrain vertices drawn per frame.
+  uint32_t terrain_vertex_budget = 1000000;
+  // Depth 1 at the near plane and 0 at infinity. Together with a float depth
+  // buffer this keeps precision roughly constant over distance, so the whole
+  // planet fits into one depth range with a near plane below a metre.
+  bool reversed_z = true;
+  // Renders without VkRenderPass and VkFramebuffer objects through dynamic
+  // rendering, with synchronization2 barriers for the attachment layouts, so
+  // a resize only recreates images and views. Falls back to the render pass
+  // if the device lacks either Vulkan 1.3 feature.
+  bool dynamic_rendering = true;
+  // Preferred present mode, FIFO if the surface does not support it. Can be
+  // switched at runtime in the Display window. FIFO caps the frame rate at
+  // the refresh rate, MAILBOX and IMMEDIATE do not, FIFO_RELAXED tears when a
+  // frame is late instead of waiting a whole refresh.
+  VkPresentModeKHR present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+  // Swap chain images to ask for, clamped to what the surface supports. 0 is
+  // one more than the surface's minimum.
+  uint32_t swap_chain_image_count = 0;
+  // Paces frames with VK_KHR_present_wait if the device supports it and
+  // VK_KHR_present_id: a frame waits with reading input until at most
+  // `max_queued_presents` of its predecessors are not on screen yet, which
+  // bounds latency under FIFO. The waits also measure input to photon
+  // latency, shown by the profiler.
+  bool present_wait = true;
+  uint32_t max_queued_presents = 1;
+  // Highest MSAA sample count to use, the device's limit if lower. 1 renders
+  // without MSAA, straight into the output image.
+  uint32_t max_msaa_samples = 8;
+  // Lowers the MSAA sample count and then the internal render resolution
+  // while the GPU frame time is over target_gpu_time_ms, and raises them
+  // again when there is headroom, see QualityGovernor. Needs dynamic
+  // rendering, the render pass fallback always uses max_msaa_samples at full
+  // resolution.
+  bool adaptive_quality = true;
+  float target_gpu_time_ms = 14.0f;
+  // Lowest internal resolution relative to the swap chain, scaled up with a
+  // linear blit.
+  float min_render_scale = 0.5f;
+  // Watches the shader sources and rebuilds the pipelines using a changed
+  // one between two frames, see ShaderLibrary. A shader that fails to compile
+  // keeps its old pipeline.
+  bool shader_hot_reload = true;
+  // Counts vertex, fragment and compute invocations per frame in the
+  // profiler. Off by default, the queries are not free on every driver.
+  bool pipeline_statistics = false;
+  // Frames of history the profiler keeps, benchmarks want all of them.
+  uint32_t profiler_history_length = 1024;
+  // Job system threads besides the main thread. They record the terrain's
+  // secondary command buffers.
+  uint32_t worker_threads = 3;
+  // Time the terrain may spend building chunks per frame, see
+  // Terrain::CreateInfo::build_budget_ms. The CPU built chunks are generated
+  // on the job system's workers in the background.
+  float terrain_build_budget_ms = 2.0f;
+  // Culls terrain chunks hidden behind nearer terrain against a Hi-Z pyramid
+  // of the depth buffer, see CullPhase. The main pass is split in two around
+  // the pyramid's build. Needs dynamic rendering and a sampleable depth
+  // format.
+  bool occlusion_culling = true;
+  // Terrain draw groups, each recorded into its own secondary command buffer.
+  // Independent of worker_threads so every thread count draws the same.
+  uint32_t terrain_draw_groups = 8;
+  // Draws the terrain with task and mesh shaders if the device has
+  // VK_EXT_mesh_shader: the task shader culls each chunk's meshlets against
+  // the frustum, their normal cone and, for the chunks tested against the
+  // Hi-Z pyramid, the pyramid, and the mesh shader builds the survivors'
+  // grid without an index buffer. Can be switched at runtime in the Shaders
+  // section.
+  bool mesh_shaders = true;
+  // Generates terrain chunks with a compute shader, on the async compute
+  // queue if the device has one. Off generates them on the CPU with SIMD.
+  bool gpu_terrain_generation = true;
+  // Height tile file overriding the procedural heights where it has tiles,
+  // see Terrain::BakeHeightTiles(). None if empty.
+  std::string height_tile_file;
+  // Memory the decoded height tiles may use.
+  size_t tile_cache_budget = 256ull * 1024ull * 1024ull;
+  // Quadtree level whose surface the CPU terrain queries sample, see
+  // TerrainQuery, and the memory their grids may use.
+  uint32_t terrain_query_level = 16;
+  size_t terrain_query_budget = 64ull * 1024ull * 1024ull;
+  // Imagery tile file draped over the terrain through a virtual texture, see
+  // Terrain::BakeImageryTiles(). A flat colour if empty.
+  std::string imagery_tile_file;
+  // Commits the imagery cache's memory as it is first used, if the device
+  // supports sparse residency.
+  bool sparse_imagery = true;
+  // Cascaded sun shadows on the terrain, see ShadowMaps. 0 cascades turns
+  // them off. The nearest `shadow_dynamic_cascades` follow the camera every
+  // frame, the others are cached and re-rendered one per frame when stale.
+  uint32_t shadow_cascades = 4;
+  uint32_t shadow_resolution = 2048;
+  uint32_t shadow_dynamic_cascades = 2;
+  // Metres, the shadows end here or at the horizon.
+  double shadow_distance = 20000.0;
+  // Ticks per second of the simulation thread, see Simulation. Frames
+  // interpolate between its ticks, so it is independent of the frame rate.
+  double simulation_rate = 60.0;
+
+  // Renders into offscreen images instead of a window. No SDL window, surface,
+  // swap chain or ImGui are created.
+  bool headless = false;
+  uint32_t headless_width = 1920;
+  uint32_t headless_height = 1080;
+  // Recorded camera path to fly, see CameraPath::Load(). The scripted flight
+  // is used if empty.
+  std::string camera_path;
+  // GPU to use, a case insensitive part of its name or its UUID. The highest
+  // scoring suitable one if empty or if none matches.
+  std::string gpu;
+};
+
 class VulkanEngine {
 public:
-  void Init();
+  void Init(const EngineConfig &config = {});
   void Run();
+  // Renders `frame_count` frames along the camera path with a fixed time step
+  // and prints frame time percentiles, GPU time and memory use as JSON to
+  // stdout and to `output_path` if not empty. With mesh shaders the path is
+  // flown once more on them, their timings under "mesh_shaders". Returns
+  // false if writing the results failed.
+  bool RunBenchmark(uint32_t frame_count, const std::string &output_path);
+  // Generates `chunk_count` terrain chunks with the scalar and SIMD CPU paths
+  // and on the GPU and prints their timings and mismatching heights as JSON,
+  // like RunBenchmark(). Returns false if writing the results failed or any
+  // height differs.
+  bool RunHeightfieldBenchmark(uint32_t chunk_count,
+                               const std::string &output_path);
+  // Runs `query_count` height queries around the camera path's start, cold,
+  // warm, one at a time and from every job system thread at once, plus a
+  // batch of rays, and prints their throughput and the error at grid
+  // vertices as JSON, like RunBenchmark(). Returns false if writing the
+  // results failed or a vertex height is off.
+  bool RunQueryBenchmark(uint32_t query_count, const std::string &output_path);
+  // Height and ray queries against the terrain on the CPU, safe to use from
+  // any thread between Init() and Destroy().
+  const TerrainQuery &GetTerrainQuery() const { return terrain_query_; }
   void Destroy();
 
 private:
   struct QueueFamilyIndices {
     std::optional<uint32_t> graphics_family;
     std::optional<uint32_t> presentation_family;
+    // Transfer-only family (DMA engine) if the device has one, otherwise the
+    // graphics family.
+    std::optional<uint32_t> transfer_family;
+    // Compute family without graphics (async compute) if the device has one,
+    // otherwise the graphics family.
+    std::optional<uint32_t> compute_family;
 
     bool IsComplete() {
       return graphics_family.has_value() && presentation_family.has_value();
@@ -30,7 +202,11 @@ private:
   void InitVulkanInstance();
   void CreateSurface();
   void ListAvailableExtensions() const;
+  // Only once the first frame was submitted, see Run(). Headless runs never
+  // set it up.
   void InitImGui();
+  void InitUploadManager();
+  void InitProfiler();
 
   // Validation Layers
   bool CheckValidationLayerSupport();
@@ -39,48 +215,128 @@ private:
   // Devices
   void PickPhysicalDevice();
   bool IsDeviceSuitable(VkPhysicalDevice device);
+  // Higher is better, for suitable devices: the device type first, then the
+  // size of its device local memory, then the optional fast paths it has.
+  uint64_t ScorePhysicalDevice(VkPhysicalDevice device);
+  // Logs what the device was created with.
+  void LogDeviceCapabilities();
   bool CheckDeviceExtensionSupport(VkPhysicalDevice device);
+  bool IsDeviceExtensionSupported(VkPhysicalDevice device,
+                                  const char *extension);
+  // No swap chain extension in headless mode.
+  const std::vector<const char *> &RequiredDeviceExtensions() const;
   void CreateLogicalDevice();
   QueueFamilyIndices FindQueueFamilies(VkPhysicalDevice device);
 
   // Swap chain
   void CreateSwapChain();
+  // Headless replacement for the swap chain images.
+  void CreateOffscreenTargets();
   VkSurfaceFormatKHR ChooseSwapSurfaceFormat(
       const std::vector<VkSurfaceFormatKHR> &available_formats);
   VkPresentModeKHR ChooseSwapPresentMode(
       const std::vector<VkPresentModeKHR> &available_present_modes);
   VkExtent2D ChooseSwapExtent(const VkSurfaceCapabilitiesKHR &capabilities);
   SwapChainSupportDetails QuerySwapChainSupport(VkPhysicalDevice device);
-  void CleanupSwapChain();
-  void RecreateSwapChain();
+  // Hands the current swap chain and its attachments to the deletion queue.
+  // They are destroyed once the frames that may still use them have retired.
+  void RetireSwapChain();
+  // Returns false without recreating anything while the window has no area,
+  // the request stays pending and the event loop keeps running.
+  bool RecreateSwapChain();
+  // Waits until no more than max_queued_presents presents are pending and
+  // records the input to photon latency of the ones that completed.
+  void WaitForQueuedPresents();
+  // Present mode, image count and quality controls and the latest latency.
+  void DrawDisplayImGui();
+  // Levels from EngineConfig and the device, sets the first one.
+  void InitQualityGovernor();
+  // Feeds the newest GPU frame time to the quality governor and applies the
+  // level it picks.
+  void UpdateQuality();
+  // Recreates the render targets, and the graphics pipeline if the sample
+  // count changed, for the governor's current level.
+  void ApplyQualityLevel();
+  // render_extent_ for the current level and swap chain extent.
+  void UpdateRenderExtent();
+  // Hands the MSAA color, depth, depth resolve and scene images to the
+  // deletion queue.
+  void RetireRenderTargets();
 
   // Image views
   void CreateImageViews();
 
   // Graphics pipeline
   void CreateDescriptorSetLayout();
-  void CreateGraphicsPipeline();
+  // Sets graphics_pipeline_ only on success, the layout is created once.
+  bool CreateGraphicsPipeline();
+  // Replaces the graphics pipeline, for a new shader, sample count or debug
+  // view. The frames in flight keep the old one until they retire.
+  bool RebuildGraphicsPipeline();
+  // Switches the terrain between the vertex and the mesh shader path, if the
+  // device has mesh shaders.
+  void SetMeshShaders(bool enabled);
+  // Terrain culling, see shaders/cull.comp. Like CreateGraphicsPipeline().
+  bool CreateCullPipeline();
+  bool RebuildCullPipeline();
+  bool CreateCullPipelineLayout();
+  // Turns occlusion culling off if the device cannot do it. The pyramid is
+  // created either way, the cull pipeline layout uses its set.
+  void InitHiZPyramid();
+  // Needs the uniform arena, whose buffer the atmosphere's sets point to.
+  void InitAtmosphere();
+  // Before the graphics pipeline, whose layout has its set. A placeholder
+  // without imagery.
+  void InitVirtualTexture();
+  // Needs the terrain, whose chunks it draws, and the uniform arena.
+  void InitShadowMaps();
+  // After the terrain, which opens the height tile file.
+  void InitTerrainQuery();
+  // Needs the atmosphere, whose sun it starts with. Only Run() starts its
+  // thread, the benchmarks step the camera themselves.
+  void InitSimulation();
+  // Takes the frame's camera and sun from the simulation.
+  void ApplySimulationState(const SimulationState &state);
+  // The sky behind the terrain, see shaders/sky.frag. Like
+  // CreateGraphicsPipeline().
+  bool CreateSkyPipeline();
+  bool RebuildSkyPipeline();
+  void InitShaderLibrary();
+  // Rebuilds the pipelines of the shaders the library reloaded since the last
+  // frame.
+  void ReloadChangedShaders();
   std::optional<VkShaderModule>
   CreateShaderModule(const std::vector<char> &code);
   void CreateRenderPass();
+  // The pipeline cache is kept on disk between runs, one file per device.
+  // Data that was written by another driver or device is ignored.
+  void LoadPipelineCache();
+  void SavePipelineCache();
+  std::string PipelineCachePath() const;
 
   // Framebuffers
   void CreateFramebuffers();
 
-  // Buffers: Vertex, Index, Uniform
+  // Buffers: Terrain, Uniform
   void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
                     VkMemoryPropertyFlags properties, VkBuffer &buffer,
-                    VkDeviceMemory &buffer_memory);
-  void CopyBuffer(VkBuffer src_buffer, VkBuffer dst_buffer, VkDeviceSize size);
-  void CreateVertexBuffer();
-  uint32_t FindMemoryType(uint32_t type_filter,
-                          VkMemoryPropertyFlags properties);
-  void CreateIndexBuffer();
-  void CreateUniformBuffers();
+                    GpuAllocation &buffer_allocation);
+  // Falls back to CPU generation if the generator cannot be created.
+  void InitTerrainGenerator();
+  void InitTerrain();
+  void InitBindlessTextures();
+  // Generates and uploads the terrain's flat and steep detail textures and
+  // adds them to bindless_textures_.
+  void CreateDetailTextures();
+  void InitUniformArena();
   void UpdateUniformBuffer(uint32_t current_image);
   void CreateDescriptorPool();
   void CreateDescriptorSets();
 
+  // Resolve target at the render resolution, only created while it is below
+  // the swap chain's.
+  void CreateSceneResources();
+
   // Depth buffer
   void CreateDepthResources();
   std::optional<VkFormat>
@@ -88,21 +344,68 @@ private:
                       VkImageTiling tiling, VkFormatFeatureFlags features);
   std::optional<VkFormat> FindDepthFormat();
   std::optional<VkImageView> CreateImageView(VkImage image, VkFormat format,
-                                             VkImageAspectFlags aspect_flags);
+                                             VkImageAspectFlags aspect_flags,
+                                             uint32_t mip_levels = 1);
   void CreateImage(uint32_t width, uint32_t height,
                    VkSampleCountFlagBits num_samples, VkFormat format,
                    VkImageTiling tiling, VkImageUsageFlags usage,
                    VkMemoryPropertyFlags properties, VkImage &image,
-                   VkDeviceMemory &image_memory);
+                   GpuAllocation &image_allocation, uint32_t mip_levels = 1);
   void TransitionImageLayout(VkImage image, VkFormat format,
                              VkImageLayout old_layout,
                              VkImageLayout new_layout);
+  // Records `barrier` with vkCmdPipelineBarrier2, or as the equivalent
+  // synchronization1 barrier if the render pass fallback is used.
+  void RecordImageBarrier(VkCommandBuffer command_buffer,
+                          const VkImageMemoryBarrier2 &barrier);
 
   // Commands
   void CreateCommandPool();
   void CreateCommandBuffer();
   void RecordCommandBuffer(VkCommandBuffer command_buffer,
                            uint32_t image_index);
+  // Parts of the main pass. With occlusion culling kFirst draws what was
+  // visible last frame and keeps the attachments, its depth goes into the Hi-Z
+  // pyramid, and kSecond draws the rest and resolves.
+  enum class MainPass { kWhole, kFirst, kSecond };
+  // The main pass with dynamic rendering: transitions the attachments, begins
+  // rendering at the render resolution and resolves into the image at
+  // `image_index`, or into the scene image that EndMainRendering() then
+  // scales up into it. kSecond has inline contents, the others secondary
+  // ones unless inline_main_pass_. kFirst ends with the depth buffer
+  // readable by compute shaders.
+  void BeginMainRendering(VkCommandBuffer command_buffer, uint32_t image_index,
+                          MainPass pass);
+  void EndMainRendering(VkCommandBuffer command_buffer, uint32_t image_index,
+                        MainPass pass);
+  // Binds the cull pipeline and its sets for `phase` and dispatches it.
+  void RecordCulling(VkCommandBuffer command_buffer, CullPhase phase);
+  // Draws ImGui over the output image at full resolution, once it is set up,
+  // and leaves the image ready to be presented or copied out.
+  void RecordOutputPass(VkCommandBuffer command_buffer, uint32_t image_index);
+  // One transient pool per job system thread and frame in flight, so workers
+  // never share a pool and a frame's pools can be reset as a whole.
+  void CreateThreadCommandPools();
+  void DestroyThreadCommandPools();
+  // Begins a secondary command buffer of `thread`'s pool for the current
+  // frame that continues the main render pass. VK_NULL_HANDLE on failure.
+  VkCommandBuffer BeginSecondaryCommandBuffer(uint32_t thread,
+                                              uint32_t image_index);
+  // Safe to call from any job system thread.
+  VkCommandBuffer RecordTerrainGroup(uint32_t group, uint32_t thread,
+                                     uint32_t image_index);
+  // The graphics pipeline and state Terrain::Draw() needs, or
+  // Terrain::DrawMeshTasks() with mesh shaders.
+  void BindTerrainState(VkCommandBuffer command_buffer);
+  // One draw group through the path of EngineConfig::mesh_shaders.
+  void DrawTerrain(VkCommandBuffer command_buffer, uint32_t group,
+                   CullPhase phase);
+  // Draws the sky wherever the terrain left the depth buffer cleared, after
+  // the terrain of the main pass.
+  void RecordSky(VkCommandBuffer command_buffer);
+  // What the secondaries of the first part of the main pass draw, recorded
+  // into the primary, for inline_main_pass_.
+  void RecordMainPassInline(VkCommandBuffer command_buffer);
   VkCommandBuffer BeginSingleTimeCommands();
   void EndSingleTimeCommands(VkCommandBuffer command_buffer);
 
@@ -113,64 +416,172 @@ private:
   // Drawing
   void CreateSyncObjects();
   void DrawFrame();
+  // Queues resource destruction until the frame being recorded has retired.
+  void DeferDestroy(std::function<void()> &&deleter);
 
   VkInstance instance_;
   VkDebugUtilsMessengerEXT debug_messenger_;
   VkPhysicalDevice physical_device_ = VK_NULL_HANDLE;
   VkDevice device_;
   VkQueue graphics_queue_;
-  VkSurfaceKHR surface_;
+  VkSurfaceKHR surface_ = VK_NULL_HANDLE;
   VkQueue presentation_queue_;
-  VkSwapchainKHR swap_chain_;
+  VkQueue transfer_queue_;
+  // Terrain chunk generation. Culling feeds the draws of the same command
+  // buffer, so it is recorded on the graphics queue.
+  VkQueue compute_queue_;
+  VkSwapchainKHR swap_chain_ = VK_NULL_HANDLE;
   std::vector<VkImage> swap_chain_images_;
+  // Only set for offscreen targets, swap chain images belong to the swap
+  // chain.
+  std::vector<GpuAllocation> swap_chain_image_allocations_;
   VkFormat swap_chain_image_format_;
   VkExtent2D swap_chain_extent_;
+  VkFormat depth_format_ = VK_FORMAT_UNDEFINED;
+  // Of the main pass, below swap_chain_extent_ when the render scale is.
+  VkExtent2D render_extent_;
+  VkImage scene_image_ = VK_NULL_HANDLE;
+  GpuAllocation scene_image_allocation_;
+  VkImageView scene_image_view_ = VK_NULL_HANDLE;
   std::vector<VkImageView> swap_chain_image_views_;
-  VkRenderPass render_pass_;
+  // VK_NULL_HANDLE with dynamic rendering, as are the framebuffers.
+  VkRenderPass render_pass_ = VK_NULL_HANDLE;
   VkDescriptorSetLayout descriptor_set_layout_;
-  VkPipelineLayout pipeline_layout_;
-  VkPipeline graphics_pipeline_;
+  VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
+  // Of the task and mesh shaders, pipeline_layout_'s sets and the Hi-Z
+  // pyramid's. Only if mesh_shaders_supported_.
+  VkPipelineLayout mesh_pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline graphics_pipeline_ = VK_NULL_HANDLE;
+  VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
+  VkDescriptorSetLayout cull_descriptor_set_layout_ = VK_NULL_HANDLE;
+  VkPipelineLayout cull_pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline cull_pipeline_ = VK_NULL_HANDLE;
+  VkPipelineLayout sky_pipeline_layout_ = VK_NULL_HANDLE;
+  VkPipeline sky_pipeline_ = VK_NULL_HANDLE;
+  ShaderLibrary shader_library_;
+  // kDebugView of shaders/shader.vert: shaded, normals or chunk size.
+  int terrain_debug_view_ = 0;
   std::vector<VkFramebuffer> swap_chain_framebuffers_;
   VkCommandPool command_pool_;
-  // NOTE:
-  // You should allocate multiple resources like buffers from a single memory
-  // allocation.
-  // NOTE:
-  // Driver developers recommend that you also store multiple buffers, like
-  // the vertex and index buffer, into a single VkBuffer and use offsets in
-  // commands like vkCmdBindVertexBuffers. The advantage is that your data is
-  // more cache friendly in that case, because it's closer together. It is even
-  // possible to reuse the same chunk of memory for multiple resources if they
-  // are not used during the same render operations, provided that their data is
-  // refreshed, of course. This is known as aliasing and some Vulkan functions
-  // have explicit flags to specify that you want to do this.
-  VkBuffer vertex_buffer_;
-  VkDeviceMemory vertex_buffer_memory_;
-  VkBuffer index_buffer_;
-  VkDeviceMemory index_buffer_memory_;
-  std::vector<VkBuffer> uniform_buffers_;
-  std::vector<VkDeviceMemory> uniform_buffers_memory_;
-  std::vector<void *> uniform_buffers_mapped_;
+  struct ThreadCommandPool {
+    VkCommandPool pool = VK_NULL_HANDLE;
+    // Allocated on demand and reused after every pool reset.
+    std::vector<VkCommandBuffer> secondary_buffers;
+    uint32_t used = 0;
+  };
+  // Indexed by frame in flight, then by job system thread.
+  std::vector<std::vector<ThreadCommandPool>> thread_command_pools_;
+  // Secondaries executed by the main render pass, in a fixed order.
+  std::vector<VkCommandBuffer> secondary_command_buffers_;
+  JobSystem job_system_;
+  GpuAllocator allocator_;
+  UploadManager upload_manager_;
+  Profiler profiler_;
+  // Upload timeline value the frame being recorded has to wait on.
+  uint64_t upload_wait_value_ = 0;
+  TerrainGenerator terrain_generator_;
+  // Same for the terrain generator's timeline.
+  uint64_t generator_wait_value_ = 0;
+  TerrainNoise terrain_noise_;
+  TerrainQuery terrain_query_;
+  TileFile height_tile_file_;
+  TileCache height_tile_cache_;
+  TileFile imagery_tile_file_;
+  TileCache imagery_tile_cache_;
+  Terrain terrain_;
+  BindlessTextures bindless_textures_;
+  struct BindlessImage {
+    VkImage image = VK_NULL_HANDLE;
+    GpuAllocation allocation;
+    VkImageView view = VK_NULL_HANDLE;
+    // In bindless_textures_.
+    uint32_t index = 0;
+  };
+  // Flat ground first, then steep ground.
+  std::vector<BindlessImage> detail_textures_;
+  // A placeholder without occlusion culling.
+  HiZPyramid hiz_;
+  Atmosphere atmosphere_;
+  VirtualTexture virtual_texture_;
+  ShadowMaps shadow_maps_;
+  Camera camera_;
+  CameraPath camera_path_;
+  Simulation simulation_;
+  UniformArena uniform_arena_;
+  // Dynamic offset of the frame's UniformBufferObject in uniform_arena_.
+  uint32_t uniform_offset_ = 0;
+  // And of its CullOcclusionData.
+  uint32_t occlusion_offset_ = 0;
+  // And of its AtmosphereGpuData.
+  uint32_t atmosphere_offset_ = 0;
+  // And of its ShadowGpuData.
+  uint32_t shadow_offset_ = 0;
   VkDescriptorPool descriptor_pool_;
-  std::vector<VkDescriptorSet> descriptor_sets_;
+  // Shared by all frames, which differ in their dynamic offsets only.
+  VkDescriptorSet descriptor_set_;
+  VkDescriptorSet cull_descriptor_set_;
   VkImage depth_image_;
-  VkDeviceMemory depth_image_memory_;
+  GpuAllocation depth_image_allocation_;
   VkImageView depth_image_view_;
+  // Single sampled copy of the depth buffer for the Hi-Z pyramid, only with
+  // occlusion culling and MSAA. Resolved by the first part of the main pass
+  // with depth_resolve_mode_.
+  VkImage depth_resolve_image_ = VK_NULL_HANDLE;
+  GpuAllocation depth_resolve_image_allocation_;
+  VkImageView depth_resolve_image_view_ = VK_NULL_HANDLE;
+  VkResolveModeFlagBits depth_resolve_mode_ = VK_RESOLVE_MODE_SAMPLE_ZERO_BIT;
   std::vector<VkCommandBuffer> command_buffers_;
   std::vector<VkSemaphore> image_available_semaphores_;
   std::vector<VkSemaphore> render_finished_semaphores_;
   std::vector<VkFence> in_flight_fences_;
   VkSampleCountFlagBits msaa_samples_ = VK_SAMPLE_COUNT_1_BIT;
-  VkImage color_image_;
-  VkDeviceMemory color_image_memory_;
-  VkImageView color_image_view_;
+  // Multisampled color target the main pass resolves, VK_NULL_HANDLE at one
+  // sample, where it draws into the resolve target directly.
+  VkImage color_image_ = VK_NULL_HANDLE;
+  GpuAllocation color_image_allocation_;
+  VkImageView color_image_view_ = VK_NULL_HANDLE;
   bool resize_requested_ = false;
   bool freeze_rendering_ = false;
+  // Of the surface, queried when the swap chain is created.
+  std::vector<VkPresentModeKHR> present_modes_;
+  VkPresentModeKHR present_mode_ = VK_PRESENT_MODE_FIFO_KHR;
+  VkSurfaceCapabilitiesKHR surface_capabilities_{};
+
+  // Present pacing, only used with EngineConfig::present_wait. Ids count up
+  // across swap chains, a new swap chain only knows the ones from
+  // first_present_id_ on.
+  PFN_vkWaitForPresentKHR wait_for_present_ = nullptr;
+  // Pipeline statistics on a device without inheritedQueries: secondaries may
+  // not run inside the frame's statistics query, so the main pass is
+  // recorded inline on the render thread instead.
+  bool inline_main_pass_ = false;
+  // VK_EXT_mesh_shader is enabled, EngineConfig::mesh_shaders picks the path.
+  bool mesh_shaders_supported_ = false;
+  PFN_vkCmdDrawMeshTasksIndirectCountEXT draw_mesh_tasks_ = nullptr;
+  uint64_t present_id_ = 0;
+  uint64_t first_present_id_ = 1;
+  uint64_t completed_present_id_ = 0;
+  // When the input of the frame being recorded was read, and of the last
+  // presents by id modulo the array size.
+  std::chrono::steady_clock::time_point input_time_;
+  std::array<std::chrono::steady_clock::time_point, 16> present_input_times_;
+  float input_to_photon_ms_ = 0.0f;
+
+  QualityGovernor quality_governor_;
+  // Frame of the last GPU time given to the governor.
+  uint64_t governed_frame_number_ = 0;
 
   VkDescriptorPool imgui_descriptor_pool_;
+  bool imgui_initialized_ = false;
 
-  SDL_Window *window_;
+  SDL_Window *window_ = nullptr;
 
+  EngineConfig config_;
+  DeletionQueue deletion_queue_;
+  // Index into the per-frame resources, cycles through frames_in_flight.
   uint32_t current_frame_ = 0;
+  // Monotonic number of the frame being recorded, used to tag deferred
+  // deletions.
+  uint64_t frame_number_ = 0;
   bool running_;
 };